@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,69 +12,363 @@
 #include <sys/mman.h>
 #include <sys/wait.h>
 #include <setjmp.h>
+#include <poll.h>
+#include <semaphore.h>
 #include "rio.h"
 #include "network.h"
+#include "http_parser.h"
+#include "response.h"
+#include "reactor.h"
+#include "ureactor.h"
+#include "cache.h"
+#include "fdcache.h"
+#include "pack.h"
+#include "admission.h"
+#include "fcgi.h"
+#include "http_range.h"
+#include "mime.h"
+#include "log.h"
+#include "stats.h"
+#include "prefork.h"
 
-#define output_error_message(...)                           \
-        fprintf(stderr, "%s:%d: ", __func__, __LINE__);     \
-        fprintf(stderr, __VA_ARGS__);
+#define output_error_message(fmt, ...)                      \
+        log_printf(LOG_ERROR, "%s:%d: " fmt, __func__, __LINE__, ##__VA_ARGS__)
+
+/* 客户端请求引起的错误 (404, 403 等) 只是警告, 大量出现时不应当淹没真正的错误 */
+#define output_warn_message(fmt, ...)                       \
+        log_printf(LOG_WARN, "%s:%d: " fmt, __func__, __LINE__, ##__VA_ARGS__)
+
+#define STR_(x)  #x
+#define STR(x)   STR_(x)
 
 #define MAXLINE  1024
+#define KEEPALIVE_TIMEOUT   5               /* 持久连接的空闲超时时间(秒) */
+#define KEEPALIVE_MAX       100             /* 每个持久连接最多处理的请求数量 */
+#define HEADER_TIMEOUT      10              /* 从收到请求的第一个字节到报头完整的超时时间(秒) */
+#define SEND_TIMEOUT        30              /* 发送响应一直没有进展时的超时时间(秒) */
+#define CACHE_BUDGET        (16 << 20)      /* 静态内容缓存的默认字节预算 */
+#define FDCACHE_MAX         1024            /* 打开文件缓存默认的条目数量上限 */
+#define FCGI_DEPTH          16              /* 每个常驻处理程序默认的队列深度 */
+#define FCGI_TIMEOUT        30              /* 常驻处理程序一直没有完成请求时的超时时间(秒), 超时回复 504 */
+#define BODY_LENGTH         0               /* cgi 响应的正文长度由 Content-length 给出 */
+#define BODY_CHUNKED        1               /* cgi 响应使用分块编码 */
+#define BODY_CLOSE          2               /* cgi 响应由关闭连接结束 */
+#define STATUS_URI          "/__status"     /* 运行时统计信息的内部 uri */
+#define STATUS_BUFSIZE      (16 << 10)      /* 统计信息页面的缓冲区大小 */
+#define USAGE               "error: %s [-p nprocs [-a]] [-r nthreads [-u]] [-b backlog] [-c cachesize] [-o nfiles] [-z] [-P archive] " \
+                            "[-C maxconns] [-I maxperip] [-L rate[:burst]] [-f handler [-F nworkers] [-Q depth]] " \
+                            "[-l logfile] [-v level] port\n"
 
 extern char **environ;
 
-void doit(int fd);
-void read_requsthdrs(rio_t *rp);
+void doit(int fd, int listenfd, response_t *resp, char const *peer, admit_key_t const *client);
+void handle_request(http_request_t *req, int status, response_t *resp, int reqleft);
+int  wait_readable(int fd, int timeout);
+int  wait_request(int fd, int listenfd, int timeout);
+int  read_request(rio_t *rp, http_request_t *req, int *status);
 int  parse_uri(char *uri, char *filename, char *cgiargs);
-void server_static(int fd, char *filename, int filesize);
-void server_dynamic(int fd, char *filename, char *cgiargs);
-void get_filetype(char const *filename, char *filetype);
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
+void server_static(response_t *resp, http_request_t *req, char *filename, fd_entry_t *fe, int keepalive,
+                   char const *encoding);
+void server_cached(response_t *resp, http_request_t *req, cache_entry_t *e, int keepalive, char const *encoding);
+char const *static_header(response_t *resp, off_t size, char const *filetype, http_validator_t const *v,
+                          size_t *hdrlen);
+void server_packed(response_t *resp, http_request_t *req, char const *filename, int keepalive);
+int  server_precompressed(response_t *resp, http_request_t *req, char const *filename, int keepalive);
+int  server_conditional(response_t *resp, http_request_t *req, char const *filetype, http_validator_t const *v,
+                        off_t size, int fd, char const *body, char const *extra, int keepalive);
+void add_body(response_t *resp, int fd, char const *body, off_t off, size_t len);
+void release_cached(void *arg);
+void release_file(void *arg);
+void release_cgi(void *arg);
+size_t parse_size(char const *str);
+void server_dynamic(response_t *resp, char *filename, char *cgiargs, int keepalive);
+int  cgi_pipe_head(response_t *resp, char *head, size_t len);
+int  cgi_header(response_t *resp, char *buf, size_t len, int framing, char **body);
+void server_fcgi(response_t *resp, char *filename, char *cgiargs, int keepalive);
+void server_status(response_t *resp, int keepalive);
+void fcgi_done(void *arg, int err, char *buf, size_t len);
+int  fcgi_response(response_t *resp, char *buf, size_t len);
+void notify_sem(void *arg);
+char const *get_filetype(char const *filename, char const *encoding);
+char const *encoding_header(char const *encoding, char const *filetype);
+int  init_error_pages(void);
+void clienterror(response_t *resp, int status, int keepalive);
+char const *connection_header(int keepalive);
 void sig_chld(int signo);
 void sig_pipe(int signo);
+void sig_term(int signo);
 void sginal_captrue();
 
+/* 预先生成的错误页面 */
+typedef struct error_page_t {
+    int          ep_status;                 /* 状态码 */
+    char const  *ep_reason;                 /* 状态描述 */
+    char const  *ep_message;                /* 页面中的错误说明 */
+    char        *ep_head;                   /* 状态行, Content-type 和 Content-length 报头 */
+    size_t       ep_headlen;                /* 报头长度 */
+    char        *ep_body;                   /* html 页面 */
+    size_t       ep_bodylen;                /* 页面长度 */
+} error_page_t;
+
+static error_page_t g_error_pages[] = {
+    { 400, "Bad Request", "Tiny couldn't parse the request" },
+    { 403, "Forbidden", "Tiny couldn't access this file" },
+    { 404, "Not found", "Tiny couldn't find this file" },
+    { 408, "Request Timeout", "Tiny didn't receive the request in time" },
+    { 414, "URI Too Long", "Tiny couldn't handle the uri" },
+    { 429, "Too Many Requests", "Tiny is receiving too many requests from this client" },
+    { 431, "Request Header Fields Too Large", "Tiny couldn't read the request" },
+    { 500, "Internal Server Error", "Tiny couldn't handle the request" },
+    { 501, "Not implemented", "Tiny does not implement this method" },
+    { 502, "Bad Gateway", "Tiny couldn't get a valid response from the handler" },
+    { 503, "Service Unavailable", "Tiny couldn't serve the request now" },
+    { 504, "Gateway Timeout", "Tiny didn't get a response from the handler in time" },
+};
+
 static sigjmp_buf env;
 static volatile sig_atomic_t canjmp;
+static volatile sig_atomic_t g_stop;        /* 收到 SIGTERM, 处理完已有的连接后退出 */
+static pthread_t g_main_thread;             /* 阻塞模式下运行 accept 循环的线程 */
+static content_cache_t g_cache;             /* 静态内容缓存 */
+static fd_cache_t g_fdcache;                /* 打开文件缓存 */
+static admit_t g_admit;                     /* 连接准入和请求限速, 多进程模式下每个工作进程分别计算 */
+static pack_t g_pack;                       /* 映射的只读归档, 没有使用归档时 pk_map 为 NULL */
+static int g_gzip;                          /* 是否在缓存文本文件时同时保存 gzip 压缩后的内容 */
+static fcgi_pool_t g_fcgi;                  /* 常驻的动态请求处理程序进程池 */
+static sem_t g_fcgi_sem;                    /* 阻塞模式下等待进程池完成请求 */
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2) {
-        output_error_message("error: %s + port\n", argv[0]);
+    int nreactors = 0;
+    int use_uring = 0;
+    int nprocs = 0;
+    int pin = 0;
+    int backlog = LISTEN_BACKLOG;
+    size_t cache_budget = CACHE_BUDGET;
+    size_t fdcache_max = FDCACHE_MAX;
+    char const *fcgi_handler = NULL;
+    int fcgi_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int fcgi_depth = FCGI_DEPTH;
+    char const *logfile = NULL;
+    char const *archive = NULL;
+    admit_conf_t admit_conf = { 0, 0, 0, 0 };
+    char *end;
+    int loglevel = LOG_INFO;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:ar:ub:c:o:zP:C:I:L:f:F:Q:l:v:")) != -1) {
+        switch (opt) {
+        case 'p':                           /* 工作进程数量, 0 表示使用 cpu 核心数量 */
+            if ((nprocs = atoi(optarg)) <= 0)
+                nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+        case 'a':                           /* 把每个工作进程绑定到一个 cpu */
+            pin = 1;
+            break;
+        case 'r':                           /* 反应堆线程数量, 0 表示使用 cpu 核心数量 */
+            if ((nreactors = atoi(optarg)) <= 0)
+                nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+        case 'u':                           /* 反应堆使用 io_uring, 内核不支持时退回 epoll */
+            use_uring = 1;
+            break;
+        case 'b':                           /* 监听套接字的连接队列长度 */
+            backlog = atoi(optarg);
+            break;
+        case 'c':                           /* 静态内容缓存的字节预算, 0 表示不使用缓存 */
+            cache_budget = parse_size(optarg);
+            break;
+        case 'o':                           /* 打开文件缓存的条目数量上限, 0 表示不缓存文件描述符 */
+            fdcache_max = atoi(optarg);
+            break;
+        case 'z':                           /* 缓存文本文件时压缩一次, 之后直接发送压缩后的内容 */
+            g_gzip = 1;
+            break;
+        case 'P':                           /* mkpack 生成的归档, 静态文件只从归档中发送 */
+            archive = optarg;
+            break;
+        case 'C':                           /* 全局并发连接上限, 超过时直接回复 503 */
+            admit_conf.ac_max_conns = atoi(optarg);
+            break;
+        case 'I':                           /* 每个客户端地址的并发连接上限 */
+            admit_conf.ac_max_per_ip = atoi(optarg);
+            break;
+        case 'L':                           /* 每个客户端地址每秒的请求数量和突发数量, 超过时回复 429 */
+            admit_conf.ac_rate = strtod(optarg, &end);
+            if (*end == ':')
+                admit_conf.ac_burst = strtod(end + 1, NULL);
+            break;
+        case 'f':                           /* 常驻处理程序路径, /cgi-bin 下的请求交给它处理 */
+            fcgi_handler = optarg;
+            break;
+        case 'F':                           /* 处理程序进程数量 */
+            fcgi_workers = atoi(optarg);
+            break;
+        case 'Q':                           /* 每个处理程序进程的队列深度 */
+            fcgi_depth = atoi(optarg);
+            break;
+        case 'l':                           /* 日志文件, 默认写入标准输出 */
+            logfile = optarg;
+            break;
+        case 'v':                           /* 日志级别: 0 错误, 1 警告, 2 访问日志, 3 连接和请求报头 */
+            loglevel = atoi(optarg);
+            break;
+        default:
+            output_error_message(USAGE, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        output_error_message(USAGE, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char const *listenport = argv[optind];
+    if (init_error_pages() < 0) {
+        output_error_message("init_error_pages error: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (log_open(logfile, loglevel) < 0) {
+        output_error_message("log_open(%s) error: %s\n", (logfile != NULL ? logfile : "stdout"), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * 多进程模式: 主进程只监视工作进程, 不会从 prefork_master 返回. 工作进程从这里继续,
+     * 各自创建日志线程, 缓存, 进程池和 SO_REUSEPORT 监听套接字, 互相之间没有共享状态
+     */
+    if (nprocs > 0 && prefork_master(nprocs, pin) < 0) {
+        output_error_message("prefork_master(%d) error: %s\n", nprocs, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
     sginal_captrue();                       /* 注册信号捕获函数 */
+    stats_init();
+
+    if (log_start() < 0) {
+        output_error_message("log_start error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cache_budget > 0 && cache_init(&g_cache, cache_budget) < 0) {
+        output_error_message("cache_init error: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (fdcache_init(&g_fdcache, fdcache_max) < 0) {
+        output_error_message("fdcache_init error: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (admit_init(&g_admit, &admit_conf) < 0) {
+        output_error_message("admit_init error: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (archive != NULL) {
+        if (pack_open(&g_pack, archive) < 0) {
+            output_error_message("pack_open(%s) error: %s\n", archive, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        log_printf(LOG_INFO, "Serving %u files from %s\n", g_pack.pk_hdr->ph_count, archive);
+    }
+
+    sem_init(&g_fcgi_sem, 0, 0);
+    if (fcgi_handler != NULL && fcgi_pool_init(&g_fcgi, fcgi_handler, fcgi_workers, fcgi_depth, FCGI_TIMEOUT) < 0) {
+        output_error_message("fcgi_pool_init(%s) error\n", fcgi_handler);
+        exit(EXIT_FAILURE);
+    }
+
+    /* 多反应堆模式, 每个线程一个 epoll 实例 (或者 io_uring), 连接由非阻塞状态机驱动 */
+    if (nreactors > 0) {
+        signal(SIGPIPE, SIG_IGN);           /* 多线程下不能使用 siglongjmp, 由 write 返回 EPIPE 处理 */
+        if (use_uring && !ureactor_supported()) {
+            log_printf(LOG_WARN, "io_uring is not available, using epoll\n");
+            use_uring = 0;
+        }
+        log_printf(LOG_INFO, "Running %d reactor threads%s\n", nreactors, (use_uring ? " (io_uring)" : ""));
+        reactor_conf_t conf = { backlog, KEEPALIVE_TIMEOUT, HEADER_TIMEOUT, SEND_TIMEOUT, KEEPALIVE_MAX, &g_admit };
+        if (use_uring) {
+            if (ureactor_run(nreactors, "127.0.0.1", listenport, handle_request, &conf) < 0) {
+                output_error_message("ureactor_run(%d, %s) error\n", nreactors, listenport);
+                exit(EXIT_FAILURE);
+            }
+            return 0;
+        }
+        if (reactor_run(nreactors, "127.0.0.1", listenport, handle_request, &conf) < 0) {
+            output_error_message("reactor_run(%d, %s) error\n", nreactors, listenport);
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
 
     int listenfd;
-    if ((listenfd = open_listenfd("127.0.0.1", argv[1])) < 0) {
-        output_error_message("open_listenfd(NULL, %s) error\n", argv[1]);
+    if ((listenfd = open_listenfd_opt("127.0.0.1", listenport, (nprocs > 0 ? LISTEN_REUSEPORT : 0), backlog)) < 0) {
+        output_error_message("open_listenfd_opt(NULL, %s) error\n", listenport);
         exit(EXIT_FAILURE);
     }
 
     int connfd;
     socklen_t addrlen;
     struct sockaddr_storage clientaddr;
+    admit_key_t client;
     char hostname[MAXLINE];
     char port[MAXLINE];
+    char peer[2 * MAXLINE];
+    struct timeval sndtimeo = { SEND_TIMEOUT, 0 };
+    response_t resp;
+    response_init(&resp);
     while (1) {
-        printf("Waiting for connnect...\n");
-        addrlen = sizeof(addrlen);
-        if ((connfd = accept(listenfd, (struct sockaddr *)&clientaddr, &addrlen)) < 0) {
-            output_error_message("accpet error: %s", strerror(errno));
+        /* 停止时取出监听队列中已经完成握手的连接, 队列为空时退出 */
+        if (g_stop)
+            fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+        addrlen = sizeof(clientaddr);
+        if ((connfd = accept4(listenfd, (struct sockaddr *)&clientaddr, &addrlen, SOCK_CLOEXEC)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if ((errno == EMFILE || errno == ENFILE) && !g_stop) {
+                /* 描述符耗尽时阻塞的 accept 也会立即返回: 丢弃一个等待的连接, 队列为空时等待新连接到来, 避免空转 */
+                struct pollfd pfd = { listenfd, POLLIN, 0 };
+                if (admit_shed(&g_admit, listenfd, ADMIT_HTTP_503, sizeof(ADMIT_HTTP_503) - 1) == 0)
+                    continue;
+                if (errno == EAGAIN) {
+                    poll(&pfd, 1, -1);
+                    continue;
+                }
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                output_error_message("accpet error: %s", strerror(errno));
             break;
         }
 
+        admit_key(&client, (struct sockaddr *)&clientaddr);
+        if (admit_connect(&g_admit, &client) < 0) {
+            admit_reject(connfd, ADMIT_HTTP_503, sizeof(ADMIT_HTTP_503) - 1);
+            continue;
+        }
+
         getnameinfo((struct sockaddr *)&clientaddr, addrlen, hostname, 
                     sizeof(hostname), port, sizeof(port), NI_NUMERICHOST); 
 
-        printf("connection form %s:%s\n", hostname, port);
+        snprintf(peer, sizeof(peer), "%s:%s", hostname, port);
+        log_printf(LOG_DEBUG, "connection from %s\n", peer);
+        stats_accept();
+
+        /* 客户端一直不读取响应时, 阻塞的发送在 SEND_TIMEOUT 之后出错返回 */
+        setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &sndtimeo, sizeof(sndtimeo));
+        set_nodelay(connfd);
         if (sigsetjmp(env, 1) == 0) {
             canjmp = 1;
-            doit(connfd);
-        }
+            doit(connfd, listenfd, &resp, peer, &client);
+        } else
+            log_printf(LOG_WARN, "error: The client has colsed the connection and data sent is lost\n");
     
+        canjmp = 0;
+        response_release(&resp);            /* 发送被 SIGPIPE 打断时, 释放响应占用的资源 */
         close(connfd);
+        admit_disconnect(&g_admit, &client);
     }
 
 
@@ -82,30 +377,121 @@ int main(int argc, char *argv[])
 
 
 /* 
- * 函数说明:        执行客户端发生的 http 请求
+ * 函数说明:        处理一个客户端连接, 支持 HTTP/1.1 持久连接. 连接空闲超过 KEEPALIVE_TIMEOUT 秒
+ *                  或处理了 KEEPALIVE_MAX 个请求后关闭. 已经读入 rio 缓冲区的流水线请求直接解析处理,
+ *                  不需要再次调用 read. 请求报头没有在 HEADER_TIMEOUT 秒内收完时回复 408
  * @fd:             与客户端连接的套接字文件描述符
+ * @listenfd:       监听套接字, 空闲时有其他客户端等待就关闭当前连接
+ * @resp:           存放响应的结构
+ * @peer:           客户端地址, 用于访问日志
+ * @client:         客户端地址, 用于请求限速
  */
-void doit(int fd)
+void doit(int fd, int listenfd, response_t *resp, char const *peer, admit_key_t const *client)
 {
     rio_t rio;
-    char buf[MAXLINE];
-    char version[MAXLINE];
-    char method[MAXLINE];
-    char uri[MAXLINE];
+    http_request_t req;
+    int status;
+    int ret;
+    uint64_t start;
 
     rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, sizeof(buf));
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);
-
-    /* 如果不是 GET 方法, 那么出错返回 */
-    if (strcasecmp(method, "GET")) {
-        output_error_message("method is not \"GET\"\n");
-        clienterror(fd, method, "501", "Not implemented", "Tiny does not inplement this method");
+    for (int reqleft = KEEPALIVE_MAX; reqleft > 0; --reqleft) {
+        /* 缓冲区中没有剩余的请求数据时, 等待客户端发送下一个请求. 阻塞模式一次只服务一个连接,
+           空闲的持久连接不能挡住其他客户端, 监听队列中有连接时立即关闭 */
+        if (rio.rio_cnt <= 0 && wait_request(fd, listenfd, KEEPALIVE_TIMEOUT * 1000) <= 0)
+            break;
+
+        start = stats_now();
+        rio_set_deadline(&rio, HEADER_TIMEOUT * 1000);
+        if (read_request(&rio, &req, &status) <= 0 && status == 0)
+            break;
+        if (status == 0 && admit_request(&g_admit, client) < 0)
+            status = 429;                   /* 超过客户端的请求速率, 回复 429 后关闭 */
+
+        response_init(resp);
+        resp->r_notify = notify_sem;
+        resp->r_notify_arg = &g_fcgi_sem;
+        resp->r_parse_ns = stats_now() - start;
+        handle_request((status == 0 ? &req : NULL), status, resp, reqleft - 1);
+
+        /* 等待进程池填充响应, 处理程序超过 FCGI_TIMEOUT 没有完成时进程池以 504 完成响应 */
+        if (resp->r_async)
+            while (sem_wait(&g_fcgi_sem) < 0 && errno == EINTR);
+
+        /* 套接字是阻塞的, 返回 0 时在等待 cgi 输出, 或者发送超过了 SO_SNDTIMEO. 都最多等待 SEND_TIMEOUT */
+        while ((ret = response_write(fd, resp)) == 0) {
+            if (resp->r_waitfd < 0 || wait_readable(resp->r_waitfd, SEND_TIMEOUT * 1000) <= 0) {
+                ret = -1;
+                break;
+            }
+        }
+        stats_response(resp);
+        response_log(resp, peer);
+        response_release(resp);
+
+        if (ret < 0 || !resp->r_keepalive || g_stop)
+            break;
+    }
+}
+
+
+/* 
+ * 函数说明:        执行客户端发送的一个 http 请求, 将响应填充到 resp 中, resp->r_keepalive 表示
+ *                  发送响应之后连接是否可以继续处理下一个请求. 阻塞模式和反应堆模式共用
+ * @req:            解析完成的请求, 请求格式错误时为 NULL
+ * @status:         请求格式错误时对应的 http 状态码
+ * @resp:           存放响应的结构
+ * @reqleft:        当前连接在本请求之后还能处理的请求数量
+ */
+void handle_request(http_request_t *req, int status, response_t *resp, int reqleft)
+{
+    clock_gettime(CLOCK_MONOTONIC, &resp->r_start);
+    if (req != NULL)
+        snprintf(resp->r_reqline, sizeof(resp->r_reqline), "%.*s %.*s %.*s", (int)req->method.len, req->method.s,
+                 (int)req->uri.len, req->uri.s, (int)req->version.len, req->version.s);
+
+    if (req == NULL) {
+        if (status == 431)
+            clienterror(resp, 431, 0);
+        else if (status == 408)
+            clienterror(resp, 408, 0);
+        else if (status == 429)
+            clienterror(resp, 429, 0);
+        else 
+            clienterror(resp, 400, 0);
+        return;
+    }
+
+    /* 如果不是 GET 方法, 那么出错返回, 请求可能带有报文主体, 所以关闭连接 */
+    if (!http_str_equal(req->method, "GET")) {
+        output_warn_message("method is not \"GET\"\n");
+        clienterror(resp, 501, 0);
+        return;
+    }
+
+    char uri[MAXLINE];
+    if (req->uri.len >= sizeof(uri) - sizeof("home.html")) {
+        clienterror(resp, 414, 0);
         return;
     }
+    memcpy(uri, req->uri.s, req->uri.len);
+    uri[req->uri.len] = '\0';
+
+    /* HTTP/1.1 默认使用持久连接, HTTP/1.0 需要客户端显式请求 */
+    int keepalive;
+    http_str_t const *connection = http_find_header(req, "Connection");
+    if (http_str_equal(req->version, "HTTP/1.1"))
+        keepalive = (connection == NULL || !http_str_has_token(*connection, "close"));
+    else 
+        keepalive = (connection != NULL && http_str_has_token(*connection, "keep-alive"));
 
-    read_requsthdrs(&rio);                  /* 忽略其余报头信息 */
+    if (reqleft <= 0)
+        keepalive = 0;
+
+    if (http_str_equal(req->uri, STATUS_URI)) {
+        server_status(resp, keepalive);
+        return;
+    }
 
     /* 解析 uri 路径 */
     char filename[MAXLINE];
@@ -113,56 +499,146 @@ void doit(int fd)
     int is_static;
     is_static = parse_uri(uri, filename, cgiargs);
 
-    /* 获得文件属性 */
-    struct stat sbuf;
-    if (stat(filename, &sbuf) < 0) {
-        output_error_message("filename: %s -- stat error:%s\n", filename, strerror(errno));
-        clienterror(fd, filename, "404", "Not found", "Tiny colun't find this file");
+    /* 启用了常驻处理程序时, 动态请求交给进程池处理, 不再为每个请求 fork 和 exec */
+    if (!is_static && g_fcgi.p_nworkers > 0) {
+        server_fcgi(resp, filename, cgiargs, keepalive);
+        return;
+    }
+
+    /* 使用归档时静态文件只在映射的归档中查找, 不访问文件系统 */
+    if (is_static && g_pack.pk_map != NULL) {
+        server_packed(resp, req, filename, keepalive);
         return;
     }
 
-    /* 静态文件 */
+    /* 客户端接受 gzip 时, 优先发送预先压缩的同名 .gz 文件 */
+    if (is_static && http_accept_encoding(req, "gzip") && server_precompressed(resp, req, filename, keepalive))
+        return;
+
+    /* 命中缓存的静态文件直接从内存发送, 不需要任何文件系统调用 */
+    cache_entry_t *e;
+    if (is_static && g_cache.c_budget > 0 && (e = cache_lookup(&g_cache, filename)) != NULL) {
+        server_cached(resp, req, e, keepalive, NULL);
+        return;
+    }
+
+    /* 静态文件, 文件描述符和文件属性从打开文件缓存中取得, 热点文件不需要重复 stat 和 open */
+    uint64_t start = stats_now();
     if (is_static) {
-        if (!S_ISREG(sbuf.st_mode) || !(sbuf.st_mode & S_IRUSR)) {
-            output_error_message("%s: not permisson read the file\n", filename);
-            clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't read the file");
+        fd_entry_t *fe = fdcache_open(&g_fdcache, filename);
+        resp->r_fs_ns += stats_now() - start;
+        if (fe == NULL) {
+            output_warn_message("filename: %s -- open error:%s\n", filename, strerror(errno));
+            if (errno == EACCES)
+                clienterror(resp, 403, keepalive);
+            else
+                clienterror(resp, 404, keepalive);
             return;
         }
-        server_static(fd, filename, sbuf.st_size);
 
-    /* 动态文件 */
-    } else {
-        if (!S_ISREG(sbuf.st_mode) || !(sbuf.st_mode & S_IXUSR)) {
-            output_error_message("%s: not permisson excute the file\n", filename);
-            clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't run the file");
+        if (!S_ISREG(fe->fe_stat.st_mode) || !(fe->fe_stat.st_mode & S_IRUSR)) {
+            output_warn_message("%s: not permisson read the file\n", filename);
+            fdcache_release(&g_fdcache, fe);
+            clienterror(resp, 403, keepalive);
             return;
         }
-        server_dynamic(fd, filename, cgiargs);
+        server_static(resp, req, filename, fe, keepalive, NULL);
+        return;
     }
+
+    /* 动态文件, cgi 程序的输出长度未知, HTTP/1.1 使用分块编码保持连接, HTTP/1.0 只能关闭连接 */
+    struct stat sbuf;
+    int ret = stat(filename, &sbuf);
+    resp->r_fs_ns += stats_now() - start;
+    if (ret < 0) {
+        output_warn_message("filename: %s -- stat error:%s\n", filename, strerror(errno));
+        clienterror(resp, 404, keepalive);
+        return;
+    }
+
+    if (!S_ISREG(sbuf.st_mode) || !(sbuf.st_mode & S_IXUSR)) {
+        output_warn_message("%s: not permisson excute the file\n", filename);
+        clienterror(resp, 403, keepalive);
+        return;
+    }
+    server_dynamic(resp, filename, cgiargs, keepalive && http_str_equal(req->version, "HTTP/1.1"));
+}
+
+
+/*
+ * 函数说明:    等待文件描述符可读, 超时返回 0, 可读返回 1, 出错返回 -1
+ * @fd:         文件描述符
+ * @timeout:    超时时间(毫秒), -1 表示一直等待
+ */
+int wait_readable(int fd, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    int ret;
+    while ((ret = poll(&pfd, 1, timeout)) < 0 && errno == EINTR && !g_stop);
+    return (ret > 0 ? 1 : ret);
 }
 
 
 /*
- * 函数功能:    忽略 http 请求中的报头
+ * 函数说明:    在持久连接上等待下一个请求: 连接可读返回 1; 超时, 或者连接还不可读时监听套接字上有等待的连接,
+ *              返回 0; 出错返回 -1
+ * @fd:         与客户端连接的套接字
+ * @listenfd:   监听套接字
+ * @timeout:    超时时间(毫秒)
+ */
+int wait_request(int fd, int listenfd, int timeout)
+{
+    struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { listenfd, POLLIN, 0 } };
+
+    int ret;
+    while ((ret = poll(pfd, 2, timeout)) < 0 && errno == EINTR && !g_stop);
+    if (ret <= 0)
+        return ret;
+    return ((pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) ? 1 : 0);
+}
+
+
+/*
+ * 函数说明:    使用增量解析器直接在 rio 缓冲区中解析请求, 数据不完整时追加读取后从上次的位置继续解析.
+ *              成功返回 1, 连接关闭返回 0, 出错返回 -1. req 中的字符串指向 rio 缓冲区, 在下次读取之前有效
  * @rp:         指向绑定了 客户端文件描述符的 rio 缓冲区指针
+ * @req:        传出解析完成的请求
+ * @status:     出错时传出对应的 http 状态码, 连接错误时为 0
  */
-void read_requsthdrs(rio_t *rp)
+int read_request(rio_t *rp, http_request_t *req, int *status)
 {
-    char buf[MAXLINE];
-    int  len;
+    http_parser_t parser;
+    int consumed;
+    ssize_t nread;
 
-    do {
-        len = rio_readlineb(rp, buf, sizeof(buf));
-        if (len > 0) {
-            buf[len] = '\0';
-            printf("%s", buf);
+    *status = 0;
+    http_parser_init(&parser);
+    while ((consumed = http_parse(&parser, rp->rio_bufptr, rp->rio_cnt)) == 0) {
+        if ((nread = rio_fill(rp)) <= 0) {
+            if (nread < 0 && errno == ENOBUFS)
+                *status = 431;
+            else if (nread < 0 && errno == ETIMEDOUT)
+                *status = 408;
+            return (nread == 0 && rp->rio_cnt == 0 ? 0 : -1);
         }
-        
-    } while (strcmp(buf, "\r\n") != 0 && len > 0);
+    }
 
-    printf("\n");
+    if (consumed < 0) {
+        *status = parser.p_error;
+        return -1;
+    }
+
+    log_printf(LOG_DEBUG, "%.*s", consumed, rp->rio_bufptr);
+    http_parser_request(&parser, rp->rio_bufptr, req);
+    rp->rio_bufptr += consumed;
+    rp->rio_cnt -= consumed;
+    return 1;
 }
 
+
 /* 
  * 函数说明:    解析 uri, 获取文件名 和 参数
  * @uri:        uri 字符串
@@ -200,179 +676,774 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 }
 
 /*
- * 函数说明:    给客户端发送静态文件
- * @fd:         与客户端连接的套接字文件描述符
+ * 函数说明:    创建静态文件的响应. 可以缓存的文件读入缓存后从内存发送, 其余文件在响应报头之后添加文件数据段,
+ *              由 response_write 使用 sendfile 零拷贝发送, 文件系统不支持 sendfile 时退回到 mmap 方式.
+ *              条件请求和 Range 请求由 server_conditional 处理
+ * @resp:       存放响应的结构
+ * @req:        请求
  * @filename:   需要发送的文件名
- * @filesize:   文件大小
+ * @fe:         fdcache_open 返回的打开文件, 响应接管这个引用, 发送完成后释放
+ * @keepalive:  响应之后是否保持连接
+ * @encoding:   文件内容的编码 (预先压缩的 .gz 文件为 "gzip"), 没有为 NULL
  */
-void server_static(int fd, char *filename, int filesize)
-{
-    char buf[MAXLINE];
-    char filetype[MAXLINE];
-
-    /* 创建响应报头 */
-    get_filetype(filename, filetype);
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-lenght: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n", buf, filetype);
-    sprintf(buf, "%s\r\n", buf);
-
-    /* 发送文件内容 */
-    int srcfd;
-    if ((srcfd = open(filename, O_RDONLY)) < 0) {
-        output_error_message("open(%s) error: %s\n", filename, strerror(errno));
-        clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't Unable to read file contents");
+void server_static(response_t *resp, http_request_t *req, char *filename, fd_entry_t *fe, int keepalive,
+                   char const *encoding)
+{
+    char const *filetype = get_filetype(filename, encoding);
+    struct stat const *sbuf = &fe->fe_stat;
+    int srcfd = fe->fe_fd;
+    http_validator_t v;
+
+    /* 创建响应报头, 编码相关的报头, Connection 报头和结束的空行单独发送, 使得报头可以被缓存 */
+    http_make_validator(&v, sbuf->st_ino, sbuf->st_size, sbuf->st_mtim);
+    size_t hdrlen;
+    char const *buf = static_header(resp, sbuf->st_size, filetype, &v, &hdrlen);
+
+    cache_entry_t *e;
+    int gzip = (g_gzip && encoding == NULL && mime_compressible(filetype));
+    if (g_cache.c_budget > 0) {
+        if ((e = cache_insert(&g_cache, filename, buf, hdrlen, srcfd, sbuf, gzip)) != NULL) {
+            fdcache_release(&g_fdcache, fe);
+            server_cached(resp, req, e, keepalive, encoding);
+            return;
+        }
+
+        /* 文件已经被替换, 丢弃过时的描述符, 这次从重新打开的文件发送 (不缓存), 下一个请求再加入缓存.
+           重新打开失败 (文件已经被删除) 时仍然发送已经打开的文件 */
+        if (errno == ESTALE) {
+            fdcache_invalidate(&g_fdcache, filename);
+            fd_entry_t *cur = fdcache_open(&g_fdcache, filename);
+            if (cur != NULL && S_ISREG(cur->fe_stat.st_mode) && (cur->fe_stat.st_mode & S_IRUSR)) {
+                fdcache_release(&g_fdcache, fe);
+                fe = cur;
+                sbuf = &fe->fe_stat;
+                srcfd = fe->fe_fd;
+                resp->r_hdrlen = buf - resp->r_hdr;
+                http_make_validator(&v, sbuf->st_ino, sbuf->st_size, sbuf->st_mtim);
+                buf = static_header(resp, sbuf->st_size, filetype, &v, &hdrlen);
+            } else if (cur != NULL)
+                fdcache_release(&g_fdcache, cur);
+        }
+    }
+
+    char const *extra = encoding_header(encoding, filetype);
+    resp->r_cleanup = release_file;
+    resp->r_cleanup_arg = fe;
+    if (server_conditional(resp, req, filetype, &v, sbuf->st_size, srcfd, NULL, extra, keepalive))
         return;
+
+    char const *connection = connection_header(keepalive);
+    response_add_mem(resp, buf, hdrlen);
+    response_add_mem(resp, extra, strlen(extra));
+    response_add_mem(resp, connection, strlen(connection));
+    response_add_mem(resp, "\r\n", 2);
+    response_add_file(resp, srcfd, 0, sbuf->st_size);
+    resp->r_keepalive = keepalive;
+}
+
+
+/*
+ * 函数说明:    在 r_hdr 中拼接静态文件 200 响应的公共报头 (不含编码, Connection 报头和结束的空行),
+ *              返回报头的起始地址, 报头长度存放在 hdrlen 中
+ * @resp:       存放响应的结构
+ * @size:       响应主体的长度
+ * @filetype:   Content-type 报头的值
+ * @v:          文件的校验器
+ * @hdrlen:     存放报头长度
+ */
+char const *static_header(response_t *resp, off_t size, char const *filetype, http_validator_t const *v,
+                          size_t *hdrlen)
+{
+    size_t start = resp->r_hdrlen;
+
+    response_append_str(resp, "HTTP/1.1 200 OK\r\nServer: Tiny Web Server\r\nContent-length: ");
+    response_append_num(resp, (unsigned long long)size);
+    response_append_str(resp, "\r\nContent-type: ");
+    response_append_str(resp, filetype);
+    response_append_str(resp, "\r\nAccept-Ranges: bytes\r\nETag: ");
+    response_append_str(resp, v->etag);
+    response_append_str(resp, "\r\nLast-Modified: ");
+    response_append_str(resp, v->lastmod);
+    response_append(resp, "\r\n", 2);
+
+    *hdrlen = resp->r_hdrlen - start;
+    return resp->r_hdr + start;
+}
+
+
+/*
+ * 函数说明:    使用缓存对象创建响应, 缓存的报头, 编码相关的报头, Connection 报头, 空行和文件内容通过一次
+ *              writev 发送. 对象中有压缩后的内容并且客户端接受 gzip 时, 发送压缩后的内容.
+ *              响应持有缓存对象的引用, 发送完成后释放
+ * @resp:       存放响应的结构
+ * @req:        请求
+ * @e:          cache_lookup / cache_insert 返回的缓存对象
+ * @keepalive:  响应之后是否保持连接
+ * @encoding:   文件内容的编码 (预先压缩的 .gz 文件为 "gzip"), 没有为 NULL
+ */
+void server_cached(response_t *resp, http_request_t *req, cache_entry_t *e, int keepalive, char const *encoding)
+{
+    char const *connection = connection_header(keepalive);
+    char const *hdr = e->ce_hdr;
+    size_t hdrlen = e->ce_hdrlen;
+    char const *body = e->ce_body;
+    size_t bodylen = e->ce_bodylen;
+    char const *filetype = get_filetype(e->ce_path, encoding);
+    http_validator_t v;
+
+    resp->r_cleanup = release_cached;
+    resp->r_cleanup_arg = e;
+    http_make_validator(&v, e->ce_ino, e->ce_bodylen, e->ce_mtime);
+
+    /* 压缩后的内容是另一种表示, 使用不同的 ETag 和 Content-length */
+    if (encoding == NULL && e->ce_gzbody != NULL && http_accept_encoding(req, "gzip")) {
+        encoding = "gzip";
+        body = e->ce_gzbody;
+        bodylen = e->ce_gzbodylen;
+        http_validator_variant(&v, "gz");
+        hdr = static_header(resp, bodylen, filetype, &v, &hdrlen);
     }
 
-    // void *srcp;
-    // if ((srcp = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0)) == MAP_FAILED) {
-    //     output_error_message("mmap error: %s\n", strerror(errno));
-    //     clienterror(fd, filename, "403", "Forbidder", "Tiny couldn't Unable to read file contents");
-    //     return;
-    // }
+    char const *extra = encoding_header(encoding, filetype);
+    if (server_conditional(resp, req, filetype, &v, bodylen, -1, body, extra, keepalive))
+        return;
 
-    // close(srcfd);
-    // rio_writen(fd, buf, strlen(buf));
-    // rio_writen(fd, srcp, filesize);
-    // munmap(srcp, filesize);
+    response_add_mem(resp, hdr, hdrlen);
+    response_add_mem(resp, extra, strlen(extra));
+    response_add_mem(resp, connection, strlen(connection));
+    response_add_mem(resp, "\r\n", 2);
+    response_add_mem(resp, body, bodylen);
+    resp->r_keepalive = keepalive;
+}
 
-    /* 使用 malloc 实现发送数据 */
-    void *srcp;
-    if ((srcp = malloc(filesize)) == NULL) {
-        output_error_message("malloc error: %s\n", strerror(errno));
-        clienterror(fd, filename, "403", "Forbidder", "Tiny couldn't Unable to read file contents");
+
+/*
+ * 函数说明:    从映射的归档中发送静态文件, 只进行一次哈希查找, 不需要 stat 和 open. 预先生成的报头,
+ *              编码相关的报头, Connection 报头和空行直接引用映射的内存, 较小的内容也从映射中一起 writev,
+ *              较大的内容使用 sendfile 从归档文件发送. 客户端接受 gzip 并且归档中有压缩版本时发送压缩版本
+ * @resp:       存放响应的结构
+ * @req:        请求
+ * @filename:   请求的文件名 (parse_uri 的结果)
+ * @keepalive:  响应之后是否保持连接
+ */
+void server_packed(response_t *resp, http_request_t *req, char const *filename, int keepalive)
+{
+    pack_entry_t const *e = pack_lookup(&g_pack, filename);
+    if (e == NULL) {
+        output_warn_message("filename: %s -- not in the archive\n", filename);
+        clienterror(resp, 404, keepalive);
         return;
     }
 
-    int read_size = rio_readn(srcfd, srcp, filesize);
-    if (read_size != filesize) {
-        output_error_message("rio_readnb error: %s\n", strerror(errno));
-        clienterror(fd, filename, "403", "Forbidder", "Tiny coludn't Unable to read file contents");
-        free(srcp);
+    char const *encoding = NULL;
+    char const *filetype = g_pack.pk_map + e->pe_type;
+    http_validator_t const *v = &e->pe_v;
+    uint64_t hdr = e->pe_hdr;
+    size_t hdrlen = e->pe_hdrlen;
+    uint64_t off = e->pe_offset;
+    size_t size = e->pe_size;
+    if (e->pe_gzsize > 0 && http_accept_encoding(req, "gzip")) {
+        encoding = "gzip";
+        v = &e->pe_gzv;
+        hdr = e->pe_gzhdr;
+        hdrlen = e->pe_gzhdrlen;
+        off = e->pe_gzoffset;
+        size = e->pe_gzsize;
+    }
+
+    char const *extra = encoding_header(encoding, filetype);
+    if (server_conditional(resp, req, filetype, v, size, -1, g_pack.pk_map + off, extra, keepalive))
         return;
+
+    char const *connection = connection_header(keepalive);
+    response_add_mem(resp, g_pack.pk_map + hdr, hdrlen);
+    response_add_mem(resp, extra, strlen(extra));
+    response_add_mem(resp, connection, strlen(connection));
+    response_add_mem(resp, "\r\n", 2);
+    if (size < PACK_SENDFILE_MIN)
+        response_add_mem(resp, g_pack.pk_map + off, size);
+    else 
+        response_add_file(resp, g_pack.pk_fd, off, size);
+    resp->r_keepalive = keepalive;
+}
+
+
+/*
+ * 函数说明:    发送可压缩文件的同名 .gz 文件 (预先压缩的内容), 创建了响应返回 1, 没有 .gz 文件返回 0
+ * @resp:       存放响应的结构
+ * @req:        请求
+ * @filename:   请求的文件名
+ * @keepalive:  响应之后是否保持连接
+ */
+int server_precompressed(response_t *resp, http_request_t *req, char const *filename, int keepalive)
+{
+    char gzname[MAXLINE + 4];
+    cache_entry_t *e;
+    fd_entry_t *fe;
+
+    if (!mime_compressible(get_filetype(filename, NULL)))
+        return 0;
+
+    snprintf(gzname, sizeof(gzname), "%s.gz", filename);
+    if (g_cache.c_budget > 0 && (e = cache_lookup(&g_cache, gzname)) != NULL) {
+        server_cached(resp, req, e, keepalive, "gzip");
+        return 1;
     }
 
-    rio_writen(fd, buf, strlen(buf));
-    rio_writen(fd, srcp, filesize);
-    free(srcp);
-    close(srcfd);
+    uint64_t start = stats_now();
+    fe = fdcache_open(&g_fdcache, gzname);
+    resp->r_fs_ns += stats_now() - start;
+    if (fe == NULL)
+        return 0;
+    if (!S_ISREG(fe->fe_stat.st_mode) || !(fe->fe_stat.st_mode & S_IRUSR)) {
+        fdcache_release(&g_fdcache, fe);
+        return 0;
+    }
+
+    server_static(resp, req, gzname, fe, keepalive, "gzip");
+    return 1;
 }
 
+
 /*
- * 函数功能:    执行 cgi 程序
- * @fd:         与客户端通信的文件描述符
+ * 函数说明:    处理条件请求和 Range 请求. 验证器匹配 If-None-Match / If-Modified-Since 时创建 304 响应,
+ *              Range 有效 (并且满足 If-Range) 时创建 206 响应, 多个区间使用 multipart/byteranges,
+ *              区间都不能满足时创建 416 响应. 创建了响应返回 1, 需要发送整个文件时返回 0
+ * @resp:       存放响应的结构
+ * @req:        请求
+ * @filetype:   文件类型, 用于分段的 Content-type
+ * @v:          文件的验证器
+ * @size:       文件大小
+ * @fd:         文件描述符, 文件内容在内存中时为 -1
+ * @body:       内存中的文件内容, 从文件发送时为 NULL
+ * @extra:      需要附加的报头 (Content-Encoding, Vary)
+ * @keepalive:  响应之后是否保持连接
+ */
+int server_conditional(response_t *resp, http_request_t *req, char const *filetype, http_validator_t const *v,
+                       off_t size, int fd, char const *body, char const *extra, int keepalive)
+{
+    char *buf = resp->r_hdr;
+    char const *connection = connection_header(keepalive);
+    int hlen;
+
+    resp->r_keepalive = keepalive;
+    if (http_not_modified(req, v)) {
+        hlen = snprintf(buf, RESP_HDRLEN, "HTTP/1.1 304 Not Modified\r\nServer: Tiny Web Server\r\n"
+                        "ETag: %s\r\nLast-Modified: %s\r\n%s%s\r\n", v->etag, v->lastmod, extra, connection);
+        response_add_mem(resp, buf, hlen);
+        return 1;
+    }
+
+    http_str_t const *range = http_find_header(req, "Range");
+    http_range_t ranges[HTTP_MAX_RANGES];
+    int n;
+    if (range == NULL || !http_if_range(req, v)
+        || (n = http_parse_ranges(*range, size, ranges, HTTP_MAX_RANGES)) == 0)
+        return 0;
+
+    if (n < 0) {
+        hlen = snprintf(buf, RESP_HDRLEN, "HTTP/1.1 416 Range Not Satisfiable\r\nServer: Tiny Web Server\r\n"
+                        "Content-Range: bytes */%lld\r\nContent-length: 0\r\n%s\r\n", (long long)size, connection);
+        response_add_mem(resp, buf, hlen);
+        return 1;
+    }
+
+    /* 单个区间, 直接发送文件的一部分 */
+    if (n == 1) {
+        hlen = snprintf(buf, RESP_HDRLEN, "HTTP/1.1 206 Partial Content\r\nServer: Tiny Web Server\r\n"
+                        "Content-length: %lld\r\nContent-type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n"
+                        "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n%s%s\r\n",
+                        (long long)(ranges[0].end - ranges[0].start + 1), filetype, (long long)ranges[0].start,
+                        (long long)ranges[0].end, (long long)size, v->etag, v->lastmod, extra, connection);
+        response_add_mem(resp, buf, hlen);
+        add_body(resp, fd, body, ranges[0].start, ranges[0].end - ranges[0].start + 1);
+        return 1;
+    }
+
+    /* 多个区间, 每个分段的报头存放在 r_body 中, 放不下时退回到发送整个文件 */
+    char boundary[32];
+    char *parts = resp->r_body;
+    size_t used = 0;
+    size_t plen[HTTP_MAX_RANGES + 1];
+    long long total = 0;
+    snprintf(boundary, sizeof(boundary), "TINY%08lx%08lx", (unsigned long)time(NULL), (unsigned long)random());
+
+    for (int i = 0; i <= n; ++i) {
+        int cnt;
+        if (i < n)
+            cnt = snprintf(parts + used, RESP_BODYLEN - used, "\r\n--%s\r\nContent-type: %s\r\n"
+                           "Content-Range: bytes %lld-%lld/%lld\r\n\r\n", boundary, filetype,
+                           (long long)ranges[i].start, (long long)ranges[i].end, (long long)size);
+        else
+            cnt = snprintf(parts + used, RESP_BODYLEN - used, "\r\n--%s--\r\n", boundary);
+        if (cnt < 0 || (size_t)cnt >= RESP_BODYLEN - used)
+            return 0;
+
+        plen[i] = cnt;
+        used += cnt;
+        total += cnt + (i < n ? ranges[i].end - ranges[i].start + 1 : 0);
+    }
+
+    hlen = snprintf(buf, RESP_HDRLEN, "HTTP/1.1 206 Partial Content\r\nServer: Tiny Web Server\r\n"
+                    "Content-length: %lld\r\nContent-type: multipart/byteranges; boundary=%s\r\n"
+                    "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n%s%s\r\n",
+                    total, boundary, v->etag, v->lastmod, extra, connection);
+    response_add_mem(resp, buf, hlen);
+
+    for (int i = 0; i <= n; ++i) {
+        response_add_mem(resp, parts, plen[i]);
+        parts += plen[i];
+        if (i < n)
+            add_body(resp, fd, body, ranges[i].start, ranges[i].end - ranges[i].start + 1);
+    }
+
+    return 1;
+}
+
+
+/*
+ * 函数说明:    在响应中添加文件的一部分, 文件内容在内存中时添加内存段, 否则添加文件段
+ * @resp:       存放响应的结构
+ * @fd:         文件描述符
+ * @body:       内存中的文件内容, 没有为 NULL
+ * @off:        起始偏移
+ * @len:        长度
+ */
+void add_body(response_t *resp, int fd, char const *body, off_t off, size_t len)
+{
+    if (body != NULL)
+        response_add_mem(resp, body + off, len);
+    else
+        response_add_file(resp, fd, off, len);
+}
+
+
+/*
+ * 函数说明:    响应发送完成后释放缓存对象的引用
+ * @arg:        cache_entry_t 指针
+ */
+void release_cached(void *arg)
+{
+    cache_release(&g_cache, (cache_entry_t *)arg);
+}
+
+
+/*
+ * 函数说明:    响应发送完成后释放打开文件的引用
+ * @arg:        fd_entry_t 指针
+ */
+void release_file(void *arg)
+{
+    fdcache_release(&g_fdcache, (fd_entry_t *)arg);
+}
+
+
+/*
+ * 函数说明:    cgi 响应释放 (管道关闭) 时减少正在运行的 cgi 数量. 在这里计数而不是在 SIGCHLD 中,
+ *              信号处理函数无法可靠地区分 cgi 子进程和 (可能已经重启的) 常驻处理程序进程
+ * @arg:        没有使用
+ */
+void release_cgi(void *arg)
+{
+    atomic_fetch_sub(&g_stats.s_cgi_active, 1);
+}
+
+/*
+ * 函数功能:    执行 cgi 程序, cgi 的标准输出重定向到管道, 由响应把管道中的数据转发给客户端:
+ *              保持连接时使用分块编码, 否则由关闭连接结束响应. 套接字不可写时不读取管道,
+ *              cgi 写满管道后自然阻塞
+ * @resp:       存放响应的结构
  * @filename:   文件名
  * @cgiargs:    cgi 程序参数字符串
+ * @keepalive:  是否保持连接 (只有 HTTP/1.1 才能使用分块编码)
  */
-void server_dynamic(int fd, char *filename, char *cgiargs)
+void server_dynamic(response_t *resp, char *filename, char *cgiargs, int keepalive)
 {
-    char buf[MAXLINE];
     char *emptylist[] = {NULL};
+    int fds[2];
 
-    /* 创建响应报头 */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
+    /* 两端都设置 O_CLOEXEC, 其他线程同时 fork 的 cgi 不会继承管道 */
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        output_error_message("pipe2 error: %s\n", strerror(errno));
+        clienterror(resp, 500, 0);
+        return;
+    }
 
     /* 执行 cgi */
     pid_t pid;
     if ((pid = fork()) < 0) {
         output_error_message("fork error: %s\n", strerror(errno));
-        clienterror(fd, filename, "403", "Forbidder", "Tiny Web Server cannot execute the program");
+        close(fds[0]);
+        close(fds[1]);
+        clienterror(resp, 403, 0);
         return;
     
     } else if (pid == 0) {
-        rio_writen(fd, buf, strlen(buf));           /* 发送响应报头 */
         setenv("QUERY_STRING", cgiargs, 1);       
-        dup2(fd, STDOUT_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
         execve(filename, emptylist, environ);
+        exit(EXIT_FAILURE);
     }
 
-    return;
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    atomic_fetch_add(&g_stats.s_cgi_active, 1);
+    resp->r_cleanup = release_cgi;
+
+    resp->r_keepalive = keepalive;
+    response_add_pipe(resp, fds[0], keepalive, cgi_pipe_head);
+}
+
+
+/*
+ * 函数说明:    管道段的报头转换函数, 根据是否保持连接选择分块编码或者由关闭连接结束响应.
+ *              cgi 没有输出合法的报头 (head 为 NULL) 时生成 502 响应并关闭连接
+ * @resp:       响应指针
+ * @head:       cgi 输出的报头, 包括结尾的空行
+ * @len:        报头长度
+ */
+int cgi_pipe_head(response_t *resp, char *head, size_t len)
+{
+    static char const body[] = "Tiny couldn't read a valid header from the program\r\n";
+    char *p;
+
+    if (head != NULL)
+        return cgi_header(resp, head, len, (resp->r_keepalive ? BODY_CHUNKED : BODY_CLOSE), &p);
+
+    output_warn_message("%s: invalid cgi header\n", resp->r_reqline);
+    resp->r_keepalive = 0;
+    int n = snprintf(resp->r_hdr, RESP_HDRLEN, "HTTP/1.1 502 Bad Gateway\r\nServer: Tiny Web Server\r\n"
+                     "Content-type: text/plain\r\nContent-length: %zu\r\n%s\r\n%s",
+                     sizeof(body) - 1, connection_header(0), body);
+    return (n < 0 || n >= RESP_HDRLEN ? -1 : n);
 }
+
 /*
- * 函数说明:    给定文件名, 获得文件类型在 http 中的表示
+ * 函数说明:    将动态请求提交给常驻处理程序进程池, 响应在处理程序返回后由 fcgi_done 异步填充.
+ *              所有处理程序的队列都已满时立即返回 503
+ * @resp:       存放响应的结构
+ * @filename:   文件名, 去掉开头的 '.' 之后作为 SCRIPT_NAME
+ * @cgiargs:    查询字符串
+ * @keepalive:  响应之后是否保持连接
+ */
+void server_fcgi(response_t *resp, char *filename, char *cgiargs, int keepalive)
+{
+    resp->r_keepalive = keepalive;
+    resp->r_async = 1;                      /* 提交之后回调随时可能在读线程中执行, 必须先设置 */
+    if (fcgi_submit(&g_fcgi, filename + 1, cgiargs, fcgi_done, resp) < 0) {
+        resp->r_async = 0;
+        clienterror(resp, 503, keepalive);
+    }
+}
+
+
+/*
+ * 函数说明:    进程池请求完成回调, 在进程池的读线程中执行. 将处理程序的输出转换为响应,
+ *              出错时返回 502, 超时返回 504, 然后通知等待发送的一方
+ * @arg:        response_t 指针
+ * @err:        请求是否出错
+ * @buf:        处理程序的输出
+ * @len:        输出长度
+ */
+void fcgi_done(void *arg, int err, char *buf, size_t len)
+{
+    response_t *resp = (response_t *)arg;
+
+    if (err || fcgi_response(resp, buf, len) < 0) {
+        free(buf);
+        clienterror(resp, (err == FCGI_ERR_TIMEOUT ? 504 : 502), resp->r_keepalive);
+    }
+
+    response_complete(resp);
+}
+
+
+/*
+ * 函数说明:    将 CGI 格式的输出 (报头, 空行, 主体) 转换为响应. Status 报头给出状态码,
+ *              其余报头原样转发, 并加上 Content-length 使连接可以保持. 成功返回 0, 格式错误返回 -1
+ * @resp:       存放响应的结构
+ * @buf:        处理程序的输出, 成功时由响应负责释放
+ * @len:        输出长度
+ */
+int fcgi_response(response_t *resp, char *buf, size_t len)
+{
+    if (buf == NULL)
+        return -1;
+
+    char *body;
+    int n;
+    if ((n = cgi_header(resp, buf, len, BODY_LENGTH, &body)) < 0)
+        return -1;
+
+    response_add_mem(resp, resp->r_hdr, n);
+    response_add_mem(resp, body, buf + len - body);
+    resp->r_cleanup = free;
+    resp->r_cleanup_arg = buf;
+    return 0;
+}
+
+
+/*
+ * 函数说明:    解析 CGI 格式的报头, 生成响应报头写入 resp->r_hdr, 返回报头长度, 格式错误返回 -1.
+ *              Status 报头给出状态码, 其余报头原样转发, 再按 framing 加上正文的边界
+ * @resp:       存放响应的结构
+ * @buf:        cgi 输出, 以报头开始
+ * @len:        输出长度, BODY_LENGTH 时剩余部分全部是正文
+ * @framing:    BODY_LENGTH / BODY_CHUNKED / BODY_CLOSE
+ * @body:       返回正文的起始位置
+ */
+int cgi_header(response_t *resp, char *buf, size_t len, int framing, char **body)
+{
+    char status[MAXLINE] = "200 OK";
+    char headers[RESP_HDRLEN];
+    char length[64] = "";
+    size_t hlen = 0;
+    char *p = buf;
+    char *end = buf + len;
+
+    *body = NULL;
+    while (*body == NULL) {
+        char *eol = (char *)memchr(p, '\n', end - p);
+        if (eol == NULL)
+            return -1;
+
+        size_t llen = eol - p;
+        if (llen > 0 && p[llen - 1] == '\r')
+            --llen;
+
+        if (llen == 0)
+            *body = eol + 1;
+        else if (llen > 7 && strncasecmp(p, "Status:", 7) == 0) {
+            char *v = p + 7;
+            while (v < p + llen && *v == ' ')
+                ++v;
+            snprintf(status, sizeof(status), "%.*s", (int)(p + llen - v), v);
+        } else {
+            if (hlen + llen + 2 >= sizeof(headers))
+                return -1;
+            memcpy(headers + hlen, p, llen);
+            memcpy(headers + hlen + llen, "\r\n", 2);
+            hlen += llen + 2;
+        }
+        p = eol + 1;
+    }
+    headers[hlen] = '\0';
+
+    if (framing == BODY_LENGTH)
+        snprintf(length, sizeof(length), "Content-length: %zu\r\n", (size_t)(end - *body));
+    else if (framing == BODY_CHUNKED)
+        snprintf(length, sizeof(length), "Transfer-Encoding: chunked\r\n");
+
+    int n = snprintf(resp->r_hdr, RESP_HDRLEN, "HTTP/1.1 %s\r\nServer: Tiny Web Server\r\n%s%s%s\r\n",
+                     status, headers, length, connection_header(resp->r_keepalive));
+    if (n < 0 || n >= RESP_HDRLEN)
+        return -1;
+
+    return n;
+}
+
+
+/*
+ * 函数说明:    返回运行时统计信息 (Prometheus 文本格式): 汇总所有线程的计数器和各阶段的延迟直方图,
+ *              以及缓存, 常驻处理程序和日志的状态. 页面缓冲区在响应发送完成后释放
+ * @resp:       存放响应的结构
+ * @keepalive:  响应之后是否保持连接
+ */
+void server_status(response_t *resp, int keepalive)
+{
+    char *body;
+    if ((body = (char *)malloc(STATUS_BUFSIZE)) == NULL) {
+        clienterror(resp, 503, keepalive);
+        return;
+    }
+
+    size_t len = stats_format(body, STATUS_BUFSIZE);
+    if (g_cache.c_budget > 0) {
+        pthread_mutex_lock(&g_cache.c_mutex);
+        len += snprintf(body + len, STATUS_BUFSIZE - len, "tiny_cache_bytes %zu\ntiny_cache_objects %zu\n",
+                        g_cache.c_bytes, g_cache.c_count);
+        pthread_mutex_unlock(&g_cache.c_mutex);
+    }
+    if (len < STATUS_BUFSIZE) {
+        pthread_mutex_lock(&g_fdcache.f_mutex);
+        len += snprintf(body + len, STATUS_BUFSIZE - len, "tiny_fdcache_files %zu\ntiny_fdcache_hits_total %llu\n"
+                        "tiny_fdcache_misses_total %llu\n", g_fdcache.f_count,
+                        (unsigned long long)g_fdcache.f_hits, (unsigned long long)g_fdcache.f_misses);
+        pthread_mutex_unlock(&g_fdcache.f_mutex);
+    }
+    if (g_fcgi.p_nworkers > 0 && len < STATUS_BUFSIZE)
+        len += snprintf(body + len, STATUS_BUFSIZE - len, "tiny_fcgi_workers %d\ntiny_fcgi_inflight %d\n",
+                        g_fcgi.p_nworkers, fcgi_inflight(&g_fcgi));
+    if (len < STATUS_BUFSIZE)
+        len += snprintf(body + len, STATUS_BUFSIZE - len, "tiny_admit_connections %d\ntiny_admit_rejected_total %llu\n"
+                        "tiny_admit_limited_total %llu\ntiny_admit_shed_total %llu\n",
+                        __atomic_load_n(&g_admit.a_conns, __ATOMIC_RELAXED),
+                        (unsigned long long)__atomic_load_n(&g_admit.a_rejected, __ATOMIC_RELAXED),
+                        (unsigned long long)__atomic_load_n(&g_admit.a_limited, __ATOMIC_RELAXED),
+                        (unsigned long long)__atomic_load_n(&g_admit.a_shed, __ATOMIC_RELAXED));
+    if (len < STATUS_BUFSIZE)
+        len += snprintf(body + len, STATUS_BUFSIZE - len, "tiny_log_dropped_total %lu\n", log_dropped());
+    if (len >= STATUS_BUFSIZE)
+        len = STATUS_BUFSIZE - 1;
+
+    int hlen = snprintf(resp->r_hdr, RESP_HDRLEN, "HTTP/1.1 200 OK\r\nServer: Tiny Web Server\r\n"
+                        "Content-length: %zu\r\nContent-type: text/plain; version=0.0.4\r\n"
+                        "Cache-Control: no-store\r\n%s\r\n", len, connection_header(keepalive));
+    resp->r_cleanup = free;
+    resp->r_cleanup_arg = body;
+    response_add_mem(resp, resp->r_hdr, hlen);
+    response_add_mem(resp, body, len);
+    resp->r_keepalive = keepalive;
+}
+
+
+/*
+ * 函数说明:    阻塞模式下异步响应的通知函数, 唤醒等待的主线程
+ * @arg:        sem_t 指针
+ */
+void notify_sem(void *arg)
+{
+    sem_post((sem_t *)arg);
+}
+
+
+/*
+ * 函数说明:    给定文件名, 按照扩展名后缀获得文件类型在 http 中的表示 (查找编译期生成的完美哈希表).
+ *              预先压缩的文件 (encoding 不为 NULL) 忽略最后的 ".gz", 返回压缩前内容的类型
  * @filename:   文件名
- * @filetype:   存放文件类型的缓冲区 
+ * @encoding:   文件内容的编码, 没有为 NULL
  */
-void get_filetype(char const *filename, char *filetype)
+char const *get_filetype(char const *filename, char const *encoding)
 {
-    if (strstr(filename, ".html"))
-        strcpy(filetype, "text/html");
+    size_t len = strlen(filename);
+    if (encoding != NULL && len > 3 && strcmp(filename + len - 3, ".gz") == 0)
+        len -= 3;
 
-    else if (strstr(filename, ".gif")) 
-        strcpy(filetype, "image/gif");
+    return mime_type(filename, len);
+}
 
-    else if (strstr(filename, ".png"))
-        strcpy(filetype, "image/png");
 
-    else if (strstr(filename, ".jpg"))
-        strcpy(filetype, "image/jpeg");
+/*
+ * 函数说明:    返回与内容编码相关的报头行: 压缩后的内容需要 Content-Encoding, 可压缩类型的所有表示都需要
+ *              Vary: Accept-Encoding, 使得共享缓存按照 Accept-Encoding 区分
+ * @encoding:   内容编码, 没有为 NULL
+ * @filetype:   文件类型
+ */
+char const *encoding_header(char const *encoding, char const *filetype)
+{
+    if (encoding != NULL)
+        return "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
 
-    else if (strstr(filename, ".mpg"))
-        strcpy(filetype, "video/mpg"); 
-    
-    else if (strstr(filename, ".mp3"))
-        strcpy(filetype, "audio/mp3");
+    if (mime_compressible(filetype))
+        return "Vary: Accept-Encoding\r\n";
 
-    else if (strstr(filename, ".mp4"))
-        strcpy(filetype, "video/mpeg4");
+    return "";
+}
 
-    else 
-        strcpy(filetype, "text/plain");
+
+/*
+ * 函数说明:    启动时预先生成所有错误页面的响应报头 (不含 Connection 报头) 和 html 主体,
+ *              之后的错误响应直接发送这些内存, 不再格式化. 成功返回 0
+ */
+int init_error_pages(void)
+{
+    for (size_t i = 0; i < sizeof(g_error_pages) / sizeof(g_error_pages[0]); ++i) {
+        error_page_t *ep = &g_error_pages[i];
+        char body[RESP_BODYLEN];
+        char head[RESP_HDRLEN];
+        int bodylen = snprintf(body, sizeof(body), "<html><title>Tiny Error</title>"
+                               "<body bgcolor=\"ffffff\">\r\n"
+                               "%d: %s\r\n"
+                               "<p>%s\r\n"
+                               "<hr><em>The Tiny Web Server</em>\r\n", ep->ep_status, ep->ep_reason, ep->ep_message);
+        int headlen = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nServer: Tiny Web Server\r\n"
+                               "Content-type: text/html\r\nContent-length: %d\r\n",
+                               ep->ep_status, ep->ep_reason, bodylen);
+
+        if ((ep->ep_head = strdup(head)) == NULL || (ep->ep_body = strdup(body)) == NULL)
+            return -1;
+        ep->ep_headlen = headlen;
+        ep->ep_bodylen = bodylen;
+    }
+
+    return 0;
 }
 
 
 /* 
- * 函数功能:    给个客户端发送错误信息
- * @fd:         与客户端连接的套节字文件描述符
- * @cause:      错误来源 
- * @errnum:     错误号
- * @shortmsg:   短错误原因描述
- * @longmsg:    长错误原因描述
+ * 函数功能:    创建发送给客户端的错误信息响应, 预先生成的报头, Connection 报头, 空行和页面通过一次 writev 发送.
+ *              没有对应页面的状态码按 500 处理
+ * @resp:       存放响应的结构
+ * @status:     状态码
+ * @keepalive:  响应之后是否保持连接
  */ 
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+void clienterror(response_t *resp, int status, int keepalive)
+{
+    error_page_t const *ep = NULL;
+    for (size_t i = 0; i < sizeof(g_error_pages) / sizeof(g_error_pages[0]); ++i) {
+        if (g_error_pages[i].ep_status == status || g_error_pages[i].ep_status == 500)
+            ep = &g_error_pages[i];
+        if (g_error_pages[i].ep_status == status)
+            break;
+    }
+
+    char const *connection = connection_header(keepalive);
+    response_add_mem(resp, ep->ep_head, ep->ep_headlen);
+    response_add_mem(resp, connection, strlen(connection));
+    response_add_mem(resp, "\r\n", 2);
+    response_add_mem(resp, ep->ep_body, ep->ep_bodylen);
+    resp->r_keepalive = keepalive;
+}
+
+/*
+ * 函数说明:    返回响应报头中描述连接是否保持的报头行
+ * @keepalive:  响应之后是否保持连接
+ */
+char const *connection_header(int keepalive)
 {
-    char buf[MAXLINE];
-    char body[MAXLINE];
+    if (keepalive)
+        return "Connection: keep-alive\r\nKeep-Alive: timeout=" STR(KEEPALIVE_TIMEOUT) "\r\n";
 
-    /* 创建 html 响应文件 */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=\"ffffff\">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web Server</em>\r\n", body);
+    return "Connection: close\r\n";
+}
 
-    /* 创建 http 响应报头 */
-    int body_len = strlen(body);
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    sprintf(buf, "%sContent-type: text/html\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, body_len);
-    sprintf(buf, "%sConnection: close\r\n\r\n", buf);
 
-    /* 发送 */
-    rio_writen(fd, buf, strlen(buf));
-    rio_writen(fd, body, body_len); 
+/*
+ * 函数说明:    解析带有 K/M/G 后缀的字节数量
+ * @str:        字符串
+ */
+size_t parse_size(char const *str)
+{
+    char *end;
+    size_t size = strtoull(str, &end, 10);
+
+    switch (*end) {
+    case 'g': case 'G': size <<= 10;        /* fall through */
+    case 'm': case 'M': size <<= 10;        /* fall through */
+    case 'k': case 'K': size <<= 10;
+    }
+
+    return size;
 }
 
+
 /*
  * 函数说明:    注册 SIGCHLD 信号处理函数, 并在信号中回收子进程
  */ 
 void sig_chld(int signo)
 {
-    while (waitpid(0, NULL, WNOHANG) > 0);      /* 非阻塞循环回收子进程 */
+    while (waitpid(-1, NULL, WNOHANG) > 0);    /* 非阻塞循环回收子进程 */
 }
 
 
 /*
- * 函数说明:    对 SIGCHLD SIGPIPE 信号进行捕获 
+ * 函数说明:    对 SIGCHLD SIGPIPE SIGTERM 信号进行捕获 
  */
 void sginal_captrue()
 {
     struct sigaction action;
 
+    g_main_thread = pthread_self();
     action.sa_handler = sig_chld;
     sigemptyset(&action.sa_mask);
     action.sa_flags = SA_RESTART;
@@ -387,12 +1458,21 @@ void sginal_captrue()
         output_error_message("sigacion error: %s \n", strerror(errno));
         exit(EXIT_FAILURE);
     }
+
+    /* 不设置 SA_RESTART, 让阻塞的 accept 和 poll 返回 EINTR */
+    action.sa_handler = sig_term;
+    action.sa_flags = 0;
+    if (sigaction(SIGTERM, &action, NULL) < 0) {
+        output_error_message("sigacion error: %s \n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 }
 
 
 /* 
  * 函数说明:    SIGPIPE 信号捕捉函数, 当 写入 connfd 对端关闭连接, 系统发送 SIGPIPE 信号, 
- *              使得进程可以完美处理异常, 通过调用 siglongjmp 回到 main 函数中
+ *              使得进程可以完美处理异常, 通过调用 siglongjmp 回到 main 函数中.
+ *              log_printf 不是异步信号安全的, 日志在 siglongjmp 返回之后由 main 函数写出
  */
 void sig_pipe(int signo)
 {
@@ -400,6 +1480,20 @@ void sig_pipe(int signo)
         return;
 
     canjmp = 0;
-    printf("\n\nerror: The client has colsed the connection and data sent is lost\n\n");
     siglongjmp(env, 1);
 }
+
+
+/*
+ * 函数说明:    SIGTERM 信号捕捉函数, 平滑退出: 不再接受新连接, 处理完已有连接上的当前请求后退出.
+ *              多进程模式下由主进程在停止或者 SIGHUP 重启时发送
+ */
+void sig_term(int signo)
+{
+    g_stop = 1;
+    reactor_stop();
+
+    /* 信号可能被日志线程等其他线程收到, 转发给主线程打断阻塞的 accept */
+    if (!pthread_equal(pthread_self(), g_main_thread))
+        pthread_kill(g_main_thread, SIGTERM);
+}
@@ -0,0 +1,341 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "timer.h"
+
+#define ADMIT_SHARDS        16              /* 客户端表的分片数量, 每个分片一个互斥量, 必须是 2 的幂 */
+#define ADMIT_SLOTS         1024            /* 每个分片的槽位数量, 必须是 2 的幂 */
+#define ADMIT_PROBE         8               /* 线性探测的最大长度, 范围内没有可用槽位时不跟踪这个客户端 */
+
+/* 拒绝连接时直接写出的响应, 不读取请求, 不分配连接结构 */
+#define ADMIT_HTTP_503      "HTTP/1.1 503 Service Unavailable\r\nServer: Tiny Web Server\r\n" \
+                            "Content-length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n"
+
+/* 准入控制的配置, 为 0 的项不限制 */
+typedef struct admit_conf_t {
+    int          ac_max_conns;              /* 全局并发连接上限 */
+    int          ac_max_per_ip;             /* 每个客户端地址的并发连接上限 */
+    double       ac_rate;                   /* 每个客户端地址每秒允许的请求数量 (令牌补充速度) */
+    double       ac_burst;                  /* 令牌桶容量, 允许的突发请求数量, 0 表示 ac_rate 的两倍 */
+} admit_conf_t;
+
+/* 客户端地址, IPv4 地址映射为 IPv6 形式, 端口不参与比较 */
+typedef struct admit_key_t {
+    uint8_t      k_addr[16];                /* 地址 */
+} admit_key_t;
+
+/* 客户端表的槽位, 32 字节 */
+typedef struct admit_client_t {
+    admit_key_t  cl_key;                    /* 客户端地址 */
+    uint32_t     cl_conns;                  /* 当前连接数量 */
+    float        cl_tokens;                 /* 令牌桶中剩余的令牌 */
+    uint64_t     cl_stamp;                  /* 上次补充令牌的时间(timer_now 加一, 毫秒), 0 表示空槽位 */
+} admit_client_t;
+
+/* 客户端表的一个分片, 开放寻址, 槽位被占用之后不再变为空, 只在空闲时被其他客户端复用 */
+typedef struct admit_shard_t {
+    pthread_mutex_t  as_mutex;              /* 互斥量 */
+    admit_client_t   as_slots[ADMIT_SLOTS]; /* 槽位 */
+} admit_shard_t;
+
+/*
+ * 连接准入和请求限速: 全局和每个客户端地址的并发连接上限, 每个客户端地址一个令牌桶.
+ * 文件描述符耗尽时使用预留的描述符接受等待的连接, 写出拒绝响应后立即关闭, 使监听队列不会堆积
+ */
+typedef struct admit_t {
+    admit_conf_t     a_conf;                /* 配置 */
+    int              a_conns;               /* 当前连接数量 */
+    int              a_reservefd;           /* 预留的文件描述符, 没有时为 -1 */
+    pthread_mutex_t  a_reserve_mutex;       /* 保护预留的文件描述符 */
+    uint64_t         a_rejected;            /* 超过连接上限被拒绝的连接数量 */
+    uint64_t         a_limited;             /* 超过速率被拒绝的请求数量 */
+    uint64_t         a_shed;                /* 文件描述符耗尽时丢弃的连接数量 */
+    admit_shard_t    a_shards[ADMIT_SHARDS];    /* 客户端表 */
+} admit_t;
+
+int  admit_init(admit_t *a, admit_conf_t const *conf);
+int  admit_tracking(admit_t const *a);
+void admit_key(admit_key_t *key, struct sockaddr const *addr);
+int  admit_connect(admit_t *a, admit_key_t const *key);
+void admit_disconnect(admit_t *a, admit_key_t const *key);
+int  admit_request(admit_t *a, admit_key_t const *key);
+int  admit_shed(admit_t *a, int listenfd, char const *reply, size_t len);
+void admit_reject(int fd, char const *reply, size_t len);
+static admit_client_t *admit_find(admit_t *a, admit_key_t const *key, uint64_t now, int create,
+                                  admit_shard_t **shard);
+static void admit_refill(admit_t const *a, admit_client_t *cl, uint64_t now);
+
+
+/*
+ * 函数说明:    初始化准入控制并打开预留的文件描述符, 成功返回 0
+ * @a:          准入控制结构
+ * @conf:       配置
+ */
+int admit_init(admit_t *a, admit_conf_t const *conf)
+{
+    bzero(a, sizeof(admit_t));
+    a->a_conf = *conf;
+    if (a->a_conf.ac_burst <= 0)
+        a->a_conf.ac_burst = 2 * a->a_conf.ac_rate;
+    if (a->a_conf.ac_rate > 0 && a->a_conf.ac_burst < 1)
+        a->a_conf.ac_burst = 1;
+
+    for (int i = 0; i < ADMIT_SHARDS; ++i)
+        pthread_mutex_init(&a->a_shards[i].as_mutex, NULL);
+    pthread_mutex_init(&a->a_reserve_mutex, NULL);
+
+    if ((a->a_reservefd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    是否需要按客户端地址跟踪 (设置了每个地址的连接上限或者请求速率), 不需要时调用者不必取得客户端地址
+ * @a:          准入控制结构
+ */
+int admit_tracking(admit_t const *a)
+{
+    return a->a_conf.ac_max_per_ip > 0 || a->a_conf.ac_rate > 0;
+}
+
+
+/*
+ * 函数说明:    由套接字地址生成客户端地址键, 其他地址族的键为全 0 (所有这类客户端共用一个槽位)
+ * @key:        存放键
+ * @addr:       accept 或者 getpeername 返回的地址
+ */
+void admit_key(admit_key_t *key, struct sockaddr const *addr)
+{
+    bzero(key, sizeof(admit_key_t));
+    if (addr->sa_family == AF_INET) {
+        key->k_addr[10] = key->k_addr[11] = 0xff;
+        memcpy(key->k_addr + 12, &((struct sockaddr_in const *)addr)->sin_addr, 4);
+    } else if (addr->sa_family == AF_INET6) {
+        memcpy(key->k_addr, &((struct sockaddr_in6 const *)addr)->sin6_addr, 16);
+    }
+}
+
+
+/*
+ * 函数说明:    新连接的准入检查, 允许时计入全局和客户端的连接数量, 连接关闭时调用 admit_disconnect.
+ *              允许返回 0, 超过上限返回 -1
+ * @a:          准入控制结构
+ * @key:        客户端地址
+ */
+int admit_connect(admit_t *a, admit_key_t const *key)
+{
+    int conns = __atomic_add_fetch(&a->a_conns, 1, __ATOMIC_RELAXED);
+    if (a->a_conf.ac_max_conns > 0 && conns > a->a_conf.ac_max_conns) {
+        __atomic_sub_fetch(&a->a_conns, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&a->a_rejected, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    if (!admit_tracking(a))
+        return 0;
+
+    /* 表中没有可用槽位时不跟踪这个客户端, 宁可放过也不拒绝正常的客户端 */
+    admit_shard_t *shard;
+    admit_client_t *cl = admit_find(a, key, timer_now() + 1, 1, &shard);
+    if (cl == NULL)
+        return 0;
+
+    if (a->a_conf.ac_max_per_ip > 0 && cl->cl_conns >= (uint32_t)a->a_conf.ac_max_per_ip) {
+        pthread_mutex_unlock(&shard->as_mutex);
+        __atomic_sub_fetch(&a->a_conns, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&a->a_rejected, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    ++cl->cl_conns;
+    pthread_mutex_unlock(&shard->as_mutex);
+    return 0;
+}
+
+
+/*
+ * 函数说明:    admit_connect 允许的连接关闭
+ * @a:          准入控制结构
+ * @key:        客户端地址
+ */
+void admit_disconnect(admit_t *a, admit_key_t const *key)
+{
+    __atomic_sub_fetch(&a->a_conns, 1, __ATOMIC_RELAXED);
+    if (!admit_tracking(a))
+        return;
+
+    admit_shard_t *shard;
+    admit_client_t *cl = admit_find(a, key, 0, 0, &shard);
+    if (cl == NULL)
+        return;
+
+    if (cl->cl_conns > 0)
+        --cl->cl_conns;
+    pthread_mutex_unlock(&shard->as_mutex);
+}
+
+
+/*
+ * 函数说明:    请求的限速检查, 从客户端的令牌桶中取出一个令牌. 允许返回 0, 超过速率返回 -1
+ * @a:          准入控制结构
+ * @key:        客户端地址
+ */
+int admit_request(admit_t *a, admit_key_t const *key)
+{
+    if (a->a_conf.ac_rate <= 0)
+        return 0;
+
+    uint64_t now = timer_now() + 1;
+    admit_shard_t *shard;
+    admit_client_t *cl = admit_find(a, key, now, 1, &shard);
+    if (cl == NULL)
+        return 0;
+
+    admit_refill(a, cl, now);
+    int ret = 0;
+    if (cl->cl_tokens >= 1)
+        cl->cl_tokens -= 1;
+    else
+        ret = -1;
+    pthread_mutex_unlock(&shard->as_mutex);
+
+    if (ret < 0)
+        __atomic_add_fetch(&a->a_limited, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+
+/*
+ * 函数说明:    accept 因为文件描述符耗尽 (EMFILE / ENFILE) 失败时调用: 关闭预留的描述符, 接受一个等待的连接,
+ *              写出拒绝响应后关闭, 再重新打开预留的描述符. 丢弃了一个连接返回 0, 失败返回 -1, 监听队列为空时
+ *              返回 -1 并把 errno 设为 EAGAIN.
+ *              监听套接字可以是阻塞的, 接受之前先检查是否有等待的连接
+ * @a:          准入控制结构
+ * @listenfd:   监听套接字
+ * @reply:      拒绝响应, 为 NULL 时直接关闭
+ * @len:        响应长度
+ */
+int admit_shed(admit_t *a, int listenfd, char const *reply, size_t len)
+{
+    struct pollfd pfd = { listenfd, POLLIN, 0 };
+    int ret = -1;
+
+    pthread_mutex_lock(&a->a_reserve_mutex);
+    if (a->a_reservefd >= 0 && poll(&pfd, 1, 0) == 1) {
+        close(a->a_reservefd);
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0) {
+            admit_reject(fd, reply, len);
+            __atomic_add_fetch(&a->a_shed, 1, __ATOMIC_RELAXED);
+            ret = 0;
+        }
+        a->a_reservefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    } else if (a->a_reservefd >= 0) {
+        errno = EAGAIN;                     /* 已经没有等待的连接, 调用者按 accept 返回 EAGAIN 处理 */
+    }
+    pthread_mutex_unlock(&a->a_reserve_mutex);
+
+    return ret;
+}
+
+
+/*
+ * 函数说明:    拒绝连接: 不等待, 能写出多少拒绝响应就写出多少, 然后关闭
+ * @fd:         连接的套接字
+ * @reply:      拒绝响应, 为 NULL 时直接关闭
+ * @len:        响应长度
+ */
+void admit_reject(int fd, char const *reply, size_t len)
+{
+    if (reply != NULL)
+        send(fd, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
+
+
+/* (内部函数)
+ * 函数说明:    在客户端表中查找客户端, 返回时持有所在分片的互斥量. 没有找到时, create 不为 0 则在探测范围内的
+ *              第一个空槽位, 或者没有连接并且令牌已经补满的槽位中创建, 否则返回 NULL (不持有互斥量)
+ * @a:          准入控制结构
+ * @key:        客户端地址
+ * @now:        当前时间(毫秒)
+ * @create:     没有找到时是否创建
+ * @shard:      存放所在的分片
+ */
+static admit_client_t *admit_find(admit_t *a, admit_key_t const *key, uint64_t now, int create,
+                                  admit_shard_t **shard)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(key->k_addr); ++i) {
+        hash ^= key->k_addr[i];
+        hash *= 16777619u;
+    }
+
+    admit_shard_t *s = &a->a_shards[(hash >> 24) & (ADMIT_SHARDS - 1)];
+    admit_client_t *reuse = NULL;
+    pthread_mutex_lock(&s->as_mutex);
+    for (int i = 0; i < ADMIT_PROBE; ++i) {
+        admit_client_t *cl = &s->as_slots[(hash + i) & (ADMIT_SLOTS - 1)];
+        if (cl->cl_stamp == 0) {
+            if (reuse == NULL)
+                reuse = cl;
+            break;
+        }
+        if (memcmp(&cl->cl_key, key, sizeof(admit_key_t)) == 0) {
+            *shard = s;
+            return cl;
+        }
+
+        /* 没有连接并且令牌桶已满的客户端与新客户端没有区别, 可以复用它的槽位 */
+        if (create && reuse == NULL && cl->cl_conns == 0) {
+            admit_refill(a, cl, now);
+            if (a->a_conf.ac_rate <= 0 || cl->cl_tokens >= a->a_conf.ac_burst)
+                reuse = cl;
+        }
+    }
+
+    if (!create || reuse == NULL) {
+        pthread_mutex_unlock(&s->as_mutex);
+        return NULL;
+    }
+
+    reuse->cl_key = *key;
+    reuse->cl_conns = 0;
+    reuse->cl_tokens = a->a_conf.ac_burst;
+    reuse->cl_stamp = now;
+    *shard = s;
+    return reuse;
+}
+
+
+/* (内部函数)
+ * 函数说明:    按经过的时间补充令牌, 不超过桶的容量
+ * @a:          准入控制结构
+ * @cl:         客户端
+ * @now:        当前时间(毫秒)
+ */
+static void admit_refill(admit_t const *a, admit_client_t *cl, uint64_t now)
+{
+    if (now <= cl->cl_stamp)
+        return;
+
+    double tokens = cl->cl_tokens + (double)(now - cl->cl_stamp) * a->a_conf.ac_rate / 1000;
+    cl->cl_tokens = (float)(tokens < a->a_conf.ac_burst ? tokens : a->a_conf.ac_burst);
+    cl->cl_stamp = now;
+}
+
+#endif
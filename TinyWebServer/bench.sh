@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# 在本地启动一个 TinyWebServer, 用 tinybench 依次运行典型场景: 小静态文件, 流水线小文件, 大文件,
+# 404 和常驻处理程序 (FastCGI) 的动态请求. 由 make bench 调用
+#
+# 用法: ./bench.sh [秒数]
+# 环境变量: PORT (默认 18080), THREADS, CONNS, SERVER_OPTS (附加的服务器选项, 例如 "-c 0" 或 "-z")
+#
+
+DURATION=${1:-5}
+PORT=${PORT:-18080}
+THREADS=${THREADS:-2}
+CONNS=${CONNS:-50}
+DIR=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(mktemp -d /tmp/tinybench.XXXXXX)
+
+cleanup() {
+    [ -n "$SERVER" ] && kill "$SERVER" 2> /dev/null
+    rm -rf "$ROOT"
+}
+trap cleanup EXIT INT TERM
+
+# 测试文件: 1KB 的 html 和 8MB 的二进制文件
+head -c 1024 /dev/urandom | od -An -tx1 | head -c 1024 > "$ROOT/small.html"
+head -c 8388608 /dev/urandom > "$ROOT/large.bin"
+
+(cd "$ROOT" && exec "$DIR/TinyWebServer.out" -r 0 -v 0 -f "$DIR/fcgi_adder.out" $SERVER_OPTS "$PORT") &
+SERVER=$!
+sleep 1
+if ! kill -0 "$SERVER" 2> /dev/null; then
+    echo "error: TinyWebServer failed to start on port $PORT" >&2
+    exit 1
+fi
+
+run() {
+    echo "=== $1"
+    shift
+    "$DIR/tinybench.out" -t "$THREADS" -c "$CONNS" -d "$DURATION" "$@"
+    echo
+}
+
+URL=http://127.0.0.1:$PORT
+run "small static file"             "$URL/small.html"
+run "small static file, pipeline 16" -p 16 "$URL/small.html"
+run "small static file, no keep-alive" -C "$URL/small.html"
+run "large static file (8MB)"       "$URL/large.bin"
+run "404 not found"                 "$URL/missing.html"
+run "dynamic (FastCGI adder)"       "$URL/cgi-bin/adder?15213&18213"
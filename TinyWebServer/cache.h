@@ -0,0 +1,426 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/inotify.h>
+#include <zlib.h>
+#include "rio.h"
+
+#define CACHE_HASH_SIZE     4096            /* 哈希桶数量, 必须是 2 的幂 */
+#define CACHE_MAX_OBJECT    (1 << 20)       /* 单个缓存对象的最大字节数 */
+#define CACHE_REVALIDATE    1               /* 没有 inotify 时, 重新检查文件属性的间隔(秒) */
+#define CACHE_GZIP_MIN      256             /* 小于这个大小的文件不压缩 */
+#define CACHE_WATCH_MASK    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+/* 缓存对象, 保存预先生成的响应报头和文件内容 */
+typedef struct cache_entry_t {
+    char                    *ce_path;       /* 文件路径 (键) */
+    unsigned                 ce_hash;       /* 路径的哈希值 */
+    char                    *ce_hdr;        /* 预先生成的响应报头, 不含 Connection 报头和结束的空行 */
+    size_t                   ce_hdrlen;     /* 响应报头长度 */
+    char                    *ce_body;       /* 文件内容 */
+    size_t                   ce_bodylen;    /* 文件内容长度 */
+    char                    *ce_gzbody;     /* gzip 压缩后的文件内容, 没有压缩为 NULL */
+    size_t                   ce_gzbodylen;  /* 压缩后的长度 */
+    struct timespec          ce_mtime;      /* 缓存时文件的修改时间 */
+    ino_t                    ce_ino;        /* 文件的 inode 号, 用于生成 ETag */
+    time_t                   ce_checked;    /* 最后一次检查文件属性的时间 */
+    int                      ce_wd;         /* inotify 监视描述符, 没有为 -1 */
+    int                      ce_refcnt;     /* 引用计数, 缓存本身持有一个引用 */
+    int                      ce_cached;     /* 是否仍在缓存中 */
+    struct cache_entry_t    *ce_hnext;      /* 哈希链表的下一结点 */
+    struct cache_entry_t    *ce_wnext;      /* 按监视描述符索引的链表的下一结点 */
+    struct cache_entry_t    *ce_prev;       /* LRU 链表的上一结点 */
+    struct cache_entry_t    *ce_next;       /* LRU 链表的下一结点 */
+} cache_entry_t;
+
+/* 多线程共享的静态内容缓存, 按字节预算进行 LRU 淘汰 */
+typedef struct content_cache_t {
+    pthread_mutex_t          c_mutex;       /* 互斥量 */
+    cache_entry_t           *c_buckets[CACHE_HASH_SIZE];    /* 哈希桶 */
+    cache_entry_t           *c_watches[CACHE_HASH_SIZE];    /* 按监视描述符索引的哈希桶, 事件分发和移除监视不需要遍历 LRU 链表 */
+    cache_entry_t            c_lru;         /* LRU 链表哨兵, c_lru.ce_next 是最近使用的对象 */
+    size_t                   c_bytes;       /* 缓存占用的字节数 */
+    size_t                   c_budget;      /* 字节预算 */
+    size_t                   c_count;       /* 缓存对象数量 */
+    int                      c_inotify;     /* inotify 文件描述符, 不可用时为 -1 */
+} content_cache_t;
+
+int  cache_init(content_cache_t *c, size_t budget);
+cache_entry_t *cache_lookup(content_cache_t *c, char const *path);
+cache_entry_t *cache_insert(content_cache_t *c, char const *path, char const *hdr, size_t hdrlen,
+                            int fd, struct stat const *st, int gzip);
+void cache_release(content_cache_t *c, cache_entry_t *e);
+static unsigned cache_hash(char const *path);
+static size_t cache_entry_size(cache_entry_t const *e);
+static void cache_gzip(cache_entry_t *e);
+static void cache_unlink(content_cache_t *c, cache_entry_t *e);
+static void cache_unwatch(content_cache_t *c, cache_entry_t *e, int rm);
+static void cache_put(cache_entry_t *e);
+static void *cache_watch(void *arg);
+
+
+/*
+ * 函数说明:    初始化缓存, 并启动 inotify 监视线程, inotify 不可用时退回到定期检查文件属性. 成功返回 0
+ * @c:          缓存指针
+ * @budget:     字节预算
+ */
+int cache_init(content_cache_t *c, size_t budget)
+{
+    if (c == NULL)
+        return -1;
+
+    bzero(c, sizeof(content_cache_t));
+    c->c_budget = budget;
+    c->c_lru.ce_next = c->c_lru.ce_prev = &c->c_lru;
+    if (pthread_mutex_init(&c->c_mutex, NULL) != 0)
+        return -1;
+
+    pthread_t tid;
+    if ((c->c_inotify = inotify_init1(IN_CLOEXEC)) >= 0
+        && pthread_create(&tid, NULL, cache_watch, c) != 0) {
+        close(c->c_inotify);
+        c->c_inotify = -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    查找缓存对象, 命中时返回增加了引用计数的对象, 使用完成后调用 cache_release, 没有命中返回 NULL
+ * @c:          缓存指针
+ * @path:       文件路径
+ */
+cache_entry_t *cache_lookup(content_cache_t *c, char const *path)
+{
+    unsigned hash = cache_hash(path);
+    time_t now = (c->c_inotify < 0 ? time(NULL) : 0);
+    cache_entry_t *e;
+    struct stat sbuf;
+
+    pthread_mutex_lock(&c->c_mutex);
+    for (e = c->c_buckets[hash & (CACHE_HASH_SIZE - 1)]; e != NULL; e = e->ce_hnext) {
+        if (e->ce_hash == hash && strcmp(e->ce_path, path) == 0)
+            break;
+    }
+
+    /* 没有 inotify 时, 每隔 CACHE_REVALIDATE 秒检查一次文件的修改时间和大小 */
+    if (e != NULL && c->c_inotify < 0 && now - e->ce_checked >= CACHE_REVALIDATE) {
+        if (stat(path, &sbuf) < 0 || sbuf.st_size != (off_t)e->ce_bodylen
+            || sbuf.st_mtim.tv_sec != e->ce_mtime.tv_sec || sbuf.st_mtim.tv_nsec != e->ce_mtime.tv_nsec) {
+            cache_unlink(c, e);
+            e = NULL;
+        } else
+            e->ce_checked = now;
+    }
+
+    if (e != NULL) {
+        /* 移动到 LRU 链表头部 */
+        e->ce_prev->ce_next = e->ce_next;
+        e->ce_next->ce_prev = e->ce_prev;
+        e->ce_next = c->c_lru.ce_next;
+        e->ce_prev = &c->c_lru;
+        c->c_lru.ce_next->ce_prev = e;
+        c->c_lru.ce_next = e;
+        ++e->ce_refcnt;
+    }
+    pthread_mutex_unlock(&c->c_mutex);
+
+    return e;
+}
+
+
+/*
+ * 函数说明:    读取文件内容并加入缓存, 必要时按 LRU 淘汰旧对象. 成功返回增加了引用计数的对象,
+ *              文件太大或读取失败返回 NULL. 描述符已经不对应路径上的文件 (文件被替换) 时返回 NULL,
+ *              errno 为 ESTALE. gzip 不为 0 时同时保存一份 gzip 压缩后的内容, 压缩只进行一次
+ * @c:          缓存指针
+ * @path:       文件路径
+ * @hdr:        预先生成的响应报头
+ * @hdrlen:     响应报头长度
+ * @fd:         已经打开的文件描述符
+ * @st:         文件属性
+ * @gzip:       是否压缩
+ */
+cache_entry_t *cache_insert(content_cache_t *c, char const *path, char const *hdr, size_t hdrlen,
+                            int fd, struct stat const *st, int gzip)
+{
+    size_t bodylen = st->st_size;
+    size_t pathlen = strlen(path);
+    if (bodylen > CACHE_MAX_OBJECT || bodylen + hdrlen > c->c_budget / 4) {
+        errno = EFBIG;
+        return NULL;
+    }
+
+    /* 对象和路径, 报头, 文件内容使用一次 malloc 分配 */
+    cache_entry_t *e;
+    if ((e = (cache_entry_t *)malloc(sizeof(cache_entry_t) + pathlen + 1 + hdrlen + bodylen)) == NULL)
+        return NULL;
+
+    bzero(e, sizeof(cache_entry_t));
+    e->ce_path = (char *)(e + 1);
+    e->ce_hdr = e->ce_path + pathlen + 1;
+    e->ce_body = e->ce_hdr + hdrlen;
+    memcpy(e->ce_path, path, pathlen + 1);
+    memcpy(e->ce_hdr, hdr, hdrlen);
+    e->ce_hdrlen = hdrlen;
+    e->ce_bodylen = bodylen;
+    e->ce_hash = cache_hash(path);
+    e->ce_mtime = st->st_mtim;
+    e->ce_ino = st->st_ino;
+    e->ce_checked = time(NULL);
+    e->ce_refcnt = 2;                       /* 缓存和调用者各持有一个引用 */
+    e->ce_cached = 1;
+
+    /* 先添加监视再读取文件, 读取之后发生的修改一定会产生事件 */
+    e->ce_wd = -1;
+    if (c->c_inotify >= 0 && (e->ce_wd = inotify_add_watch(c->c_inotify, path, CACHE_WATCH_MASK)) < 0) {
+        free(e);
+        return NULL;
+    }
+
+    /* 监视是按路径添加的. 文件被替换 (写入临时文件后 mv) 时 fd 还指向旧的 inode, 监视却在新的 inode 上,
+       缓存旧内容之后不会再收到事件, 不能缓存 */
+    struct stat cur;
+    int stale = (stat(path, &cur) < 0 || cur.st_dev != st->st_dev || cur.st_ino != st->st_ino);
+    if (stale || pread(fd, e->ce_body, bodylen, 0) != (ssize_t)bodylen) {
+        if (e->ce_wd >= 0) {
+            pthread_mutex_lock(&c->c_mutex);
+            e->ce_wnext = c->c_watches[e->ce_wd & (CACHE_HASH_SIZE - 1)];
+            c->c_watches[e->ce_wd & (CACHE_HASH_SIZE - 1)] = e;
+            cache_unwatch(c, e, 1);
+            pthread_mutex_unlock(&c->c_mutex);
+        }
+        free(e);
+        errno = (stale ? ESTALE : EIO);
+        return NULL;
+    }
+
+    if (gzip && bodylen >= CACHE_GZIP_MIN)
+        cache_gzip(e);
+
+    size_t size = cache_entry_size(e);
+    unsigned index = e->ce_hash & (CACHE_HASH_SIZE - 1);
+    cache_entry_t *old;
+
+    pthread_mutex_lock(&c->c_mutex);
+    /* 先加入监视链表, 替换或者淘汰共享同一个监视描述符的旧对象时不会移除这个监视 */
+    if (e->ce_wd >= 0) {
+        e->ce_wnext = c->c_watches[e->ce_wd & (CACHE_HASH_SIZE - 1)];
+        c->c_watches[e->ce_wd & (CACHE_HASH_SIZE - 1)] = e;
+    }
+
+    for (old = c->c_buckets[index]; old != NULL; old = old->ce_hnext) {
+        if (old->ce_hash == e->ce_hash && strcmp(old->ce_path, path) == 0) {
+            cache_unlink(c, old);           /* 其他线程已经插入了同一个文件 */
+            break;
+        }
+    }
+
+    while (c->c_bytes + size > c->c_budget && c->c_lru.ce_prev != &c->c_lru)
+        cache_unlink(c, c->c_lru.ce_prev);
+
+    e->ce_hnext = c->c_buckets[index];
+    c->c_buckets[index] = e;
+    e->ce_next = c->c_lru.ce_next;
+    e->ce_prev = &c->c_lru;
+    c->c_lru.ce_next->ce_prev = e;
+    c->c_lru.ce_next = e;
+    c->c_bytes += size;
+    ++c->c_count;
+    pthread_mutex_unlock(&c->c_mutex);
+
+    return e;
+}
+
+
+/*
+ * 函数说明:    释放 cache_lookup / cache_insert 返回的引用
+ * @c:          缓存指针
+ * @e:          缓存对象
+ */
+void cache_release(content_cache_t *c, cache_entry_t *e)
+{
+    pthread_mutex_lock(&c->c_mutex);
+    cache_put(e);
+    pthread_mutex_unlock(&c->c_mutex);
+}
+
+
+/* (内部函数)
+ * 函数说明:    计算路径的哈希值 (FNV-1a)
+ * @path:       文件路径
+ */
+static unsigned cache_hash(char const *path)
+{
+    unsigned hash = 2166136261u;
+    while (*path != '\0') {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+/* (内部函数)
+ * 函数说明:    计算对象占用的字节数
+ * @e:          缓存对象
+ */
+static size_t cache_entry_size(cache_entry_t const *e)
+{
+    return sizeof(cache_entry_t) + strlen(e->ce_path) + e->ce_hdrlen + e->ce_bodylen + e->ce_gzbodylen;
+}
+
+
+/* (内部函数)
+ * 函数说明:    使用 zlib 将文件内容压缩为 gzip 格式, 压缩失败或者压缩后没有变小时不保存
+ * @e:          缓存对象
+ */
+static void cache_gzip(cache_entry_t *e)
+{
+    z_stream zs;
+    bzero(&zs, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return;
+
+    uLong bound = deflateBound(&zs, e->ce_bodylen);
+    char *out;
+    if ((out = (char *)malloc(bound)) == NULL) {
+        deflateEnd(&zs);
+        return;
+    }
+
+    zs.next_in = (Bytef *)e->ce_body;
+    zs.avail_in = e->ce_bodylen;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= e->ce_bodylen) {
+        deflateEnd(&zs);
+        free(out);
+        return;
+    }
+
+    e->ce_gzbody = out;
+    e->ce_gzbodylen = zs.total_out;
+    deflateEnd(&zs);
+}
+
+
+/* (内部函数)
+ * 函数说明:    将对象从缓存中移除并释放缓存持有的引用, 调用者需要持有互斥量
+ * @c:          缓存指针
+ * @e:          缓存对象
+ */
+static void cache_unlink(content_cache_t *c, cache_entry_t *e)
+{
+    cache_entry_t **pp = &c->c_buckets[e->ce_hash & (CACHE_HASH_SIZE - 1)];
+    while (*pp != e)
+        pp = &(*pp)->ce_hnext;
+    *pp = e->ce_hnext;
+
+    e->ce_prev->ce_next = e->ce_next;
+    e->ce_next->ce_prev = e->ce_prev;
+    c->c_bytes -= cache_entry_size(e);
+    --c->c_count;
+    e->ce_cached = 0;
+
+    if (e->ce_wd >= 0)
+        cache_unwatch(c, e, 1);
+
+    cache_put(e);
+}
+
+
+/* (内部函数)
+ * 函数说明:    将对象从监视链表中移除. 同一个文件通过不同路径访问时共享同一个监视描述符,
+ *              只检查同一个哈希桶, 没有其他对象使用时才移除监视. 调用者需要持有互斥量
+ * @c:          缓存指针
+ * @e:          缓存对象, ce_wd 不为 -1
+ * @rm:         没有其他对象使用时是否移除监视 (内核已经移除时为 0)
+ */
+static void cache_unwatch(content_cache_t *c, cache_entry_t *e, int rm)
+{
+    cache_entry_t **pp = &c->c_watches[e->ce_wd & (CACHE_HASH_SIZE - 1)];
+    int shared = 0;
+    while (*pp != NULL) {
+        if (*pp == e)
+            *pp = e->ce_wnext;
+        else {
+            shared = shared || (*pp)->ce_wd == e->ce_wd;
+            pp = &(*pp)->ce_wnext;
+        }
+    }
+
+    if (rm && !shared)
+        inotify_rm_watch(c->c_inotify, e->ce_wd);
+    e->ce_wnext = NULL;
+}
+
+
+/* (内部函数)
+ * 函数说明:    减少对象的引用计数, 计数为 0 时释放对象, 调用者需要持有互斥量
+ * @e:          缓存对象
+ */
+static void cache_put(cache_entry_t *e)
+{
+    if (--e->ce_refcnt == 0) {
+        free(e->ce_gzbody);
+        free(e);
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    inotify 监视线程, 文件被修改, 移动或删除时将对应的对象移出缓存
+ * @arg:        content_cache_t 指针
+ */
+static void *cache_watch(void *arg)
+{
+    content_cache_t *c = (content_cache_t *)arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t nread;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        if ((nread = read(c->c_inotify, buf, sizeof(buf))) <= 0) {
+            if (nread < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+
+        pthread_mutex_lock(&c->c_mutex);
+        for (char *p = buf; p < buf + nread; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            cache_entry_t *e = (ev->wd >= 0 ? c->c_watches[ev->wd & (CACHE_HASH_SIZE - 1)] : NULL);
+            cache_entry_t *next;
+            while (e != NULL) {
+                next = e->ce_wnext;
+                if (e->ce_wd == ev->wd) {
+                    if (ev->mask & IN_IGNORED) {
+                        cache_unwatch(c, e, 0); /* 监视已经被内核移除 */
+                        e->ce_wd = -1;
+                    }
+                    cache_unlink(c, e);
+                }
+                e = next;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        pthread_mutex_unlock(&c->c_mutex);
+    }
+
+    return NULL;
+}
+
+#endif
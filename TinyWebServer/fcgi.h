@@ -0,0 +1,435 @@
+#ifndef _FCGI_H_
+#define _FCGI_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "fcgi_proto.h"
+#include "log.h"
+
+#define FCGI_MAX_DEPTH      64              /* 每个工作进程最多同时处理的请求数量 */
+#define FCGI_MAX_OUTPUT     (8 << 20)       /* 一个请求最多输出的字节数量 */
+#define FCGI_PARAMS_LEN     4096            /* 一个请求的参数编码后的最大长度 */
+#define FCGI_ERR_FAILED     1               /* 请求失败: 工作进程退出, 输出过长等 */
+#define FCGI_ERR_TIMEOUT    2               /* 请求没有在超时时间内完成 */
+
+/*
+ * 请求完成回调, 在工作进程的读线程 (超时时在监视线程) 中调用, 每个请求只调用一次.
+ * 出错时 err 为 FCGI_ERR_FAILED 或 FCGI_ERR_TIMEOUT. buf 由回调负责 free, 可能为 NULL
+ * @arg:        提交请求时传入的参数
+ * @err:        是否出错
+ * @buf:        处理程序的标准输出
+ * @len:        输出长度
+ */
+typedef void (fcgi_callback)(void *arg, int err, char *buf, size_t len);
+
+/* 一个正在处理的请求, 请求 ID 为槽位下标 + 1 */
+typedef struct fcgi_slot_t {
+    int              s_used;                /* 槽位是否被占用 */
+    int              s_error;               /* 请求是否出错 */
+    int              s_expired;             /* 已经超时并调用了回调, 槽位保留到工作进程结束这个请求 */
+    time_t           s_deadline;            /* 请求的截止时间 */
+    char            *s_buf;                 /* 标准输出缓冲区 */
+    size_t           s_len;                 /* 已经收到的输出长度 */
+    size_t           s_cap;                 /* 缓冲区容量 */
+    fcgi_callback   *s_callback;            /* 请求完成回调 */
+    void            *s_arg;                 /* 回调参数 */
+} fcgi_slot_t;
+
+/* 常驻的工作进程, 通过一对 UNIX 套接字与服务器通信, 一条连接上复用多个请求 */
+typedef struct fcgi_worker_t {
+    int              w_fd;                  /* 与工作进程通信的套接字 */
+    pid_t            w_pid;                 /* 工作进程 ID */
+    time_t           w_started;             /* 工作进程启动时间 */
+    int              w_inflight;            /* 正在处理的请求数量 */
+    pthread_mutex_t  w_mutex;               /* 保护槽位 */
+    pthread_mutex_t  w_wmutex;              /* 保证请求记录完整写入, 以及重启时替换套接字 */
+    pthread_t        w_reader;              /* 读取响应记录的线程 */
+    struct fcgi_pool_t *w_pool;             /* 所属的进程池 */
+    fcgi_slot_t      w_slots[FCGI_MAX_DEPTH];   /* 请求槽位 */
+} fcgi_worker_t;
+
+/* 工作进程池 */
+typedef struct fcgi_pool_t {
+    char const      *p_handler;             /* 处理程序路径 */
+    int              p_nworkers;            /* 工作进程数量, 0 表示没有启用 */
+    int              p_depth;               /* 每个工作进程的队列深度 */
+    int              p_timeout;             /* 请求的超时时间(秒) */
+    unsigned         p_next;                /* 轮询选择工作进程的起始位置 */
+    fcgi_worker_t   *p_workers;             /* 工作进程数组 */
+} fcgi_pool_t;
+
+int  fcgi_pool_init(fcgi_pool_t *pool, char const *handler, int nworkers, int depth, int timeout);
+int  fcgi_submit(fcgi_pool_t *pool, char const *script, char const *query,
+                 fcgi_callback *callback, void *arg);
+int  fcgi_inflight(fcgi_pool_t const *pool);
+void *fcgi_reader(void *arg);
+void *fcgi_watchdog(void *arg);
+static int  fcgi_spawn(fcgi_worker_t *w);
+static void fcgi_restart(fcgi_worker_t *w);
+static void fcgi_finish(fcgi_worker_t *w, int id, int err);
+
+
+/*
+ * 函数说明:    初始化进程池, 启动 nworkers 个常驻的处理程序进程和对应的读线程, 以及检查请求超时的
+ *              监视线程, 成功返回 0, 失败返回 -1
+ * @pool:       进程池指针
+ * @handler:    处理程序路径
+ * @nworkers:   工作进程数量
+ * @depth:      每个工作进程同时处理的请求数量上限
+ * @timeout:    请求的超时时间(秒)
+ */
+int fcgi_pool_init(fcgi_pool_t *pool, char const *handler, int nworkers, int depth, int timeout)
+{
+    if (pool == NULL || handler == NULL || nworkers <= 0 || depth <= 0 || timeout <= 0)
+        return -1;
+
+    bzero(pool, sizeof(fcgi_pool_t));
+    pool->p_handler = handler;
+    pool->p_timeout = timeout;
+    pool->p_depth = (depth > FCGI_MAX_DEPTH ? FCGI_MAX_DEPTH : depth);
+    if ((pool->p_workers = (fcgi_worker_t *)calloc(nworkers, sizeof(fcgi_worker_t))) == NULL)
+        return -1;
+
+    for (int i = 0; i < nworkers; ++i) {
+        fcgi_worker_t *w = &pool->p_workers[i];
+        w->w_pool = pool;
+        pthread_mutex_init(&w->w_mutex, NULL);
+        pthread_mutex_init(&w->w_wmutex, NULL);
+
+        if (fcgi_spawn(w) < 0) {
+            log_printf(LOG_ERROR, "%s: fcgi_spawn(%s) error: %s\n", __func__, handler, strerror(errno));
+            return -1;
+        }
+
+        if (pthread_create(&w->w_reader, NULL, fcgi_reader, w) != 0) {
+            log_printf(LOG_ERROR, "%s: pthread_create error\n", __func__);
+            return -1;
+        }
+        pthread_detach(w->w_reader);
+        ++pool->p_nworkers;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, fcgi_watchdog, pool) != 0) {
+        log_printf(LOG_ERROR, "%s: pthread_create error\n", __func__);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    向负载最小的工作进程提交一个请求, 请求完成或者超时时调用 callback.
+ *              所有工作进程的队列都已满时返回 -1, 调用者应当返回 503; 成功返回 0
+ * @pool:       进程池指针
+ * @script:     脚本名称 (SCRIPT_NAME)
+ * @query:      查询字符串 (QUERY_STRING)
+ * @callback:   请求完成回调
+ * @arg:        回调参数
+ */
+int fcgi_submit(fcgi_pool_t *pool, char const *script, char const *query,
+                fcgi_callback *callback, void *arg)
+{
+    if (pool == NULL || pool->p_nworkers <= 0 || callback == NULL)
+        return -1;
+
+    /* 编码参数, 过长的参数直接拒绝 */
+    char params[FCGI_PARAMS_LEN];
+    size_t slen = strlen(script);
+    size_t qlen = strlen(query);
+    if (slen + qlen + 64 > sizeof(params))
+        return -1;
+
+    size_t plen = 0;
+    plen += fcgi_put_param(params + plen, "SCRIPT_NAME", script, slen);
+    plen += fcgi_put_param(params + plen, "QUERY_STRING", query, qlen);
+    plen += fcgi_put_param(params + plen, "REQUEST_METHOD", "GET", 3);
+
+    /* 从轮询位置开始, 选择正在处理的请求最少的工作进程 (不加锁读取, 只是近似值) */
+    unsigned start = __atomic_fetch_add(&pool->p_next, 1, __ATOMIC_RELAXED);
+    fcgi_worker_t *w = NULL;
+    for (int i = 0; i < pool->p_nworkers; ++i) {
+        fcgi_worker_t *cand = &pool->p_workers[(start + i) % pool->p_nworkers];
+        int inflight = __atomic_load_n(&cand->w_inflight, __ATOMIC_RELAXED);
+        if (inflight < pool->p_depth && (w == NULL || inflight < w->w_inflight))
+            w = cand;
+    }
+    if (w == NULL)
+        return -1;
+
+    /* 持有写锁期间分配槽位并写入, 保证重启工作进程时不会有写了一半的请求 */
+    pthread_mutex_lock(&w->w_wmutex);
+    pthread_mutex_lock(&w->w_mutex);
+    int id = 0;
+    if (w->w_inflight < w->w_pool->p_depth) {
+        for (int i = 0; i < w->w_pool->p_depth; ++i) {
+            if (!w->w_slots[i].s_used) {
+                id = i + 1;
+                break;
+            }
+        }
+    }
+    if (id == 0) {
+        pthread_mutex_unlock(&w->w_mutex);
+        pthread_mutex_unlock(&w->w_wmutex);
+        return -1;
+    }
+
+    fcgi_slot_t *slot = &w->w_slots[id - 1];
+    bzero(slot, sizeof(fcgi_slot_t));
+    slot->s_used = 1;
+    slot->s_callback = callback;
+    slot->s_arg = arg;
+    slot->s_deadline = time(NULL) + pool->p_timeout;
+    __atomic_add_fetch(&w->w_inflight, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&w->w_mutex);
+
+    /* BEGIN_REQUEST, PARAMS, 空的 PARAMS 和空的 STDIN 合并为一次发送 */
+    fcgi_header_t hbegin, hparams, hend, hstdin;
+    fcgi_begin_body_t begin;
+    bzero(&begin, sizeof(begin));
+    begin.role_b0 = FCGI_RESPONDER;
+    begin.flags = FCGI_KEEP_CONN;
+    fcgi_make_header(&hbegin, FCGI_BEGIN_REQUEST, id, sizeof(begin));
+    fcgi_make_header(&hparams, FCGI_PARAMS, id, plen);
+    fcgi_make_header(&hend, FCGI_PARAMS, id, 0);
+    fcgi_make_header(&hstdin, FCGI_STDIN, id, 0);
+
+    struct iovec iov[6] = {
+        { &hbegin, FCGI_HEADER_LEN }, { &begin, sizeof(begin) },
+        { &hparams, FCGI_HEADER_LEN }, { params, plen },
+        { &hend, FCGI_HEADER_LEN }, { &hstdin, FCGI_HEADER_LEN },
+    };
+    int ret = fcgi_sendv(w->w_fd, iov, 6);
+    if (ret < 0) {
+        /* 工作进程已经退出, 释放槽位, 由读线程负责重启 */
+        pthread_mutex_lock(&w->w_mutex);
+        slot->s_used = 0;
+        __atomic_sub_fetch(&w->w_inflight, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&w->w_mutex);
+    }
+    pthread_mutex_unlock(&w->w_wmutex);
+
+    return ret;
+}
+
+
+/*
+ * 函数说明:    返回所有工作进程正在处理的请求数量 (近似值)
+ * @pool:       进程池指针
+ */
+int fcgi_inflight(fcgi_pool_t const *pool)
+{
+    int n = 0;
+    for (int i = 0; i < pool->p_nworkers; ++i)
+        n += __atomic_load_n(&pool->p_workers[i].w_inflight, __ATOMIC_RELAXED);
+
+    return n;
+}
+
+
+/*
+ * 函数说明:    工作进程读线程例程函数, 按请求 ID 分发 STDOUT 记录, 收到 END_REQUEST 时调用回调.
+ *              工作进程退出时让所有未完成的请求失败并重启工作进程
+ * @arg:        fcgi_worker_t 指针
+ */
+void *fcgi_reader(void *arg)
+{
+    fcgi_worker_t *w = (fcgi_worker_t *)arg;
+    fcgi_header_t hdr;
+    char *content;
+    int len;
+
+    if ((content = (char *)malloc(FCGI_MAX_CONTENT + 256)) == NULL)
+        return NULL;
+
+    while (1) {
+        if ((len = fcgi_read_record(w->w_fd, &hdr, content)) <= 0 && hdr.type == 0) {
+            fcgi_restart(w);
+            continue;
+        } else if (len < 0) {
+            log_printf(LOG_ERROR, "%s: bad record from worker %d\n", __func__, (int)w->w_pid);
+            kill(w->w_pid, SIGKILL);
+            fcgi_restart(w);
+            continue;
+        }
+
+        int id = (hdr.request_id_b1 << 8) | hdr.request_id_b0;
+        if (id < 1 || id > FCGI_MAX_DEPTH)
+            continue;
+
+        if (hdr.type == FCGI_STDOUT && len > 0) {
+            pthread_mutex_lock(&w->w_mutex);
+            fcgi_slot_t *slot = &w->w_slots[id - 1];
+            if (slot->s_used && !slot->s_error && !slot->s_expired) {
+                if (slot->s_len + len > FCGI_MAX_OUTPUT) {
+                    slot->s_error = 1;
+                } else if (slot->s_len + len > slot->s_cap) {
+                    size_t cap = (slot->s_cap == 0 ? 4096 : slot->s_cap);
+                    while (cap < slot->s_len + len)
+                        cap *= 2;
+                    char *buf = (char *)realloc(slot->s_buf, cap);
+                    if (buf == NULL)
+                        slot->s_error = 1;
+                    else {
+                        slot->s_buf = buf;
+                        slot->s_cap = cap;
+                    }
+                }
+                if (!slot->s_error) {
+                    memcpy(slot->s_buf + slot->s_len, content, len);
+                    slot->s_len += len;
+                }
+            }
+            pthread_mutex_unlock(&w->w_mutex);
+        } else if (hdr.type == FCGI_STDERR && len > 0) {
+            log_printf(LOG_WARN, "%.*s", len, content);
+        } else if (hdr.type == FCGI_END_REQUEST) {
+            fcgi_finish(w, id, 0);
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * 函数说明:    请求超时监视线程例程函数, 每秒检查一次所有槽位, 超过截止时间的请求以 FCGI_ERR_TIMEOUT
+ *              调用回调. 工作进程仍然在处理这个请求, 槽位保留到收到 END_REQUEST (迟到的输出被丢弃)
+ *              或者工作进程重启, 避免请求 ID 被复用后收到上一个请求的记录
+ * @arg:        fcgi_pool_t 指针
+ */
+void *fcgi_watchdog(void *arg)
+{
+    fcgi_pool_t *pool = (fcgi_pool_t *)arg;
+
+    while (1) {
+        sleep(1);
+        time_t now = time(NULL);
+        for (int i = 0; i < pool->p_nworkers; ++i) {
+            fcgi_worker_t *w = &pool->p_workers[i];
+            for (int id = 1; id <= pool->p_depth; ++id) {
+                pthread_mutex_lock(&w->w_mutex);
+                fcgi_slot_t *slot = &w->w_slots[id - 1];
+                if (!slot->s_used || slot->s_expired || now < slot->s_deadline) {
+                    pthread_mutex_unlock(&w->w_mutex);
+                    continue;
+                }
+
+                fcgi_callback *callback = slot->s_callback;
+                void *cbarg = slot->s_arg;
+                free(slot->s_buf);
+                slot->s_buf = NULL;
+                slot->s_len = slot->s_cap = 0;
+                slot->s_expired = 1;
+                pthread_mutex_unlock(&w->w_mutex);
+
+                log_printf(LOG_WARN, "%s: request %d on worker %d timed out\n", __func__, id, (int)w->w_pid);
+                callback(cbarg, FCGI_ERR_TIMEOUT, NULL, 0);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/* (内部函数)
+ * 函数说明:    创建一对 UNIX 套接字, fork 并在子进程中执行处理程序, 成功返回 0, 失败返回 -1
+ * @w:          工作进程指针
+ */
+static int fcgi_spawn(fcgi_worker_t *w)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+
+    char *argv[] = { (char *)w->w_pool->p_handler, NULL };
+    pid_t pid;
+    if ((pid = fork()) < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if (pid == 0) {
+        /* dup2 得到的文件描述符不带 FD_CLOEXEC, 在 execv 之后保留 */
+        if (dup2(sv[1], FCGI_LISTENSOCK_FILENO) < 0)
+            _exit(EXIT_FAILURE);
+        execv(argv[0], argv);
+        _exit(EXIT_FAILURE);
+    }
+
+    close(sv[1]);
+    w->w_fd = sv[0];
+    w->w_pid = pid;
+    w->w_started = time(NULL);
+    return 0;
+}
+
+
+/* (内部函数)
+ * 函数说明:    工作进程退出后, 让所有未完成的请求失败, 然后启动新的工作进程.
+ *              工作进程启动后立即退出时等待 1 秒, 避免处理程序无法运行时反复重启
+ * @w:          工作进程指针
+ */
+static void fcgi_restart(fcgi_worker_t *w)
+{
+    log_printf(LOG_ERROR, "%s: worker %d exited, restarting\n", __func__, (int)w->w_pid);
+
+    pthread_mutex_lock(&w->w_wmutex);
+    for (int id = 1; id <= FCGI_MAX_DEPTH; ++id)
+        fcgi_finish(w, id, 1);
+
+    close(w->w_fd);
+    if (time(NULL) - w->w_started < 1)
+        sleep(1);
+
+    while (fcgi_spawn(w) < 0) {
+        log_printf(LOG_ERROR, "%s: fcgi_spawn(%s) error: %s\n", __func__, w->w_pool->p_handler, strerror(errno));
+        sleep(1);
+    }
+    pthread_mutex_unlock(&w->w_wmutex);
+}
+
+
+/* (内部函数)
+ * 函数说明:    结束一个请求, 释放槽位并调用回调, 槽位没有被占用时什么也不做.
+ *              已经超时的请求只释放槽位, 回调已经调用过
+ * @w:          工作进程指针
+ * @id:         请求 ID
+ * @err:        是否出错
+ */
+static void fcgi_finish(fcgi_worker_t *w, int id, int err)
+{
+    pthread_mutex_lock(&w->w_mutex);
+    fcgi_slot_t *slot = &w->w_slots[id - 1];
+    if (!slot->s_used) {
+        pthread_mutex_unlock(&w->w_mutex);
+        return;
+    }
+
+    fcgi_callback *callback = slot->s_callback;
+    void *arg = slot->s_arg;
+    char *buf = slot->s_buf;
+    size_t len = slot->s_len;
+    int expired = slot->s_expired;
+    err = (err || slot->s_error ? FCGI_ERR_FAILED : 0);
+
+    bzero(slot, sizeof(fcgi_slot_t));
+    __atomic_sub_fetch(&w->w_inflight, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&w->w_mutex);
+
+    if (!expired)
+        callback(arg, err, buf, len);
+}
+
+#endif
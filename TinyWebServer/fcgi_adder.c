@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include "fcgi_proto.h"
+
+/*
+ * 常驻的测试处理程序, 由 TinyWebServer -f 启动, 通过标准输入上的套接字接收 FastCGI 格式的请求.
+ * 脚本 /cgi-bin/adder 计算 QUERY_STRING 中以 '&' 分隔的数字之和, 其余脚本返回 404
+ */
+
+#define output_error_message(...)                           \
+        fprintf(stderr, "%s:%d: ", __func__, __LINE__);     \
+        fprintf(stderr, __VA_ARGS__);
+
+#define MAXLINE     1024
+#define MAXREQ      256                     /* 同时处理的请求数量上限 (请求 ID 的范围) */
+#define PARAMS_LEN  8192                    /* 一个请求的参数最大长度 */
+
+/* 一个请求的状态, 按请求 ID 索引, 不同请求的记录可以交错到达 */
+typedef struct request_t {
+    int      used;                          /* 是否收到了 BEGIN_REQUEST */
+    size_t   plen;                          /* 已经收到的参数长度 */
+    char     params[PARAMS_LEN];            /* 编码后的参数 */
+} request_t;
+
+int  serve(int fd);
+void respond(int fd, int id, request_t *req);
+void adder(char const *query, size_t qlen, char *body);
+
+static request_t requests[MAXREQ];
+static char content[FCGI_MAX_CONTENT + 256];
+
+int main(int argc, char *argv[])
+{
+    if (serve(FCGI_LISTENSOCK_FILENO) < 0) {
+        output_error_message("serve error: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    循环读取记录, 参数接收完成 (收到空的 PARAMS) 后处理请求, 服务器关闭连接时返回 0, 出错返回 -1
+ * @fd:         与服务器连接的套接字
+ */
+int serve(int fd)
+{
+    fcgi_header_t hdr;
+    int len;
+
+    while ((len = fcgi_read_record(fd, &hdr, content)) >= 0) {
+        if (hdr.type == 0)                  /* 服务器关闭了连接 */
+            return 0;
+
+        int id = (hdr.request_id_b1 << 8) | hdr.request_id_b0;
+        if (id <= 0 || id >= MAXREQ)
+            continue;
+
+        request_t *req = &requests[id];
+        switch (hdr.type) {
+        case FCGI_BEGIN_REQUEST:
+            req->used = 1;
+            req->plen = 0;
+            break;
+
+        case FCGI_PARAMS:
+            if (!req->used)
+                break;
+            if (len == 0) {
+                respond(fd, id, req);
+                req->used = 0;
+            } else if (req->plen + len <= sizeof(req->params)) {
+                memcpy(req->params + req->plen, content, len);
+                req->plen += len;
+            }
+            break;
+
+        case FCGI_ABORT_REQUEST:
+            req->used = 0;
+            break;
+
+        default:                            /* 只处理 GET 请求, 忽略 STDIN */
+            break;
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+ * 函数说明:    根据 SCRIPT_NAME 生成 CGI 格式的输出, 发送 STDOUT, 空的 STDOUT 和 END_REQUEST
+ * @fd:         与服务器连接的套接字
+ * @id:         请求 ID
+ * @req:        请求状态
+ */
+void respond(int fd, int id, request_t *req)
+{
+    char const *script = "";
+    char const *query = "";
+    size_t slen = 0;
+    size_t qlen = 0;
+    char body[MAXLINE];
+    char out[2 * MAXLINE];
+    int n;
+
+    fcgi_get_param(req->params, req->plen, "SCRIPT_NAME", &script, &slen);
+    fcgi_get_param(req->params, req->plen, "QUERY_STRING", &query, &qlen);
+
+    if (slen == strlen("/cgi-bin/adder") && strncmp(script, "/cgi-bin/adder", slen) == 0) {
+        adder(query, qlen, body);
+        n = snprintf(out, sizeof(out), "Content-type: text/html\r\n\r\n%s", body);
+    } else {
+        n = snprintf(out, sizeof(out), "Status: 404 Not Found\r\nContent-type: text/plain\r\n\r\n"
+                     "no such script: %.*s\n", (int)slen, script);
+    }
+
+    fcgi_end_body_t end;
+    bzero(&end, sizeof(end));
+    end.protocol_status = FCGI_REQUEST_COMPLETE;
+
+    fcgi_write_record(fd, FCGI_STDOUT, id, out, n);
+    fcgi_write_record(fd, FCGI_STDOUT, id, NULL, 0);
+    fcgi_write_record(fd, FCGI_END_REQUEST, id, &end, sizeof(end));
+}
+
+
+/*
+ * 函数说明:    计算查询字符串中以 '&' 分隔的数字之和, 生成 html 主体
+ * @query:      查询字符串 (不以 '\0' 结尾)
+ * @qlen:       查询字符串长度
+ * @body:       存放主体的缓冲区, 至少 MAXLINE 字节
+ */
+void adder(char const *query, size_t qlen, char *body)
+{
+    char args[MAXLINE];
+    long sum = 0;
+
+    snprintf(args, sizeof(args), "%.*s", (int)qlen, query);
+    for (char *tok = strtok(args, "&"); tok != NULL; tok = strtok(NULL, "&"))
+        sum += strtol(tok, NULL, 10);
+
+    snprintf(body, MAXLINE, "<html><title>Tiny adder</title><body>\r\n"
+             "The answer is: %.*s = %ld\r\n"
+             "<p>Thanks for visiting!\r\n</body></html>\r\n", (int)(qlen > 256 ? 256 : qlen), query, sum);
+}
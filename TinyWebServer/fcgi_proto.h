@@ -0,0 +1,290 @@
+#ifndef _FCGI_PROTO_H_
+#define _FCGI_PROTO_H_
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include "rio.h"
+
+/*
+ * 与 FastCGI 相同的记录格式: 8 字节记录头 + 内容 + 填充, 记录头中的 request id 用于在
+ * 一条连接上复用多个请求. 服务器发送 BEGIN_REQUEST, 若干 PARAMS 和一个空的 PARAMS 结束参数,
+ * 处理程序返回若干 STDOUT, 一个空的 STDOUT 和 END_REQUEST
+ */
+#define FCGI_VERSION_1          1
+#define FCGI_BEGIN_REQUEST      1
+#define FCGI_ABORT_REQUEST      2
+#define FCGI_END_REQUEST        3
+#define FCGI_PARAMS             4
+#define FCGI_STDIN              5
+#define FCGI_STDOUT             6
+#define FCGI_STDERR             7
+
+#define FCGI_RESPONDER          1           /* BEGIN_REQUEST 中的角色 */
+#define FCGI_KEEP_CONN          1           /* BEGIN_REQUEST 中的标志: 请求结束后不关闭连接 */
+#define FCGI_REQUEST_COMPLETE   0           /* END_REQUEST 中的协议状态 */
+#define FCGI_OVERLOADED         2
+
+#define FCGI_HEADER_LEN         8           /* 记录头长度 */
+#define FCGI_MAX_CONTENT        65535       /* 一条记录最多携带的内容字节数 */
+#define FCGI_LISTENSOCK_FILENO  0           /* 工作进程中与服务器通信的套接字 */
+
+/* 记录头 */
+typedef struct fcgi_header_t {
+    unsigned char   version;                /* 协议版本 */
+    unsigned char   type;                   /* 记录类型 */
+    unsigned char   request_id_b1;          /* 请求 ID 高字节 */
+    unsigned char   request_id_b0;          /* 请求 ID 低字节 */
+    unsigned char   content_length_b1;      /* 内容长度高字节 */
+    unsigned char   content_length_b0;      /* 内容长度低字节 */
+    unsigned char   padding_length;         /* 填充长度 */
+    unsigned char   reserved;
+} fcgi_header_t;
+
+/* BEGIN_REQUEST 记录的内容 */
+typedef struct fcgi_begin_body_t {
+    unsigned char   role_b1;
+    unsigned char   role_b0;
+    unsigned char   flags;
+    unsigned char   reserved[5];
+} fcgi_begin_body_t;
+
+/* END_REQUEST 记录的内容 */
+typedef struct fcgi_end_body_t {
+    unsigned char   app_status_b3;
+    unsigned char   app_status_b2;
+    unsigned char   app_status_b1;
+    unsigned char   app_status_b0;
+    unsigned char   protocol_status;
+    unsigned char   reserved[3];
+} fcgi_end_body_t;
+
+void   fcgi_make_header(fcgi_header_t *hdr, int type, int id, size_t len);
+int    fcgi_read_record(int fd, fcgi_header_t *hdr, char *content);
+int    fcgi_write_record(int fd, int type, int id, void const *data, size_t len);
+int    fcgi_sendv(int fd, struct iovec *iov, int iovcnt);
+size_t fcgi_put_param(char *buf, char const *name, char const *value, size_t vlen);
+int    fcgi_get_param(char const *params, size_t len, char const *name, char const **value, size_t *vlen);
+static size_t fcgi_put_length(unsigned char *p, size_t len);
+static int    fcgi_get_length(unsigned char const **pp, unsigned char const *end, size_t *len);
+
+
+/*
+ * 函数说明:    填充记录头
+ * @hdr:        记录头指针
+ * @type:       记录类型
+ * @id:         请求 ID
+ * @len:        内容长度, 不超过 FCGI_MAX_CONTENT
+ */
+void fcgi_make_header(fcgi_header_t *hdr, int type, int id, size_t len)
+{
+    hdr->version = FCGI_VERSION_1;
+    hdr->type = type;
+    hdr->request_id_b1 = (id >> 8) & 0xff;
+    hdr->request_id_b0 = id & 0xff;
+    hdr->content_length_b1 = (len >> 8) & 0xff;
+    hdr->content_length_b0 = len & 0xff;
+    hdr->padding_length = 0;
+    hdr->reserved = 0;
+}
+
+
+/*
+ * 函数说明:    读取一条完整的记录, 返回内容长度, 连接关闭返回 0 (hdr->type 为 0), 出错返回 -1
+ * @fd:         与对端连接的套接字
+ * @hdr:        传出记录头
+ * @content:    存放内容的缓冲区, 至少 FCGI_MAX_CONTENT + 255 字节
+ */
+int fcgi_read_record(int fd, fcgi_header_t *hdr, char *content)
+{
+    ssize_t n;
+    if ((n = rio_readn(fd, hdr, FCGI_HEADER_LEN)) != FCGI_HEADER_LEN) {
+        hdr->type = 0;
+        return (n == 0 ? 0 : -1);
+    }
+
+    if (hdr->version != FCGI_VERSION_1)
+        return -1;
+
+    size_t len = (hdr->content_length_b1 << 8) | hdr->content_length_b0;
+    size_t total = len + hdr->padding_length;
+    if (total > 0 && rio_readn(fd, content, total) != (ssize_t)total)
+        return -1;
+
+    return len;
+}
+
+
+/*
+ * 函数说明:    发送一个流的数据, 超过 FCGI_MAX_CONTENT 的数据拆分为多条记录, len 为 0 时发送流结束记录.
+ *              成功返回 0, 失败返回 -1
+ * @fd:         与对端连接的套接字
+ * @type:       记录类型
+ * @id:         请求 ID
+ * @data:       数据
+ * @len:        数据长度
+ */
+int fcgi_write_record(int fd, int type, int id, void const *data, size_t len)
+{
+    fcgi_header_t hdr;
+    struct iovec iov[2];
+    char const *p = (char const *)data;
+
+    do {
+        size_t cnt = (len > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len);
+        fcgi_make_header(&hdr, type, id, cnt);
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = FCGI_HEADER_LEN;
+        iov[1].iov_base = (void *)p;
+        iov[1].iov_len = cnt;
+
+        if (fcgi_sendv(fd, iov, 2) < 0)
+            return -1;
+
+        p += cnt;
+        len -= cnt;
+    } while (len > 0);
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    使用 sendmsg 发送 iovec 数组中的全部数据, 对端关闭时返回 -1 (EPIPE) 而不产生 SIGPIPE.
+ *              成功返回 0, 失败返回 -1
+ * @fd:         与对端连接的套接字
+ * @iov:        iovec 数组, 发送过程中会被修改
+ * @iovcnt:     iovec 数量
+ */
+int fcgi_sendv(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    ssize_t n;
+
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen > 0) {
+        if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    按 FastCGI 的名称-值对格式编码一个参数, 返回写入 buf 的字节数量
+ * @buf:        存放编码结果的缓冲区
+ * @name:       参数名称
+ * @value:      参数值
+ * @vlen:       参数值长度
+ */
+size_t fcgi_put_param(char *buf, char const *name, char const *value, size_t vlen)
+{
+    size_t nlen = strlen(name);
+    unsigned char *p = (unsigned char *)buf;
+
+    p += fcgi_put_length(p, nlen);
+    p += fcgi_put_length(p, vlen);
+    memcpy(p, name, nlen);
+    memcpy(p + nlen, value, vlen);
+    return (p + nlen + vlen) - (unsigned char *)buf;
+}
+
+
+/*
+ * 函数说明:    在编码后的参数中查找参数, 找到返回 1, 没有找到返回 0
+ * @params:     编码后的参数
+ * @len:        参数的总长度
+ * @name:       参数名称
+ * @value:      传出参数值 (不以 '\0' 结尾)
+ * @vlen:       传出参数值长度
+ */
+int fcgi_get_param(char const *params, size_t len, char const *name, char const **value, size_t *vlen)
+{
+    unsigned char const *p = (unsigned char const *)params;
+    unsigned char const *end = p + len;
+    size_t nlen = strlen(name);
+    size_t klen;
+
+    while (p < end) {
+        if (fcgi_get_length(&p, end, &klen) < 0 || fcgi_get_length(&p, end, vlen) < 0
+            || (size_t)(end - p) < klen + *vlen)
+            return 0;
+
+        if (klen == nlen && memcmp(p, name, nlen) == 0) {
+            *value = (char const *)p + klen;
+            return 1;
+        }
+        p += klen + *vlen;
+    }
+
+    return 0;
+}
+
+
+/* (内部函数)
+ * 函数说明:    编码长度, 小于 128 使用 1 个字节, 否则使用最高位为 1 的 4 个字节, 返回使用的字节数
+ * @p:          存放编码结果的缓冲区
+ * @len:        长度
+ */
+static size_t fcgi_put_length(unsigned char *p, size_t len)
+{
+    if (len < 128) {
+        p[0] = len;
+        return 1;
+    }
+
+    p[0] = ((len >> 24) & 0x7f) | 0x80;
+    p[1] = (len >> 16) & 0xff;
+    p[2] = (len >> 8) & 0xff;
+    p[3] = len & 0xff;
+    return 4;
+}
+
+
+/* (内部函数)
+ * 函数说明:    解码长度, 成功返回 0, 数据不完整返回 -1
+ * @pp:         指向当前位置的指针, 返回时指向长度之后的位置
+ * @end:        数据结束位置
+ * @len:        传出长度
+ */
+static int fcgi_get_length(unsigned char const **pp, unsigned char const *end, size_t *len)
+{
+    unsigned char const *p = *pp;
+    if (p >= end)
+        return -1;
+
+    if (!(p[0] & 0x80)) {
+        *len = p[0];
+        *pp = p + 1;
+        return 0;
+    }
+
+    if (end - p < 4)
+        return -1;
+
+    *len = ((size_t)(p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    *pp = p + 4;
+    return 0;
+}
+
+#endif
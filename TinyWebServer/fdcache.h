@@ -0,0 +1,301 @@
+#ifndef _FDCACHE_H_
+#define _FDCACHE_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#define FDCACHE_HASH_SIZE   1024            /* 哈希桶数量, 必须是 2 的幂 */
+#define FDCACHE_TTL         1               /* 条目的有效期(秒), 到期后重新 open, 文件被替换或修改后最多延迟这么久 */
+
+/* 打开文件缓存的条目, 保存已经打开的文件描述符和打开时的文件属性, 或者文件不存在 */
+typedef struct fd_entry_t {
+    char                    *fe_path;       /* 文件路径 (键) */
+    unsigned                 fe_hash;       /* 路径的哈希值 */
+    int                      fe_fd;         /* 只读打开的文件描述符, 文件不存在的条目为 -1 */
+    int                      fe_errno;      /* 文件不存在的条目保存 open 的错误码 */
+    struct stat              fe_stat;       /* 打开时的文件属性 */
+    time_t                   fe_expire;     /* 到期时间 */
+    int                      fe_refcnt;     /* 引用计数, 缓存本身持有一个引用, 为 0 时关闭文件 */
+    int                      fe_cached;     /* 是否仍在缓存中 */
+    struct fd_entry_t       *fe_hnext;      /* 哈希链表的下一结点 */
+    struct fd_entry_t       *fe_prev;       /* LRU 链表的上一结点 */
+    struct fd_entry_t       *fe_next;       /* LRU 链表的下一结点 */
+} fd_entry_t;
+
+/*
+ * 多线程共享的打开文件缓存, 按路径保存文件描述符和 stat 结果. 同一个热点文件的并发请求共用一个
+ * 文件描述符 (sendfile 和 pread 都使用显式的偏移, 不会互相影响), 不需要每次都解析路径和读取元数据.
+ * 条目数量超过上限时按 LRU 淘汰, 被淘汰的条目在最后一个引用释放时才关闭文件.
+ * 不存在的文件同样缓存一个有效期, 每个 gzip 请求查找 .gz 文件时不会重复 open 失败
+ */
+typedef struct fd_cache_t {
+    pthread_mutex_t          f_mutex;       /* 互斥量 */
+    fd_entry_t              *f_buckets[FDCACHE_HASH_SIZE];  /* 哈希桶 */
+    fd_entry_t               f_lru;         /* LRU 链表哨兵, f_lru.fe_next 是最近使用的条目 */
+    size_t                   f_count;       /* 缓存的条目数量 */
+    size_t                   f_max;         /* 条目数量上限, 0 表示不缓存 */
+    uint64_t                 f_hits;        /* 命中次数 */
+    uint64_t                 f_misses;      /* 没有命中 (需要 open) 的次数 */
+} fd_cache_t;
+
+int  fdcache_init(fd_cache_t *c, size_t max);
+fd_entry_t *fdcache_open(fd_cache_t *c, char const *path);
+void fdcache_release(fd_cache_t *c, fd_entry_t *e);
+void fdcache_invalidate(fd_cache_t *c, char const *path);
+static unsigned fdcache_hash(char const *path);
+static void fdcache_insert(fd_cache_t *c, fd_entry_t *e, time_t now);
+static void fdcache_unlink(fd_cache_t *c, fd_entry_t *e);
+static void fdcache_put(fd_entry_t *e);
+
+
+/*
+ * 函数说明:    初始化打开文件缓存. 条目数量上限不超过文件描述符限制的四分之一, 给连接留出足够的余量.
+ *              成功返回 0
+ * @c:          缓存指针
+ * @max:        条目数量上限, 0 表示不缓存 (每次都 open, 发送完成后关闭)
+ */
+int fdcache_init(fd_cache_t *c, size_t max)
+{
+    if (c == NULL)
+        return -1;
+
+    bzero(c, sizeof(fd_cache_t));
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && max > rl.rlim_cur / 4)
+        max = rl.rlim_cur / 4;
+    c->f_max = max;
+    c->f_lru.fe_next = c->f_lru.fe_prev = &c->f_lru;
+    if (pthread_mutex_init(&c->f_mutex, NULL) != 0)
+        return -1;
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    以只读方式打开文件, 返回增加了引用计数的条目, 使用完成后调用 fdcache_release.
+ *              命中没有到期的条目时不进行任何系统调用. 没有命中时 open 一次并 fstat, 只缓存普通文件
+ *              和不存在的文件. 打开失败返回 NULL, errno 为 open 的错误
+ * @c:          缓存指针
+ * @path:       文件路径
+ */
+fd_entry_t *fdcache_open(fd_cache_t *c, char const *path)
+{
+    unsigned hash = fdcache_hash(path);
+    unsigned index = hash & (FDCACHE_HASH_SIZE - 1);
+    time_t now = time(NULL);
+    fd_entry_t *e;
+
+    pthread_mutex_lock(&c->f_mutex);
+    for (e = c->f_buckets[index]; e != NULL; e = e->fe_hnext) {
+        if (e->fe_hash == hash && strcmp(e->fe_path, path) == 0)
+            break;
+    }
+
+    if (e != NULL && now >= e->fe_expire) {
+        fdcache_unlink(c, e);               /* 到期, 重新打开, 正在使用它的响应不受影响 */
+        e = NULL;
+    }
+
+    if (e != NULL) {
+        /* 移动到 LRU 链表头部 */
+        e->fe_prev->fe_next = e->fe_next;
+        e->fe_next->fe_prev = e->fe_prev;
+        e->fe_next = c->f_lru.fe_next;
+        e->fe_prev = &c->f_lru;
+        c->f_lru.fe_next->fe_prev = e;
+        c->f_lru.fe_next = e;
+        ++c->f_hits;
+        if (e->fe_fd < 0) {
+            errno = e->fe_errno;
+            pthread_mutex_unlock(&c->f_mutex);
+            return NULL;
+        }
+        ++e->fe_refcnt;
+        pthread_mutex_unlock(&c->f_mutex);
+        return e;
+    }
+    ++c->f_misses;
+    pthread_mutex_unlock(&c->f_mutex);
+
+    /* O_NONBLOCK 避免打开 FIFO 时阻塞, 对普通文件没有影响 */
+    size_t pathlen = strlen(path);
+    int fd, err = 0;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK)) < 0) {
+        err = errno;
+        if (c->f_max == 0 || (err != ENOENT && err != ENOTDIR))
+            return NULL;
+    }
+
+    if ((e = (fd_entry_t *)malloc(sizeof(fd_entry_t) + pathlen + 1)) == NULL) {
+        if (fd >= 0)
+            close(fd);
+        errno = (fd >= 0 ? ENOMEM : err);
+        return NULL;
+    }
+
+    bzero(e, sizeof(fd_entry_t));
+    e->fe_path = (char *)(e + 1);
+    memcpy(e->fe_path, path, pathlen + 1);
+    e->fe_hash = hash;
+    e->fe_fd = fd;
+    e->fe_expire = now + FDCACHE_TTL;
+    e->fe_refcnt = 1;
+    if (fd < 0) {
+        /* 文件不存在, 只由缓存持有, 到期前的查找直接返回同样的错误 */
+        e->fe_errno = err;
+        pthread_mutex_lock(&c->f_mutex);
+        fdcache_insert(c, e, now);
+        pthread_mutex_unlock(&c->f_mutex);
+        errno = err;
+        return NULL;
+    }
+
+    if (fstat(fd, &e->fe_stat) < 0) {
+        int err = errno;
+        fdcache_put(e);
+        errno = err;
+        return NULL;
+    }
+
+    if (c->f_max == 0 || !S_ISREG(e->fe_stat.st_mode))
+        return e;
+
+    pthread_mutex_lock(&c->f_mutex);
+    ++e->fe_refcnt;                         /* 缓存和调用者各持有一个引用 */
+    fdcache_insert(c, e, now);
+    pthread_mutex_unlock(&c->f_mutex);
+
+    return e;
+}
+
+
+/*
+ * 函数说明:    释放 fdcache_open 返回的引用
+ * @c:          缓存指针
+ * @e:          缓存条目
+ */
+void fdcache_release(fd_cache_t *c, fd_entry_t *e)
+{
+    pthread_mutex_lock(&c->f_mutex);
+    fdcache_put(e);
+    pthread_mutex_unlock(&c->f_mutex);
+}
+
+
+/*
+ * 函数说明:    将路径对应的条目移出缓存, 下一次 fdcache_open 重新打开. 用于发现文件已经被替换时,
+ *              不必等到条目到期. 正在使用这个条目的响应不受影响
+ * @c:          缓存指针
+ * @path:       文件路径
+ */
+void fdcache_invalidate(fd_cache_t *c, char const *path)
+{
+    unsigned hash = fdcache_hash(path);
+    fd_entry_t *e;
+
+    pthread_mutex_lock(&c->f_mutex);
+    for (e = c->f_buckets[hash & (FDCACHE_HASH_SIZE - 1)]; e != NULL; e = e->fe_hnext) {
+        if (e->fe_hash == hash && strcmp(e->fe_path, path) == 0) {
+            fdcache_unlink(c, e);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&c->f_mutex);
+}
+
+
+/* (内部函数)
+ * 函数说明:    计算路径的哈希值 (FNV-1a)
+ * @path:       文件路径
+ */
+static unsigned fdcache_hash(char const *path)
+{
+    unsigned hash = 2166136261u;
+    while (*path != '\0') {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+/* (内部函数)
+ * 函数说明:    将新条目加入缓存, 替换其他线程同时加入的同名条目, 缓存持有条目的一个引用 (由调用者计入).
+ *              调用者需要持有互斥量
+ * @c:          缓存指针
+ * @e:          新条目
+ * @now:        当前时间
+ */
+static void fdcache_insert(fd_cache_t *c, fd_entry_t *e, time_t now)
+{
+    unsigned index = e->fe_hash & (FDCACHE_HASH_SIZE - 1);
+    fd_entry_t *old;
+    for (old = c->f_buckets[index]; old != NULL; old = old->fe_hnext) {
+        if (old->fe_hash == e->fe_hash && strcmp(old->fe_path, e->fe_path) == 0) {
+            fdcache_unlink(c, old);         /* 其他线程已经打开了同一个文件 */
+            break;
+        }
+    }
+
+    /* 同时关闭链表尾部已经到期的条目, 不再被访问的 (例如已经进入内容缓存的) 文件不会一直占用描述符 */
+    while (c->f_lru.fe_prev != &c->f_lru && (c->f_count >= c->f_max || c->f_lru.fe_prev->fe_expire <= now))
+        fdcache_unlink(c, c->f_lru.fe_prev);
+
+    e->fe_hnext = c->f_buckets[index];
+    c->f_buckets[index] = e;
+    e->fe_next = c->f_lru.fe_next;
+    e->fe_prev = &c->f_lru;
+    c->f_lru.fe_next->fe_prev = e;
+    c->f_lru.fe_next = e;
+    e->fe_cached = 1;
+    ++c->f_count;
+}
+
+
+/* (内部函数)
+ * 函数说明:    将条目从缓存中移除并释放缓存持有的引用, 调用者需要持有互斥量
+ * @c:          缓存指针
+ * @e:          缓存条目
+ */
+static void fdcache_unlink(fd_cache_t *c, fd_entry_t *e)
+{
+    fd_entry_t **pp = &c->f_buckets[e->fe_hash & (FDCACHE_HASH_SIZE - 1)];
+    while (*pp != e)
+        pp = &(*pp)->fe_hnext;
+    *pp = e->fe_hnext;
+
+    e->fe_prev->fe_next = e->fe_next;
+    e->fe_next->fe_prev = e->fe_prev;
+    --c->f_count;
+    e->fe_cached = 0;
+    fdcache_put(e);
+}
+
+
+/* (内部函数)
+ * 函数说明:    减少条目的引用计数, 计数为 0 时关闭文件并释放条目. 没有加入缓存的条目只有一个引用,
+ *              调用者不需要持有互斥量
+ * @e:          缓存条目
+ */
+static void fdcache_put(fd_entry_t *e)
+{
+    if (--e->fe_refcnt == 0) {
+        if (e->fe_fd >= 0)
+            close(e->fe_fd);
+        free(e);
+    }
+}
+
+#endif
@@ -0,0 +1,343 @@
+#ifndef _HTTP_PARSER_H_
+#define _HTTP_PARSER_H_
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#define HTTP_MAX_HEADERS    32              /* 一个请求最多允许的报头数量 */
+#define HTTP_MAX_HEADER_LEN 8192            /* 请求行加上所有报头的最大字节数量, 超过时返回 431 */
+
+/* 解析状态 */
+enum {
+    HTTP_STATE_LINE = 0,                    /* 正在解析请求行 */
+    HTTP_STATE_HEADER,                      /* 正在解析报头 */
+    HTTP_STATE_DONE,                        /* 请求报头解析完成 */
+    HTTP_STATE_ERROR,                       /* 请求格式错误 */
+};
+
+/* 不以 '\0' 结尾的字符串视图, 直接指向 rio 缓冲区 */
+typedef struct http_str_t {
+    char const  *s;                         /* 字符串起始地址 */
+    size_t       len;                       /* 字符串长度 */
+} http_str_t;
+
+/* 报头名称和值 */
+typedef struct http_header_t {
+    http_str_t   name;                      /* 报头名称 */
+    http_str_t   value;                     /* 报头的值, 已去除首尾空白 */
+} http_header_t;
+
+/* 解析完成的请求, 所有字符串都指向 rio 缓冲区, 在下次填充缓冲区之前有效 */
+typedef struct http_request_t {
+    http_str_t      method;                 /* 请求方法 */
+    http_str_t      uri;                    /* 请求的 uri */
+    http_str_t      version;                /* http 版本 */
+    http_header_t   headers[HTTP_MAX_HEADERS];  /* 请求报头 */
+    int             nheaders;               /* 请求报头数量 */
+} http_request_t;
+
+/* 相对于报文起始位置的偏移, 缓冲区数据被移动后仍然有效 */
+typedef struct http_span_t {
+    size_t       off;                       /* 起始偏移 */
+    size_t       len;                       /* 长度 */
+} http_span_t;
+
+/* 可恢复的解析器, 数据不完整时保存状态, 下次从上次扫描的位置继续 */
+typedef struct http_parser_t {
+    int          p_state;                   /* 解析状态 */
+    int          p_error;                   /* 出错时对应的 http 状态码 */
+    size_t       p_pos;                     /* 当前行已经扫描到的偏移 */
+    size_t       p_line;                    /* 当前行的起始偏移 */
+    http_span_t  p_method;                  /* 请求方法 */
+    http_span_t  p_uri;                     /* 请求 uri */
+    http_span_t  p_version;                 /* http 版本 */
+    http_span_t  p_names[HTTP_MAX_HEADERS]; /* 报头名称 */
+    http_span_t  p_values[HTTP_MAX_HEADERS];/* 报头的值 */
+    int          p_nheaders;                /* 报头数量 */
+} http_parser_t;
+
+void   http_parser_init(http_parser_t *p);
+int    http_parse(http_parser_t *p, char const *buf, size_t len);
+void   http_parser_request(http_parser_t const *p, char const *buf, http_request_t *req);
+int    http_str_equal(http_str_t str, char const *cstr);
+int    http_str_has_token(http_str_t str, char const *token);
+http_str_t const *http_find_header(http_request_t const *req, char const *name);
+int    http_accept_encoding(http_request_t const *req, char const *coding);
+static int http_parse_line(http_parser_t *p, char const *buf, size_t start, size_t end);
+
+
+/*
+ * 函数说明:    初始化解析器, 每解析一个新的请求之前调用
+ * @p:          解析器指针
+ */
+void http_parser_init(http_parser_t *p)
+{
+    bzero(p, sizeof(http_parser_t));
+    p->p_state = HTTP_STATE_LINE;
+}
+
+
+/*
+ * 函数说明:    增量解析请求报头. 请求报头完整时返回报头占用的字节数量, 数据不完整时返回 0,
+ *              格式错误返回 -1 (p_error 中保存对应的 http 状态码). 返回 0 时, 调用者追加数据后
+ *              使用同一个 buf 起始位置再次调用, 已经扫描过的数据不会被重复扫描
+ * @p:          解析器指针
+ * @buf:        报文的起始地址
+ * @len:        当前可用的字节数量
+ */
+int http_parse(http_parser_t *p, char const *buf, size_t len)
+{
+    if (p == NULL || buf == NULL)
+        return -1;
+
+    while (p->p_state != HTTP_STATE_DONE && p->p_state != HTTP_STATE_ERROR) {
+        /* 使用 memchr 查找行尾, 只扫描新到达的数据 */
+        char const *eol = (char const *)memchr(buf + p->p_pos, '\n', len - p->p_pos);
+        if (eol == NULL) {
+            p->p_pos = len;
+            if (len < HTTP_MAX_HEADER_LEN)
+                return 0;
+        }
+
+        /* 报头过长时不再等待更多数据, 限制每个连接占用的缓冲区 */
+        size_t end = (eol != NULL ? (size_t)(eol - buf) : len);
+        if (end >= HTTP_MAX_HEADER_LEN) {
+            p->p_error = 431;
+            p->p_state = HTTP_STATE_ERROR;
+            break;
+        }
+
+        size_t start = p->p_line;
+        p->p_pos = p->p_line = end + 1;
+
+        if (end > start && buf[end - 1] == '\r')
+            --end;
+
+        if (http_parse_line(p, buf, start, end) < 0)
+            p->p_state = HTTP_STATE_ERROR;
+    }
+
+    return (p->p_state == HTTP_STATE_DONE ? (int)p->p_pos : -1);
+}
+
+
+/* (内部函数)
+ * 函数说明:    解析一行数据 (不含行尾的 CRLF), 成功返回 0, 失败返回 -1
+ * @p:          解析器指针
+ * @buf:        报文的起始地址
+ * @start:      行的起始偏移
+ * @end:        行的结束偏移
+ */
+static int http_parse_line(http_parser_t *p, char const *buf, size_t start, size_t end)
+{
+    char const *line = buf + start;
+    size_t len = end - start;
+
+    /* 请求行: method SP uri SP version */
+    if (p->p_state == HTTP_STATE_LINE) {
+        if (len == 0)                       /* 忽略请求行之前的空行 */
+            return 0;
+
+        char const *sp1 = (char const *)memchr(line, ' ', len);
+        if (sp1 == NULL || sp1 == line)
+            goto bad_request;
+
+        char const *uri = sp1 + 1;
+        char const *sp2 = (char const *)memchr(uri, ' ', line + len - uri);
+        if (sp2 == NULL || sp2 == uri)
+            goto bad_request;
+
+        char const *version = sp2 + 1;
+        size_t vlen = line + len - version;
+        if (vlen < 8 || strncmp(version, "HTTP/", 5) != 0)
+            goto bad_request;
+
+        p->p_method.off = start;
+        p->p_method.len = sp1 - line;
+        p->p_uri.off = uri - buf;
+        p->p_uri.len = sp2 - uri;
+        p->p_version.off = version - buf;
+        p->p_version.len = vlen;
+        p->p_state = HTTP_STATE_HEADER;
+        return 0;
+    }
+
+    /* 空行表示报头结束 */
+    if (len == 0) {
+        p->p_state = HTTP_STATE_DONE;
+        return 0;
+    }
+
+    /* 不支持已经废弃的报头折行 */
+    if (line[0] == ' ' || line[0] == '\t')
+        goto bad_request;
+
+    /* 报头: name ":" OWS value OWS */
+    char const *colon = (char const *)memchr(line, ':', len);
+    if (colon == NULL || colon == line)
+        goto bad_request;
+
+    if (p->p_nheaders >= HTTP_MAX_HEADERS) {
+        p->p_error = 431;
+        return -1;
+    }
+
+    char const *value = colon + 1;
+    char const *vend = line + len;
+    while (value < vend && (*value == ' ' || *value == '\t'))
+        ++value;
+    while (vend > value && (vend[-1] == ' ' || vend[-1] == '\t'))
+        --vend;
+
+    p->p_names[p->p_nheaders].off = start;
+    p->p_names[p->p_nheaders].len = colon - line;
+    p->p_values[p->p_nheaders].off = value - buf;
+    p->p_values[p->p_nheaders].len = vend - value;
+    ++p->p_nheaders;
+    return 0;
+
+bad_request:
+    p->p_error = 400;
+    return -1;
+}
+
+
+/*
+ * 函数说明:    将解析器中保存的偏移转换成指向缓冲区的字符串视图
+ * @p:          已经完成解析的解析器
+ * @buf:        报文的起始地址 (与调用 http_parse 时相同)
+ * @req:        传出解析完成的请求
+ */
+void http_parser_request(http_parser_t const *p, char const *buf, http_request_t *req)
+{
+    req->method.s = buf + p->p_method.off;
+    req->method.len = p->p_method.len;
+    req->uri.s = buf + p->p_uri.off;
+    req->uri.len = p->p_uri.len;
+    req->version.s = buf + p->p_version.off;
+    req->version.len = p->p_version.len;
+
+    req->nheaders = p->p_nheaders;
+    for (int i = 0; i < p->p_nheaders; ++i) {
+        req->headers[i].name.s = buf + p->p_names[i].off;
+        req->headers[i].name.len = p->p_names[i].len;
+        req->headers[i].value.s = buf + p->p_values[i].off;
+        req->headers[i].value.len = p->p_values[i].len;
+    }
+}
+
+
+/*
+ * 函数说明:    不区分大小写比较字符串视图和 C 字符串, 相等返回 1
+ * @str:        字符串视图
+ * @cstr:       以 '\0' 结尾的字符串
+ */
+int http_str_equal(http_str_t str, char const *cstr)
+{
+    return strlen(cstr) == str.len && strncasecmp(str.s, cstr, str.len) == 0;
+}
+
+
+/*
+ * 函数说明:    判断以逗号分隔的报头值中是否包含 token (不区分大小写), 包含返回 1
+ * @str:        报头的值
+ * @token:      需要查找的 token
+ */
+int http_str_has_token(http_str_t str, char const *token)
+{
+    char const *p = str.s;
+    char const *end = str.s + str.len;
+    while (p < end) {
+        char const *comma = (char const *)memchr(p, ',', end - p);
+        char const *tend = (comma == NULL ? end : comma);
+        http_str_t item;
+
+        while (p < tend && (*p == ' ' || *p == '\t'))
+            ++p;
+        item.s = p;
+        item.len = tend - p;
+        while (item.len > 0 && (item.s[item.len - 1] == ' ' || item.s[item.len - 1] == '\t'))
+            --item.len;
+
+        if (http_str_equal(item, token))
+            return 1;
+
+        p = tend + 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    查找请求报头 (不区分大小写), 找不到返回 NULL
+ * @req:        请求指针
+ * @name:       报头名称
+ */
+http_str_t const *http_find_header(http_request_t const *req, char const *name)
+{
+    for (int i = 0; i < req->nheaders; ++i) {
+        if (http_str_equal(req->headers[i].name, name))
+            return &req->headers[i].value;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * 函数说明:    判断请求的 Accept-Encoding 是否接受 coding, q=0 表示不接受, "*" 匹配没有列出的编码.
+ *              接受返回 1
+ * @req:        请求指针
+ * @coding:     内容编码, 如 "gzip"
+ */
+int http_accept_encoding(http_request_t const *req, char const *coding)
+{
+    http_str_t const *ae = http_find_header(req, "Accept-Encoding");
+    if (ae == NULL)
+        return 0;
+
+    int listed = -1;                        /* coding 本身是否被接受, -1 表示没有列出 */
+    int star = 0;                           /* "*" 是否被接受 */
+    char const *p = ae->s;
+    char const *end = ae->s + ae->len;
+    while (p < end) {
+        char const *comma = (char const *)memchr(p, ',', end - p);
+        char const *iend = (comma == NULL ? end : comma);
+        char const *semi = (char const *)memchr(p, ';', iend - p);
+        http_str_t name;
+
+        while (p < iend && (*p == ' ' || *p == '\t'))
+            ++p;
+        name.s = p;
+        name.len = (semi == NULL ? iend : semi) - p;
+        while (name.len > 0 && (name.s[name.len - 1] == ' ' || name.s[name.len - 1] == '\t'))
+            --name.len;
+
+        /* q 的值全部是 0 时表示不接受 */
+        int accepted = 1;
+        if (semi != NULL) {
+            char const *q = semi + 1;
+            while (q < iend && (*q == ' ' || *q == '\t'))
+                ++q;
+            if (iend - q >= 2 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+                accepted = 0;
+                for (q += 2; q < iend && *q != ' ' && *q != '\t'; ++q) {
+                    if (*q != '0' && *q != '.')
+                        accepted = 1;
+                }
+            }
+        }
+
+        if (http_str_equal(name, coding))
+            listed = accepted;
+        else if (name.len == 1 && name.s[0] == '*')
+            star = accepted;
+
+        p = iend + 1;
+    }
+
+    return (listed >= 0 ? listed : star);
+}
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef _HTTP_RANGE_H_
+#define _HTTP_RANGE_H_
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/types.h>
+#include "http_parser.h"
+
+#define HTTP_ETAG_LEN       64              /* ETag 缓冲区大小 */
+#define HTTP_DATE_LEN       32              /* http 日期缓冲区大小 */
+#define HTTP_MAX_RANGES     8               /* 一个请求最多处理的区间数量, 超过时忽略 Range 返回整个文件 */
+
+/* 静态文件的验证器, 用于条件请求 */
+typedef struct http_validator_t {
+    char         etag[HTTP_ETAG_LEN];       /* 强 ETag (带引号), 由 inode, 大小和修改时间生成 */
+    char         lastmod[HTTP_DATE_LEN];    /* Last-Modified 报头的值 */
+    time_t       mtime;                     /* 修改时间(秒) */
+} http_validator_t;
+
+/* 字节区间, 包含两个端点 */
+typedef struct http_range_t {
+    off_t        start;                     /* 第一个字节的偏移 */
+    off_t        end;                       /* 最后一个字节的偏移 */
+} http_range_t;
+
+void   http_make_validator(http_validator_t *v, ino_t ino, off_t size, struct timespec mtime);
+void   http_validator_variant(http_validator_t *v, char const *tag);
+size_t http_format_date(time_t t, char *buf, size_t len);
+time_t http_parse_date(http_str_t str);
+int    http_not_modified(http_request_t const *req, http_validator_t const *v);
+int    http_if_range(http_request_t const *req, http_validator_t const *v);
+int    http_parse_ranges(http_str_t value, off_t size, http_range_t *ranges, int max);
+static int http_etag_match(http_str_t list, char const *etag);
+static int http_parse_offset(char const **pp, char const *end, off_t *value);
+
+
+/*
+ * 函数说明:    根据文件属性生成验证器
+ * @v:          验证器指针
+ * @ino:        文件的 inode 号
+ * @size:       文件大小
+ * @mtime:      文件修改时间
+ */
+void http_make_validator(http_validator_t *v, ino_t ino, off_t size, struct timespec mtime)
+{
+    snprintf(v->etag, sizeof(v->etag), "\"%lx-%llx-%llx\"", (unsigned long)ino, (unsigned long long)size,
+             (unsigned long long)mtime.tv_sec * 1000000000ULL + mtime.tv_nsec);
+    http_format_date(mtime.tv_sec, v->lastmod, sizeof(v->lastmod));
+    v->mtime = mtime.tv_sec;
+}
+
+
+/*
+ * 函数说明:    为同一文件的不同表示 (如 gzip 压缩后的内容) 生成不同的 ETag, 在引号内追加 "-tag"
+ * @v:          验证器指针
+ * @tag:        表示的名称
+ */
+void http_validator_variant(http_validator_t *v, char const *tag)
+{
+    size_t len = strlen(v->etag);
+    if (len >= 2 && len + strlen(tag) + 1 < sizeof(v->etag))
+        snprintf(v->etag + len - 1, sizeof(v->etag) - len + 1, "-%s\"", tag);
+}
+
+
+/*
+ * 函数说明:    将时间格式化为 IMF-fixdate 格式的 http 日期, 返回字符串长度
+ * @t:          时间
+ * @buf:        存放日期的缓冲区, 至少 HTTP_DATE_LEN 字节
+ * @len:        缓冲区大小
+ */
+size_t http_format_date(time_t t, char *buf, size_t len)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+
+/*
+ * 函数说明:    解析 IMF-fixdate 格式的 http 日期, 格式错误返回 -1
+ * @str:        日期字符串
+ */
+time_t http_parse_date(http_str_t str)
+{
+    char buf[HTTP_DATE_LEN + 1];
+    struct tm tm;
+
+    if (str.len == 0 || str.len > HTTP_DATE_LEN)
+        return -1;
+    memcpy(buf, str.s, str.len);
+    buf[str.len] = '\0';
+
+    bzero(&tm, sizeof(tm));
+    char const *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0')
+        return -1;
+
+    return timegm(&tm);
+}
+
+
+/*
+ * 函数说明:    判断 GET 请求的条件是否使得响应应当为 304 Not Modified, 是返回 1.
+ *              If-None-Match 存在时忽略 If-Modified-Since
+ * @req:        请求
+ * @v:          文件的验证器
+ */
+int http_not_modified(http_request_t const *req, http_validator_t const *v)
+{
+    http_str_t const *inm = http_find_header(req, "If-None-Match");
+    if (inm != NULL)
+        return http_etag_match(*inm, v->etag);
+
+    http_str_t const *ims = http_find_header(req, "If-Modified-Since");
+    time_t since;
+    if (ims != NULL && (since = http_parse_date(*ims)) != (time_t)-1)
+        return v->mtime <= since;
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    判断 If-Range 条件, 没有 If-Range 或者验证器匹配时返回 1 (应当处理 Range),
+ *              不匹配返回 0 (忽略 Range, 返回整个文件). ETag 使用强比较, 日期必须完全相等
+ * @req:        请求
+ * @v:          文件的验证器
+ */
+int http_if_range(http_request_t const *req, http_validator_t const *v)
+{
+    http_str_t const *ir = http_find_header(req, "If-Range");
+    if (ir == NULL)
+        return 1;
+
+    if (ir->len > 0 && ir->s[0] == '"')
+        return ir->len == strlen(v->etag) && memcmp(ir->s, v->etag, ir->len) == 0;
+
+    if (ir->len >= 2 && ir->s[0] == 'W' && ir->s[1] == '/')
+        return 0;                           /* 弱 ETag 不能用于 If-Range */
+
+    return http_parse_date(*ir) == v->mtime;
+}
+
+
+/*
+ * 函数说明:    解析 Range 报头, 返回可以满足的区间数量. 报头格式错误, 不是字节区间或者区间数量超过 max 时
+ *              返回 0 (忽略 Range); 所有区间都不能满足时返回 -1 (416 Range Not Satisfiable)
+ * @value:      Range 报头的值
+ * @size:       文件大小
+ * @ranges:     传出区间数组
+ * @max:        区间数组大小
+ */
+int http_parse_ranges(http_str_t value, off_t size, http_range_t *ranges, int max)
+{
+    char const *p = value.s;
+    char const *end = value.s + value.len;
+    int n = 0;
+    int items = 0;
+
+    if (value.len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+        return 0;
+    p += 6;
+
+    while (p < end) {
+        off_t first = -1;
+        off_t last = -1;
+
+        while (p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+        if (p < end && *p == ',') {         /* 允许空的列表元素 */
+            ++p;
+            continue;
+        }
+
+        /* first-pos "-" [ last-pos ] 或者 "-" suffix-length */
+        if (p < end && *p != '-' && http_parse_offset(&p, end, &first) < 0)
+            return 0;
+        if (p >= end || *p != '-')
+            return 0;
+        ++p;
+        if (p < end && *p >= '0' && *p <= '9' && http_parse_offset(&p, end, &last) < 0)
+            return 0;
+        if (first < 0 && last < 0)
+            return 0;
+        if (first >= 0 && last >= 0 && last < first)
+            return 0;
+
+        while (p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+        if (p < end && *p++ != ',')
+            return 0;
+        ++items;
+
+        /* 后缀区间: 最后 last 个字节 */
+        if (first < 0) {
+            if (last == 0 || size == 0)
+                continue;
+            first = (last >= size ? 0 : size - last);
+            last = size - 1;
+        } else {
+            if (first >= size)
+                continue;
+            if (last < 0 || last >= size)
+                last = size - 1;
+        }
+
+        if (n >= max)
+            return 0;
+        ranges[n].start = first;
+        ranges[n].end = last;
+        ++n;
+    }
+
+    if (items == 0)
+        return 0;
+
+    return (n == 0 ? -1 : n);
+}
+
+
+/* (内部函数)
+ * 函数说明:    在以逗号分隔的 ETag 列表中查找 etag (弱比较), "*" 匹配任何 ETag, 找到返回 1
+ * @list:       If-None-Match 报头的值
+ * @etag:       文件的强 ETag
+ */
+static int http_etag_match(http_str_t list, char const *etag)
+{
+    char const *p = list.s;
+    char const *end = list.s + list.len;
+    size_t elen = strlen(etag);
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            ++p;
+        char const *tend = p;
+        while (tend < end && *tend != ',')
+            ++tend;
+
+        char const *tag = p;
+        size_t tlen = tend - p;
+        while (tlen > 0 && (tag[tlen - 1] == ' ' || tag[tlen - 1] == '\t'))
+            --tlen;
+        if (tlen == 1 && tag[0] == '*')
+            return 1;
+        if (tlen >= 2 && tag[0] == 'W' && tag[1] == '/') {
+            tag += 2;
+            tlen -= 2;
+        }
+        if (tlen == elen && memcmp(tag, etag, elen) == 0)
+            return 1;
+
+        p = tend;
+    }
+
+    return 0;
+}
+
+
+/* (内部函数)
+ * 函数说明:    解析一个十进制的非负偏移, 成功返回 0, 没有数字或者溢出返回 -1
+ * @pp:         指向当前位置的指针, 返回时指向数字之后的位置
+ * @end:        数据结束位置
+ * @value:      传出偏移
+ */
+static int http_parse_offset(char const **pp, char const *end, off_t *value)
+{
+    char const *p = *pp;
+    off_t v = 0;
+
+    if (p >= end || *p < '0' || *p > '9')
+        return -1;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (v > (((off_t)1 << 62) - 1) / 10)
+            return -1;
+        v = v * 10 + (*p++ - '0');
+    }
+
+    *pp = p;
+    *value = v;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "rio.h"
+
+#define LOG_RING_SLOTS      512             /* 每个线程环形缓冲区的记录数量, 必须是 2 的幂 */
+#define LOG_RECLEN          256             /* 一条记录的最大长度, 超过时截断 */
+#define LOG_BATCH           (64 << 10)      /* 后台线程一次 write 的最大字节数 */
+#define LOG_IDLE_MS         20              /* 所有缓冲区都为空时, 后台线程的休眠时间(毫秒) */
+#define LOG_CACHELINE       64
+
+/* 日志级别, 数值越大越详细 */
+enum {
+    LOG_ERROR = 0,                          /* 错误 */
+    LOG_WARN,                               /* 警告 */
+    LOG_INFO,                               /* 访问日志 */
+    LOG_DEBUG,                              /* 连接和请求报头 */
+};
+
+/*
+ * 单生产者单消费者的无锁环形缓冲区, 每个线程第一次写日志时创建一个, 之后不再释放.
+ * 生产者只修改 lr_head, 后台线程只修改 lr_tail, 两者放在不同的缓存行中
+ */
+typedef struct log_ring_t {
+    _Alignas(LOG_CACHELINE) atomic_size_t lr_head;  /* 下一条写入的记录序号 */
+    _Alignas(LOG_CACHELINE) atomic_size_t lr_tail;  /* 下一条取出的记录序号 */
+    struct log_ring_t   *lr_next;           /* 所有环形缓冲区组成的链表 */
+    uint16_t             lr_len[LOG_RING_SLOTS];            /* 每条记录的长度 */
+    char                 lr_buf[LOG_RING_SLOTS][LOG_RECLEN];/* 记录内容 */
+} log_ring_t;
+
+/* 异步日志, 请求路径只格式化记录并放入本线程的环形缓冲区, 由后台线程批量写入文件 */
+typedef struct async_log_t {
+    int                  l_fd;              /* 日志文件描述符 */
+    int                  l_level;           /* 记录的最高级别 */
+    int                  l_running;         /* 后台线程是否已经启动 */
+    _Atomic(log_ring_t *) l_rings;          /* 所有线程的环形缓冲区链表 */
+    atomic_ulong         l_dropped;         /* 缓冲区满时丢弃的记录数量 */
+    unsigned long        l_reported;        /* 已经报告过的丢弃数量 */
+    pthread_t            l_tid;             /* 后台线程 ID */
+    char                 l_batch[LOG_BATCH];/* 批量写入缓冲区 */
+} async_log_t;
+
+static async_log_t g_log = { .l_fd = STDERR_FILENO, .l_level = LOG_INFO };
+static __thread log_ring_t *t_log_ring;     /* 本线程的环形缓冲区 */
+
+/* 级别过滤放在宏中, 被过滤的记录不需要计算参数 */
+#define log_printf(level, ...)                                  \
+        do {                                                    \
+            if ((level) <= g_log.l_level)                       \
+                log_write((level), __VA_ARGS__);                \
+        } while (0)
+
+int  log_open(char const *path, int level);
+int  log_start(void);
+void log_write(int level, char const *fmt, ...);
+char const *log_date(void);
+unsigned long log_dropped(void);
+void log_flush(void);
+static log_ring_t *log_ring(void);
+static size_t log_drain(int fd);
+static void *log_writer(void *arg);
+
+
+/*
+ * 函数说明:    只打开日志文件, 之后的日志同步写入, 直到调用 log_start. 多进程模式下主进程在 fork 之前
+ *              调用, 后台线程不会被 fork 复制, 由各个工作进程自己启动. 成功返回 0
+ * @path:       日志文件路径, NULL 表示标准输出
+ * @level:      记录的最高级别
+ */
+int log_open(char const *path, int level)
+{
+    int fd = STDOUT_FILENO;
+    if (path != NULL && (fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+        return -1;
+
+    g_log.l_fd = fd;
+    g_log.l_level = level;
+    return 0;
+}
+
+
+/*
+ * 函数说明:    启动后台写入线程, 之后的日志经过环形缓冲区异步写入. 成功返回 0
+ */
+int log_start(void)
+{
+    if (pthread_create(&g_log.l_tid, NULL, log_writer, NULL) != 0)
+        return -1;
+
+    pthread_detach(g_log.l_tid);
+    g_log.l_running = 1;
+    atexit(log_flush);
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    格式化一条日志记录并放入本线程的环形缓冲区, 从不阻塞: 缓冲区满时丢弃记录并计数.
+ *              记录应当以换行结尾, 超过 LOG_RECLEN 时截断
+ * @level:      日志级别
+ * @fmt:        格式字符串
+ */
+void log_write(int level, char const *fmt, ...)
+{
+    va_list ap;
+    log_ring_t *ring;
+
+    /* 后台线程没有启动 (初始化之前或者失败) 时同步写入 */
+    if (!g_log.l_running || (ring = log_ring()) == NULL) {
+        va_start(ap, fmt);
+        vdprintf(g_log.l_fd, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->lr_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->lr_tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&g_log.l_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    size_t idx = head & (LOG_RING_SLOTS - 1);
+    va_start(ap, fmt);
+    int n = vsnprintf(ring->lr_buf[idx], LOG_RECLEN, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if (n >= LOG_RECLEN) {
+        n = LOG_RECLEN;
+        ring->lr_buf[idx][LOG_RECLEN - 1] = '\n';
+    }
+
+    ring->lr_len[idx] = n;
+    atomic_store_explicit(&ring->lr_head, head + 1, memory_order_release);
+}
+
+
+/*
+ * 函数说明:    返回当前时间的访问日志格式 "18/Oct/2026:10:00:00 +0000" (UTC), 字符串属于调用线程,
+ *              每个线程每秒只格式化一次
+ */
+char const *log_date(void)
+{
+    static __thread time_t last;
+    static __thread char date[32];
+
+    time_t now = time(NULL);
+    if (now != last) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        last = now;
+    }
+
+    return date;
+}
+
+
+/*
+ * 函数说明:    返回缓冲区满时丢弃的记录总数
+ */
+unsigned long log_dropped(void)
+{
+    return atomic_load_explicit(&g_log.l_dropped, memory_order_relaxed);
+}
+
+
+/*
+ * 函数说明:    在调用线程中写出所有缓冲区中的记录, 进程退出时调用
+ */
+void log_flush(void)
+{
+    while (log_drain(g_log.l_fd) > 0)
+        ;
+}
+
+
+/* (内部函数)
+ * 函数说明:    返回本线程的环形缓冲区, 第一次调用时创建并加入全局链表. 内存不足返回 NULL
+ */
+static log_ring_t *log_ring(void)
+{
+    if (t_log_ring != NULL)
+        return t_log_ring;
+
+    log_ring_t *ring;
+    if (posix_memalign((void **)&ring, LOG_CACHELINE, sizeof(log_ring_t)) != 0)
+        return NULL;
+    atomic_init(&ring->lr_head, 0);
+    atomic_init(&ring->lr_tail, 0);
+
+    ring->lr_next = atomic_load(&g_log.l_rings);
+    while (!atomic_compare_exchange_weak(&g_log.l_rings, &ring->lr_next, ring))
+        ;
+
+    t_log_ring = ring;
+    return ring;
+}
+
+
+/* (内部函数)
+ * 函数说明:    取出所有环形缓冲区中的记录, 拼接到批量缓冲区中写入文件, 返回取出的记录数量.
+ *              后台线程和 log_flush 都会调用, 使用互斥量保证每个缓冲区只有一个消费者
+ * @fd:         日志文件描述符
+ */
+static size_t log_drain(int fd)
+{
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    char *batch = g_log.l_batch;
+    size_t used = 0;
+    size_t nrecs = 0;
+
+    pthread_mutex_lock(&mutex);
+
+    /* 报告新增的丢弃数量 */
+    unsigned long dropped = log_dropped();
+    if (dropped != g_log.l_reported) {
+        used += snprintf(batch, LOG_BATCH, "log: %lu records dropped\n", dropped - g_log.l_reported);
+        g_log.l_reported = dropped;
+    }
+
+    for (log_ring_t *ring = atomic_load(&g_log.l_rings); ring != NULL; ring = ring->lr_next) {
+        size_t tail = atomic_load_explicit(&ring->lr_tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->lr_head, memory_order_acquire);
+
+        for (; tail != head; ++tail, ++nrecs) {
+            size_t idx = tail & (LOG_RING_SLOTS - 1);
+            if (used + ring->lr_len[idx] > LOG_BATCH) {
+                rio_writen(fd, batch, used);
+                used = 0;
+            }
+            memcpy(batch + used, ring->lr_buf[idx], ring->lr_len[idx]);
+            used += ring->lr_len[idx];
+
+            /* 及时归还槽位, 避免生产者在一次批量写入期间丢弃记录 */
+            atomic_store_explicit(&ring->lr_tail, tail + 1, memory_order_release);
+        }
+    }
+
+    if (used > 0)
+        rio_writen(fd, batch, used);
+
+    pthread_mutex_unlock(&mutex);
+    return nrecs;
+}
+
+
+/* (内部函数)
+ * 函数说明:    后台写入线程例程函数, 循环取出记录, 所有缓冲区都为空时休眠 LOG_IDLE_MS 毫秒
+ * @arg:        未使用
+ */
+static void *log_writer(void *arg)
+{
+    struct timespec idle = { 0, LOG_IDLE_MS * 1000000L };
+
+    while (1) {
+        if (log_drain(g_log.l_fd) == 0)
+            nanosleep(&idle, NULL);
+    }
+
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _MIME_H_
+#define _MIME_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "mime_hash.h"
+#include "mime_table.h"                     /* 由 mimegen.cpp 在编译期生成 */
+
+#define MIME_DEFAULT    "text/plain"        /* 没有扩展名或者扩展名未知时使用的类型 */
+
+char const *mime_type(char const *name, size_t len);
+int  mime_compressible(char const *type);
+
+
+/*
+ * 函数说明:    根据文件名最后一个 '.' 之后的扩展名 (不区分大小写) 查找 MIME 类型, 两级完美哈希,
+ *              查找时间为常数. 没有扩展名或者扩展名未知时返回 MIME_DEFAULT
+ * @name:       文件名 (可以包含路径)
+ * @len:        文件名长度, 只考虑前 len 个字符
+ */
+char const *mime_type(char const *name, size_t len)
+{
+    size_t i = len;
+    while (i > 0 && name[i - 1] != '.' && name[i - 1] != '/')
+        --i;
+    if (i == 0 || name[i - 1] != '.')
+        return MIME_DEFAULT;
+
+    size_t extlen = len - i;
+    if (extlen == 0 || extlen > MIME_MAX_EXT)
+        return MIME_DEFAULT;
+
+    uint64_t key = mime_pack(name + i, extlen);
+    uint32_t disp = mime_disp[mime_hash(key, 0) & (MIME_BUCKETS - 1)];
+    size_t slot = mime_hash(key, disp) & (MIME_SLOTS - 1);
+    if (mime_keys[slot] != key || mime_types[slot] == NULL)
+        return MIME_DEFAULT;
+
+    return mime_types[slot];
+}
+
+
+/*
+ * 函数说明:    判断文件类型是否值得压缩 (文本类型, JSON, JavaScript, XML 和 SVG)
+ * @type:       MIME 类型
+ */
+int mime_compressible(char const *type)
+{
+    size_t len = strlen(type);
+
+    return strncmp(type, "text/", 5) == 0
+           || strcmp(type, "application/json") == 0
+           || strcmp(type, "application/javascript") == 0
+           || strcmp(type, "application/xml") == 0
+           || (len > 4 && strcmp(type + len - 4, "+xml") == 0);
+}
+
+#endif
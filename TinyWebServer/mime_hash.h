@@ -0,0 +1,50 @@
+#ifndef _MIME_HASH_H_
+#define _MIME_HASH_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * 扩展名到 MIME 类型的完美哈希使用的打包和哈希函数, 由 mimegen.cpp (编译期构造哈希表)
+ * 和 mime.h (运行时查找) 共用, 保证两边的计算结果一致
+ */
+#ifdef __cplusplus
+#define MIME_CONSTEXPR  constexpr
+#else
+#define MIME_CONSTEXPR
+#endif
+
+#define MIME_MAX_EXT    8                   /* 扩展名最大长度, 打包成一个 uint64_t */
+
+/*
+ * 函数说明:    将扩展名转换为小写并打包成 64 位整数, 第 i 个字符放在第 i 个字节
+ * @ext:        扩展名 (不含 '.')
+ * @len:        扩展名长度, 不超过 MIME_MAX_EXT
+ */
+static MIME_CONSTEXPR inline uint64_t mime_pack(char const *ext, size_t len)
+{
+    uint64_t key = 0;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)ext[i];
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        key |= (uint64_t)c << (8 * i);
+    }
+
+    return key;
+}
+
+
+/*
+ * 函数说明:    带种子的 64 位混合哈希 (splitmix64 的终结函数)
+ * @key:        打包后的扩展名
+ * @seed:       种子, 第一级使用 0, 第二级使用桶的位移值
+ */
+static MIME_CONSTEXPR inline uint64_t mime_hash(uint64_t key, uint64_t seed)
+{
+    uint64_t x = key + (seed + 1) * 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+#endif
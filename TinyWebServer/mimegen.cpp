@@ -0,0 +1,348 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include "../valuelist/ValueList.hpp"
+#include "mime_hash.h"
+
+/*
+ * 在编译期为扩展名到 MIME 类型的映射构造完美哈希表 (hash and displace), 运行时只负责把结果
+ * 输出为 C 头文件 mime_table.h, 供 TinyWebServer 使用.
+ *
+ * 第一级: mime_hash(key, 0) 选择桶; 第二级: 为每个桶寻找位移值 d, 使得桶内所有扩展名的
+ * mime_hash(key, d) 落在互不冲突的空槽位上. 查找时只需要计算两次哈希和一次比较
+ */
+
+struct Mime {
+    char const  *ext;                       /* 扩展名 (不含 '.', 小写) */
+    char const  *type;                      /* MIME 类型 */
+};
+
+static constexpr Mime mimes[] = {
+    /* 文本 */
+    { "html",   "text/html" },
+    { "htm",    "text/html" },
+    { "shtml",  "text/html" },
+    { "css",    "text/css" },
+    { "txt",    "text/plain" },
+    { "text",   "text/plain" },
+    { "log",    "text/plain" },
+    { "conf",   "text/plain" },
+    { "ini",    "text/plain" },
+    { "c",      "text/plain" },
+    { "h",      "text/plain" },
+    { "cpp",    "text/plain" },
+    { "hpp",    "text/plain" },
+    { "md",     "text/markdown" },
+    { "csv",    "text/csv" },
+    { "tsv",    "text/tab-separated-values" },
+    { "xml",    "text/xml" },
+    { "ics",    "text/calendar" },
+    { "vcf",    "text/vcard" },
+    { "vtt",    "text/vtt" },
+    { "srt",    "text/plain" },
+    { "js",     "text/javascript" },
+    { "mjs",    "text/javascript" },
+
+    /* 应用程序 */
+    { "json",   "application/json" },
+    { "map",    "application/json" },
+    { "jsonld", "application/ld+json" },
+    { "xhtml",  "application/xhtml+xml" },
+    { "rss",    "application/rss+xml" },
+    { "atom",   "application/atom+xml" },
+    { "wasm",   "application/wasm" },
+    { "pdf",    "application/pdf" },
+    { "ps",     "application/postscript" },
+    { "eps",    "application/postscript" },
+    { "rtf",    "application/rtf" },
+    { "doc",    "application/msword" },
+    { "docx",   "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+    { "xls",    "application/vnd.ms-excel" },
+    { "xlsx",   "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+    { "ppt",    "application/vnd.ms-powerpoint" },
+    { "pptx",   "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+    { "odt",    "application/vnd.oasis.opendocument.text" },
+    { "ods",    "application/vnd.oasis.opendocument.spreadsheet" },
+    { "odp",    "application/vnd.oasis.opendocument.presentation" },
+    { "epub",   "application/epub+zip" },
+    { "zip",    "application/zip" },
+    { "gz",     "application/gzip" },
+    { "tgz",    "application/gzip" },
+    { "bz2",    "application/x-bzip2" },
+    { "xz",     "application/x-xz" },
+    { "zst",    "application/zstd" },
+    { "tar",    "application/x-tar" },
+    { "7z",     "application/x-7z-compressed" },
+    { "rar",    "application/vnd.rar" },
+    { "jar",    "application/java-archive" },
+    { "apk",    "application/vnd.android.package-archive" },
+    { "deb",    "application/vnd.debian.binary-package" },
+    { "rpm",    "application/x-rpm" },
+    { "iso",    "application/x-iso9660-image" },
+    { "dmg",    "application/x-apple-diskimage" },
+    { "exe",    "application/octet-stream" },
+    { "dll",    "application/octet-stream" },
+    { "bin",    "application/octet-stream" },
+    { "so",     "application/octet-stream" },
+    { "o",      "application/octet-stream" },
+    { "out",    "application/octet-stream" },
+    { "img",    "application/octet-stream" },
+    { "msi",    "application/octet-stream" },
+    { "swf",    "application/x-shockwave-flash" },
+    { "sh",     "application/x-sh" },
+    { "pl",     "application/x-perl" },
+    { "py",     "text/x-python" },
+    { "sql",    "application/sql" },
+    { "yaml",   "application/yaml" },
+    { "yml",    "application/yaml" },
+    { "toml",   "application/toml" },
+    { "der",    "application/x-x509-ca-cert" },
+    { "pem",    "application/x-x509-ca-cert" },
+    { "crt",    "application/x-x509-ca-cert" },
+
+    /* 图片 */
+    { "gif",    "image/gif" },
+    { "png",    "image/png" },
+    { "jpg",    "image/jpeg" },
+    { "jpeg",   "image/jpeg" },
+    { "jpe",    "image/jpeg" },
+    { "webp",   "image/webp" },
+    { "avif",   "image/avif" },
+    { "heic",   "image/heic" },
+    { "svg",    "image/svg+xml" },
+    { "svgz",   "image/svg+xml" },
+    { "ico",    "image/x-icon" },
+    { "bmp",    "image/bmp" },
+    { "tif",    "image/tiff" },
+    { "tiff",   "image/tiff" },
+    { "apng",   "image/apng" },
+    { "jxl",    "image/jxl" },
+    { "psd",    "image/vnd.adobe.photoshop" },
+
+    /* 音频 */
+    { "mp3",    "audio/mpeg" },
+    { "ogg",    "audio/ogg" },
+    { "oga",    "audio/ogg" },
+    { "opus",   "audio/opus" },
+    { "wav",    "audio/wav" },
+    { "flac",   "audio/flac" },
+    { "aac",    "audio/aac" },
+    { "m4a",    "audio/mp4" },
+    { "mid",    "audio/midi" },
+    { "midi",   "audio/midi" },
+    { "weba",   "audio/webm" },
+
+    /* 视频 */
+    { "mp4",    "video/mp4" },
+    { "m4v",    "video/mp4" },
+    { "mpg",    "video/mpeg" },
+    { "mpeg",   "video/mpeg" },
+    { "webm",   "video/webm" },
+    { "ogv",    "video/ogg" },
+    { "mov",    "video/quicktime" },
+    { "avi",    "video/x-msvideo" },
+    { "wmv",    "video/x-ms-wmv" },
+    { "flv",    "video/x-flv" },
+    { "mkv",    "video/x-matroska" },
+    { "3gp",    "video/3gpp" },
+    { "ts",     "video/mp2t" },
+    { "m3u8",   "application/vnd.apple.mpegurl" },
+    { "mpd",    "application/dash+xml" },
+
+    /* 字体 */
+    { "woff",   "font/woff" },
+    { "woff2",  "font/woff2" },
+    { "ttf",    "font/ttf" },
+    { "otf",    "font/otf" },
+    { "eot",    "application/vnd.ms-fontobject" },
+};
+
+static constexpr size_t MIME_COUNT = sizeof(mimes) / sizeof(mimes[0]);
+static constexpr size_t MIME_BUCKETS = 64;  /* 第一级桶数量, 必须是 2 的幂 */
+static constexpr size_t MIME_SLOTS = 256;   /* 槽位数量, 必须是 2 的幂 */
+
+static_assert(MIME_SLOTS >= MIME_COUNT, "too many mime types for the table");
+
+
+/*
+ * 函数说明:    编译期求字符串长度
+ * @s:          字符串
+ */
+constexpr size_t ext_length(char const *s)
+{
+    size_t len = 0;
+    while (s[len] != '\0')
+        ++len;
+    return len;
+}
+
+
+/* 元函数: 下标 -> 打包后的扩展名 */
+template<typename Index>
+struct ExtKeyT;
+
+template<size_t I>
+struct ExtKeyT<ValueT<size_t, I>> {
+    static_assert(ext_length(mimes[I].ext) <= MIME_MAX_EXT, "extension too long");
+    static constexpr uint64_t value = mime_pack(mimes[I].ext, ext_length(mimes[I].ext));
+};
+
+/* 所有扩展名组成的编译期序列 */
+using Keys = Transform<IndexSequence<MIME_COUNT>, ExtKeyT>;
+using KeyT = decltype(Front<Keys>::value);
+
+
+/* 元函数: 排序后的序列中相邻元素相等时累计 */
+template<typename Acc, typename Element>
+struct CountDupT;
+
+template<typename T, T Prev, T Count, T X>
+struct CountDupT<ValueList<T, Prev, Count>, ValueT<T, X>> {
+    using Type = ValueList<T, X, Count + (X == Prev ? 1 : 0)>;
+};
+
+template<typename List>
+struct DupCountT;
+
+template<typename T, T Prev, T Count>
+struct DupCountT<ValueList<T, Prev, Count>> {
+    static constexpr uint64_t value = Count;
+};
+
+static_assert(DupCountT<Accmulate<InsertSort<Keys, SmallerThanT>, CountDupT,
+                                  ValueList<KeyT, 0, 0>>>::value == 0,
+              "duplicate extension in the mime table");
+
+
+/*
+ * 函数说明:    将编译期序列展开成数组
+ */
+template<typename List>
+struct ToArrayT;
+
+template<typename T, T... Values>
+struct ToArrayT<ValueList<T, Values...>> {
+    static constexpr std::array<uint64_t, sizeof...(Values)> value = { Values... };
+};
+
+
+/* 构造完成的完美哈希表 */
+struct PerfectHash {
+    uint32_t    disp[MIME_BUCKETS];         /* 每个桶的位移值 */
+    uint64_t    keys[MIME_SLOTS];           /* 槽位中的扩展名, 空槽位为 0 */
+    int         index[MIME_SLOTS];          /* 槽位对应 mimes 中的下标, 空槽位为 -1 */
+    bool        ok;                         /* 是否构造成功 */
+};
+
+
+/*
+ * 函数说明:    编译期构造完美哈希表: 按桶的大小从大到小, 为每个桶寻找不产生冲突的位移值
+ * @keys:       打包后的扩展名
+ */
+constexpr PerfectHash build(std::array<uint64_t, MIME_COUNT> const &keys)
+{
+    PerfectHash ph{};
+    size_t bucket[MIME_COUNT]{};
+    size_t bsize[MIME_BUCKETS]{};
+    size_t order[MIME_BUCKETS]{};
+
+    for (size_t i = 0; i < MIME_SLOTS; ++i)
+        ph.index[i] = -1;
+
+    for (size_t i = 0; i < MIME_COUNT; ++i) {
+        bucket[i] = mime_hash(keys[i], 0) & (MIME_BUCKETS - 1);
+        ++bsize[bucket[i]];
+    }
+
+    /* 选择排序, 先放置大的桶 */
+    for (size_t i = 0; i < MIME_BUCKETS; ++i)
+        order[i] = i;
+    for (size_t i = 0; i < MIME_BUCKETS; ++i) {
+        size_t max = i;
+        for (size_t j = i + 1; j < MIME_BUCKETS; ++j) {
+            if (bsize[order[j]] > bsize[order[max]])
+                max = j;
+        }
+        size_t tmp = order[i];
+        order[i] = order[max];
+        order[max] = tmp;
+    }
+
+    for (size_t i = 0; i < MIME_BUCKETS && bsize[order[i]] > 0; ++i) {
+        size_t b = order[i];
+        uint32_t d = 1;
+        for (;  d < 100000; ++d) {
+            size_t slots[MIME_COUNT]{};
+            size_t n = 0;
+            bool fit = true;
+            for (size_t k = 0; k < MIME_COUNT && fit; ++k) {
+                if (bucket[k] != b)
+                    continue;
+                size_t slot = mime_hash(keys[k], d) & (MIME_SLOTS - 1);
+                if (ph.index[slot] >= 0)
+                    fit = false;
+                for (size_t j = 0; j < n && fit; ++j) {
+                    if (slots[j] == slot)
+                        fit = false;
+                }
+                slots[n++] = slot;
+            }
+            if (fit)
+                break;
+        }
+        if (d == 100000)
+            return ph;
+
+        ph.disp[b] = d;
+        for (size_t k = 0; k < MIME_COUNT; ++k) {
+            if (bucket[k] == b) {
+                size_t slot = mime_hash(keys[k], d) & (MIME_SLOTS - 1);
+                ph.keys[slot] = keys[k];
+                ph.index[slot] = k;
+            }
+        }
+    }
+
+    ph.ok = true;
+    return ph;
+}
+
+static constexpr PerfectHash table = build(ToArrayT<Keys>::value);
+static_assert(table.ok, "failed to build the perfect hash, enlarge MIME_SLOTS");
+
+
+/*
+ * 输出 mime_table.h
+ */
+int main()
+{
+    printf("/* 由 mimegen.cpp 生成, 不要手工修改 */\n");
+    printf("#ifndef _MIME_TABLE_H_\n#define _MIME_TABLE_H_\n#include <stdint.h>\n\n");
+    printf("#define MIME_BUCKETS    %zu\n", MIME_BUCKETS);
+    printf("#define MIME_SLOTS      %zu\n\n", MIME_SLOTS);
+
+    printf("static const uint32_t mime_disp[MIME_BUCKETS] = {");
+    for (size_t i = 0; i < MIME_BUCKETS; ++i)
+        printf("%s%u,", (i % 12 == 0 ? "\n    " : " "), table.disp[i]);
+    printf("\n};\n\n");
+
+    printf("static const uint64_t mime_keys[MIME_SLOTS] = {");
+    for (size_t i = 0; i < MIME_SLOTS; ++i)
+        printf("%s0x%llxULL,", (i % 4 == 0 ? "\n    " : " "), (unsigned long long)table.keys[i]);
+    printf("\n};\n\n");
+
+    printf("static const char *const mime_types[MIME_SLOTS] = {");
+    for (size_t i = 0; i < MIME_SLOTS; ++i) {
+        if (table.index[i] < 0)
+            printf("\n    NULL,");
+        else {
+            size_t len = strlen(mimes[table.index[i]].type);
+            printf("\n    \"%s\",%*s/* .%s */", mimes[table.index[i]].type,
+                   (int)(len < 48 ? 48 - len : 1), "", mimes[table.index[i]].ext);
+        }
+    }
+    printf("\n};\n\n#endif\n");
+
+    return 0;
+}
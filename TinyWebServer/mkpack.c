@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "pack.h"
+#include "mime.h"
+
+/*
+ * 打包工具: 把文档根目录下的所有普通文件打包为一个只读归档, 归档中保存按路径排序的条目表, 哈希表,
+ * 预先生成的响应报头, 验证器和可选的 gzip 压缩版本. 服务器使用 -P 选项映射归档之后,
+ * 静态请求不再需要 stat 和 open. cgi-bin 下的文件由服务器动态执行, 不打包
+ */
+
+#define output_error_message(...)                           \
+        fprintf(stderr, "%s:%d: ", __func__, __LINE__);     \
+        fprintf(stderr, __VA_ARGS__);
+
+#define MAXLINE         1024
+#define PACK_GZIP_MIN   256                 /* 小于这个大小的文件不压缩, 节省的字节不值得一个额外的版本 */
+#define USAGE           "usage: %s [-z] docroot archive\n"                                          \
+                        "  -z  store a gzip variant of compressible files without a .gz sibling\n"
+
+/* 待打包的文件 */
+typedef struct pack_file_t {
+    char        *pf_path;                   /* 路径, 以 "./" 开头 */
+    struct stat  pf_stat;                   /* 文件属性 */
+} pack_file_t;
+
+/* 可以增长的字节缓冲区, 用于构造字符串区 */
+typedef struct pack_buf_t {
+    char        *b_data;                    /* 数据 */
+    size_t       b_len;                     /* 已经使用的字节数 */
+    size_t       b_cap;                     /* 容量 */
+} pack_buf_t;
+
+static pack_file_t *g_files;                /* 扫描到的文件 */
+static size_t g_nfiles;                     /* 文件数量 */
+static size_t g_capfiles;                   /* g_files 的容量 */
+
+static int add_file(char const *path, struct stat const *st, int flag, struct FTW *ftw);
+static int compare_file(void const *a, void const *b);
+static char *read_file(char const *path, size_t size);
+static char *gzip_file(char const *data, size_t size, size_t *gzsize);
+static uint64_t buf_append(pack_buf_t *b, char const *data, size_t len);
+static int write_at(int fd, void const *data, size_t len, uint64_t off);
+static uint64_t align_up(uint64_t off);
+
+
+int main(int argc, char *argv[])
+{
+    int gzip = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "z")) != -1) {
+        switch (opt) {
+        case 'z':
+            gzip = 1;
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 2) {
+        fprintf(stderr, USAGE, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* 先写入临时文件, 完成后 rename, 正在使用旧归档的服务器不受影响 */
+    char const *root = argv[optind];
+    char const *archive = argv[optind + 1];
+    char tmpname[4096];
+    char cwd[4096];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", archive);
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        output_error_message("getcwd error: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    int fd;
+    if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        output_error_message("open(%s) error: %s\n", tmpname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* 在文档根目录中遍历, nftw 给出的路径 "./a/b" 正好是 parse_uri 的结果 */
+    if (chdir(root) < 0) {
+        output_error_message("chdir(%s) error: %s\n", root, strerror(errno));
+        goto fail;
+    }
+    if (nftw(".", add_file, 64, 0) != 0) {
+        output_error_message("nftw(%s) error: %s\n", root, strerror(errno));
+        goto fail;
+    }
+    qsort(g_files, g_nfiles, sizeof(pack_file_t), compare_file);
+
+    pack_entry_t *entries = (pack_entry_t *)calloc(g_nfiles + 1, sizeof(pack_entry_t));
+    pack_buf_t strings = { NULL, 0, 0 };
+    size_t ngzip = 0;
+    uint64_t off = align_up(sizeof(pack_header_t));
+    if (entries == NULL) {
+        output_error_message("calloc error: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    /*
+     * 文件内容和压缩版本依次写在文件头之后, 路径, MIME 类型和报头放入字符串区, 字符串区在所有内容之后,
+     * 条目中先记录相对于字符串区的偏移, 写入前再加上区域的起始位置
+     */
+    for (size_t i = 0; i < g_nfiles; ++i) {
+        pack_file_t *f = &g_files[i];
+        pack_entry_t *e = &entries[i];
+        char const *type = mime_type(f->pf_path, strlen(f->pf_path));
+        char *data = read_file(f->pf_path, f->pf_stat.st_size);
+        if (data == NULL) {
+            output_error_message("read(%s) error: %s\n", f->pf_path, strerror(errno));
+            goto fail;
+        }
+
+        e->pe_pathlen = strlen(f->pf_path);
+        e->pe_hash = pack_hash(f->pf_path, e->pe_pathlen);
+        e->pe_offset = off;
+        e->pe_size = f->pf_stat.st_size;
+        if (write_at(fd, data, e->pe_size, off) < 0)
+            goto fail_write;
+        off += e->pe_size;
+        http_make_validator(&e->pe_v, f->pf_stat.st_ino, f->pf_stat.st_size, f->pf_stat.st_mtim);
+        e->pe_gzv = e->pe_v;
+        http_validator_variant(&e->pe_gzv, "gz");
+
+        /* 压缩版本: 优先使用同名的 .gz 文件 (与 server_precompressed 一致), 否则按 -z 压缩一次 */
+        char *gzdata = NULL;
+        size_t gzsize = 0;
+        if (mime_compressible(type)) {
+            char gzname[4096];
+            struct stat gzst;
+            snprintf(gzname, sizeof(gzname), "%s.gz", f->pf_path);
+            if (stat(gzname, &gzst) == 0 && S_ISREG(gzst.st_mode)) {
+                if ((gzdata = read_file(gzname, gzst.st_size)) == NULL) {
+                    output_error_message("read(%s) error: %s\n", gzname, strerror(errno));
+                    free(data);
+                    goto fail;
+                }
+                gzsize = gzst.st_size;
+            } else if (gzip && e->pe_size >= PACK_GZIP_MIN) {
+                gzdata = gzip_file(data, e->pe_size, &gzsize);
+            }
+        }
+        free(data);
+
+        if (gzdata != NULL) {
+            e->pe_gzoffset = off;
+            e->pe_gzsize = gzsize;
+            if (write_at(fd, gzdata, gzsize, off) < 0) {
+                free(gzdata);
+                goto fail_write;
+            }
+            off += gzsize;
+            free(gzdata);
+            ++ngzip;
+        }
+
+        /* 与 static_header 生成的报头相同 */
+        char hdr[MAXLINE];
+        int len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nServer: Tiny Web Server\r\n"
+                           "Content-length: %llu\r\nContent-type: %s\r\nAccept-Ranges: bytes\r\n"
+                           "ETag: %s\r\nLast-Modified: %s\r\n",
+                           (unsigned long long)e->pe_size, type, e->pe_v.etag, e->pe_v.lastmod);
+        e->pe_hdr = buf_append(&strings, hdr, len);
+        e->pe_hdrlen = len;
+        if (e->pe_gzsize > 0) {
+            len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nServer: Tiny Web Server\r\n"
+                           "Content-length: %llu\r\nContent-type: %s\r\nAccept-Ranges: bytes\r\n"
+                           "ETag: %s\r\nLast-Modified: %s\r\n",
+                           (unsigned long long)e->pe_gzsize, type, e->pe_gzv.etag, e->pe_gzv.lastmod);
+            e->pe_gzhdr = buf_append(&strings, hdr, len);
+            e->pe_gzhdrlen = len;
+        }
+        e->pe_path = buf_append(&strings, f->pf_path, e->pe_pathlen + 1);
+        e->pe_type = buf_append(&strings, type, strlen(type) + 1);
+    }
+
+    for (size_t i = 0; i < g_nfiles; ++i) {
+        entries[i].pe_path += off;
+        entries[i].pe_type += off;
+        entries[i].pe_hdr += off;
+        if (entries[i].pe_gzsize > 0)
+            entries[i].pe_gzhdr += off;
+    }
+    if (write_at(fd, strings.b_data, strings.b_len, off) < 0)
+        goto fail_write;
+    off = align_up(off + strings.b_len);
+
+    /* 条目表和哈希表, 槽位数量至少是条目数量的两倍 */
+    pack_header_t h;
+    bzero(&h, sizeof(h));
+    memcpy(h.ph_magic, PACK_MAGIC, sizeof(h.ph_magic));
+    h.ph_count = g_nfiles;
+    h.ph_buckets = 16;
+    while (h.ph_buckets < 2 * g_nfiles)
+        h.ph_buckets <<= 1;
+
+    uint32_t *hash = (uint32_t *)calloc(h.ph_buckets, sizeof(uint32_t));
+    if (hash == NULL) {
+        output_error_message("calloc error: %s\n", strerror(errno));
+        goto fail;
+    }
+    for (size_t i = 0; i < g_nfiles; ++i) {
+        uint32_t slot = entries[i].pe_hash & (h.ph_buckets - 1);
+        while (hash[slot] != 0)
+            slot = (slot + 1) & (h.ph_buckets - 1);
+        hash[slot] = i + 1;
+    }
+
+    h.ph_entries = off;
+    if (write_at(fd, entries, g_nfiles * sizeof(pack_entry_t), off) < 0)
+        goto fail_write;
+    off = align_up(off + g_nfiles * sizeof(pack_entry_t));
+    h.ph_hash = off;
+    if (write_at(fd, hash, h.ph_buckets * sizeof(uint32_t), off) < 0)
+        goto fail_write;
+    off += h.ph_buckets * sizeof(uint32_t);
+    h.ph_size = off;
+    if (write_at(fd, &h, sizeof(h), 0) < 0 || ftruncate(fd, off) < 0 || fsync(fd) < 0)
+        goto fail_write;
+
+    close(fd);
+    if (chdir(cwd) < 0 || rename(tmpname, archive) < 0) {
+        output_error_message("rename(%s) error: %s\n", archive, strerror(errno));
+        unlink(tmpname);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%s: %zu files, %zu gzip variants, %llu bytes\n", archive, g_nfiles, ngzip, (unsigned long long)off);
+    return 0;
+
+fail_write:
+    output_error_message("write(%s) error: %s\n", tmpname, strerror(errno));
+fail:
+    close(fd);
+    if (chdir(cwd) == 0)
+        unlink(tmpname);
+    exit(EXIT_FAILURE);
+}
+
+
+/*
+ * 函数说明:    nftw 的回调函数, 记录普通文件. 跳过 cgi-bin 下的文件和没有读权限的文件
+ * @path:       文件路径
+ * @st:         文件属性
+ * @flag:       文件类型
+ * @ftw:        目录层次信息
+ */
+static int add_file(char const *path, struct stat const *st, int flag, struct FTW *ftw)
+{
+    (void)ftw;
+    if (flag != FTW_F || !S_ISREG(st->st_mode) || strstr(path, "cgi-bin") != NULL || access(path, R_OK) < 0)
+        return 0;
+
+    if (g_nfiles == g_capfiles) {
+        size_t cap = (g_capfiles == 0 ? 256 : 2 * g_capfiles);
+        pack_file_t *files = (pack_file_t *)realloc(g_files, cap * sizeof(pack_file_t));
+        if (files == NULL)
+            return -1;
+        g_files = files;
+        g_capfiles = cap;
+    }
+
+    if ((g_files[g_nfiles].pf_path = strdup(path)) == NULL)
+        return -1;
+    g_files[g_nfiles].pf_stat = *st;
+    ++g_nfiles;
+    return 0;
+}
+
+
+/*
+ * 函数说明:    按路径排序文件
+ */
+static int compare_file(void const *a, void const *b)
+{
+    return strcmp(((pack_file_t const *)a)->pf_path, ((pack_file_t const *)b)->pf_path);
+}
+
+
+/*
+ * 函数说明:    读取整个文件, 返回 malloc 分配的内容, 失败返回 NULL
+ * @path:       文件路径
+ * @size:       文件大小
+ */
+static char *read_file(char const *path, size_t size)
+{
+    int fd;
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+
+    char *data = (char *)malloc(size + 1);
+    size_t got = 0;
+    while (data != NULL && got < size) {
+        ssize_t n = read(fd, data + got, size - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = EIO;                /* 打包期间文件被截断 */
+            free(data);
+            data = NULL;
+            break;
+        }
+        got += n;
+    }
+
+    close(fd);
+    return data;
+}
+
+
+/*
+ * 函数说明:    使用 zlib 将内容压缩为 gzip 格式, 压缩失败或者压缩后没有变小时返回 NULL
+ * @data:       内容
+ * @size:       内容长度
+ * @gzsize:     存放压缩后的长度
+ */
+static char *gzip_file(char const *data, size_t size, size_t *gzsize)
+{
+    z_stream zs;
+    bzero(&zs, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    uLong bound = deflateBound(&zs, size);
+    char *out = (char *)malloc(bound);
+    if (out == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = size;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= size) {
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+
+    *gzsize = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+
+/*
+ * 函数说明:    在缓冲区末尾追加数据, 返回数据在缓冲区中的偏移. 内存不足时退出
+ * @b:          缓冲区
+ * @data:       数据
+ * @len:        数据长度
+ */
+static uint64_t buf_append(pack_buf_t *b, char const *data, size_t len)
+{
+    uint64_t off = b->b_len;
+    if (b->b_len + len > b->b_cap) {
+        size_t cap = (b->b_cap == 0 ? 4096 : b->b_cap);
+        while (cap < b->b_len + len)
+            cap *= 2;
+        char *p = (char *)realloc(b->b_data, cap);
+        if (p == NULL) {
+            output_error_message("realloc error: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        b->b_data = p;
+        b->b_cap = cap;
+    }
+
+    memcpy(b->b_data + off, data, len);
+    b->b_len += len;
+    return off;
+}
+
+
+/*
+ * 函数说明:    在指定偏移写入全部数据, 失败返回 -1
+ * @fd:         文件描述符
+ * @data:       数据
+ * @len:        数据长度
+ * @off:        文件偏移
+ */
+static int write_at(int fd, void const *data, size_t len, uint64_t off)
+{
+    char const *p = (char const *)data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    将偏移向上对齐到 PACK_ALIGN
+ * @off:        偏移
+ */
+static uint64_t align_up(uint64_t off)
+{
+    return (off + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+}
@@ -5,6 +5,17 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LISTEN_REUSEPORT    0x01            /* 设置 SO_REUSEPORT, 多个套接字可以绑定同一个端口 */
+#define LISTEN_NONBLOCK     0x02            /* 非阻塞套接字 */
+#define LISTEN_BACKLOG      SOMAXCONN       /* 默认的连接队列长度, 内核还会按 net.core.somaxconn 截断 */
+
+int open_listenfd(char const *host, char const *port);
+int open_listenfd_opt(char const *host, char const *port, int flags, int backlog);
+void set_nodelay(int connfd);
 
 
 /* 
@@ -13,6 +24,19 @@
  * @port:       绑定的端口号
  */
 int open_listenfd(char const *host, char const *port)
+{
+    return open_listenfd_opt(host, port, 0, LISTEN_BACKLOG);
+}
+
+
+/* 
+ * 函数说明:    创建 TCP 监听套接字文件描述符, 并设置端口复用
+ * @host:       绑定的 主机名(可选)
+ * @port:       绑定的端口号
+ * @flags:      LISTEN_REUSEPORT / LISTEN_NONBLOCK 的组合
+ * @backlog:    已完成握手, 等待 accept 的连接队列长度, 不大于 0 时使用 LISTEN_BACKLOG
+ */
+int open_listenfd_opt(char const *host, char const *port, int flags, int backlog)
 {
     if (port == NULL)
         return -1;
@@ -32,10 +56,15 @@ int open_listenfd(char const *host, char const *port)
     int listenfd;
     int sockopt = 1;
     for (p = listp; p != NULL; p = p->ai_next) {
-        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+        if ((listenfd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) < 0)
             continue;
         
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
+        if ((flags & LISTEN_REUSEPORT) 
+            && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &sockopt, sizeof(sockopt)) < 0) {
+            close(listenfd);
+            continue;
+        }
 
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break;
@@ -49,12 +78,28 @@ int open_listenfd(char const *host, char const *port)
     if (p == NULL)
      return -1;
 
-    if (listen(listenfd, 128) < 0) {
+    if (listen(listenfd, (backlog > 0 ? backlog : LISTEN_BACKLOG)) < 0) {
         close(listenfd);
         return -1;
     }
 
+    if (flags & LISTEN_NONBLOCK)
+        fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
     return listenfd;
 }
  
-#endif
+
+
+/*
+ * 函数说明:    关闭已连接套接字的 Nagle 算法. 响应的报头和主体分成多次写出, 流水线请求的多个响应也是分别写出,
+ *              开启 Nagle 时后面的小段要等客户端的延迟确认, 每个响应多等几十毫秒
+ * @connfd:     已连接套接字
+ */
+void set_nodelay(int connfd)
+{
+    int one = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,197 @@
+#ifndef _PACK_H_
+#define _PACK_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "http_range.h"
+
+#define PACK_MAGIC          "TINYPAK1"      /* 归档文件的魔数, 格式改变时修改最后的版本号 */
+#define PACK_ALIGN          8               /* 各个区域的对齐字节数 */
+#define PACK_SENDFILE_MIN   (64 * 1024)     /* 不小于这个大小的内容使用 sendfile 发送, 更小的内容直接 writev 映射的内存 */
+
+/*
+ * 归档文件布局: 文件头, 文件内容 (原始内容和压缩后的内容), 字符串区, 按路径排序的条目表, 哈希表.
+ * 所有位置都是相对于文件开头的偏移. 条目中直接保存验证器结构, 归档只能在相同平台上使用
+ */
+typedef struct pack_header_t {
+    char         ph_magic[8];               /* PACK_MAGIC */
+    uint32_t     ph_count;                  /* 条目数量 */
+    uint32_t     ph_buckets;                /* 哈希表槽位数量, 2 的幂 */
+    uint64_t     ph_entries;                /* 条目表的偏移 */
+    uint64_t     ph_hash;                   /* 哈希表的偏移, 每个槽位是条目下标加一, 0 表示空槽位 */
+    uint64_t     ph_size;                   /* 归档文件的总大小 */
+} pack_header_t;
+
+/* 一个文件的条目, 报头是预先生成的 200 响应报头 (不含编码相关的报头, Connection 报头和结束的空行) */
+typedef struct pack_entry_t {
+    uint64_t         pe_path;               /* 路径 (以 "./" 开头, 与 parse_uri 的结果相同) 在字符串区中的偏移 */
+    uint32_t         pe_pathlen;            /* 路径长度 */
+    uint32_t         pe_hash;               /* 路径的哈希值 */
+    uint64_t         pe_type;               /* MIME 类型在字符串区中的偏移 */
+    uint64_t         pe_offset;             /* 文件内容的偏移 */
+    uint64_t         pe_size;               /* 文件内容的长度 */
+    uint64_t         pe_hdr;                /* 报头的偏移 */
+    uint64_t         pe_hdrlen;             /* 报头长度 */
+    uint64_t         pe_gzoffset;           /* gzip 压缩后内容的偏移 */
+    uint64_t         pe_gzsize;             /* gzip 压缩后内容的长度, 0 表示没有压缩的版本 */
+    uint64_t         pe_gzhdr;              /* 压缩版本报头的偏移 */
+    uint64_t         pe_gzhdrlen;           /* 压缩版本报头的长度 */
+    http_validator_t pe_v;                  /* 验证器 */
+    http_validator_t pe_gzv;                /* 压缩版本的验证器 */
+} pack_entry_t;
+
+/* 映射到内存中的归档 */
+typedef struct pack_t {
+    int                  pk_fd;             /* 归档文件描述符, 用于 sendfile */
+    char const          *pk_map;            /* 映射的起始地址, 没有打开归档时为 NULL */
+    size_t               pk_size;           /* 映射的大小 */
+    pack_header_t const *pk_hdr;            /* 文件头 */
+    pack_entry_t const  *pk_entries;        /* 条目表 */
+    uint32_t const      *pk_hash;           /* 哈希表 */
+} pack_t;
+
+int  pack_open(pack_t *p, char const *path);
+void pack_close(pack_t *p);
+pack_entry_t const *pack_lookup(pack_t const *p, char const *path);
+static uint32_t pack_hash(char const *path, size_t len);
+static int pack_in_range(pack_t const *p, uint64_t off, uint64_t len);
+
+
+/*
+ * 函数说明:    以只读方式映射归档文件, 检查文件头和每个条目引用的区域都在文件范围内, 不读取文件内容.
+ *              服务期间不能原地修改归档文件 (截断会导致访问映射时 SIGBUS), 更新时应当写入新文件后 rename.
+ *              成功返回 0, 失败返回 -1
+ * @p:          归档指针
+ * @path:       归档文件路径
+ */
+int pack_open(pack_t *p, char const *path)
+{
+    struct stat st;
+
+    bzero(p, sizeof(pack_t));
+    if ((p->pk_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    if (fstat(p->pk_fd, &st) < 0 || (size_t)st.st_size < sizeof(pack_header_t)) {
+        close(p->pk_fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, p->pk_fd, 0);
+    if (map == MAP_FAILED) {
+        close(p->pk_fd);
+        return -1;
+    }
+
+    p->pk_map = (char const *)map;
+    p->pk_size = st.st_size;
+    p->pk_hdr = (pack_header_t const *)map;
+    pack_header_t const *h = p->pk_hdr;
+    if (memcmp(h->ph_magic, PACK_MAGIC, sizeof(h->ph_magic)) != 0 || h->ph_size != p->pk_size
+        || h->ph_buckets == 0 || (h->ph_buckets & (h->ph_buckets - 1)) != 0 || h->ph_count >= h->ph_buckets
+        || h->ph_entries % PACK_ALIGN != 0 || h->ph_hash % PACK_ALIGN != 0
+        || !pack_in_range(p, h->ph_entries, (uint64_t)h->ph_count * sizeof(pack_entry_t))
+        || !pack_in_range(p, h->ph_hash, (uint64_t)h->ph_buckets * sizeof(uint32_t)))
+        goto invalid;
+
+    p->pk_entries = (pack_entry_t const *)(p->pk_map + h->ph_entries);
+    p->pk_hash = (uint32_t const *)(p->pk_map + h->ph_hash);
+    for (uint32_t i = 0; i < h->ph_count; ++i) {
+        pack_entry_t const *e = &p->pk_entries[i];
+        if (!pack_in_range(p, e->pe_path, e->pe_pathlen + 1) || p->pk_map[e->pe_path + e->pe_pathlen] != '\0'
+            || !pack_in_range(p, e->pe_type, 1) || memchr(p->pk_map + e->pe_type, '\0', p->pk_size - e->pe_type) == NULL
+            || !pack_in_range(p, e->pe_offset, e->pe_size) || !pack_in_range(p, e->pe_hdr, e->pe_hdrlen)
+            || !pack_in_range(p, e->pe_gzoffset, e->pe_gzsize) || !pack_in_range(p, e->pe_gzhdr, e->pe_gzhdrlen)
+            || memchr(e->pe_v.etag, '\0', sizeof(e->pe_v.etag)) == NULL
+            || memchr(e->pe_v.lastmod, '\0', sizeof(e->pe_v.lastmod)) == NULL
+            || memchr(e->pe_gzv.etag, '\0', sizeof(e->pe_gzv.etag)) == NULL
+            || memchr(e->pe_gzv.lastmod, '\0', sizeof(e->pe_gzv.lastmod)) == NULL)
+            goto invalid;
+    }
+    for (uint32_t i = 0; i < h->ph_buckets; ++i) {
+        if (p->pk_hash[i] > h->ph_count)
+            goto invalid;
+    }
+
+    return 0;
+
+invalid:
+    pack_close(p);
+    errno = EINVAL;
+    return -1;
+}
+
+
+/*
+ * 函数说明:    解除映射并关闭归档文件
+ * @p:          归档指针
+ */
+void pack_close(pack_t *p)
+{
+    if (p->pk_map != NULL) {
+        munmap((void *)p->pk_map, p->pk_size);
+        close(p->pk_fd);
+    }
+    bzero(p, sizeof(pack_t));
+}
+
+
+/*
+ * 函数说明:    按路径查找条目, 一次哈希计算加上线性探测, 不进行任何系统调用. 没有找到返回 NULL
+ * @p:          归档指针
+ * @path:       路径 (parse_uri 的结果)
+ */
+pack_entry_t const *pack_lookup(pack_t const *p, char const *path)
+{
+    size_t len = strlen(path);
+    uint32_t hash = pack_hash(path, len);
+    uint32_t mask = p->pk_hdr->ph_buckets - 1;
+
+    for (uint32_t i = hash & mask; p->pk_hash[i] != 0; i = (i + 1) & mask) {
+        pack_entry_t const *e = &p->pk_entries[p->pk_hash[i] - 1];
+        if (e->pe_hash == hash && e->pe_pathlen == len && memcmp(p->pk_map + e->pe_path, path, len) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+
+/* (内部函数)
+ * 函数说明:    计算路径的哈希值 (FNV-1a), 打包工具和服务器使用同一个函数
+ * @path:       路径
+ * @len:        路径长度
+ */
+static uint32_t pack_hash(char const *path, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+/* (内部函数)
+ * 函数说明:    检查 [off, off + len) 是否在映射范围内
+ * @p:          归档指针
+ * @off:        起始偏移
+ * @len:        长度
+ */
+static int pack_in_range(pack_t const *p, uint64_t off, uint64_t len)
+{
+    return off <= p->pk_size && len <= p->pk_size - off;
+}
+
+#endif
@@ -0,0 +1,306 @@
+#ifndef _PREFORK_H_
+#define _PREFORK_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include "log.h"
+
+#define PREFORK_MIN_LIFETIME    1           /* 工作进程存活不到该时间(秒)就退出时, 推迟重启 */
+#define PREFORK_RESPAWN_DELAY   1           /* 推迟重启的时间(秒), 避免启动即崩溃时反复 fork */
+
+/* 主进程记录的一个工作进程 */
+typedef struct prefork_child_t {
+    pid_t        pc_pid;                    /* 进程 ID, -1 表示等待重启 */
+    int          pc_index;                  /* 工作进程编号, 决定绑定的 cpu */
+    int          pc_gen;                    /* 所属的代, SIGHUP 之后旧一代的进程退出时不再重启 */
+    time_t       pc_time;                   /* 运行中为启动时间, 等待重启时为重启时间 */
+} prefork_child_t;
+
+/* 多进程模式的主进程, 只负责启动, 监视和重启工作进程, 不处理连接 */
+typedef struct prefork_t {
+    int              p_nworkers;            /* 每一代的工作进程数量 */
+    int              p_pin;                 /* 是否把工作进程绑定到 cpu */
+    int              p_gen;                 /* 当前的代 */
+    int              p_nchildren;           /* 记录的工作进程数量, 包括正在退出的旧一代 */
+    int              p_capacity;            /* 记录数组的容量 */
+    prefork_child_t *p_children;            /* 工作进程记录数组 */
+    pid_t            p_master;              /* 主进程 ID */
+    cpu_set_t        p_cpus;                /* 主进程允许使用的 cpu */
+    sigset_t         p_oldmask;             /* 进入主循环之前的信号掩码, 工作进程恢复使用 */
+} prefork_t;
+
+int  prefork_master(int nworkers, int pin);
+static int  prefork_spawn(prefork_t *p, prefork_child_t *c, time_t now);
+static int  prefork_add(prefork_t *p, int index);
+static void prefork_reap(prefork_t *p, time_t now);
+static void prefork_child(prefork_t *p, int index);
+static void prefork_shutdown(prefork_t *p, int signo);
+
+
+/*
+ * 函数说明:    进入多进程模式. 调用进程成为主进程, 启动 nworkers 个工作进程后只负责监视它们, 不再返回;
+ *              工作进程从本函数返回自己的编号 (0 到 nworkers - 1), 之后各自打开 SO_REUSEPORT 监听套接字,
+ *              由内核在各个进程之间分配新连接. 失败返回 -1.
+ *              主进程的信号: SIGCHLD 重启退出的工作进程; SIGHUP 平滑重启, 先启动新一代工作进程,
+ *              再向旧一代发送 SIGTERM, 让它们处理完已有的连接后退出; SIGTERM/SIGINT 转发给所有工作进程,
+ *              等待它们退出后主进程退出
+ * @nworkers:   工作进程数量
+ * @pin:        是否把第 i 个工作进程绑定到第 i 个可用的 cpu
+ */
+int prefork_master(int nworkers, int pin)
+{
+    prefork_t p;
+    sigset_t set;
+
+    if (nworkers <= 0)
+        return -1;
+
+    bzero(&p, sizeof(p));
+    p.p_nworkers = nworkers;
+    p.p_pin = pin;
+    p.p_master = getpid();
+    if (sched_getaffinity(0, sizeof(p.p_cpus), &p.p_cpus) < 0)
+        p.p_pin = 0;
+
+    /* 信号一直阻塞, 由 sigtimedwait 同步取出, 主循环中不需要考虑异步的信号处理函数 */
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &set, &p.p_oldmask) < 0)
+        return -1;
+
+    for (int i = 0; i < nworkers; ++i) {
+        int ret = prefork_add(&p, i);
+        if (ret > 0) {
+            prefork_child(&p, i);
+            return i;
+        }
+        if (ret < 0) {
+            prefork_shutdown(&p, SIGTERM);
+            sigprocmask(SIG_SETMASK, &p.p_oldmask, NULL);
+            return -1;
+        }
+    }
+    log_printf(LOG_INFO, "master %d: running %d worker processes\n", (int)p.p_master, nworkers);
+
+    while (1) {
+        /* 启动到期的等待重启的工作进程 */
+        time_t now = time(NULL);
+        int pending = 0;
+        for (int i = 0; i < p.p_nchildren; ++i) {
+            prefork_child_t *c = &p.p_children[i];
+            if (c->pc_pid >= 0)
+                continue;
+            if (c->pc_time > now) {
+                pending = 1;
+                continue;
+            }
+            if (prefork_spawn(&p, c, now) == 0) {
+                int index = c->pc_index;
+                prefork_child(&p, index);
+                return index;
+            }
+            if (c->pc_pid < 0)
+                pending = 1;
+        }
+
+        /* 有等待重启的进程时最多等待 1 秒 */
+        struct timespec timeout = { PREFORK_RESPAWN_DELAY, 0 };
+        int signo = sigtimedwait(&set, NULL, (pending ? &timeout : NULL));
+        if (signo < 0)
+            continue;
+
+        switch (signo) {
+        case SIGCHLD:
+            prefork_reap(&p, time(NULL));
+            break;
+
+        case SIGHUP:
+            log_printf(LOG_INFO, "master %d: SIGHUP, restarting workers\n", (int)p.p_master);
+            ++p.p_gen;
+            for (int i = 0; i < nworkers; ++i) {
+                if (prefork_add(&p, i) > 0) {
+                    prefork_child(&p, i);
+                    return i;
+                }
+            }
+
+            /* 新一代已经在监听, 旧一代不再接受新连接, 处理完已有的连接后退出 */
+            for (int i = 0; i < p.p_nchildren; ) {
+                prefork_child_t *c = &p.p_children[i];
+                if (c->pc_gen == p.p_gen) {
+                    ++i;
+                } else if (c->pc_pid > 0) {
+                    kill(c->pc_pid, SIGTERM);
+                    ++i;
+                } else {
+                    p.p_children[i] = p.p_children[--p.p_nchildren];
+                }
+            }
+            break;
+
+        default:
+            prefork_shutdown(&p, signo);
+            exit(0);
+        }
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    fork 一个工作进程. 在工作进程中返回 0, 在主进程中返回 1 (fork 失败时推迟重启)
+ * @p:          主进程指针
+ * @c:          工作进程记录
+ * @now:        当前时间
+ */
+static int prefork_spawn(prefork_t *p, prefork_child_t *c, time_t now)
+{
+    pid_t pid;
+    if ((pid = fork()) == 0)
+        return 0;
+
+    if (pid < 0) {
+        log_printf(LOG_ERROR, "%s: fork error: %s\n", __func__, strerror(errno));
+        c->pc_pid = -1;
+        c->pc_time = now + PREFORK_RESPAWN_DELAY;
+        return 1;
+    }
+
+    c->pc_pid = pid;
+    c->pc_time = now;
+    return 1;
+}
+
+
+/* (内部函数)
+ * 函数说明:    为当前一代增加第 index 个工作进程并立即启动. 主进程中成功返回 0, 内存不足返回 -1,
+ *              在工作进程中返回 1
+ * @p:          主进程指针
+ * @index:      工作进程编号
+ */
+static int prefork_add(prefork_t *p, int index)
+{
+    if (p->p_nchildren == p->p_capacity) {
+        int capacity = (p->p_capacity > 0 ? p->p_capacity * 2 : p->p_nworkers);
+        prefork_child_t *children;
+        if ((children = (prefork_child_t *)realloc(p->p_children, capacity * sizeof(prefork_child_t))) == NULL)
+            return -1;
+        p->p_children = children;
+        p->p_capacity = capacity;
+    }
+
+    prefork_child_t *c = &p->p_children[p->p_nchildren++];
+    c->pc_pid = -1;
+    c->pc_index = index;
+    c->pc_gen = p->p_gen;
+    c->pc_time = 0;
+
+    return (prefork_spawn(p, c, time(NULL)) == 0 ? 1 : 0);
+}
+
+
+/* (内部函数)
+ * 函数说明:    回收退出的工作进程. 当前一代的进程安排重启, 存活时间过短的推迟重启; 旧一代的进程删除记录
+ * @p:          主进程指针
+ * @now:        当前时间
+ */
+static void prefork_reap(prefork_t *p, time_t now)
+{
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < p->p_nchildren; ++i) {
+            prefork_child_t *c = &p->p_children[i];
+            if (c->pc_pid != pid)
+                continue;
+
+            if (c->pc_gen != p->p_gen) {
+                p->p_children[i] = p->p_children[--p->p_nchildren];
+                break;
+            }
+
+            if (WIFSIGNALED(status))
+                log_printf(LOG_ERROR, "master %d: worker %d (pid %d) killed by signal %d\n",
+                           (int)p->p_master, c->pc_index, (int)pid, WTERMSIG(status));
+            else
+                log_printf(LOG_ERROR, "master %d: worker %d (pid %d) exited with status %d\n",
+                           (int)p->p_master, c->pc_index, (int)pid, WEXITSTATUS(status));
+
+            c->pc_pid = -1;
+            c->pc_time = (now - c->pc_time < PREFORK_MIN_LIFETIME ? now + PREFORK_RESPAWN_DELAY : now);
+            break;
+        }
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    fork 之后在工作进程中调用: 恢复信号掩码, 主进程退出时收到 SIGTERM, 按需绑定 cpu,
+ *              释放主进程的记录
+ * @p:          主进程指针
+ * @index:      工作进程编号
+ */
+static void prefork_child(prefork_t *p, int index)
+{
+    sigprocmask(SIG_SETMASK, &p->p_oldmask, NULL);
+
+    /* 主进程在 prctl 之前已经退出时不会再收到信号, 直接退出 */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != p->p_master)
+        exit(0);
+
+    if (p->p_pin) {
+        int ncpus = CPU_COUNT(&p->p_cpus);
+        int nth = index % ncpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &p->p_cpus) && nth-- == 0) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                if (sched_setaffinity(0, sizeof(set), &set) < 0)
+                    log_printf(LOG_WARN, "worker %d: sched_setaffinity(%d) error: %s\n",
+                               index, cpu, strerror(errno));
+                break;
+            }
+        }
+    }
+
+    free(p->p_children);
+    p->p_children = NULL;
+}
+
+
+/* (内部函数)
+ * 函数说明:    向所有工作进程发送 SIGTERM 并等待它们退出
+ * @p:          主进程指针
+ * @signo:      主进程收到的信号
+ */
+static void prefork_shutdown(prefork_t *p, int signo)
+{
+    log_printf(LOG_INFO, "master %d: signal %d, stopping workers\n", (int)p->p_master, signo);
+    for (int i = 0; i < p->p_nchildren; ++i) {
+        if (p->p_children[i].pc_pid > 0)
+            kill(p->p_children[i].pc_pid, SIGTERM);
+    }
+
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+        ;
+
+    free(p->p_children);
+    p->p_children = NULL;
+    p->p_nchildren = 0;
+}
+
+#endif
@@ -0,0 +1,603 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "rio.h"
+#include "network.h"
+#include "http_parser.h"
+#include "response.h"
+#include "log.h"
+#include "stats.h"
+#include "timer.h"
+#include "admission.h"
+
+#define REACTOR_MAXEVENTS   256             /* 一次 epoll_wait 最多返回的事件数量 */
+#define REACTOR_PEERLEN     64              /* 客户端地址字符串的长度 */
+#define REACTOR_DRAIN_IDLE  1               /* 停止过程中, 发送完响应的连接等待下一个请求的超时时间(秒) */
+
+/*
+ * 请求处理函数: 根据解析完成的请求填充响应. 请求格式错误时 req 为 NULL, status 为对应的 http 状态码
+ * @req:        请求
+ * @status:     请求出错时的 http 状态码, 正常为 0
+ * @resp:       需要填充的响应
+ * @reqleft:    当前连接在本请求之后还能处理的请求数量
+ */
+typedef void (request_handler)(http_request_t *req, int status, response_t *resp, int reqleft);
+
+/* 反应堆的配置, 超时时间的单位都是秒 */
+typedef struct reactor_conf_t {
+    int          rc_backlog;                /* 监听套接字的连接队列长度 */
+    int          rc_idle_timeout;           /* 持久连接等待下一个请求的超时时间 */
+    int          rc_header_timeout;         /* 从收到请求的第一个字节到报头完整的超时时间, 收到数据不会延长 */
+    int          rc_send_timeout;           /* 发送响应一直没有进展 (套接字不可写或者 cgi 没有输出) 的超时时间 */
+    int          rc_max_requests;           /* 每个连接最多处理的请求数量 */
+    admit_t     *rc_admit;                  /* 连接准入和请求限速 */
+} reactor_conf_t;
+
+/* 连接状态 */
+enum {
+    CONN_READING = 0,                       /* 正在读取解析请求 */
+    CONN_WRITING,                           /* 正在发送响应 */
+    CONN_WAITING,                           /* 等待其他线程异步填充响应 */
+};
+
+/* 非阻塞 http 连接的状态机 */
+typedef struct conn_t {
+    int              c_fd;                  /* 与客户端连接的套接字 */
+    int              c_state;               /* 连接状态 */
+    int              c_reqleft;             /* 还能处理的请求数量 */
+    int              c_waitfd;              /* 加入 epoll 的 cgi 管道, 没有为 -1 */
+    timer_node_t     c_timer;               /* 空闲, 报头或者发送的超时定时器 */
+    struct reactor_t *c_reactor;            /* 所属的反应堆 */
+    struct conn_t   *c_done_next;           /* 完成队列中的下一结点 */
+    struct conn_t   *c_next;                /* 已关闭链表中的下一结点 */
+    char             c_peer[REACTOR_PEERLEN];   /* 客户端地址, 用于访问日志 */
+    admit_key_t      c_client;              /* 客户端地址, 用于准入控制 */
+    uint64_t         c_parse_start;         /* 当前请求的第一个字节开始解析的时间(纳秒) */
+    http_parser_t    c_parser;              /* 请求解析器, 保存跨多次读取的解析状态 */
+    response_t       c_resp;                /* 正在发送的响应 */
+    rio_t            c_rio;                 /* 读缓冲区 */
+} conn_t;
+
+/* 反应堆, 每个线程一个, 拥有自己的 epoll 实例和 SO_REUSEPORT 监听套接字 */
+typedef struct reactor_t {
+    int              r_epfd;                /* epoll 句柄 */
+    int              r_listenfd;            /* 监听套接字 */
+    pthread_t        r_tid;                 /* 线程 ID */
+    request_handler *r_handler;             /* 请求处理函数 */
+    reactor_conf_t   r_conf;                /* 配置 */
+    size_t           r_nconns;              /* 当前连接数量 */
+    timer_wheel_t    r_timers;              /* 所有连接的超时定时器 */
+    int              r_eventfd;             /* 其他线程完成异步响应时用于唤醒 epoll_wait */
+    pthread_mutex_t  r_done_mutex;          /* 保护完成队列 */
+    conn_t          *r_done;                /* 异步响应已经填充完成, 等待发送的连接 */
+    conn_t          *r_closed;              /* 本轮关闭的连接, 同一轮中可能还有它的管道事件, 处理完之后再释放 */
+} reactor_t;
+
+static volatile sig_atomic_t g_reactor_stop;    /* 收到停止请求, 由信号处理函数设置 */
+
+int  reactor_init(reactor_t *r, char const *host, char const *port, request_handler *handler,
+                  reactor_conf_t const *conf);
+int  reactor_run(int nthreads, char const *host, char const *port, request_handler *handler,
+                 reactor_conf_t const *conf);
+void *reactor_loop(void *arg);
+void reactor_stop(void);
+static void reactor_accept(reactor_t *r);
+static int  reactor_quiesce(reactor_t *r);
+static void reactor_expire(reactor_t *r);
+static void reactor_drain_done(reactor_t *r);
+static void conn_notify(void *arg);
+static void conn_process(reactor_t *r, conn_t *c);
+static void conn_timeout(reactor_t *r, conn_t *c);
+static void conn_arm(reactor_t *r, conn_t *c, int timeout);
+static void conn_watch(reactor_t *r, conn_t *c, int fd);
+static void conn_close(reactor_t *r, conn_t *c);
+
+
+/*
+ * 函数说明:    初始化反应堆, 创建 epoll 实例和 SO_REUSEPORT 监听套接字, 成功返回 0, 失败返回 -1
+ * @r:          反应堆指针
+ * @host:       绑定的主机名(可选)
+ * @port:       绑定的端口号
+ * @handler:    请求处理函数
+ * @conf:       配置
+ */
+int reactor_init(reactor_t *r, char const *host, char const *port, request_handler *handler,
+                 reactor_conf_t const *conf)
+{
+    if (r == NULL || port == NULL || handler == NULL || conf == NULL)
+        return -1;
+
+    bzero(r, sizeof(reactor_t));
+    r->r_handler = handler;
+    r->r_conf = *conf;
+    timer_wheel_init(&r->r_timers);
+    pthread_mutex_init(&r->r_done_mutex, NULL);
+
+    if ((r->r_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return -1;
+
+    /* eventfd 的 data.ptr 为反应堆本身 */
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    if ((r->r_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        close(r->r_epfd);
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = r;
+    if (epoll_ctl(r->r_epfd, EPOLL_CTL_ADD, r->r_eventfd, &ev) < 0) {
+        close(r->r_eventfd);
+        close(r->r_epfd);
+        return -1;
+    }
+
+    if ((r->r_listenfd = open_listenfd_opt(host, port, LISTEN_REUSEPORT | LISTEN_NONBLOCK, conf->rc_backlog)) < 0) {
+        close(r->r_eventfd);
+        close(r->r_epfd);
+        return -1;
+    }
+
+    /* 监听套接字的 data.ptr 为 NULL, 与连接区分 */
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(r->r_epfd, EPOLL_CTL_ADD, r->r_listenfd, &ev) < 0) {
+        close(r->r_listenfd);
+        close(r->r_eventfd);
+        close(r->r_epfd);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    启动 nthreads 个反应堆线程并等待它们结束, 每个线程一个 epoll 实例,
+ *              由内核通过 SO_REUSEPORT 在各个线程的监听套接字之间分配新连接
+ * @nthreads:   线程数量
+ * @host:       绑定的主机名(可选)
+ * @port:       绑定的端口号
+ * @handler:    请求处理函数
+ * @conf:       配置
+ */
+int reactor_run(int nthreads, char const *host, char const *port, request_handler *handler,
+                reactor_conf_t const *conf)
+{
+    if (nthreads <= 0)
+        return -1;
+
+    reactor_t *reactors;
+    if ((reactors = (reactor_t *)calloc(nthreads, sizeof(reactor_t))) == NULL)
+        return -1;
+
+    int started = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        if (reactor_init(&reactors[i], host, port, handler, conf) < 0) {
+            log_printf(LOG_ERROR, "%s: reactor_init(%s) error: %s\n", __func__, port, strerror(errno));
+            break;
+        }
+
+        if (pthread_create(&reactors[i].r_tid, NULL, reactor_loop, &reactors[i]) != 0) {
+            log_printf(LOG_ERROR, "%s: pthread_create error\n", __func__);
+            break;
+        }
+        ++started;
+    }
+
+    for (int i = 0; i < started; ++i)
+        pthread_join(reactors[i].r_tid, NULL);
+
+    free(reactors);
+    return (started == nthreads ? 0 : -1);
+}
+
+
+/*
+ * 函数说明:    反应堆线程例程函数, 循环执行 epoll_wait 并驱动连接的状态机
+ * @arg:        reactor_t 指针
+ */
+void *reactor_loop(void *arg)
+{
+    reactor_t *r = (reactor_t *)arg;
+    struct epoll_event events[REACTOR_MAXEVENTS];
+    int readyn;
+
+    while (1) {
+        if (g_reactor_stop && reactor_quiesce(r))
+            break;
+
+        if ((readyn = epoll_wait(r->r_epfd, events, REACTOR_MAXEVENTS, timer_timeout(&r->r_timers, 1000))) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_printf(LOG_ERROR, "%s: epoll_wait error: %s\n", __func__, strerror(errno));
+            break;
+        }
+
+        /* 完成队列中的连接可能被关闭释放, 等本轮其他事件处理完之后再取出, 避免访问已经释放的连接 */
+        int done = 0;
+        for (int i = 0; i < readyn; ++i) {
+            if (events[i].data.ptr == NULL)
+                reactor_accept(r);
+            else if (events[i].data.ptr == r)
+                done = 1;
+            else
+                conn_process(r, (conn_t *)events[i].data.ptr);
+        }
+        if (done)
+            reactor_drain_done(r);
+
+        reactor_expire(r);
+
+        while (r->r_closed != NULL) {
+            conn_t *c = r->r_closed;
+            r->r_closed = c->c_next;
+            free(c);
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * 函数说明:    请求所有反应堆线程停止: 不再接受新连接, 已有的连接处理完当前请求后关闭,
+ *              所有连接关闭后线程退出. 只设置标志, 可以在信号处理函数中调用
+ */
+void reactor_stop(void)
+{
+    g_reactor_stop = 1;
+}
+
+
+/* (内部函数)
+ * 函数说明:    停止过程中的一步: 第一次调用时取出监听队列中已经完成握手的连接, 然后关闭监听套接字.
+ *              空闲的连接由定时器关闭, 之后发送完响应的连接只等待 REACTOR_DRAIN_IDLE. 所有连接都关闭后返回 1
+ * @r:          反应堆指针
+ */
+static int reactor_quiesce(reactor_t *r)
+{
+    if (r->r_listenfd >= 0) {
+        reactor_accept(r);
+        epoll_ctl(r->r_epfd, EPOLL_CTL_DEL, r->r_listenfd, NULL);
+        close(r->r_listenfd);
+        r->r_listenfd = -1;
+    }
+
+    return (r->r_nconns == 0);
+}
+
+
+/* (内部函数)
+ * 函数说明:    接受监听套接字上所有等待的连接, 创建连接状态机并加入 epoll. 超过连接上限的连接直接回复 503
+ *              后关闭; 文件描述符耗尽时用预留的描述符丢弃等待的连接, 不让监听套接字一直可读
+ * @r:          反应堆指针
+ */
+static void reactor_accept(reactor_t *r)
+{
+    int connfd;
+    struct sockaddr_storage clientaddr;
+    socklen_t addrlen;
+    char hostname[NI_MAXHOST];
+    char port[NI_MAXSERV];
+
+    while (1) {
+        addrlen = sizeof(clientaddr);
+        if ((connfd = accept4(r->r_listenfd, (struct sockaddr *)&clientaddr, &addrlen,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if ((errno == EMFILE || errno == ENFILE)
+                && admit_shed(r->r_conf.rc_admit, r->r_listenfd, ADMIT_HTTP_503, sizeof(ADMIT_HTTP_503) - 1) == 0)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_printf(LOG_ERROR, "%s: accept error: %s\n", __func__, strerror(errno));
+            return;
+        }
+
+        admit_key_t client;
+        admit_key(&client, (struct sockaddr *)&clientaddr);
+        if (admit_connect(r->r_conf.rc_admit, &client) < 0) {
+            admit_reject(connfd, ADMIT_HTTP_503, sizeof(ADMIT_HTTP_503) - 1);
+            continue;
+        }
+
+        conn_t *c;
+        if ((c = (conn_t *)malloc(sizeof(conn_t))) == NULL) {
+            admit_disconnect(r->r_conf.rc_admit, &client);
+            close(connfd);
+            continue;
+        }
+
+        getnameinfo((struct sockaddr *)&clientaddr, addrlen, hostname,
+                    sizeof(hostname), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
+        snprintf(c->c_peer, sizeof(c->c_peer), "%s:%s", hostname, port);
+        log_printf(LOG_DEBUG, "connection from %s\n", c->c_peer);
+        stats_accept();
+
+        set_nodelay(connfd);
+        c->c_fd = connfd;
+        c->c_client = client;
+        c->c_state = CONN_READING;
+        c->c_reactor = r;
+        c->c_reqleft = r->r_conf.rc_max_requests;
+        c->c_waitfd = -1;
+        timer_init(&c->c_timer);
+        c->c_parse_start = 0;
+        http_parser_init(&c->c_parser);
+        response_init(&c->c_resp);
+        rio_readinitb(&c->c_rio, connfd);
+
+        /* 边沿触发同时监听读写, 连接的整个生命周期内不需要再修改 epoll 事件 */
+        struct epoll_event ev;
+        bzero(&ev, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(r->r_epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            admit_disconnect(r->r_conf.rc_admit, &client);
+            close(connfd);
+            free(c);
+            continue;
+        }
+
+        ++r->r_nconns;
+        conn_arm(r, c, (g_reactor_stop ? REACTOR_DRAIN_IDLE : r->r_conf.rc_idle_timeout));
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    处理所有到期的连接定时器
+ * @r:          反应堆指针
+ */
+static void reactor_expire(reactor_t *r)
+{
+    uint64_t now = timer_now();
+    timer_node_t *t;
+    while ((t = timer_expired(&r->r_timers, now)) != NULL)
+        conn_timeout(r, (conn_t *)((char *)t - offsetof(conn_t, c_timer)));
+}
+
+
+/* (内部函数)
+ * 函数说明:    取出完成队列中的所有连接, 继续发送它们的响应
+ * @r:          反应堆指针
+ */
+static void reactor_drain_done(reactor_t *r)
+{
+    uint64_t cnt;
+    while (read(r->r_eventfd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&r->r_done_mutex);
+    conn_t *c = r->r_done;
+    r->r_done = NULL;
+    pthread_mutex_unlock(&r->r_done_mutex);
+
+    while (c != NULL) {
+        conn_t *next = c->c_done_next;
+        c->c_state = CONN_WRITING;
+        conn_process(r, c);
+        c = next;
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    异步响应的通知函数, 在填充响应的线程中调用: 将连接加入所属反应堆的完成队列并唤醒反应堆
+ * @arg:        conn_t 指针
+ */
+static void conn_notify(void *arg)
+{
+    conn_t *c = (conn_t *)arg;
+    reactor_t *r = c->c_reactor;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&r->r_done_mutex);
+    c->c_done_next = r->r_done;
+    r->r_done = c;
+    pthread_mutex_unlock(&r->r_done_mutex);
+
+    while (write(r->r_eventfd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+
+/* (内部函数)
+ * 函数说明:    驱动连接状态机: 读取并解析请求, 调用请求处理函数, 发送响应, 直到套接字返回 EAGAIN.
+ *              已经在缓冲区中的流水线请求会在上一个响应发送完成后直接处理
+ * @r:          反应堆指针
+ * @c:          连接指针
+ */
+static void conn_process(reactor_t *r, conn_t *c)
+{
+    http_request_t req;
+    ssize_t nread;
+    int consumed;
+    int status;
+    int ret;
+
+    if (c->c_fd < 0)
+        return;                             /* 本轮中已经被关闭 */
+
+    if (c->c_state == CONN_WAITING)
+        return;                             /* 响应填充完成之后由完成队列继续处理 */
+
+    while (1) {
+        if (c->c_state == CONN_READING) {
+            status = 0;
+
+            /* 收到请求的第一个字节时开始计算报头超时, 之后收到数据不会延长, 慢速发送报头的客户端不能一直占用连接 */
+            if (c->c_parse_start == 0 && c->c_rio.rio_cnt > 0) {
+                c->c_parse_start = stats_now();
+                conn_arm(r, c, r->r_conf.rc_header_timeout);
+            }
+            consumed = http_parse(&c->c_parser, c->c_rio.rio_bufptr, c->c_rio.rio_cnt);
+            if (consumed == 0) {
+                if ((nread = rio_fill(&c->c_rio)) > 0)
+                    continue;
+
+                if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    return;                 /* 等待更多数据 */
+
+                if (nread < 0 && errno == ENOBUFS) {
+                    status = 431;
+                } else {
+                    conn_close(r, c);       /* 对端关闭或出错 */
+                    return;
+                }
+            } else if (consumed < 0)
+                status = c->c_parser.p_error;
+            else if (admit_request(r->r_conf.rc_admit, &c->c_client) < 0)
+                status = 429;               /* 超过客户端的请求速率, 回复 429 后关闭 */
+
+            response_init(&c->c_resp);
+            c->c_resp.r_notify = conn_notify;
+            c->c_resp.r_notify_arg = c;
+            c->c_resp.r_parse_ns = stats_now() - c->c_parse_start;
+            if (status == 0) {
+                http_parser_request(&c->c_parser, c->c_rio.rio_bufptr, &req);
+                r->r_handler(&req, 0, &c->c_resp, --c->c_reqleft);
+                c->c_rio.rio_bufptr += consumed;
+                c->c_rio.rio_cnt -= consumed;
+            } else
+                r->r_handler(NULL, status, &c->c_resp, 0);
+
+            /* 异步填充响应期间连接还被其他线程引用, 不能超时关闭. 进程池保证在请求超时后完成响应 */
+            if (c->c_resp.r_async) {
+                timer_cancel(&r->r_timers, &c->c_timer);
+                c->c_state = CONN_WAITING;
+                return;
+            }
+            c->c_state = CONN_WRITING;
+        }
+
+        /* 等待 EPOLLOUT, 或者等待 cgi 管道可读. 每次有进展都重新计算发送超时 */
+        if ((ret = response_write(c->c_fd, &c->c_resp)) == 0) {
+            conn_arm(r, c, r->r_conf.rc_send_timeout);
+            if (c->c_resp.r_waitfd >= 0 && c->c_resp.r_waitfd != c->c_waitfd)
+                conn_watch(r, c, c->c_resp.r_waitfd);
+            return;
+        }
+
+        conn_watch(r, c, -1);
+        stats_response(&c->c_resp);
+        response_log(&c->c_resp, c->c_peer);
+        response_release(&c->c_resp);
+        if (ret < 0 || !c->c_resp.r_keepalive) {
+            conn_close(r, c);
+            return;
+        }
+
+        c->c_state = CONN_READING;
+        c->c_parse_start = 0;
+        http_parser_init(&c->c_parser);
+        conn_arm(r, c, (g_reactor_stop ? REACTOR_DRAIN_IDLE : r->r_conf.rc_idle_timeout));
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    连接的定时器到期: 等待下一个请求时直接关闭; 报头没有在时限内收完时回复 408 后关闭;
+ *              发送响应没有进展时以 RST 关闭
+ * @r:          反应堆指针
+ * @c:          连接指针
+ */
+static void conn_timeout(reactor_t *r, conn_t *c)
+{
+    if (c->c_state == CONN_READING && c->c_parse_start != 0) {
+        log_printf(LOG_WARN, "%s: request header timeout\n", c->c_peer);
+        response_init(&c->c_resp);
+        c->c_resp.r_parse_ns = stats_now() - c->c_parse_start;
+        r->r_handler(NULL, 408, &c->c_resp, 0);
+        c->c_state = CONN_WRITING;
+        conn_process(r, c);
+        return;
+    }
+
+    /* 不读取响应的客户端: 以 RST 关闭, 内核直接丢弃发送队列中的数据, 而不是继续尝试发送 */
+    if (c->c_state == CONN_WRITING) {
+        struct linger lg = { 1, 0 };
+        log_printf(LOG_WARN, "%s: send timeout\n", c->c_peer);
+        setsockopt(c->c_fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    conn_close(r, c);
+}
+
+
+/* (内部函数)
+ * 函数说明:    启动连接的定时器, 已经启动的重新计时
+ * @r:          反应堆指针
+ * @c:          连接指针
+ * @timeout:    超时时间(秒)
+ */
+static void conn_arm(reactor_t *r, conn_t *c, int timeout)
+{
+    timer_arm(&r->r_timers, &c->c_timer, timer_now(), (unsigned)timeout * 1000);
+}
+
+
+/* (内部函数)
+ * 函数说明:    把响应等待的 cgi 管道加入 epoll (边沿触发, 事件的 data.ptr 同样为连接), 替换之前加入的管道.
+ *              fd 为 -1 时只移除之前的管道. 其他进程 fork 时可能持有管道的副本, 关闭之前必须显式移除
+ * @r:          反应堆指针
+ * @c:          连接指针
+ * @fd:         管道的读端
+ */
+static void conn_watch(reactor_t *r, conn_t *c, int fd)
+{
+    if (c->c_waitfd >= 0)
+        epoll_ctl(r->r_epfd, EPOLL_CTL_DEL, c->c_waitfd, NULL);
+    c->c_waitfd = -1;
+
+    if (fd < 0)
+        return;
+
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(r->r_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_printf(LOG_ERROR, "%s: epoll_ctl error: %s\n", __func__, strerror(errno));
+        conn_close(r, c);
+        return;
+    }
+    c->c_waitfd = fd;
+}
+
+
+/* (内部函数)
+ * 函数说明:    关闭连接, 释放连接占用的资源. 连接结构放入 r_closed, 本轮事件处理完之后释放
+ * @r:          反应堆指针
+ * @c:          连接指针
+ */
+static void conn_close(reactor_t *r, conn_t *c)
+{
+    timer_cancel(&r->r_timers, &c->c_timer);
+    --r->r_nconns;
+
+    /* cgi 子进程可能还持有套接字的副本, 需要显式从 epoll 中移除 */
+    conn_watch(r, c, -1);
+    epoll_ctl(r->r_epfd, EPOLL_CTL_DEL, c->c_fd, NULL);
+    response_release(&c->c_resp);
+    close(c->c_fd);
+    admit_disconnect(r->r_conf.rc_admit, &c->c_client);
+
+    c->c_fd = -1;
+    c->c_next = r->r_closed;
+    r->r_closed = c;
+}
+
+#endif
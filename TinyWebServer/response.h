@@ -0,0 +1,680 @@
+#ifndef _RESPONSE_H_
+#define _RESPONSE_H_
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "log.h"
+
+#define RESP_HDRLEN     1024                /* 响应报头缓冲区大小 */
+#define RESP_BODYLEN    2048                /* 内联响应主体缓冲区大小 (错误页面, multipart 分段报头) */
+#define RESP_MAXSEG     24                  /* 一个响应最多包含的数据段数量 */
+#define RESP_REQLINE    192                 /* 访问日志中保存的请求行长度 */
+#define RESP_FRAMELEN   32                  /* 分块编码的分块报头和结尾 */
+
+/* 数据段类型 */
+enum {
+    SEG_MEM = 0,                            /* 内存中的数据 */
+    SEG_FILE,                               /* 文件中的数据, 使用 sendfile 发送 */
+    SEG_PIPE,                               /* 管道中长度未知的数据 (cgi 输出), 使用 splice 转发 */
+};
+
+/* 管道段的转发状态 */
+enum {
+    PIPE_HEAD = 0,                          /* 读取 cgi 报头 */
+    PIPE_SEND,                              /* 发送内存中的数据 (响应报头, 分块报头和结尾) */
+    PIPE_BODY,                              /* 把管道中的数据 splice 到套接字 */
+};
+
+struct response_t;
+
+/*
+ * 管道段的报头转换函数: 把 cgi 输出的报头 (以空行结束) 转换为 http 响应报头, 写入 r->r_hdr,
+ * 返回响应报头的长度, 出错返回 -1. cgi 没有输出合法的报头时 head 为 NULL, 此时应当在 r->r_hdr 中
+ * 生成完整的错误响应 (报头和正文)
+ * @r:          响应指针
+ * @head:       cgi 报头, 包括结尾的空行
+ * @len:        cgi 报头长度
+ */
+typedef int (response_head)(struct response_t *r, char *head, size_t len);
+
+/* 响应中的一段数据 */
+typedef struct resp_seg_t {
+    int          s_type;                    /* 数据段类型 */
+    char const  *s_data;                    /* SEG_MEM: 数据起始地址 */
+    int          s_fd;                      /* SEG_FILE: 文件描述符 */
+    off_t        s_off;                     /* SEG_FILE: 下一个发送字节的文件偏移 */
+    size_t       s_len;                     /* 剩余未发送的字节数量 */
+    void        *s_map;                     /* 退回 mmap 方式时映射的地址 */
+    size_t       s_maplen;                  /* 映射的长度 */
+    int          s_state;                   /* SEG_PIPE: 转发状态 */
+    int          s_chunked;                 /* SEG_PIPE: 是否使用分块编码, 否则由关闭连接结束响应 */
+    int          s_eof;                     /* SEG_PIPE: 管道的写端已经关闭, 发送完内存中的数据后结束 */
+    int          s_started;                 /* SEG_PIPE: 已经发送过分块, 下一个分块报头之前需要 CRLF */
+    size_t       s_chunk;                   /* SEG_PIPE: 当前分块中还没有转发的字节数量 */
+    size_t       s_got;                     /* SEG_PIPE: 已经读入 r_body 的 cgi 报头字节数量 */
+    response_head *s_head;                  /* SEG_PIPE: 报头转换函数 */
+    struct iovec s_iov[3];                  /* SEG_PIPE: 等待发送的内存数据 */
+    int          s_iovcnt;                  /* SEG_PIPE: 等待发送的内存数据数量 */
+    char         s_frame[RESP_FRAMELEN];    /* SEG_PIPE: 分块报头和结尾 */
+} resp_seg_t;
+
+/*
+ * 一个待发送的响应, 由若干数据段组成. 发送过程可以被 EAGAIN 打断,
+ * 下次调用 response_write 时从中断的位置继续发送
+ */
+typedef struct response_t {
+    char         r_hdr[RESP_HDRLEN];        /* 响应报头 */
+    size_t       r_hdrlen;                  /* r_hdr 中已经由 response_append 追加的字节数量 */
+    char         r_body[RESP_BODYLEN];      /* 内联的响应主体(错误页面等) */
+    resp_seg_t   r_segs[RESP_MAXSEG];       /* 数据段 */
+    int          r_nsegs;                   /* 数据段数量 */
+    int          r_cur;                     /* 当前正在发送的数据段 */
+    int          r_keepalive;               /* 发送完成后是否保持连接 */
+    void       (*r_cleanup)(void *);        /* 发送完成后调用的清理函数 (释放缓存引用等), 没有为 NULL */
+    void        *r_cleanup_arg;             /* 清理函数的参数 */
+    int          r_async;                   /* 响应由其他线程异步填充, 填充完成之前不能发送 */
+    void       (*r_notify)(void *);         /* 异步响应填充完成时的通知函数 */
+    void        *r_notify_arg;              /* 通知函数的参数 */
+    int          r_status;                  /* 状态码, 由第一个数据段中的状态行得到, 用于访问日志 */
+    size_t       r_length;                  /* 响应的总字节数 */
+    struct timespec r_start;                /* 开始处理请求的时间 */
+    char         r_reqline[RESP_REQLINE];   /* 请求行, 用于访问日志 */
+    uint64_t     r_parse_ns;                /* 读取解析请求报头的耗时(纳秒), 用于统计 */
+    uint64_t     r_fs_ns;                   /* stat / open 的耗时(纳秒), 用于统计 */
+    uint64_t     r_send_start;              /* 第一次调用 response_write 的时间(纳秒), 用于统计 */
+    int          r_waitfd;                  /* response_write 返回 0 时, 等待可读的管道, 等待套接字可写为 -1 */
+} response_t;
+
+void response_init(response_t *r);
+int  response_add_mem(response_t *r, char const *data, size_t len);
+int  response_add_file(response_t *r, int fd, off_t off, size_t len);
+int  response_add_pipe(response_t *r, int fd, int chunked, response_head *head);
+int  response_append(response_t *r, char const *data, size_t len);
+int  response_append_str(response_t *r, char const *str);
+int  response_append_num(response_t *r, unsigned long long num);
+int  response_write(int fd, response_t *r);
+int  response_iov(response_t *r, struct iovec *iov, int max);
+void response_advance(response_t *r, size_t n);
+void response_release(response_t *r);
+void response_complete(response_t *r);
+void response_log(response_t const *r, char const *peer);
+static void response_send_start(response_t *r);
+static int response_mmap_seg(resp_seg_t *seg);
+static int response_pipe(int fd, response_t *r, resp_seg_t *seg);
+static int response_pipe_head(response_t *r, resp_seg_t *seg);
+static void response_pipe_frame(resp_seg_t *seg, size_t len);
+static int response_parse_status(char const *data, size_t len);
+
+
+/*
+ * 函数说明:    初始化响应结构
+ * @r:          响应指针
+ */
+void response_init(response_t *r)
+{
+    r->r_hdr[0] = '\0';
+    r->r_hdrlen = 0;
+    r->r_nsegs = 0;
+    r->r_cur = 0;
+    r->r_keepalive = 0;
+    r->r_cleanup = NULL;
+    r->r_cleanup_arg = NULL;
+    r->r_async = 0;
+    r->r_status = 0;
+    r->r_length = 0;
+    r->r_reqline[0] = '\0';
+    r->r_parse_ns = 0;
+    r->r_fs_ns = 0;
+    r->r_send_start = 0;
+    r->r_waitfd = -1;
+}
+
+
+/*
+ * 函数说明:    在响应末尾添加一段内存数据, 数据在响应发送完成之前必须有效
+ * @r:          响应指针
+ * @data:       数据起始地址
+ * @len:        数据长度
+ */
+int response_add_mem(response_t *r, char const *data, size_t len)
+{
+    if (r == NULL || r->r_nsegs >= RESP_MAXSEG)
+        return -1;
+
+    /* 第一个数据段是状态行 */
+    if (r->r_nsegs == 0)
+        r->r_status = response_parse_status(data, len);
+
+    r->r_length += len;
+    resp_seg_t *seg = &r->r_segs[r->r_nsegs++];
+    bzero(seg, sizeof(resp_seg_t));
+    seg->s_type = SEG_MEM;
+    seg->s_data = data;
+    seg->s_fd = -1;
+    seg->s_len = len;
+    return 0;
+}
+
+
+/*
+ * 函数说明:    在响应末尾添加一段文件数据
+ * @r:          响应指针
+ * @fd:         文件描述符
+ * @off:        文件中的起始偏移
+ * @len:        数据长度
+ */
+int response_add_file(response_t *r, int fd, off_t off, size_t len)
+{
+    if (r == NULL || fd < 0 || r->r_nsegs >= RESP_MAXSEG)
+        return -1;
+
+    r->r_length += len;
+    resp_seg_t *seg = &r->r_segs[r->r_nsegs++];
+    bzero(seg, sizeof(resp_seg_t));
+    seg->s_type = SEG_FILE;
+    seg->s_fd = fd;
+    seg->s_off = off;
+    seg->s_len = len;
+    return 0;
+}
+
+
+/*
+ * 函数说明:    在响应末尾添加一个管道段, 转发管道中的全部数据直到写端关闭. 管道中首先是 cgi 报头,
+ *              由 head 转换为响应报头之后, 数据使用 splice 零拷贝转发. 管道应当是非阻塞的,
+ *              由响应负责关闭. 响应报头写在 r_hdr 中, 正文之前不能再有其他数据段
+ * @r:          响应指针
+ * @fd:         管道的读端
+ * @chunked:    是否使用分块编码, 为 0 时由关闭连接结束响应
+ * @head:       报头转换函数
+ */
+int response_add_pipe(response_t *r, int fd, int chunked, response_head *head)
+{
+    if (r == NULL || fd < 0 || head == NULL || r->r_nsegs >= RESP_MAXSEG)
+        return -1;
+
+    resp_seg_t *seg = &r->r_segs[r->r_nsegs++];
+    bzero(seg, sizeof(resp_seg_t));
+    seg->s_type = SEG_PIPE;
+    seg->s_fd = fd;
+    seg->s_state = PIPE_HEAD;
+    seg->s_chunked = chunked;
+    seg->s_head = head;
+    return 0;
+}
+
+
+/*
+ * 函数说明:    在 r_hdr 末尾追加数据, 用于逐段拼接响应报头, 不需要像 sprintf 那样反复扫描已有的内容.
+ *              拼接完成后由调用者把 [开始时的 r_hdrlen, r_hdrlen) 作为内存段加入响应. 空间不足时不追加, 返回 -1
+ * @r:          响应指针
+ * @data:       数据起始地址
+ * @len:        数据长度
+ */
+int response_append(response_t *r, char const *data, size_t len)
+{
+    if (len > RESP_HDRLEN - r->r_hdrlen)
+        return -1;
+
+    memcpy(r->r_hdr + r->r_hdrlen, data, len);
+    r->r_hdrlen += len;
+    return 0;
+}
+
+
+/*
+ * 函数说明:    在 r_hdr 末尾追加字符串
+ * @r:          响应指针
+ * @str:        字符串
+ */
+int response_append_str(response_t *r, char const *str)
+{
+    return response_append(r, str, strlen(str));
+}
+
+
+/*
+ * 函数说明:    在 r_hdr 末尾追加十进制数字
+ * @r:          响应指针
+ * @num:        数字
+ */
+int response_append_num(response_t *r, unsigned long long num)
+{
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    do {
+        *--p = (char)('0' + num % 10);
+        num /= 10;
+    } while (num != 0);
+
+    return response_append(r, p, digits + sizeof(digits) - p);
+}
+
+
+/*
+ * 函数说明:    发送响应, 连续的内存段合并为一次 writev, 文件段使用 sendfile 发送,
+ *              文件不支持 sendfile 时退回到 mmap 方式, 管道段使用 splice 转发. 全部发送完成返回 1,
+ *              非阻塞套接字暂时不可写, 或者管道暂时没有数据 (r_waitfd 为管道) 时返回 0, 出错返回 -1
+ * @fd:         与客户端连接的套接字
+ * @r:          响应指针
+ */
+int response_write(int fd, response_t *r)
+{
+    if (r == NULL)
+        return -1;
+
+    response_send_start(r);
+
+    ssize_t n;
+    r->r_waitfd = -1;
+    while (r->r_cur < r->r_nsegs) {
+        resp_seg_t *seg = &r->r_segs[r->r_cur];
+
+        /* 管道段的长度事先未知, 由 response_pipe 判断是否转发完成 */
+        if (seg->s_type == SEG_PIPE) {
+            int ret;
+            if ((ret = response_pipe(fd, r, seg)) <= 0)
+                return ret;
+            ++r->r_cur;
+            continue;
+        }
+
+        if (seg->s_len == 0) {
+            ++r->r_cur;
+            continue;
+        }
+
+        /* 内存段 */
+        if (seg->s_type == SEG_MEM) {
+            struct iovec iov[RESP_MAXSEG];
+            int iovcnt = response_iov(r, iov, RESP_MAXSEG);
+
+            if ((n = writev(fd, iov, iovcnt)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+            }
+
+            response_advance(r, n);
+
+        /* 文件段 */
+        } else {
+            if ((n = sendfile(fd, seg->s_fd, &seg->s_off, seg->s_len)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                if ((errno == EINVAL || errno == ENOSYS) && response_mmap_seg(seg) == 0)
+                    continue;
+                return -1;
+            } else if (n == 0)              /* 文件被截断 */
+                return -1;
+
+            seg->s_len -= n;
+        }
+    }
+
+    return 1;
+}
+
+
+/*
+ * 函数说明:    收集从当前数据段开始的连续内存段, 供调用者自行发送 (例如提交给 io_uring), 发送之后调用
+ *              response_advance. 返回 iovec 的数量, 当前数据段不是内存段或者响应已经发送完成时返回 0,
+ *              此时应当调用 response_write
+ * @r:          响应指针
+ * @iov:        传出的 iovec 数组
+ * @max:        数组长度
+ */
+int response_iov(response_t *r, struct iovec *iov, int max)
+{
+    response_send_start(r);
+
+    /* 跳过已经发送完的数据段, 管道段的长度事先未知, 不能跳过 */
+    while (r->r_cur < r->r_nsegs && r->r_segs[r->r_cur].s_type != SEG_PIPE && r->r_segs[r->r_cur].s_len == 0)
+        ++r->r_cur;
+
+    int iovcnt = 0;
+    for (int i = r->r_cur; i < r->r_nsegs && iovcnt < max; ++i) {
+        resp_seg_t *seg = &r->r_segs[i];
+        if (seg->s_type != SEG_MEM || seg->s_len == 0)
+            break;
+        iov[iovcnt].iov_base = (void *)seg->s_data;
+        iov[iovcnt].iov_len = seg->s_len;
+        ++iovcnt;
+    }
+
+    return iovcnt;
+}
+
+
+/*
+ * 函数说明:    记录从当前数据段开始已经发送了 n 个字节, n 不超过 response_iov 返回的总长度
+ * @r:          响应指针
+ * @n:          已经发送的字节数量
+ */
+void response_advance(response_t *r, size_t n)
+{
+    for (int i = r->r_cur; n > 0 && i < r->r_nsegs; ++i) {
+        size_t cnt = (n < r->r_segs[i].s_len ? n : r->r_segs[i].s_len);
+        r->r_segs[i].s_data += cnt;
+        r->r_segs[i].s_len -= cnt;
+        n -= cnt;
+    }
+}
+
+
+/*
+ * 函数说明:    释放响应占用的资源 (映射的内存, 需要关闭的文件, 清理函数)
+ * @r:          响应指针
+ */
+void response_release(response_t *r)
+{
+    for (int i = 0; i < r->r_nsegs; ++i) {
+        if (r->r_segs[i].s_map != NULL) {
+            munmap(r->r_segs[i].s_map, r->r_segs[i].s_maplen);
+            r->r_segs[i].s_map = NULL;
+        }
+        if (r->r_segs[i].s_type == SEG_PIPE && r->r_segs[i].s_fd >= 0) {
+            close(r->r_segs[i].s_fd);
+            r->r_segs[i].s_fd = -1;
+        }
+    }
+
+    if (r->r_cleanup != NULL)
+        r->r_cleanup(r->r_cleanup_arg);
+
+    r->r_cleanup = NULL;
+    r->r_nsegs = 0;
+    r->r_cur = 0;
+}
+
+
+/*
+ * 函数说明:    异步填充响应的一方在填充完成后调用, 通知等待发送的一方.
+ *              r_notify 和 r_notify_arg 由发送方在调用请求处理函数之前设置
+ * @r:          响应指针
+ */
+void response_complete(response_t *r)
+{
+    if (r->r_notify != NULL)
+        r->r_notify(r->r_notify_arg);
+}
+
+
+/*
+ * 函数说明:    响应发送完成 (或者发送出错) 后写一条访问日志: 客户端地址, 时间, 请求行, 状态码,
+ *              响应字节数和从开始处理请求到发送完成的时间(微秒)
+ * @r:          响应指针
+ * @peer:       客户端地址
+ */
+void response_log(response_t const *r, char const *peer)
+{
+    if (g_log.l_level < LOG_INFO)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long usec = (now.tv_sec - r->r_start.tv_sec) * 1000000LL + (now.tv_nsec - r->r_start.tv_nsec) / 1000;
+
+    log_write(LOG_INFO, "%s - - [%s] \"%s\" %d %zu %lld\n", peer, log_date(),
+              (r->r_reqline[0] != '\0' ? r->r_reqline : "-"), r->r_status, r->r_length, usec);
+}
+
+
+/* (内部函数)
+ * 函数说明:    第一次发送时记录开始发送的时间
+ * @r:          响应指针
+ */
+static void response_send_start(response_t *r)
+{
+    if (r->r_send_start == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        r->r_send_start = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    文件不支持 sendfile 时, 使用 mmap 映射文件段剩余的部分, 并将其转换为内存段
+ * @seg:        文件数据段
+ */
+static int response_mmap_seg(resp_seg_t *seg)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t start = seg->s_off - seg->s_off % pagesize;
+    size_t maplen = seg->s_len + (seg->s_off - start);
+
+    void *map;
+    if ((map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, seg->s_fd, start)) == MAP_FAILED)
+        return -1;
+
+    seg->s_type = SEG_MEM;
+    seg->s_map = map;
+    seg->s_maplen = maplen;
+    seg->s_data = (char const *)map + (seg->s_off - start);
+    return 0;
+}
+
+/* (内部函数)
+ * 函数说明:    转发管道段: 读取 cgi 报头并发送响应报头, 之后每次取管道中已有的数据作为一个分块,
+ *              分块报头用 MSG_MORE 发送, 与随后 splice 的数据合并成报文. 管道写端关闭时发送结束分块.
+ *              转发完成返回 1, 套接字不可写或者管道为空返回 0, 出错返回 -1
+ * @fd:         与客户端连接的套接字
+ * @r:          响应指针
+ * @seg:        管道段
+ */
+static int response_pipe(int fd, response_t *r, resp_seg_t *seg)
+{
+    ssize_t n;
+    int avail;
+
+    while (1) {
+        switch (seg->s_state) {
+        case PIPE_HEAD:
+            if ((n = response_pipe_head(r, seg)) == 0)
+                return 0;
+
+            /* 还没有发送任何数据, 可以改为发送错误响应 */
+            if (n < 0) {
+                int len;
+                if ((len = seg->s_head(r, NULL, 0)) < 0)
+                    return -1;
+                r->r_status = response_parse_status(r->r_hdr, len);
+                seg->s_iov[0].iov_base = r->r_hdr;
+                seg->s_iov[0].iov_len = len;
+                seg->s_iovcnt = 1;
+                seg->s_eof = 1;
+            }
+            seg->s_state = PIPE_SEND;
+            break;
+
+        case PIPE_SEND:
+            if (seg->s_iovcnt > 0) {
+                struct msghdr msg;
+                bzero(&msg, sizeof(msg));
+                msg.msg_iov = seg->s_iov;
+                msg.msg_iovlen = seg->s_iovcnt;
+                if ((n = sendmsg(fd, &msg, (seg->s_eof ? 0 : MSG_MORE))) < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+                }
+
+                r->r_length += n;
+                while (seg->s_iovcnt > 0 && (size_t)n >= seg->s_iov[0].iov_len) {
+                    n -= seg->s_iov[0].iov_len;
+                    memmove(seg->s_iov, seg->s_iov + 1, --seg->s_iovcnt * sizeof(struct iovec));
+                }
+                if (seg->s_iovcnt > 0) {
+                    seg->s_iov[0].iov_base = (char *)seg->s_iov[0].iov_base + n;
+                    seg->s_iov[0].iov_len -= n;
+                }
+                continue;
+            }
+
+            if (seg->s_eof)
+                return 1;
+            seg->s_state = PIPE_BODY;
+            break;
+
+        case PIPE_BODY:
+            if (seg->s_chunk > 0) {
+                if ((n = splice(seg->s_fd, NULL, fd, NULL, seg->s_chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+                } else if (n == 0)
+                    return -1;
+
+                r->r_length += n;
+                seg->s_chunk -= n;
+                continue;
+            }
+
+            /* 当前分块转发完成, 管道中已有的数据作为下一个分块 */
+            if (ioctl(seg->s_fd, FIONREAD, &avail) < 0)
+                return -1;
+            if (avail > 0) {
+                seg->s_chunk = avail;
+                if (seg->s_chunked) {
+                    response_pipe_frame(seg, avail);
+                    seg->s_state = PIPE_SEND;
+                }
+                continue;
+            }
+
+            /* 管道为空: 写端关闭表示 cgi 输出结束, 否则等待管道可读 */
+            struct pollfd pfd = { seg->s_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 0) < 0 && errno != EINTR)
+                return -1;
+            if (pfd.revents & POLLIN)
+                continue;
+            if (!(pfd.revents & (POLLHUP | POLLERR))) {
+                r->r_waitfd = seg->s_fd;
+                return 0;
+            }
+
+            seg->s_eof = 1;
+            if (!seg->s_chunked)
+                return 1;
+            response_pipe_frame(seg, 0);
+            seg->s_state = PIPE_SEND;
+            break;
+        }
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    读取 cgi 报头到 r_body 中, 读到空行之后调用报头转换函数, 把响应报头和已经读入的正文
+ *              放入待发送的内存数据. 完成返回 1, 管道为空返回 0, 报头过长, 格式错误或者 cgi 没有输出
+ *              报头就退出返回 -1
+ * @r:          响应指针
+ * @seg:        管道段
+ */
+static int response_pipe_head(response_t *r, resp_seg_t *seg)
+{
+    ssize_t n;
+    char *end = NULL;
+
+    while (end == NULL) {
+        if (seg->s_got >= RESP_BODYLEN)
+            return -1;
+
+        if ((n = read(seg->s_fd, r->r_body + seg->s_got, RESP_BODYLEN - seg->s_got)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                r->r_waitfd = seg->s_fd;
+                return 0;
+            }
+            return -1;
+        } else if (n == 0)
+            return -1;
+
+        /* 从新读入数据之前的 3 个字节开始查找空行, 空行可能跨越两次读取 */
+        size_t from = (seg->s_got > 3 ? seg->s_got - 3 : 0);
+        seg->s_got += n;
+        for (char *p = r->r_body + from; p < r->r_body + seg->s_got; ++p) {
+            if (*p != '\n')
+                continue;
+            if (p + 1 < r->r_body + seg->s_got && p[1] == '\n') {
+                end = p + 2;
+                break;
+            }
+            if (p + 2 < r->r_body + seg->s_got && p[1] == '\r' && p[2] == '\n') {
+                end = p + 3;
+                break;
+            }
+        }
+    }
+
+    size_t headlen = end - r->r_body;
+    int hdrlen = seg->s_head(r, r->r_body, headlen);
+    if (hdrlen < 0)
+        return -1;
+    r->r_status = response_parse_status(r->r_hdr, hdrlen);
+
+    seg->s_iov[0].iov_base = r->r_hdr;
+    seg->s_iov[0].iov_len = hdrlen;
+    seg->s_iovcnt = 1;
+
+    /* 和报头一起读入的正文作为第一个分块 */
+    size_t left = seg->s_got - headlen;
+    if (left > 0) {
+        if (seg->s_chunked)
+            response_pipe_frame(seg, left);
+        seg->s_iov[seg->s_iovcnt].iov_base = end;
+        seg->s_iov[seg->s_iovcnt].iov_len = left;
+        ++seg->s_iovcnt;
+    }
+
+    return 1;
+}
+
+
+/* (内部函数)
+ * 函数说明:    生成下一个分块的报头 (之前有分块时加上前一个分块结尾的 CRLF), 放在待发送数据的末尾.
+ *              len 为 0 时生成结束分块
+ * @seg:        管道段
+ * @len:        分块长度
+ */
+static void response_pipe_frame(resp_seg_t *seg, size_t len)
+{
+    int n = snprintf(seg->s_frame, sizeof(seg->s_frame), "%s%zx\r\n%s",
+                     (seg->s_started ? "\r\n" : ""), len, (len == 0 ? "\r\n" : ""));
+
+    seg->s_iov[seg->s_iovcnt].iov_base = seg->s_frame;
+    seg->s_iov[seg->s_iovcnt].iov_len = n;
+    ++seg->s_iovcnt;
+    seg->s_started = 1;
+}
+
+
+/* (内部函数)
+ * 函数说明:    从状态行 "HTTP/1.x NNN" 中解析状态码, 不是状态行返回 0
+ * @data:       数据起始地址
+ * @len:        数据长度
+ */
+static int response_parse_status(char const *data, size_t len)
+{
+    if (len < 12 || strncmp(data, "HTTP/1.", 7) != 0)
+        return 0;
+
+    return (data[9] - '0') * 100 + (data[10] - '0') * 10 + (data[11] - '0');
+}
+
+#endif
@@ -4,7 +4,12 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include "timer.h"
 
 #define RIO_BUFSIZE 8192
 
@@ -12,14 +17,19 @@ typedef struct rio_t {
     int      rio_fd;
     int      rio_cnt;
     char    *rio_bufptr;
+    uint64_t rio_deadline;                  /* rio_fill 的截止时间 (单调时钟, 毫秒), 0 表示不限制 */
     char     rio_buf[RIO_BUFSIZE]; 
 } rio_t;
 
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_sendfilen(int outfd, int infd, off_t *offset, size_t n);
 void    rio_readinitb(rio_t *rp, int fd);
+void    rio_set_deadline(rio_t *rp, int timeout);
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rio_fill(rio_t *rp);
+static  ssize_t rio_refill(rio_t *rp);
 static  ssize_t rio_read(rio_t *fp, char *usrbuf, size_t n);
 
 
@@ -47,7 +57,7 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
             break;
 
         nleft -= nread;
-        bufptr += nleft;
+        bufptr += nread;
     }
 
     return (n - nleft);
@@ -84,6 +94,36 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 
 
+/*
+ * 函数说明:    使用 sendfile 将文件内容直接发送到 outfd, 数据不经过用户空间缓冲区
+ * @outfd:      目的文件描述符(套接字)
+ * @infd:       源文件描述符
+ * @offset:     文件的起始偏移, 返回时更新为发送结束的位置
+ * @n:          发送的字节数量
+ */
+ssize_t rio_sendfilen(int outfd, int infd, off_t *offset, size_t n)
+{
+    if (outfd < 0 || infd < 0 || offset == NULL)
+        return -1;
+
+    size_t nleft = n;
+    ssize_t nsend;
+    while (nleft > 0) {
+        if ((nsend = sendfile(outfd, infd, offset, nleft)) < 0) {
+            if (errno == EINTR)                 /* 被信号中断, 重新发送 */
+                nsend = 0;
+            else 
+                return -1;
+        } else if (nsend == 0)                  /* 文件被截断, 已经没有数据可以发送 */
+            break;
+
+        nleft -= nsend;
+    }
+
+    return (n - nleft);
+}
+
+
 /* 
  * 函数说明:    初始化 rio_t 缓冲区
  * @rpi:        缓冲区指针
@@ -94,20 +134,28 @@ void rio_readinitb(rio_t *rp, int fd)
     rp->rio_fd = fd;
     rp->rio_cnt = 0;
     rp->rio_bufptr = rp->rio_buf;
+    rp->rio_deadline = 0;
 }
 
 
 /*
- * 函数说明:    负责给 rio_t 填充缓冲区, 并将数据拷贝到用户缓冲区中 
+ * 函数说明:    设置之后 rio_fill 的截止时间, 用于限制阻塞套接字上读取一个完整请求的总时间,
+ *              客户端每次只发送几个字节也不能延长. 超时后 rio_fill 返回 -1, errno 为 ETIMEDOUT
  * @rp:         rio_t 缓冲区指针
- * @usrbuf:     数据缓冲区指针
- * @n:          拷贝的字节数量 
+ * @timeout:    从现在开始的超时时间(毫秒), 小于等于 0 表示取消限制
  */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+void rio_set_deadline(rio_t *rp, int timeout)
 {
-    if (rp == NULL || usrbuf == NULL)
-        return -1;
+    rp->rio_deadline = (timeout > 0 ? timer_now() + timeout : 0);
+}
+
 
+/* (内部函数)
+ * 函数说明:    缓冲区为空时重新填充 rio_t 缓冲区, 返回缓冲区中的字节数量, 读到文件尾返回 0, 出错返回 -1
+ * @rp:         rio_t 缓冲区指针
+ */
+static ssize_t rio_refill(rio_t *rp)
+{
     while (rp->rio_cnt <= 0) {
         rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
 
@@ -120,6 +168,25 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
             rp->rio_bufptr = rp->rio_buf;
     }
 
+    return rp->rio_cnt;
+}
+
+
+/*
+ * 函数说明:    负责给 rio_t 填充缓冲区, 并将数据拷贝到用户缓冲区中 
+ * @rp:         rio_t 缓冲区指针
+ * @usrbuf:     数据缓冲区指针
+ * @n:          拷贝的字节数量 
+ */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    if (rp == NULL || usrbuf == NULL)
+        return -1;
+
+    ssize_t ret;
+    if ((ret = rio_refill(rp)) <= 0)
+        return ret;
+
     int cnt = n;
     if (cnt > rp->rio_cnt)
         cnt = rp->rio_cnt;
@@ -130,6 +197,60 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 }
 
 
+/*
+ * 函数说明:    将缓冲区中未读取的数据移动到缓冲区头部, 然后调用一次 read 在其后追加数据.
+ *              未读数据相对于 rio_bufptr 的偏移保持不变, 适用于需要跨多次读取保存解析状态的场景.
+ *              返回读取的字节数量, 读到文件尾返回 0, 出错返回 -1 (非阻塞套接字没有数据时 errno 为 EAGAIN,
+ *              缓冲区已满时 errno 为 ENOBUFS, 超过 rio_set_deadline 设置的截止时间时 errno 为 ETIMEDOUT)
+ * @rp:         rio_t 缓冲区指针
+ */
+ssize_t rio_fill(rio_t *rp)
+{
+    if (rp == NULL)
+        return -1;
+
+    if (rp->rio_cnt <= 0) {
+        rp->rio_cnt = 0;
+        rp->rio_bufptr = rp->rio_buf;
+    } else if (rp->rio_bufptr != rp->rio_buf) {
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+
+    if (rp->rio_cnt >= (int)sizeof(rp->rio_buf)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    /* 设置了截止时间时先等待可读, 剩余时间按截止时间计算 */
+    while (rp->rio_deadline != 0) {
+        uint64_t now = timer_now();
+        if (now >= rp->rio_deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = rp->rio_fd;
+        pfd.events = POLLIN;
+        int ret = poll(&pfd, 1, (int)(rp->rio_deadline - now));
+        if (ret > 0)
+            break;
+        if (ret < 0 && errno != EINTR)
+            return -1;
+    }
+
+    ssize_t nread;
+    while ((nread = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, sizeof(rp->rio_buf) - rp->rio_cnt)) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    rp->rio_cnt += nread;
+    return nread;
+}
+
+
 /*
  * 函数说明:    从 rio 缓冲区中, 读取字节
  * @rp:         rio_t 缓冲区指针
@@ -160,38 +281,49 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 
 /* 
- * 函数说明:    在 rio 缓冲区中读取一行数据 
+ * 函数说明:    在 rio 缓冲区中读取一行数据, 使用 memchr 在缓冲区中查找行尾, 整段拷贝
  * @rp:         指向 rio 缓冲区的指针
  * @usrbuf:     字节缓冲区
  * @maxlen:     最大长度
  */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 {
-    if (rp == NULL || usrbuf == NULL)
+    if (rp == NULL || usrbuf == NULL || maxlen == 0)
         return -1;
 
-    size_t n;
+    size_t n = 0;
     ssize_t nread;
     char *bufptr = (char *)usrbuf;
-    char c;
-    for (n = 1; n < maxlen; ++n) {
-        if ((nread = rio_read(rp, &c, sizeof(c))) == 1) {
-            *bufptr++ = c;
-            if (c == '\n') {
-                ++n;
-                break;
-            } 
-        } else if (nread == 0) {
-            if (n == 1) 
+    while (n < maxlen - 1) {
+        if ((nread = rio_refill(rp)) < 0)
+            return -1;
+        else if (nread == 0) {
+            if (n == 0) 
                 return 0;
             else 
                 break;
-        } else 
-            return -1;
+        }
+
+        size_t cnt = maxlen - 1 - n;
+        if (cnt > (size_t)rp->rio_cnt)
+            cnt = rp->rio_cnt;
+
+        char *eol = (char *)memchr(rp->rio_bufptr, '\n', cnt);
+        if (eol != NULL)
+            cnt = eol - rp->rio_bufptr + 1;
+
+        memcpy(bufptr, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        bufptr += cnt;
+        n += cnt;
+
+        if (eol != NULL)
+            break;
     }
 
     *bufptr = '\0';
-    return n - 1;
+    return n;
 }
 
 #endif
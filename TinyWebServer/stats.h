@@ -0,0 +1,293 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "response.h"
+
+#define STATS_MAXCODE       600             /* 记录的状态码范围 [0, STATS_MAXCODE) */
+#define STATS_SUB_BITS      2               /* 每个 2 的幂区间分为 4 个桶, 相对误差不超过 25% */
+#define STATS_SUB           (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS       (STATS_SUB + (64 - STATS_SUB_BITS) * STATS_SUB)
+#define STATS_CACHELINE     64
+
+/* 请求处理的阶段 */
+enum {
+    STATS_PARSE = 0,                        /* 从开始读取请求到报头解析完成 */
+    STATS_FS,                               /* stat 和 open 文件 */
+    STATS_SEND,                             /* 从第一次发送到响应发送完成 */
+    STATS_NSTAGES,
+};
+
+/* 一个阶段的延迟直方图 (纳秒), 对数-线性分桶 */
+typedef struct stats_hist_t {
+    uint64_t     sh_counts[STATS_BUCKETS];  /* 每个桶中的样本数量 */
+    uint64_t     sh_count;                  /* 样本总数 */
+    uint64_t     sh_sum;                    /* 样本的和 */
+    uint64_t     sh_max;                    /* 最大的样本 */
+} stats_hist_t;
+
+/*
+ * 每个线程一份的计数器, 只由所属线程修改, 读取 /__status 时才汇总. 按缓存行对齐分配,
+ * 不同线程的计数器不会共享缓存行
+ */
+typedef struct thread_stats_t {
+    _Alignas(STATS_CACHELINE) uint64_t st_accepted;     /* 接受的连接数量 */
+    uint64_t     st_requests;               /* 完成的请求数量 */
+    uint64_t     st_bytes;                  /* 发送的字节数 */
+    uint64_t     st_codes[STATS_MAXCODE];   /* 按状态码统计的请求数量 */
+    stats_hist_t st_stages[STATS_NSTAGES];  /* 各阶段的延迟直方图 */
+    struct thread_stats_t *st_next;         /* 所有线程的计数器组成的链表 */
+} thread_stats_t;
+
+/* 全局的统计信息 */
+typedef struct server_stats_t {
+    _Atomic(thread_stats_t *) s_threads;    /* 所有线程的计数器链表 */
+    atomic_int   s_cgi_active;              /* 正在转发输出的 cgi 子进程数量 */
+    time_t       s_start;                   /* 服务器启动时间 */
+} server_stats_t;
+
+static server_stats_t g_stats;
+static thread_stats_t g_stats_fallback;     /* 内存不足时使用, 不参与汇总 */
+static __thread thread_stats_t *t_stats;    /* 本线程的计数器 */
+
+/* 计数器只有一个写者, 使用普通的读改写, 原子存储保证读者不会读到撕裂的值 */
+#define STATS_ADD(field, n)     __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define STATS_LOAD(field)       __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void     stats_init(void);
+uint64_t stats_now(void);
+thread_stats_t *stats_thread(void);
+void     stats_accept(void);
+void     stats_record(thread_stats_t *st, int stage, uint64_t ns);
+void     stats_response(response_t const *r);
+size_t   stats_format(char *buf, size_t len);
+static int stats_index(uint64_t value);
+static uint64_t stats_highest(int index);
+static uint64_t stats_quantile(stats_hist_t const *h, double q);
+
+
+/*
+ * 函数说明:    记录服务器启动时间
+ */
+void stats_init(void)
+{
+    g_stats.s_start = time(NULL);
+}
+
+
+/*
+ * 函数说明:    返回单调时钟的当前时间(纳秒)
+ */
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * 函数说明:    返回本线程的计数器, 第一次调用时创建并加入全局链表
+ */
+thread_stats_t *stats_thread(void)
+{
+    if (t_stats != NULL)
+        return t_stats;
+
+    thread_stats_t *st;
+    if (posix_memalign((void **)&st, STATS_CACHELINE, sizeof(thread_stats_t)) != 0)
+        return (t_stats = &g_stats_fallback);
+    bzero(st, sizeof(thread_stats_t));
+
+    st->st_next = atomic_load(&g_stats.s_threads);
+    while (!atomic_compare_exchange_weak(&g_stats.s_threads, &st->st_next, st))
+        ;
+
+    return (t_stats = st);
+}
+
+
+/*
+ * 函数说明:    接受了一个连接
+ */
+void stats_accept(void)
+{
+    thread_stats_t *st = stats_thread();
+    STATS_ADD(st->st_accepted, 1);
+}
+
+
+/*
+ * 函数说明:    在阶段的直方图中记录一个样本
+ * @st:         本线程的计数器
+ * @stage:      阶段
+ * @ns:         耗时(纳秒)
+ */
+void stats_record(thread_stats_t *st, int stage, uint64_t ns)
+{
+    stats_hist_t *h = &st->st_stages[stage];
+    int idx = stats_index(ns);
+
+    STATS_ADD(h->sh_counts[idx], 1);
+    STATS_ADD(h->sh_count, 1);
+    STATS_ADD(h->sh_sum, ns);
+    if (ns > h->sh_max)
+        __atomic_store_n(&h->sh_max, ns, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * 函数说明:    一个响应发送完成 (或者发送出错), 记录状态码, 字节数和各阶段的耗时
+ * @r:          响应指针
+ */
+void stats_response(response_t const *r)
+{
+    thread_stats_t *st = stats_thread();
+
+    STATS_ADD(st->st_requests, 1);
+    STATS_ADD(st->st_bytes, r->r_length);
+    if (r->r_status >= 0 && r->r_status < STATS_MAXCODE)
+        STATS_ADD(st->st_codes[r->r_status], 1);
+
+    if (r->r_parse_ns > 0)
+        stats_record(st, STATS_PARSE, r->r_parse_ns);
+    if (r->r_fs_ns > 0)
+        stats_record(st, STATS_FS, r->r_fs_ns);
+    if (r->r_send_start > 0)
+        stats_record(st, STATS_SEND, stats_now() - r->r_send_start);
+}
+
+
+/*
+ * 函数说明:    汇总所有线程的计数器, 以 Prometheus 文本格式写入 buf, 返回写入的长度
+ * @buf:        存放结果的缓冲区
+ * @len:        缓冲区大小
+ */
+size_t stats_format(char *buf, size_t len)
+{
+    static char const *const stages[STATS_NSTAGES] = { "parse", "fs", "send" };
+    static double const quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    thread_stats_t *sum;
+    size_t used = 0;
+    int nthreads = 0;
+
+    if ((sum = (thread_stats_t *)calloc(1, sizeof(thread_stats_t))) == NULL)
+        return 0;
+
+    for (thread_stats_t *st = atomic_load(&g_stats.s_threads); st != NULL; st = st->st_next, ++nthreads) {
+        sum->st_accepted += STATS_LOAD(st->st_accepted);
+        sum->st_requests += STATS_LOAD(st->st_requests);
+        sum->st_bytes += STATS_LOAD(st->st_bytes);
+        for (int i = 0; i < STATS_MAXCODE; ++i)
+            sum->st_codes[i] += STATS_LOAD(st->st_codes[i]);
+
+        for (int s = 0; s < STATS_NSTAGES; ++s) {
+            stats_hist_t *dst = &sum->st_stages[s];
+            stats_hist_t *src = &st->st_stages[s];
+            for (int i = 0; i < STATS_BUCKETS; ++i)
+                dst->sh_counts[i] += STATS_LOAD(src->sh_counts[i]);
+            dst->sh_count += STATS_LOAD(src->sh_count);
+            dst->sh_sum += STATS_LOAD(src->sh_sum);
+            if (STATS_LOAD(src->sh_max) > dst->sh_max)
+                dst->sh_max = STATS_LOAD(src->sh_max);
+        }
+    }
+
+#define STATS_PRINT(...)                                                    \
+    do {                                                                    \
+        int n_ = snprintf(buf + used, len - used, __VA_ARGS__);             \
+        if (n_ > 0)                                                         \
+            used = ((size_t)n_ < len - used ? used + n_ : len - 1);         \
+    } while (0)
+
+    int cgi = atomic_load(&g_stats.s_cgi_active);
+    STATS_PRINT("tiny_uptime_seconds %ld\n", (long)(time(NULL) - g_stats.s_start));
+    STATS_PRINT("tiny_threads %d\n", nthreads);
+    STATS_PRINT("tiny_connections_accepted_total %llu\n", (unsigned long long)sum->st_accepted);
+    STATS_PRINT("tiny_requests_total %llu\n", (unsigned long long)sum->st_requests);
+    for (int i = 0; i < STATS_MAXCODE; ++i) {
+        if (sum->st_codes[i] > 0)
+            STATS_PRINT("tiny_responses_total{code=\"%d\"} %llu\n", i, (unsigned long long)sum->st_codes[i]);
+    }
+    STATS_PRINT("tiny_bytes_sent_total %llu\n", (unsigned long long)sum->st_bytes);
+    STATS_PRINT("tiny_cgi_children_active %d\n", (cgi > 0 ? cgi : 0));
+
+    for (int s = 0; s < STATS_NSTAGES; ++s) {
+        stats_hist_t const *h = &sum->st_stages[s];
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i)
+            STATS_PRINT("tiny_stage_latency_us{stage=\"%s\",quantile=\"%g\"} %.1f\n", stages[s], quantiles[i],
+                        stats_quantile(h, quantiles[i]) / 1000.0);
+        STATS_PRINT("tiny_stage_latency_us_max{stage=\"%s\"} %.1f\n", stages[s], h->sh_max / 1000.0);
+        STATS_PRINT("tiny_stage_latency_us_sum{stage=\"%s\"} %.1f\n", stages[s], h->sh_sum / 1000.0);
+        STATS_PRINT("tiny_stage_latency_us_count{stage=\"%s\"} %llu\n", stages[s],
+                    (unsigned long long)h->sh_count);
+    }
+
+#undef STATS_PRINT
+
+    free(sum);
+    return used;
+}
+
+
+/* (内部函数)
+ * 函数说明:    返回值所在的桶: 小于 STATS_SUB 的值每个值一个桶, 之后每个 2 的幂区间 STATS_SUB 个桶
+ * @value:      值
+ */
+static int stats_index(uint64_t value)
+{
+    if (value < STATS_SUB)
+        return (int)value;
+
+    int shift = 63 - __builtin_clzll(value) - STATS_SUB_BITS;
+    return STATS_SUB + shift * STATS_SUB + (int)((value >> shift) - STATS_SUB);
+}
+
+
+/* (内部函数)
+ * 函数说明:    返回桶中最大的值
+ * @index:      桶的下标
+ */
+static uint64_t stats_highest(int index)
+{
+    if (index < STATS_SUB)
+        return index;
+
+    int shift = (index - STATS_SUB) / STATS_SUB;
+    uint64_t sub = (index - STATS_SUB) % STATS_SUB + STATS_SUB;
+    return ((sub + 1) << shift) - 1;
+}
+
+
+/* (内部函数)
+ * 函数说明:    返回分位数对应的值 (所在桶的上界, 不超过最大值), 没有样本返回 0
+ * @h:          直方图
+ * @q:          分位数, 0 到 1
+ */
+static uint64_t stats_quantile(stats_hist_t const *h, double q)
+{
+    uint64_t target = (uint64_t)(h->sh_count * q);
+    uint64_t count = 0;
+
+    if (h->sh_count == 0)
+        return 0;
+    if (target == 0)
+        target = 1;
+
+    for (int i = 0; i < STATS_BUCKETS; ++i) {
+        count += h->sh_counts[i];
+        if (count >= target) {
+            uint64_t v = stats_highest(i);
+            return (v < h->sh_max ? v : h->sh_max);
+        }
+    }
+
+    return h->sh_max;
+}
+
+#endif
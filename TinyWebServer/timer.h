@@ -0,0 +1,181 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TIMER_TICK_MS       100             /* 时间轮的刻度(毫秒), 定时器的精度 */
+#define TIMER_SLOTS         512             /* 槽位数量, 必须是 2 的幂. 一圈 51.2 秒, 更远的定时器多转几圈 */
+
+/* 定时器结点, 嵌入到需要定时的结构中, 到期时通过 offsetof 找回外层结构 */
+typedef struct timer_node_t {
+    struct timer_node_t *t_next;            /* 槽位链表中的下一结点 */
+    struct timer_node_t *t_prev;            /* 槽位链表中的上一结点, NULL 表示没有启动 */
+    uint64_t     t_expire;                  /* 到期的刻度 */
+} timer_node_t;
+
+/*
+ * 哈希时间轮: 定时器按到期刻度放入 t_expire % TIMER_SLOTS 号槽位的双向链表, 启动和取消都是 O(1).
+ * 每个刻度只检查一个槽位, 槽位中还没有到期的 (需要再转几圈的) 定时器留在原处. 只由一个线程使用
+ */
+typedef struct timer_wheel_t {
+    timer_node_t w_slots[TIMER_SLOTS];      /* 每个槽位一个双向循环链表的哨兵 */
+    uint64_t     w_tick;                    /* 下一个需要检查的刻度 */
+    size_t       w_count;                   /* 已经启动的定时器数量 */
+} timer_wheel_t;
+
+void     timer_wheel_init(timer_wheel_t *w);
+uint64_t timer_now(void);
+void     timer_init(timer_node_t *t);
+int      timer_armed(timer_node_t const *t);
+void     timer_arm(timer_wheel_t *w, timer_node_t *t, uint64_t now, unsigned timeout);
+void     timer_cancel(timer_wheel_t *w, timer_node_t *t);
+timer_node_t *timer_expired(timer_wheel_t *w, uint64_t now);
+int      timer_timeout(timer_wheel_t const *w, int idle);
+
+
+/*
+ * 函数说明:    初始化时间轮
+ * @w:          时间轮指针
+ */
+void timer_wheel_init(timer_wheel_t *w)
+{
+    for (int i = 0; i < TIMER_SLOTS; ++i)
+        w->w_slots[i].t_next = w->w_slots[i].t_prev = &w->w_slots[i];
+    w->w_tick = timer_now() / TIMER_TICK_MS + 1;
+    w->w_count = 0;
+}
+
+
+/*
+ * 函数说明:    返回单调时钟的当前时间(毫秒)
+ */
+uint64_t timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * 函数说明:    初始化定时器结点, 初始为没有启动
+ * @t:          定时器指针
+ */
+void timer_init(timer_node_t *t)
+{
+    t->t_next = t->t_prev = NULL;
+    t->t_expire = 0;
+}
+
+
+/*
+ * 函数说明:    定时器是否已经启动
+ * @t:          定时器指针
+ */
+int timer_armed(timer_node_t const *t)
+{
+    return (t->t_prev != NULL);
+}
+
+
+/*
+ * 函数说明:    启动定时器, 在 timeout 毫秒之后到期 (向上取整到刻度). 已经启动的定时器重新计时
+ * @w:          时间轮指针
+ * @t:          定时器指针
+ * @now:        当前时间(毫秒), 由 timer_now 得到
+ * @timeout:    超时时间(毫秒)
+ */
+void timer_arm(timer_wheel_t *w, timer_node_t *t, uint64_t now, unsigned timeout)
+{
+    timer_cancel(w, t);
+
+    uint64_t expire = (now + timeout + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (expire < w->w_tick)
+        expire = w->w_tick;
+
+    timer_node_t *head = &w->w_slots[expire & (TIMER_SLOTS - 1)];
+    t->t_expire = expire;
+    t->t_next = head;
+    t->t_prev = head->t_prev;
+    head->t_prev->t_next = t;
+    head->t_prev = t;
+    ++w->w_count;
+}
+
+
+/*
+ * 函数说明:    取消定时器, 没有启动时什么也不做
+ * @w:          时间轮指针
+ * @t:          定时器指针
+ */
+void timer_cancel(timer_wheel_t *w, timer_node_t *t)
+{
+    if (t->t_prev == NULL)
+        return;
+
+    t->t_prev->t_next = t->t_next;
+    t->t_next->t_prev = t->t_prev;
+    t->t_next = t->t_prev = NULL;
+    --w->w_count;
+}
+
+
+/*
+ * 函数说明:    取出一个到期的定时器 (取出后处于没有启动的状态), 没有到期的定时器返回 NULL.
+ *              调用者循环调用直到返回 NULL, 处理到期定时器时可以启动或取消其他定时器
+ * @w:          时间轮指针
+ * @now:        当前时间(毫秒)
+ */
+timer_node_t *timer_expired(timer_wheel_t *w, uint64_t now)
+{
+    uint64_t tick = now / TIMER_TICK_MS;
+
+    /* 没有定时器时直接跳到当前刻度, 长时间空闲之后不需要逐个检查错过的刻度 */
+    if (w->w_count == 0) {
+        if (w->w_tick <= tick)
+            w->w_tick = tick + 1;
+        return NULL;
+    }
+
+    for (; w->w_tick <= tick; ++w->w_tick) {
+        timer_node_t *head = &w->w_slots[w->w_tick & (TIMER_SLOTS - 1)];
+        for (timer_node_t *t = head->t_next; t != head; t = t->t_next) {
+            if (t->t_expire <= w->w_tick) {
+                timer_cancel(w, t);
+                return t;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * 函数说明:    返回 epoll_wait 等使用的超时时间(毫秒): 到下一个非空槽位的刻度为止, 没有定时器时为 idle,
+ *              结果不超过 idle (idle 为 -1 表示不限). 槽位中的定时器可能要再转几圈才到期, 这时只是提前醒来
+ *              检查一次, 每圈最多 TIMER_SLOTS 次, 不会比逐个刻度醒来更频繁
+ * @w:          时间轮指针
+ * @idle:       没有定时器时的超时时间
+ */
+int timer_timeout(timer_wheel_t const *w, int idle)
+{
+    if (w->w_count == 0)
+        return idle;
+
+    uint64_t now = timer_now();
+    for (uint64_t tick = w->w_tick; tick < w->w_tick + TIMER_SLOTS; ++tick) {
+        timer_node_t const *head = &w->w_slots[tick & (TIMER_SLOTS - 1)];
+        if (head->t_next == head)
+            continue;
+
+        uint64_t at = tick * TIMER_TICK_MS;
+        uint64_t timeout = (at > now ? at - now : 0);
+        return (idle >= 0 && timeout > (uint64_t)idle ? idle : (int)timeout);
+    }
+
+    return idle;
+}
+
+#endif
@@ -0,0 +1,796 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * 类似 wrk 的压力测试程序: 每个线程用一个 epoll 驱动若干非阻塞连接, 持续发送 GET 请求 (可以流水线发送),
+ * 记录每个响应的延迟, 结束时合并所有线程的直方图并报告 req/s, bytes/s 和 p50/p90/p99/p99.9 延迟
+ */
+
+#define output_error_message(...)                           \
+        fprintf(stderr, "%s:%d: ", __func__, __LINE__);     \
+        fprintf(stderr, __VA_ARGS__);
+
+#define MAXLINE         1024
+#define BENCH_BUFSIZE   (64 << 10)          /* 每个连接的接收缓冲区大小 */
+#define BENCH_MAXDEPTH  64                  /* 流水线深度上限 */
+#define BENCH_MAXEVENTS 256                 /* 一次 epoll_wait 最多返回的事件数量 */
+#define USAGE           "usage: %s [-t threads] [-c connections] [-d seconds] [-p depth] [-C] url\n" \
+                        "  -t  threads (default 2)\n"                                              \
+                        "  -c  connections, shared by all threads (default 10)\n"                  \
+                        "  -d  duration in seconds (default 10)\n"                                 \
+                        "  -p  requests pipelined on each connection (default 1)\n"                \
+                        "  -C  send Connection: close and reconnect for every request\n"
+
+/*
+ * 延迟直方图, 与 HdrHistogram 相同的对数-线性分桶: 小于 HIST_SUB 的值每个值一个桶,
+ * 之后每个 2 的幂区间分为 HIST_SUB / 2 个桶, 相对误差不超过 1/64. 单位为微秒
+ */
+#define HIST_SUB_BITS   7
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_HALF       (HIST_SUB / 2)
+#define HIST_SIZE       (HIST_SUB + (64 - HIST_SUB_BITS) * HIST_HALF)
+
+typedef struct histogram_t {
+    uint64_t     h_counts[HIST_SIZE];       /* 每个桶中的值的数量 */
+    uint64_t     h_total;                   /* 值的总数 */
+    uint64_t     h_max;                     /* 最大值 */
+    double       h_sum;                     /* 值的和, 用于计算平均值 */
+    double       h_sumsq;                   /* 值的平方和, 用于计算标准差 */
+} histogram_t;
+
+/* 响应解析状态 */
+enum {
+    RESP_HEADER = 0,                        /* 读取响应报头 */
+    RESP_BODY,                              /* 读取 Content-length 指定长度的主体 */
+    RESP_UNTIL_CLOSE,                       /* 没有长度, 读取到连接关闭 */
+    RESP_CHUNK_SIZE,                        /* 读取分块大小行 */
+    RESP_CHUNK_DATA,                        /* 读取分块数据 */
+    RESP_CHUNK_CRLF,                        /* 读取分块数据之后的 CRLF */
+    RESP_TRAILER,                           /* 读取最后一个分块之后的尾部报头 */
+};
+
+/* 一个测试连接 */
+typedef struct bench_conn_t {
+    int          c_fd;                      /* 套接字, 没有连接时为 -1 */
+    int          c_connected;               /* 非阻塞 connect 是否已经完成 */
+    int          c_inflight;                /* 已经发送还没有收到响应的请求数量 */
+    size_t       c_woff;                    /* 当前一批请求已经发送的字节数 */
+    size_t       c_wlen;                    /* 当前一批请求的总字节数 */
+    uint64_t     c_sent;                    /* 当前一批请求开始发送的时间(微秒) */
+    int          c_state;                   /* 响应解析状态 */
+    int          c_close;                   /* 当前响应之后服务器会关闭连接 */
+    long long    c_remain;                  /* 主体或分块剩余的字节数 */
+    size_t       c_len;                     /* 接收缓冲区中的字节数 */
+    char         c_buf[BENCH_BUFSIZE];      /* 接收缓冲区 */
+} bench_conn_t;
+
+/* 一个测试线程 */
+typedef struct bench_thread_t {
+    pthread_t    t_tid;                     /* 线程 ID */
+    int          t_epfd;                    /* epoll 句柄 */
+    int          t_nconns;                  /* 连接数量 */
+    bench_conn_t *t_conns;                  /* 连接数组 */
+    uint64_t     t_requests;                /* 完成的请求数量 */
+    uint64_t     t_bytes;                   /* 读取的字节数 */
+    uint64_t     t_non2xx;                  /* 状态码不是 2xx 或 3xx 的响应数量 */
+    uint64_t     t_err_connect;             /* 连接错误 */
+    uint64_t     t_err_read;                /* 读取错误 (包括响应格式错误) */
+    uint64_t     t_err_write;               /* 写入错误 */
+    histogram_t  t_hist;                    /* 延迟直方图 */
+} bench_thread_t;
+
+/* 测试参数, 所有线程共享, 启动后只读 */
+static struct {
+    struct sockaddr_storage addr;           /* 服务器地址 */
+    socklen_t    addrlen;                   /* 地址长度 */
+    char         host[MAXLINE];             /* 主机名 */
+    char         port[32];                  /* 端口 */
+    char         path[MAXLINE];             /* 请求路径 */
+    int          depth;                     /* 流水线深度 */
+    int          keepalive;                 /* 是否使用持久连接 */
+    char        *req;                       /* depth 个请求拼接成的缓冲区 */
+    size_t       reqlen;                    /* 单个请求的长度 */
+    uint64_t     deadline;                  /* 结束时间(微秒) */
+} g_bench;
+
+int  parse_url(char const *url);
+void *bench_loop(void *arg);
+static uint64_t now_us(void);
+static void conn_open(bench_thread_t *t, bench_conn_t *c);
+static void conn_reset(bench_thread_t *t, bench_conn_t *c);
+static int  conn_write(bench_thread_t *t, bench_conn_t *c);
+static int  conn_read(bench_thread_t *t, bench_conn_t *c);
+static int  conn_parse(bench_thread_t *t, bench_conn_t *c, int eof);
+static int  parse_header(bench_thread_t *t, bench_conn_t *c, char const *hdr, size_t len);
+static int  response_done(bench_thread_t *t, bench_conn_t *c);
+void hist_record(histogram_t *h, uint64_t value);
+void hist_merge(histogram_t *dst, histogram_t const *src);
+uint64_t hist_percentile(histogram_t const *h, double percentile);
+static int hist_index(uint64_t value);
+static uint64_t hist_highest(int index);
+void print_report(bench_thread_t *threads, int nthreads, double elapsed);
+void format_units(double value, char const *const *units, double base, char *buf, size_t len);
+void format_time(double usec, char *buf, size_t len);
+
+int main(int argc, char *argv[])
+{
+    int nthreads = 2;
+    int nconns = 10;
+    int duration = 10;
+    int opt;
+
+    g_bench.depth = 1;
+    g_bench.keepalive = 1;
+    while ((opt = getopt(argc, argv, "t:c:d:p:C")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'p':
+            g_bench.depth = atoi(optarg);
+            break;
+        case 'C':
+            g_bench.keepalive = 0;
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1 || nthreads <= 0 || nconns <= 0 || duration <= 0
+        || g_bench.depth <= 0 || g_bench.depth > BENCH_MAXDEPTH) {
+        fprintf(stderr, USAGE, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (parse_url(argv[optind]) < 0) {
+        output_error_message("invalid url: %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* 不使用持久连接时每个连接只能发送一个请求 */
+    if (!g_bench.keepalive)
+        g_bench.depth = 1;
+    if (nthreads > nconns)
+        nthreads = nconns;
+
+    char req[3 * MAXLINE];
+    g_bench.reqlen = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s:%s\r\n%s\r\n", g_bench.path,
+                              g_bench.host, g_bench.port, (g_bench.keepalive ? "" : "Connection: close\r\n"));
+    if ((g_bench.req = (char *)malloc(g_bench.reqlen * g_bench.depth)) == NULL) {
+        output_error_message("malloc error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < g_bench.depth; ++i)
+        memcpy(g_bench.req + i * g_bench.reqlen, req, g_bench.reqlen);
+
+    bench_thread_t *threads;
+    if ((threads = (bench_thread_t *)calloc(nthreads, sizeof(bench_thread_t))) == NULL) {
+        output_error_message("calloc error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Running %ds test @ http://%s:%s%s\n", duration, g_bench.host, g_bench.port, g_bench.path);
+    printf("  %d threads and %d connections, pipeline depth %d, %s\n", nthreads, nconns, g_bench.depth,
+           (g_bench.keepalive ? "keep-alive" : "connection close"));
+
+    uint64_t start = now_us();
+    g_bench.deadline = start + (uint64_t)duration * 1000000;
+    for (int i = 0; i < nthreads; ++i) {
+        threads[i].t_nconns = nconns / nthreads + (i < nconns % nthreads);
+        if (pthread_create(&threads[i].t_tid, NULL, bench_loop, &threads[i]) != 0) {
+            output_error_message("pthread_create error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < nthreads; ++i)
+        pthread_join(threads[i].t_tid, NULL);
+
+    print_report(threads, nthreads, (now_us() - start) / 1e6);
+    return 0;
+}
+
+
+/*
+ * 函数说明:    解析 http://host[:port]/path 形式的 url 并解析服务器地址, 成功返回 0
+ * @url:        url 字符串
+ */
+int parse_url(char const *url)
+{
+    if (strncmp(url, "http://", 7) == 0)
+        url += 7;
+
+    char const *slash = strchr(url, '/');
+    size_t hlen = (slash != NULL ? (size_t)(slash - url) : strlen(url));
+    if (hlen == 0 || hlen >= sizeof(g_bench.host))
+        return -1;
+
+    memcpy(g_bench.host, url, hlen);
+    g_bench.host[hlen] = '\0';
+    snprintf(g_bench.path, sizeof(g_bench.path), "%s", (slash != NULL ? slash : "/"));
+
+    char *colon = strrchr(g_bench.host, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        snprintf(g_bench.port, sizeof(g_bench.port), "%s", colon + 1);
+    } else
+        strcpy(g_bench.port, "80");
+
+    struct addrinfo hints;
+    struct addrinfo *res;
+    bzero(&hints, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (getaddrinfo(g_bench.host, g_bench.port, &hints, &res) != 0)
+        return -1;
+
+    memcpy(&g_bench.addr, res->ai_addr, res->ai_addrlen);
+    g_bench.addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+
+/*
+ * 函数说明:    测试线程例程函数, 打开所有连接, 驱动它们直到测试结束
+ * @arg:        bench_thread_t 指针
+ */
+void *bench_loop(void *arg)
+{
+    bench_thread_t *t = (bench_thread_t *)arg;
+    struct epoll_event events[BENCH_MAXEVENTS];
+
+    if ((t->t_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+        || (t->t_conns = (bench_conn_t *)calloc(t->t_nconns, sizeof(bench_conn_t))) == NULL) {
+        output_error_message("thread setup error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    for (int i = 0; i < t->t_nconns; ++i) {
+        t->t_conns[i].c_fd = -1;
+        conn_open(t, &t->t_conns[i]);
+    }
+
+    while (now_us() < g_bench.deadline) {
+        int readyn = epoll_wait(t->t_epfd, events, BENCH_MAXEVENTS, 100);
+        for (int i = 0; i < readyn; ++i) {
+            bench_conn_t *c = (bench_conn_t *)events[i].data.ptr;
+            if (c->c_fd < 0)
+                continue;
+
+            /* 非阻塞 connect 完成 */
+            if (!c->c_connected) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->c_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0 || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                    ++t->t_err_connect;
+                    conn_reset(t, c);
+                    continue;
+                }
+                c->c_connected = 1;
+            }
+
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && conn_read(t, c) < 0) {
+                conn_reset(t, c);
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && conn_write(t, c) < 0)
+                conn_reset(t, c);
+        }
+    }
+
+    for (int i = 0; i < t->t_nconns; ++i) {
+        if (t->t_conns[i].c_fd >= 0)
+            close(t->t_conns[i].c_fd);
+    }
+    close(t->t_epfd);
+    free(t->t_conns);
+    return NULL;
+}
+
+
+/* (内部函数)
+ * 函数说明:    返回单调时钟的当前时间(微秒)
+ */
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* (内部函数)
+ * 函数说明:    发起非阻塞连接并加入 epoll (边沿触发同时监听读写), 失败时计入连接错误
+ * @t:          测试线程
+ * @c:          连接
+ */
+static void conn_open(bench_thread_t *t, bench_conn_t *c)
+{
+    int one = 1;
+
+    c->c_connected = 0;
+    c->c_inflight = 0;
+    c->c_woff = c->c_wlen = 0;
+    c->c_state = RESP_HEADER;
+    c->c_close = 0;
+    c->c_len = 0;
+
+    if ((c->c_fd = socket(g_bench.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        ++t->t_err_connect;
+        return;
+    }
+    setsockopt(c->c_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(c->c_fd, (struct sockaddr *)&g_bench.addr, g_bench.addrlen) < 0 && errno != EINPROGRESS) {
+        ++t->t_err_connect;
+        close(c->c_fd);
+        c->c_fd = -1;
+        return;
+    }
+
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(t->t_epfd, EPOLL_CTL_ADD, c->c_fd, &ev) < 0) {
+        ++t->t_err_connect;
+        close(c->c_fd);
+        c->c_fd = -1;
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    关闭连接并重新连接, 未完成的请求被丢弃
+ * @t:          测试线程
+ * @c:          连接
+ */
+static void conn_reset(bench_thread_t *t, bench_conn_t *c)
+{
+    if (c->c_fd >= 0)
+        close(c->c_fd);
+    c->c_fd = -1;
+
+    if (now_us() < g_bench.deadline)
+        conn_open(t, c);
+}
+
+
+/* (内部函数)
+ * 函数说明:    没有未完成的请求时开始发送新的一批 (depth 个) 请求, 发送到 EAGAIN 为止. 出错返回 -1
+ * @t:          测试线程
+ * @c:          连接
+ */
+static int conn_write(bench_thread_t *t, bench_conn_t *c)
+{
+    if (!c->c_connected)
+        return 0;
+
+    if (c->c_inflight == 0 && c->c_woff == c->c_wlen) {
+        c->c_inflight = g_bench.depth;
+        c->c_woff = 0;
+        c->c_wlen = g_bench.reqlen * g_bench.depth;
+        c->c_sent = now_us();
+    }
+
+    while (c->c_woff < c->c_wlen) {
+        ssize_t n = send(c->c_fd, g_bench.req + c->c_woff, c->c_wlen - c->c_woff, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            ++t->t_err_write;
+            return -1;
+        }
+        c->c_woff += n;
+    }
+
+    return 0;
+}
+
+
+/* (内部函数)
+ * 函数说明:    读取到 EAGAIN 为止并解析响应, 一批响应全部完成后发送下一批请求.
+ *              连接需要重新打开时返回 -1
+ * @t:          测试线程
+ * @c:          连接
+ */
+static int conn_read(bench_thread_t *t, bench_conn_t *c)
+{
+    while (1) {
+        ssize_t n = recv(c->c_fd, c->c_buf + c->c_len, sizeof(c->c_buf) - c->c_len, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            ++t->t_err_read;
+            return -1;
+        }
+
+        t->t_bytes += n;
+        c->c_len += n;
+        int ret = conn_parse(t, c, n == 0);
+        if (ret < 0 || n == 0) {
+            if (ret < 0 || c->c_inflight > 0 || c->c_len > 0)
+                ++t->t_err_read;            /* 响应格式错误或者服务器提前关闭了连接 */
+            return -1;
+        }
+        if (ret > 0)
+            return -1;                      /* 服务器在响应之后关闭连接 */
+
+        if (c->c_inflight == 0 && conn_write(t, c) < 0)
+            return -1;
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    解析缓冲区中的响应, 消耗已经处理的数据. 正常返回 0, 响应完成后需要重新连接返回 1,
+ *              格式错误返回 -1
+ * @t:          测试线程
+ * @c:          连接
+ * @eof:        服务器已经关闭了连接
+ */
+static int conn_parse(bench_thread_t *t, bench_conn_t *c, int eof)
+{
+    size_t off = 0;
+    int ret = 0;
+
+    while (ret == 0) {
+        char *p = c->c_buf + off;
+        size_t avail = c->c_len - off;
+        char *end;
+
+        switch (c->c_state) {
+        case RESP_HEADER:
+            if ((end = memmem(p, avail, "\r\n\r\n", 4)) == NULL) {
+                if (avail == sizeof(c->c_buf))
+                    ret = -1;               /* 报头超过缓冲区 */
+                goto out;
+            }
+            if (c->c_inflight <= 0 || parse_header(t, c, p, end + 4 - p) < 0) {
+                ret = -1;
+                goto out;
+            }
+            off += end + 4 - p;
+            if (c->c_state == RESP_BODY && c->c_remain == 0)
+                ret = response_done(t, c);
+            break;
+
+        case RESP_BODY:
+        case RESP_CHUNK_DATA:
+            if (avail == 0)
+                goto out;
+            if ((long long)avail > c->c_remain)
+                avail = c->c_remain;
+            off += avail;
+            c->c_remain -= avail;
+            if (c->c_remain == 0) {
+                if (c->c_state == RESP_BODY)
+                    ret = response_done(t, c);
+                else
+                    c->c_state = RESP_CHUNK_CRLF;
+            }
+            break;
+
+        case RESP_UNTIL_CLOSE:
+            off += avail;
+            if (eof) {
+                response_done(t, c);
+                ret = 1;
+            }
+            goto out;
+
+        case RESP_CHUNK_SIZE:
+            if ((end = memmem(p, avail, "\r\n", 2)) == NULL)
+                goto out;
+            c->c_remain = strtoll(p, NULL, 16);
+            off += end + 2 - p;
+            c->c_state = (c->c_remain > 0 ? RESP_CHUNK_DATA : RESP_TRAILER);
+            break;
+
+        case RESP_CHUNK_CRLF:
+            if (avail < 2)
+                goto out;
+            off += 2;
+            c->c_state = RESP_CHUNK_SIZE;
+            break;
+
+        case RESP_TRAILER:
+            if ((end = memmem(p, avail, "\r\n", 2)) == NULL)
+                goto out;
+            off += end + 2 - p;
+            if (end == p)                   /* 空行, 响应结束 */
+                ret = response_done(t, c);
+            break;
+        }
+    }
+
+out:
+    if (off > 0) {
+        memmove(c->c_buf, c->c_buf + off, c->c_len - off);
+        c->c_len -= off;
+    }
+    return ret;
+}
+
+
+/* (内部函数)
+ * 函数说明:    解析响应报头: 状态码, Content-length, Transfer-Encoding 和 Connection, 设置主体的读取方式.
+ *              格式错误返回 -1
+ * @t:          测试线程
+ * @c:          连接
+ * @hdr:        报头 (以空行结束)
+ * @len:        报头长度
+ */
+static int parse_header(bench_thread_t *t, bench_conn_t *c, char const *hdr, size_t len)
+{
+    char const *end = hdr + len;
+    int status;
+
+    if (len < 12 || strncmp(hdr, "HTTP/1.", 7) != 0 || sscanf(hdr + 9, "%3d", &status) != 1)
+        return -1;
+    if (status < 200 || status >= 400)
+        ++t->t_non2xx;
+
+    long long length = -1;
+    int chunked = 0;
+    c->c_close = (strncmp(hdr, "HTTP/1.0", 8) == 0);
+    for (char const *line = memchr(hdr, '\n', len) + 1; line < end; ) {
+        char const *eol = memchr(line, '\n', end - line);
+        if (eol == NULL)
+            break;
+
+        if (strncasecmp(line, "Content-length:", 15) == 0)
+            length = strtoll(line + 15, NULL, 10);
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+            chunked = (memmem(line, eol - line, "chunked", 7) != NULL);
+        else if (strncasecmp(line, "Connection:", 11) == 0) {
+            if (memmem(line, eol - line, "close", 5) != NULL)
+                c->c_close = 1;
+            else if (memmem(line, eol - line, "keep-alive", 10) != NULL)
+                c->c_close = 0;
+        }
+        line = eol + 1;
+    }
+
+    /* 1xx, 204 和 304 没有主体 */
+    if (status < 200 || status == 204 || status == 304)
+        length = 0;
+
+    if (chunked)
+        c->c_state = RESP_CHUNK_SIZE;
+    else if (length >= 0) {
+        c->c_state = RESP_BODY;
+        c->c_remain = length;
+    } else {
+        c->c_state = RESP_UNTIL_CLOSE;
+        c->c_close = 1;
+    }
+
+    return 0;
+}
+
+
+/* (内部函数)
+ * 函数说明:    一个响应接收完成, 记录延迟 (从这一批请求开始发送到响应完整到达).
+ *              服务器会在这个响应之后关闭连接时返回 1
+ * @t:          测试线程
+ * @c:          连接
+ */
+static int response_done(bench_thread_t *t, bench_conn_t *c)
+{
+    hist_record(&t->t_hist, now_us() - c->c_sent);
+    ++t->t_requests;
+    --c->c_inflight;
+    c->c_state = RESP_HEADER;
+    return c->c_close;
+}
+
+
+/*
+ * 函数说明:    在直方图中记录一个值
+ * @h:          直方图
+ * @value:      值(微秒)
+ */
+void hist_record(histogram_t *h, uint64_t value)
+{
+    ++h->h_counts[hist_index(value)];
+    ++h->h_total;
+    h->h_sum += value;
+    h->h_sumsq += (double)value * value;
+    if (value > h->h_max)
+        h->h_max = value;
+}
+
+
+/*
+ * 函数说明:    将 src 中的值合并到 dst 中
+ * @dst:        目标直方图
+ * @src:        源直方图
+ */
+void hist_merge(histogram_t *dst, histogram_t const *src)
+{
+    for (int i = 0; i < HIST_SIZE; ++i)
+        dst->h_counts[i] += src->h_counts[i];
+    dst->h_total += src->h_total;
+    dst->h_sum += src->h_sum;
+    dst->h_sumsq += src->h_sumsq;
+    if (src->h_max > dst->h_max)
+        dst->h_max = src->h_max;
+}
+
+
+/*
+ * 函数说明:    返回百分位数对应的值 (所在桶的上界, 不超过最大值)
+ * @h:          直方图
+ * @percentile: 百分位数, 0 到 100
+ */
+uint64_t hist_percentile(histogram_t const *h, double percentile)
+{
+    uint64_t target = (uint64_t)ceil(h->h_total * percentile / 100.0);
+    uint64_t count = 0;
+
+    if (target == 0)
+        target = 1;
+    for (int i = 0; i < HIST_SIZE; ++i) {
+        count += h->h_counts[i];
+        if (count >= target) {
+            uint64_t v = hist_highest(i);
+            return (v < h->h_max ? v : h->h_max);
+        }
+    }
+
+    return h->h_max;
+}
+
+
+/* (内部函数)
+ * 函数说明:    返回值所在的桶
+ * @value:      值
+ */
+static int hist_index(uint64_t value)
+{
+    if (value < HIST_SUB)
+        return (int)value;
+
+    int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return HIST_SUB + (shift - 1) * HIST_HALF + (int)((value >> shift) - HIST_HALF);
+}
+
+
+/* (内部函数)
+ * 函数说明:    返回桶中最大的值
+ * @index:      桶的下标
+ */
+static uint64_t hist_highest(int index)
+{
+    if (index < HIST_SUB)
+        return index;
+
+    int shift = (index - HIST_SUB) / HIST_HALF + 1;
+    uint64_t sub = (index - HIST_SUB) % HIST_HALF + HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+
+/*
+ * 函数说明:    合并所有线程的结果并打印报告
+ * @threads:    测试线程数组
+ * @nthreads:   线程数量
+ * @elapsed:    实际测试时间(秒)
+ */
+void print_report(bench_thread_t *threads, int nthreads, double elapsed)
+{
+    static char const *const byte_units[] = { "B", "KB", "MB", "GB", "TB", NULL };
+    static char const *const count_units[] = { "", "k", "M", "G", NULL };
+    static histogram_t hist;
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    uint64_t non2xx = 0;
+    uint64_t econnect = 0, eread = 0, ewrite = 0;
+    char b1[32], b2[32], b3[32];
+
+    for (int i = 0; i < nthreads; ++i) {
+        bench_thread_t *t = &threads[i];
+        hist_merge(&hist, &t->t_hist);
+        requests += t->t_requests;
+        bytes += t->t_bytes;
+        non2xx += t->t_non2xx;
+        econnect += t->t_err_connect;
+        eread += t->t_err_read;
+        ewrite += t->t_err_write;
+    }
+
+    double mean = (hist.h_total > 0 ? hist.h_sum / hist.h_total : 0);
+    double var = (hist.h_total > 0 ? hist.h_sumsq / hist.h_total - mean * mean : 0);
+    format_time(mean, b1, sizeof(b1));
+    format_time(sqrt(var > 0 ? var : 0), b2, sizeof(b2));
+    format_time(hist.h_max, b3, sizeof(b3));
+    printf("  Latency     %10s %10s %10s  (mean, stdev, max)\n", b1, b2, b3);
+
+    printf("  Latency Distribution\n");
+    static double const percentiles[] = { 50, 75, 90, 99, 99.9, 99.99 };
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+        format_time(hist_percentile(&hist, percentiles[i]), b1, sizeof(b1));
+        printf("    p%-6g %10s\n", percentiles[i], b1);
+    }
+
+    format_units(bytes, byte_units, 1024, b1, sizeof(b1));
+    printf("  %llu requests in %.2fs, %s read\n", (unsigned long long)requests, elapsed, b1);
+    if (non2xx > 0)
+        printf("  Non-2xx or 3xx responses: %llu\n", (unsigned long long)non2xx);
+    if (econnect + eread + ewrite > 0)
+        printf("  Socket errors: connect %llu, read %llu, write %llu\n", (unsigned long long)econnect,
+               (unsigned long long)eread, (unsigned long long)ewrite);
+
+    format_units(requests / elapsed, count_units, 1000, b1, sizeof(b1));
+    format_units(bytes / elapsed, byte_units, 1024, b2, sizeof(b2));
+    printf("Requests/sec: %10s\n", b1);
+    printf("Transfer/sec: %10s\n", b2);
+}
+
+
+/*
+ * 函数说明:    按单位格式化数值, 例如 1536 -> "1.50KB"
+ * @value:      数值
+ * @units:      单位数组, 以 NULL 结尾
+ * @base:       相邻单位之间的倍数
+ * @buf:        存放结果的缓冲区
+ * @len:        缓冲区大小
+ */
+void format_units(double value, char const *const *units, double base, char *buf, size_t len)
+{
+    int i = 0;
+    while (value >= base && units[i + 1] != NULL) {
+        value /= base;
+        ++i;
+    }
+
+    snprintf(buf, len, "%.2f%s", value, units[i]);
+}
+
+
+/*
+ * 函数说明:    格式化时间, 自动选择 us / ms / s
+ * @usec:       时间(微秒)
+ * @buf:        存放结果的缓冲区
+ * @len:        缓冲区大小
+ */
+void format_time(double usec, char *buf, size_t len)
+{
+    if (usec < 1000)
+        snprintf(buf, len, "%.0fus", usec);
+    else if (usec < 1000000)
+        snprintf(buf, len, "%.2fms", usec / 1000);
+    else
+        snprintf(buf, len, "%.2fs", usec / 1000000);
+}
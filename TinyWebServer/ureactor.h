@@ -0,0 +1,803 @@
+#ifndef _UREACTOR_H_
+#define _UREACTOR_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "uring.h"
+#include "reactor.h"
+
+#define UREACTOR_ENTRIES    1024            /* sq 的大小, cq 为它的两倍 */
+#define UREACTOR_NBUFS      256             /* 注册的接收缓冲区数量, 更多的连接使用自己分配的缓冲区 */
+
+/* 提交给 io_uring 的操作, 保存在 user_data 的低 3 位, 高位为连接指针 */
+enum {
+    UOP_ACCEPT = 1,                         /* 接受连接 (多次完成), 连接指针为 NULL */
+    UOP_EVENT,                              /* 读取 eventfd, 连接指针为 NULL */
+    UOP_CANCEL,                             /* 取消连接上正在进行的操作, 忽略它的完成事件 */
+    UOP_RECV,                               /* 接收请求 */
+    UOP_SEND,                               /* 发送内存中的响应数据 */
+    UOP_POLL,                               /* 等待套接字可写或者 cgi 管道可读, 然后由 response_write 发送 */
+};
+#define UOP_MASK            7
+
+/*
+ * io_uring 反应堆中的连接. 每个连接同一时刻最多只有一个正在进行的操作 (c_pending),
+ * 操作的完成事件是唯一会引用连接的地方, 因此关闭时只需要等待这一个操作完成 (或者被取消) 再释放
+ */
+typedef struct uconn_t {
+    int              c_fd;                  /* 与客户端连接的套接字 */
+    int              c_state;               /* 连接状态, 与 conn_t 相同 */
+    int              c_reqleft;             /* 还能处理的请求数量 */
+    int              c_pending;             /* 正在进行的操作 UOP_*, 没有为 0 */
+    int              c_closing;             /* 已经关闭, 等待正在进行的操作完成后释放 */
+    int              c_timedout;            /* 报头超时, 接收被取消之后回复 408 */
+    int              c_bufidx;              /* 在注册缓冲区中的槽位, -1 表示 c_buf 是自己分配的 */
+    char            *c_buf;                 /* 接收缓冲区, RIO_BUFSIZE 字节 */
+    char            *c_bufptr;              /* 缓冲区中下一个未解析的字节 */
+    int              c_cnt;                 /* 缓冲区中未解析的字节数量 */
+    timer_node_t     c_timer;               /* 空闲, 报头或者发送的超时定时器 */
+    struct ureactor_t *c_reactor;           /* 所属的反应堆 */
+    struct uconn_t  *c_done_next;           /* 完成队列中的下一结点 */
+    char             c_peer[REACTOR_PEERLEN];   /* 客户端地址, 用于访问日志 */
+    admit_key_t      c_client;              /* 客户端地址, 用于准入控制 */
+    uint64_t         c_parse_start;         /* 当前请求的第一个字节开始解析的时间(纳秒) */
+    http_parser_t    c_parser;              /* 请求解析器 */
+    response_t       c_resp;                /* 正在发送的响应 */
+    struct msghdr    c_msg;                 /* 正在进行的 sendmsg 的参数, 完成之前必须有效 */
+    struct iovec     c_iov[RESP_MAXSEG];    /* 正在发送的内存段 */
+} uconn_t;
+
+/*
+ * 基于完成通知的反应堆, 每个线程一个 io_uring 和一个 SO_REUSEPORT 监听套接字. 与 reactor_t 使用相同的
+ * 请求处理函数, 配置和超时规则: 接受连接, 接收请求和发送内存中的响应都由 io_uring 完成,
+ * 本轮产生的所有请求在下一次等待完成事件时一起提交, 每轮只需要一次 io_uring_enter
+ */
+typedef struct ureactor_t {
+    uring_t          u_ring;                /* io_uring */
+    int              u_listenfd;            /* 监听套接字, 同时注册为 0 号固定文件 */
+    int              u_fixed;               /* 监听套接字是否注册成功 */
+    int              u_multishot;           /* 内核是否支持多次完成的 accept, 不支持时每个连接重新提交 */
+    pthread_t        u_tid;                 /* 线程 ID */
+    request_handler *u_handler;             /* 请求处理函数 */
+    reactor_conf_t   u_conf;                /* 配置 */
+    size_t           u_nconns;              /* 当前连接数量, 包括等待操作完成后释放的连接 */
+    timer_wheel_t    u_timers;              /* 所有连接的超时定时器 */
+    int              u_eventfd;             /* 其他线程完成异步响应时用于唤醒 */
+    uint64_t         u_eventval;            /* 读取 eventfd 的缓冲区 */
+    pthread_mutex_t  u_done_mutex;          /* 保护完成队列 */
+    uconn_t         *u_done;                /* 异步响应已经填充完成, 等待发送的连接 */
+    char            *u_bufs;                /* 注册的接收缓冲区, UREACTOR_NBUFS 个槽位, 注册失败为 NULL */
+    int              u_freebufs[UREACTOR_NBUFS];    /* 空闲槽位栈 */
+    int              u_nfree;               /* 空闲槽位数量 */
+} ureactor_t;
+
+int  ureactor_supported(void);
+int  ureactor_init(ureactor_t *r, char const *host, char const *port, request_handler *handler,
+                   reactor_conf_t const *conf);
+int  ureactor_run(int nthreads, char const *host, char const *port, request_handler *handler,
+                  reactor_conf_t const *conf);
+void *ureactor_loop(void *arg);
+static void ureactor_destroy(ureactor_t *r);
+static struct io_uring_sqe *ureactor_sqe(ureactor_t *r, int op, int fd, void const *addr, unsigned len,
+                                         uconn_t *c);
+static void ureactor_accept(ureactor_t *r);
+static void ureactor_accepted(ureactor_t *r, int res, unsigned flags);
+static int  ureactor_quiesce(ureactor_t *r);
+static void ureactor_expire(ureactor_t *r);
+static void ureactor_drain_done(ureactor_t *r);
+static void uconn_notify(void *arg);
+static void uconn_complete(ureactor_t *r, uconn_t *c, int op, int res);
+static void uconn_process(ureactor_t *r, uconn_t *c);
+static int  uconn_recv(ureactor_t *r, uconn_t *c);
+static int  uconn_send(ureactor_t *r, uconn_t *c);
+static void uconn_header_timeout(ureactor_t *r, uconn_t *c);
+static void uconn_timeout(ureactor_t *r, uconn_t *c);
+static void uconn_arm(ureactor_t *r, uconn_t *c, int timeout);
+static void uconn_close(ureactor_t *r, uconn_t *c);
+static void uconn_free(ureactor_t *r, uconn_t *c);
+
+
+/*
+ * 函数说明:    检查运行中的内核是否支持 io_uring 反应堆需要的特性: 带超时的等待 (5.11) 和使用到的所有操作.
+ *              io_uring 被禁用 (kernel.io_uring_disabled, seccomp) 时同样返回 0
+ */
+int ureactor_supported(void)
+{
+    static int const ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_READ_FIXED, IORING_OP_SENDMSG,
+                               IORING_OP_POLL_ADD, IORING_OP_READ, IORING_OP_ASYNC_CANCEL };
+    uring_t u;
+
+    if (uring_init(&u, 8, 0) < 0)
+        return 0;
+
+    int ok = ((u.u_features & IORING_FEAT_EXT_ARG) && uring_probe(&u, ops, sizeof(ops) / sizeof(ops[0])));
+    uring_exit(&u);
+    return ok;
+}
+
+
+/*
+ * 函数说明:    初始化 io_uring 反应堆: 创建 io_uring, eventfd 和 SO_REUSEPORT 监听套接字,
+ *              把监听套接字注册为固定文件, 注册接收缓冲区. 注册失败 (例如超过 RLIMIT_MEMLOCK)
+ *              只影响性能, 退回到普通的文件描述符和每个连接自己的缓冲区. 成功返回 0, 失败返回 -1
+ * @r:          反应堆指针
+ * @host:       绑定的主机名(可选)
+ * @port:       绑定的端口号
+ * @handler:    请求处理函数
+ * @conf:       配置
+ */
+int ureactor_init(ureactor_t *r, char const *host, char const *port, request_handler *handler,
+                  reactor_conf_t const *conf)
+{
+    if (r == NULL || port == NULL || handler == NULL || conf == NULL)
+        return -1;
+
+    bzero(r, sizeof(ureactor_t));
+    r->u_handler = handler;
+    r->u_conf = *conf;
+    r->u_multishot = 1;
+    r->u_listenfd = r->u_eventfd = -1;
+    timer_wheel_init(&r->u_timers);
+    pthread_mutex_init(&r->u_done_mutex, NULL);
+
+    if (uring_init(&r->u_ring, UREACTOR_ENTRIES, 0) < 0)
+        return -1;
+
+    if ((r->u_eventfd = eventfd(0, EFD_CLOEXEC)) < 0 ||
+        (r->u_listenfd = open_listenfd_opt(host, port, LISTEN_REUSEPORT, conf->rc_backlog)) < 0) {
+        ureactor_destroy(r);
+        return -1;
+    }
+
+    r->u_fixed = (uring_register(&r->u_ring, IORING_REGISTER_FILES, &r->u_listenfd, 1) == 0);
+
+    /* 接收缓冲区注册为一整块, 每个槽位 RIO_BUFSIZE 字节, 内核接收时不需要每次映射用户页面 */
+    struct iovec iov;
+    iov.iov_len = (size_t)UREACTOR_NBUFS * RIO_BUFSIZE;
+    iov.iov_base = mmap(NULL, iov.iov_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (iov.iov_base != MAP_FAILED) {
+        if (uring_register(&r->u_ring, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+            r->u_bufs = (char *)iov.iov_base;
+            for (int i = 0; i < UREACTOR_NBUFS; ++i)
+                r->u_freebufs[i] = UREACTOR_NBUFS - 1 - i;
+            r->u_nfree = UREACTOR_NBUFS;
+        } else {
+            log_printf(LOG_WARN, "%s: register buffers error: %s\n", __func__, strerror(errno));
+            munmap(iov.iov_base, iov.iov_len);
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    启动 nthreads 个 io_uring 反应堆线程并等待它们结束. 与 reactor_run 相同,
+ *              由内核通过 SO_REUSEPORT 在各个线程的监听套接字之间分配新连接, 停止同样使用 reactor_stop
+ * @nthreads:   线程数量
+ * @host:       绑定的主机名(可选)
+ * @port:       绑定的端口号
+ * @handler:    请求处理函数
+ * @conf:       配置
+ */
+int ureactor_run(int nthreads, char const *host, char const *port, request_handler *handler,
+                 reactor_conf_t const *conf)
+{
+    if (nthreads <= 0)
+        return -1;
+
+    ureactor_t *reactors;
+    if ((reactors = (ureactor_t *)calloc(nthreads, sizeof(ureactor_t))) == NULL)
+        return -1;
+
+    int started = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        if (ureactor_init(&reactors[i], host, port, handler, conf) < 0) {
+            log_printf(LOG_ERROR, "%s: ureactor_init(%s) error: %s\n", __func__, port, strerror(errno));
+            break;
+        }
+
+        if (pthread_create(&reactors[i].u_tid, NULL, ureactor_loop, &reactors[i]) != 0) {
+            log_printf(LOG_ERROR, "%s: pthread_create error\n", __func__);
+            ureactor_destroy(&reactors[i]);
+            break;
+        }
+        ++started;
+    }
+
+    for (int i = 0; i < started; ++i) {
+        pthread_join(reactors[i].u_tid, NULL);
+        ureactor_destroy(&reactors[i]);
+    }
+
+    free(reactors);
+    return (started == nthreads ? 0 : -1);
+}
+
+
+/*
+ * 函数说明:    io_uring 反应堆线程例程函数: 提交本轮产生的请求并等待完成事件, 处理所有完成事件和到期的定时器
+ * @arg:        ureactor_t 指针
+ */
+void *ureactor_loop(void *arg)
+{
+    ureactor_t *r = (ureactor_t *)arg;
+    struct io_uring_cqe *cqe;
+
+    ureactor_accept(r);
+    if (ureactor_sqe(r, IORING_OP_READ, r->u_eventfd, &r->u_eventval, sizeof(r->u_eventval), NULL) == NULL)
+        return NULL;
+
+    while (1) {
+        if (g_reactor_stop && ureactor_quiesce(r))
+            break;
+
+        /* cq 溢出时内核拒绝提交 (EBUSY), 先处理已有的完成事件 */
+        if (uring_submit(&r->u_ring, 1, timer_timeout(&r->u_timers, 1000)) < 0 && errno != EBUSY && errno != EAGAIN) {
+            log_printf(LOG_ERROR, "%s: io_uring_enter error: %s\n", __func__, strerror(errno));
+            break;
+        }
+
+        while ((cqe = uring_peek_cqe(&r->u_ring)) != NULL) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&r->u_ring);
+
+            int op = (int)(data & UOP_MASK);
+            if (op == UOP_ACCEPT) {
+                ureactor_accepted(r, res, flags);
+            } else if (op == UOP_EVENT) {
+                ureactor_drain_done(r);
+                ureactor_sqe(r, IORING_OP_READ, r->u_eventfd, &r->u_eventval, sizeof(r->u_eventval), NULL);
+            } else if (op != UOP_CANCEL) {
+                uconn_complete(r, (uconn_t *)(uintptr_t)(data & ~(uint64_t)UOP_MASK), op, res);
+            }
+        }
+
+        ureactor_expire(r);
+    }
+
+    return NULL;
+}
+
+
+/* (内部函数)
+ * 函数说明:    释放反应堆的资源, 没有完成的请求由内核取消
+ * @r:          反应堆指针
+ */
+static void ureactor_destroy(ureactor_t *r)
+{
+    if (r->u_ring.u_fd >= 0)
+        uring_exit(&r->u_ring);
+    if (r->u_bufs != NULL)
+        munmap(r->u_bufs, (size_t)UREACTOR_NBUFS * RIO_BUFSIZE);
+    if (r->u_listenfd >= 0)
+        close(r->u_listenfd);
+    if (r->u_eventfd >= 0)
+        close(r->u_eventfd);
+    r->u_bufs = NULL;
+    r->u_listenfd = r->u_eventfd = -1;
+}
+
+
+/* (内部函数)
+ * 函数说明:    取得一个 sqe 并填充公共字段, user_data 为连接指针和操作. 连接的操作记录在 c_pending 中.
+ *              sq 已满且无法提交时返回 NULL
+ * @r:          反应堆指针
+ * @op:         IORING_OP_*
+ * @fd:         文件描述符
+ * @addr:       缓冲区或者 msghdr
+ * @len:        长度
+ * @c:          连接指针, 反应堆本身的操作为 NULL
+ */
+static struct io_uring_sqe *ureactor_sqe(ureactor_t *r, int op, int fd, void const *addr, unsigned len,
+                                         uconn_t *c)
+{
+    int uop;
+    switch (op) {
+    case IORING_OP_ACCEPT:          uop = UOP_ACCEPT; break;
+    case IORING_OP_READ:            uop = UOP_EVENT; break;
+    case IORING_OP_ASYNC_CANCEL:    uop = UOP_CANCEL; break;
+    case IORING_OP_SENDMSG:         uop = UOP_SEND; break;
+    case IORING_OP_POLL_ADD:        uop = UOP_POLL; break;
+    default:                        uop = UOP_RECV; break;
+    }
+
+    struct io_uring_sqe *sqe;
+    if ((sqe = uring_get_sqe(&r->u_ring)) == NULL) {
+        log_printf(LOG_ERROR, "%s: submission queue full: %s\n", __func__, strerror(errno));
+        return NULL;
+    }
+
+    uring_prep(sqe, op, fd, addr, len, 0, (uint64_t)(uintptr_t)c | uop);
+    if (c != NULL && uop != UOP_CANCEL)
+        c->c_pending = uop;
+    return sqe;
+}
+
+
+/* (内部函数)
+ * 函数说明:    提交接受连接的请求. 支持时使用多次完成的 accept, 一次提交之后每个新连接产生一个完成事件
+ * @r:          反应堆指针
+ */
+static void ureactor_accept(ureactor_t *r)
+{
+    struct io_uring_sqe *sqe;
+    if ((sqe = ureactor_sqe(r, IORING_OP_ACCEPT, (r->u_fixed ? 0 : r->u_listenfd), NULL, 0, NULL)) == NULL)
+        return;
+
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (r->u_fixed)
+        sqe->flags |= IOSQE_FIXED_FILE;
+    if (r->u_multishot)
+        sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+}
+
+
+/* (内部函数)
+ * 函数说明:    处理接受连接的完成事件: 创建连接并提交第一次接收. 没有 IORING_CQE_F_MORE 时重新提交 accept
+ * @r:          反应堆指针
+ * @res:        新连接的套接字, 或者负的错误码
+ * @flags:      完成事件的标志
+ */
+static void ureactor_accepted(ureactor_t *r, int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE) && r->u_listenfd >= 0) {
+        if (res == -EINVAL && r->u_multishot) {
+            r->u_multishot = 0;             /* 5.19 之前的内核 */
+            ureactor_accept(r);
+            return;
+        }
+        ureactor_accept(r);
+    }
+
+    /* 文件描述符耗尽时用预留的描述符丢弃监听队列中等待的连接, 这时没有其他 accept 在进行 */
+    if ((res == -EMFILE || res == -ENFILE) && r->u_listenfd >= 0) {
+        while (admit_shed(r->u_conf.rc_admit, r->u_listenfd, ADMIT_HTTP_503, sizeof(ADMIT_HTTP_503) - 1) == 0)
+            ;
+        return;
+    }
+
+    if (res < 0) {
+        if (res != -ECANCELED && res != -EINTR && res != -ECONNABORTED)
+            log_printf(LOG_ERROR, "%s: accept error: %s\n", __func__, strerror(-res));
+        return;
+    }
+
+    /* 多次完成的 accept 不能返回每个连接的地址, 只在需要访问日志或者按地址准入时查询 */
+    struct sockaddr_storage clientaddr;
+    socklen_t addrlen = sizeof(clientaddr);
+    admit_key_t client;
+    int known = ((g_log.l_level >= LOG_INFO || admit_tracking(r->u_conf.rc_admit))
+                 && getpeername(res, (struct sockaddr *)&clientaddr, &addrlen) == 0);
+    if (!known)
+        clientaddr.ss_family = AF_UNSPEC;
+    admit_key(&client, (struct sockaddr *)&clientaddr);
+    if (admit_connect(r->u_conf.rc_admit, &client) < 0) {
+        admit_reject(res, ADMIT_HTTP_503, sizeof(ADMIT_HTTP_503) - 1);
+        return;
+    }
+    set_nodelay(res);
+
+    uconn_t *c;
+    if ((c = (uconn_t *)malloc(sizeof(uconn_t))) == NULL) {
+        admit_disconnect(r->u_conf.rc_admit, &client);
+        close(res);
+        return;
+    }
+
+    c->c_bufidx = -1;
+    if (r->u_nfree > 0) {
+        c->c_bufidx = r->u_freebufs[--r->u_nfree];
+        c->c_buf = r->u_bufs + (size_t)c->c_bufidx * RIO_BUFSIZE;
+    } else if ((c->c_buf = (char *)malloc(RIO_BUFSIZE)) == NULL) {
+        admit_disconnect(r->u_conf.rc_admit, &client);
+        free(c);
+        close(res);
+        return;
+    }
+
+    char hostname[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    strcpy(c->c_peer, "-");
+    if (known && g_log.l_level >= LOG_INFO &&
+        getnameinfo((struct sockaddr *)&clientaddr, addrlen, hostname, sizeof(hostname), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        snprintf(c->c_peer, sizeof(c->c_peer), "%s:%s", hostname, port);
+    log_printf(LOG_DEBUG, "connection from %s\n", c->c_peer);
+    stats_accept();
+
+    c->c_fd = res;
+    c->c_client = client;
+    c->c_state = CONN_READING;
+    c->c_reqleft = r->u_conf.rc_max_requests;
+    c->c_pending = c->c_closing = c->c_timedout = 0;
+    c->c_bufptr = c->c_buf;
+    c->c_cnt = 0;
+    c->c_reactor = r;
+    timer_init(&c->c_timer);
+    c->c_parse_start = 0;
+    http_parser_init(&c->c_parser);
+    response_init(&c->c_resp);
+
+    ++r->u_nconns;
+    uconn_arm(r, c, (g_reactor_stop ? REACTOR_DRAIN_IDLE : r->u_conf.rc_idle_timeout));
+    uconn_process(r, c);
+}
+
+
+/* (内部函数)
+ * 函数说明:    停止过程中的一步: 第一次调用时取消 accept 并关闭监听套接字, 空闲的连接由定时器关闭.
+ *              所有连接都释放后返回 1
+ * @r:          反应堆指针
+ */
+static int ureactor_quiesce(ureactor_t *r)
+{
+    if (r->u_listenfd >= 0) {
+        struct io_uring_sqe *sqe;
+        if ((sqe = ureactor_sqe(r, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, NULL)) != NULL)
+            sqe->addr = UOP_ACCEPT;
+        uring_submit(&r->u_ring, 0, 0);
+
+        /* 注册的固定文件持有监听套接字的引用, 注销之后 close 才会真正关闭 */
+        if (r->u_fixed)
+            uring_register(&r->u_ring, IORING_UNREGISTER_FILES, NULL, 0);
+        r->u_fixed = 0;
+        close(r->u_listenfd);
+        r->u_listenfd = -1;
+    }
+
+    return (r->u_nconns == 0);
+}
+
+
+/* (内部函数)
+ * 函数说明:    处理所有到期的连接定时器
+ * @r:          反应堆指针
+ */
+static void ureactor_expire(ureactor_t *r)
+{
+    uint64_t now = timer_now();
+    timer_node_t *t;
+    while ((t = timer_expired(&r->u_timers, now)) != NULL)
+        uconn_timeout(r, (uconn_t *)((char *)t - offsetof(uconn_t, c_timer)));
+}
+
+
+/* (内部函数)
+ * 函数说明:    取出完成队列中的所有连接, 继续发送它们的响应
+ * @r:          反应堆指针
+ */
+static void ureactor_drain_done(ureactor_t *r)
+{
+    pthread_mutex_lock(&r->u_done_mutex);
+    uconn_t *c = r->u_done;
+    r->u_done = NULL;
+    pthread_mutex_unlock(&r->u_done_mutex);
+
+    while (c != NULL) {
+        uconn_t *next = c->c_done_next;
+        c->c_state = CONN_WRITING;
+        uconn_process(r, c);
+        c = next;
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    异步响应的通知函数, 在填充响应的线程中调用: 将连接加入所属反应堆的完成队列并唤醒反应堆
+ * @arg:        uconn_t 指针
+ */
+static void uconn_notify(void *arg)
+{
+    uconn_t *c = (uconn_t *)arg;
+    ureactor_t *r = c->c_reactor;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&r->u_done_mutex);
+    c->c_done_next = r->u_done;
+    r->u_done = c;
+    pthread_mutex_unlock(&r->u_done_mutex);
+
+    while (write(r->u_eventfd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+
+/* (内部函数)
+ * 函数说明:    处理连接上一个操作的完成事件, 然后继续驱动连接状态机. 已经关闭的连接在这里释放
+ * @r:          反应堆指针
+ * @c:          连接指针
+ * @op:         完成的操作 UOP_*
+ * @res:        操作的结果, 负数为错误码
+ */
+static void uconn_complete(ureactor_t *r, uconn_t *c, int op, int res)
+{
+    c->c_pending = 0;
+    if (c->c_closing) {
+        uconn_free(r, c);
+        return;
+    }
+
+    switch (op) {
+    case UOP_RECV:
+        if (res > 0)
+            c->c_cnt += res;
+        if (c->c_timedout) {
+            uconn_header_timeout(r, c);
+            return;
+        }
+        if (res <= 0) {
+            uconn_close(r, c);              /* 对端关闭或出错 */
+            return;
+        }
+        break;
+
+    case UOP_SEND:
+        if (res < 0) {
+            uconn_close(r, c);
+            return;
+        }
+        response_advance(&c->c_resp, res);
+        break;
+
+    default:                                /* UOP_POLL: 由 response_write 判断是否出错 */
+        break;
+    }
+
+    uconn_process(r, c);
+}
+
+
+/* (内部函数)
+ * 函数说明:    驱动连接状态机: 解析缓冲区中的请求, 调用请求处理函数, 开始发送响应.
+ *              需要等待时提交一个 io_uring 操作后返回, 由它的完成事件继续
+ * @r:          反应堆指针
+ * @c:          连接指针
+ */
+static void uconn_process(ureactor_t *r, uconn_t *c)
+{
+    http_request_t req;
+    int consumed;
+    int status;
+    int ret;
+
+    while (1) {
+        if (c->c_state == CONN_READING) {
+            status = 0;
+
+            if (c->c_parse_start == 0 && c->c_cnt > 0) {
+                c->c_parse_start = stats_now();
+                uconn_arm(r, c, r->u_conf.rc_header_timeout);
+            }
+            consumed = http_parse(&c->c_parser, c->c_bufptr, c->c_cnt);
+            if (consumed == 0) {
+                if (uconn_recv(r, c) == 0)
+                    return;                 /* 等待更多数据 */
+
+                if (errno == ENOBUFS) {
+                    status = 431;
+                } else {
+                    uconn_close(r, c);
+                    return;
+                }
+            } else if (consumed < 0)
+                status = c->c_parser.p_error;
+            else if (admit_request(r->u_conf.rc_admit, &c->c_client) < 0)
+                status = 429;               /* 超过客户端的请求速率, 回复 429 后关闭 */
+
+            response_init(&c->c_resp);
+            c->c_resp.r_notify = uconn_notify;
+            c->c_resp.r_notify_arg = c;
+            c->c_resp.r_parse_ns = stats_now() - c->c_parse_start;
+            if (status == 0) {
+                http_parser_request(&c->c_parser, c->c_bufptr, &req);
+                r->u_handler(&req, 0, &c->c_resp, --c->c_reqleft);
+                c->c_bufptr += consumed;
+                c->c_cnt -= consumed;
+            } else
+                r->u_handler(NULL, status, &c->c_resp, 0);
+
+            if (c->c_resp.r_async) {
+                timer_cancel(&r->u_timers, &c->c_timer);
+                c->c_state = CONN_WAITING;
+                return;
+            }
+            c->c_state = CONN_WRITING;
+        }
+
+        /* 每次有进展都重新计算发送超时 */
+        if ((ret = uconn_send(r, c)) == 0) {
+            uconn_arm(r, c, r->u_conf.rc_send_timeout);
+            return;
+        }
+
+        stats_response(&c->c_resp);
+        response_log(&c->c_resp, c->c_peer);
+        response_release(&c->c_resp);
+        if (ret < 0 || !c->c_resp.r_keepalive) {
+            uconn_close(r, c);
+            return;
+        }
+
+        c->c_state = CONN_READING;
+        c->c_parse_start = 0;
+        http_parser_init(&c->c_parser);
+        uconn_arm(r, c, (g_reactor_stop ? REACTOR_DRAIN_IDLE : r->u_conf.rc_idle_timeout));
+    }
+}
+
+
+/* (内部函数)
+ * 函数说明:    把未解析的数据移到缓冲区开头, 提交接收剩余空间的请求. 使用注册缓冲区的连接提交
+ *              READ_FIXED, 否则提交 RECV. 成功返回 0; 缓冲区已满返回 -1, errno 为 ENOBUFS
+ * @r:          反应堆指针
+ * @c:          连接指针
+ */
+static int uconn_recv(ureactor_t *r, uconn_t *c)
+{
+    if (c->c_bufptr != c->c_buf) {
+        memmove(c->c_buf, c->c_bufptr, c->c_cnt);
+        c->c_bufptr = c->c_buf;
+    }
+
+    if (c->c_cnt >= RIO_BUFSIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe;
+    int op = (c->c_bufidx >= 0 ? IORING_OP_READ_FIXED : IORING_OP_RECV);
+    if ((sqe = ureactor_sqe(r, op, c->c_fd, c->c_buf + c->c_cnt, RIO_BUFSIZE - c->c_cnt, c)) == NULL)
+        return -1;
+
+    sqe->buf_index = 0;
+    return 0;
+}
+
+
+/* (内部函数)
+ * 函数说明:    继续发送响应: 当前是内存段时提交 SENDMSG; 文件段和管道段直接调用 response_write
+ *              (sendfile / splice), 暂时无法继续时提交 POLL_ADD 等待套接字可写或者管道可读.
+ *              发送完成返回 1, 已经提交操作返回 0, 出错返回 -1
+ * @r:          反应堆指针
+ * @c:          连接指针
+ */
+static int uconn_send(ureactor_t *r, uconn_t *c)
+{
+    int iovcnt;
+    if ((iovcnt = response_iov(&c->c_resp, c->c_iov, RESP_MAXSEG)) > 0) {
+        bzero(&c->c_msg, sizeof(c->c_msg));
+        c->c_msg.msg_iov = c->c_iov;
+        c->c_msg.msg_iovlen = iovcnt;
+
+        struct io_uring_sqe *sqe;
+        if ((sqe = ureactor_sqe(r, IORING_OP_SENDMSG, c->c_fd, &c->c_msg, 1, c)) == NULL)
+            return -1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        return 0;
+    }
+
+    int ret;
+    if ((ret = response_write(c->c_fd, &c->c_resp)) != 0)
+        return ret;
+
+    struct io_uring_sqe *sqe;
+    int waitfd = (c->c_resp.r_waitfd >= 0 ? c->c_resp.r_waitfd : c->c_fd);
+    if ((sqe = ureactor_sqe(r, IORING_OP_POLL_ADD, waitfd, NULL, 0, c)) == NULL)
+        return -1;
+    sqe->poll32_events = (c->c_resp.r_waitfd >= 0 ? POLLIN : POLLOUT);
+    return 0;
+}
+
+
+/* (内部函数)
+ * 函数说明:    报头没有在时限内收完: 回复 408 后关闭
+ * @r:          反应堆指针
+ * @c:          连接指针
+ */
+static void uconn_header_timeout(ureactor_t *r, uconn_t *c)
+{
+    log_printf(LOG_WARN, "%s: request header timeout\n", c->c_peer);
+    c->c_timedout = 0;
+    response_init(&c->c_resp);
+    c->c_resp.r_parse_ns = stats_now() - c->c_parse_start;
+    r->u_handler(NULL, 408, &c->c_resp, 0);
+    c->c_state = CONN_WRITING;
+    uconn_process(r, c);
+}
+
+
+/* (内部函数)
+ * 函数说明:    连接的定时器到期, 规则与 conn_timeout 相同. 报头超时的连接上有正在进行的接收,
+ *              先取消它, 在它的完成事件中回复 408
+ * @r:          反应堆指针
+ * @c:          连接指针
+ */
+static void uconn_timeout(ureactor_t *r, uconn_t *c)
+{
+    if (c->c_state == CONN_READING && c->c_parse_start != 0) {
+        struct io_uring_sqe *sqe;
+        if (c->c_pending == 0) {
+            uconn_header_timeout(r, c);
+        } else if ((sqe = ureactor_sqe(r, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, c)) != NULL) {
+            sqe->addr = (uint64_t)(uintptr_t)c | c->c_pending;
+            c->c_timedout = 1;
+        } else
+            uconn_close(r, c);
+        return;
+    }
+
+    if (c->c_state == CONN_WRITING) {
+        struct linger lg = { 1, 0 };
+        log_printf(LOG_WARN, "%s: send timeout\n", c->c_peer);
+        setsockopt(c->c_fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    uconn_close(r, c);
+}
+
+
+/* (内部函数)
+ * 函数说明:    启动连接的定时器, 已经启动的重新计时
+ * @r:          反应堆指针
+ * @c:          连接指针
+ * @timeout:    超时时间(秒)
+ */
+static void uconn_arm(ureactor_t *r, uconn_t *c, int timeout)
+{
+    timer_arm(&r->u_timers, &c->c_timer, timer_now(), (unsigned)timeout * 1000);
+}
+
+
+/* (内部函数)
+ * 函数说明:    关闭连接. 没有正在进行的操作时立即释放; 否则取消该操作, 内核可能还在使用缓冲区和响应中的数据,
+ *              在它的完成事件中再释放
+ * @r:          反应堆指针
+ * @c:          连接指针
+ */
+static void uconn_close(ureactor_t *r, uconn_t *c)
+{
+    timer_cancel(&r->u_timers, &c->c_timer);
+    c->c_closing = 1;
+    if (c->c_pending == 0) {
+        uconn_free(r, c);
+        return;
+    }
+
+    struct io_uring_sqe *sqe;
+    if ((sqe = ureactor_sqe(r, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, c)) != NULL)
+        sqe->addr = (uint64_t)(uintptr_t)c | c->c_pending;
+    else
+        shutdown(c->c_fd, SHUT_RDWR);       /* 无法取消时让正在进行的操作出错返回 */
+}
+
+
+/* (内部函数)
+ * 函数说明:    释放连接占用的资源, 连接上不能再有正在进行的操作
+ * @r:          反应堆指针
+ * @c:          连接指针
+ */
+static void uconn_free(ureactor_t *r, uconn_t *c)
+{
+    --r->u_nconns;
+    response_release(&c->c_resp);
+    close(c->c_fd);
+    admit_disconnect(r->u_conf.rc_admit, &c->c_client);
+    if (c->c_bufidx >= 0)
+        r->u_freebufs[r->u_nfree++] = c->c_bufidx;
+    else
+        free(c->c_buf);
+    free(c);
+}
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef _URING_H_
+#define _URING_H_
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * 直接使用系统调用的最小 io_uring 封装, 不依赖 liburing. 只由一个线程使用:
+ * 调用者用 uring_get_sqe 取得 sqe 并填充, 之后一次 uring_submit 提交所有 sqe 并等待完成事件,
+ * 再用 uring_peek_cqe / uring_cqe_seen 逐个取出完成事件
+ */
+typedef struct uring_t {
+    int          u_fd;                      /* io_uring 文件描述符 */
+    unsigned     u_features;                /* 内核支持的特性 IORING_FEAT_* */
+    unsigned    *u_sq_head;                 /* sq 头部, 由内核推进 */
+    unsigned    *u_sq_tail;                 /* sq 尾部, 由本进程推进 */
+    unsigned    *u_sq_array;                /* sq 下标数组 */
+    unsigned     u_sq_mask;                 /* sq 下标掩码 */
+    unsigned     u_sq_entries;              /* sq 大小 */
+    unsigned     u_sqe_tail;                /* 已经填充, 还没有提交给内核的 sqe 的尾部 */
+    struct io_uring_sqe *u_sqes;            /* sqe 数组 */
+    unsigned    *u_cq_head;                 /* cq 头部, 由本进程推进 */
+    unsigned    *u_cq_tail;                 /* cq 尾部, 由内核推进 */
+    unsigned     u_cq_mask;                 /* cq 下标掩码 */
+    struct io_uring_cqe *u_cqes;            /* cqe 数组 */
+    void        *u_sq_ring;                 /* sq 的映射地址 */
+    size_t       u_sq_ringsz;               /* sq 的映射长度 */
+    void        *u_cq_ring;                 /* cq 的映射地址, 与 sq 共用一次映射时等于 u_sq_ring */
+    size_t       u_cq_ringsz;               /* cq 的映射长度 */
+    size_t       u_sqes_sz;                 /* sqe 数组的映射长度 */
+} uring_t;
+
+int  uring_init(uring_t *u, unsigned entries, unsigned flags);
+void uring_exit(uring_t *u);
+int  uring_probe(uring_t *u, int const *ops, int nops);
+struct io_uring_sqe *uring_get_sqe(uring_t *u);
+int  uring_reserve(uring_t *u, unsigned n);
+int  uring_submit(uring_t *u, unsigned wait_nr, int timeout);
+struct io_uring_cqe *uring_peek_cqe(uring_t *u);
+void uring_cqe_seen(uring_t *u);
+int  uring_register(uring_t *u, unsigned opcode, void const *arg, unsigned nr);
+void uring_prep(struct io_uring_sqe *sqe, int op, int fd, void const *addr, unsigned len, uint64_t off,
+                uint64_t user_data);
+
+
+/*
+ * 函数说明:    创建 io_uring 并映射 sq, cq 和 sqe 数组, cq 的大小为 sq 的两倍. 成功返回 0, 失败返回 -1
+ *              (内核不支持时 errno 为 ENOSYS, 被禁用时为 EPERM)
+ * @u:          ring 指针
+ * @entries:    sq 大小
+ * @flags:      IORING_SETUP_* 标志
+ */
+int uring_init(uring_t *u, unsigned entries, unsigned flags)
+{
+    struct io_uring_params p;
+
+    bzero(u, sizeof(uring_t));
+    bzero(&p, sizeof(p));
+    p.flags = flags;
+    if ((u->u_fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return -1;
+
+    u->u_features = p.features;
+    u->u_sq_ringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->u_cq_ringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->u_cq_ringsz > u->u_sq_ringsz)
+            u->u_sq_ringsz = u->u_cq_ringsz;
+        u->u_cq_ringsz = u->u_sq_ringsz;
+    }
+
+    u->u_sq_ring = mmap(NULL, u->u_sq_ringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        u->u_fd, IORING_OFF_SQ_RING);
+    if (u->u_sq_ring == MAP_FAILED) {
+        close(u->u_fd);
+        return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->u_cq_ring = u->u_sq_ring;
+    else if ((u->u_cq_ring = mmap(NULL, u->u_cq_ringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  u->u_fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        munmap(u->u_sq_ring, u->u_sq_ringsz);
+        close(u->u_fd);
+        return -1;
+    }
+
+    u->u_sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->u_sqes = (struct io_uring_sqe *)mmap(NULL, u->u_sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            u->u_fd, IORING_OFF_SQES);
+    if (u->u_sqes == MAP_FAILED) {
+        if (u->u_cq_ring != u->u_sq_ring)
+            munmap(u->u_cq_ring, u->u_cq_ringsz);
+        munmap(u->u_sq_ring, u->u_sq_ringsz);
+        close(u->u_fd);
+        return -1;
+    }
+
+    char *sq = (char *)u->u_sq_ring;
+    char *cq = (char *)u->u_cq_ring;
+    u->u_sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->u_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->u_sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->u_sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->u_sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+    u->u_sqe_tail = *u->u_sq_tail;
+    u->u_cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->u_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->u_cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->u_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* sq 下标数组固定为恒等映射, 之后只需要推进尾部 */
+    for (unsigned i = 0; i < u->u_sq_entries; ++i)
+        u->u_sq_array[i] = i;
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    解除映射并关闭 io_uring, 没有完成的请求由内核取消
+ * @u:          ring 指针
+ */
+void uring_exit(uring_t *u)
+{
+    munmap(u->u_sqes, u->u_sqes_sz);
+    if (u->u_cq_ring != u->u_sq_ring)
+        munmap(u->u_cq_ring, u->u_cq_ringsz);
+    munmap(u->u_sq_ring, u->u_sq_ringsz);
+    close(u->u_fd);
+    u->u_fd = -1;
+}
+
+
+/*
+ * 函数说明:    检查内核是否支持所有给出的操作码, 都支持返回 1, 否则返回 0
+ * @u:          ring 指针
+ * @ops:        IORING_OP_* 数组
+ * @nops:       数组长度
+ */
+int uring_probe(uring_t *u, int const *ops, int nops)
+{
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe;
+    if ((probe = (struct io_uring_probe *)calloc(1, len)) == NULL)
+        return 0;
+
+    int ok = (uring_register(u, IORING_REGISTER_PROBE, probe, 256) == 0);
+    for (int i = 0; ok && i < nops; ++i) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+    }
+
+    free(probe);
+    return ok;
+}
+
+
+/*
+ * 函数说明:    取得一个空闲的 sqe, sq 已满时先提交已经填充的 sqe. 返回的 sqe 已经清零.
+ *              之前取得的 sqe 必须已经填充完成; 链接的多个 sqe 先用 uring_reserve 保证不会被分开提交
+ * @u:          ring 指针
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *u)
+{
+    if (uring_reserve(u, 1) < 0)
+        return NULL;
+
+    struct io_uring_sqe *sqe = &u->u_sqes[u->u_sqe_tail++ & u->u_sq_mask];
+    bzero(sqe, sizeof(*sqe));
+    return sqe;
+}
+
+
+/*
+ * 函数说明:    保证 sq 中至少有 n 个空闲的 sqe, 不够时先提交已经填充的 sqe. 成功返回 0, 失败返回 -1
+ * @u:          ring 指针
+ * @n:          需要的 sqe 数量
+ */
+int uring_reserve(uring_t *u, unsigned n)
+{
+    if (u->u_sqe_tail - __atomic_load_n(u->u_sq_head, __ATOMIC_ACQUIRE) + n <= u->u_sq_entries)
+        return 0;
+
+    if (uring_submit(u, 0, 0) < 0)
+        return -1;
+    return (u->u_sqe_tail - __atomic_load_n(u->u_sq_head, __ATOMIC_ACQUIRE) + n <= u->u_sq_entries ? 0 : -1);
+}
+
+
+/*
+ * 函数说明:    一次 io_uring_enter 提交所有已经填充的 sqe, 并等待至少 wait_nr 个完成事件.
+ *              返回提交的数量, 出错返回 -1. 等待超时或者被信号打断不算出错
+ * @u:          ring 指针
+ * @wait_nr:    等待的完成事件数量, 0 表示只提交
+ * @timeout:    等待的超时时间(毫秒), -1 表示一直等待. 需要 IORING_FEAT_EXT_ARG
+ */
+int uring_submit(uring_t *u, unsigned wait_nr, int timeout)
+{
+    /* 按内核已经取走的位置计算, 上次没有提交完 (例如 cq 溢出时返回 EBUSY) 的 sqe 这次继续提交 */
+    __atomic_store_n(u->u_sq_tail, u->u_sqe_tail, __ATOMIC_RELEASE);
+    unsigned nsubmit = u->u_sqe_tail - __atomic_load_n(u->u_sq_head, __ATOMIC_ACQUIRE);
+
+    if (nsubmit == 0 && wait_nr == 0)
+        return 0;
+
+    unsigned flags = (wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argsz = 0;
+    if (wait_nr > 0 && timeout >= 0 && (u->u_features & IORING_FEAT_EXT_ARG)) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        bzero(&arg, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    int ret = (int)syscall(__NR_io_uring_enter, u->u_fd, nsubmit, wait_nr, flags, argp, argsz);
+    if (ret < 0 && (errno == ETIME || errno == EINTR))
+        return 0;
+    return ret;
+}
+
+
+/*
+ * 函数说明:    返回下一个完成事件, 没有返回 NULL. 处理完之后调用 uring_cqe_seen
+ * @u:          ring 指针
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *u)
+{
+    unsigned head = *u->u_cq_head;
+    if (head == __atomic_load_n(u->u_cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->u_cqes[head & u->u_cq_mask];
+}
+
+
+/*
+ * 函数说明:    释放 uring_peek_cqe 返回的完成事件
+ * @u:          ring 指针
+ */
+void uring_cqe_seen(uring_t *u)
+{
+    __atomic_store_n(u->u_cq_head, *u->u_cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * 函数说明:    io_uring_register 系统调用 (注册缓冲区, 注册文件, 探测操作码等), 成功返回 0
+ * @u:          ring 指针
+ * @opcode:     IORING_REGISTER_*
+ * @arg:        参数
+ * @nr:         参数数量
+ */
+int uring_register(uring_t *u, unsigned opcode, void const *arg, unsigned nr)
+{
+    return ((int)syscall(__NR_io_uring_register, u->u_fd, opcode, arg, nr) < 0 ? -1 : 0);
+}
+
+
+/*
+ * 函数说明:    填充 sqe 的公共字段, 操作相关的标志由调用者在之后设置
+ * @sqe:        uring_get_sqe 返回的 sqe
+ * @op:         IORING_OP_*
+ * @fd:         文件描述符 (IOSQE_FIXED_FILE 时为注册文件的下标)
+ * @addr:       缓冲区, iovec 数组或者路径
+ * @len:        长度
+ * @off:        文件偏移或者第二个地址
+ * @user_data:  完成事件中原样返回的数据
+ */
+void uring_prep(struct io_uring_sqe *sqe, int op, int fd, void const *addr, unsigned len, uint64_t off,
+                uint64_t user_data)
+{
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+}
+
+#endif
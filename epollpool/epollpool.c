@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,107 +9,277 @@
 #include <sys/fcntl.h>
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sched.h>
 #include "netword.h"
+#include "../TinyWebServer/uring.h"
+#include "../TinyWebServer/admission.h"
+#include "../TinyWebServer/timer.h"
 
 #define EPOLL_MAX 1024
-#define BUFLEN 4096
-#define HASH_MAX 24
-#define HASH(fd) ((fd) % (HASH_MAX))
+#define BUFLEN 4096                                 /* io_uring 模式下每个连接的缓冲区大小 */
+#define BUF_CLASSES 4                               /* epoll 模式下缓冲区的大小等级数量, 大小见 g_buf_sizes */
+#define BUF_MAX (64 * 1024)                         /* 最大的缓冲区等级, 也是一次读取的最大字节数 */
+#define SLAB_BYTES (64 * 1024)                      /* 对象池每次向 malloc 申请的大约字节数 */
+#define CONN_SLAB 256                               /* 连接对象池每块的连接数量 */
+#define OUT_MAX (1024 * 1024)                       /* 输出队列超过这个字节数时暂停读取, 等对端取走数据 */
+#define OUT_IOV 16                                  /* 每次 writev 发送的最多缓冲区数量 */
+#define TABLE_INIT 1024                             /* 连接表的初始槽位数量 */
+#define IDLE_TIMEOUT 60                             /* 连接的空闲超时时间(秒) */
 #define SERVER_PORT "8000"
+#define URING_ENTRIES 1024                          /* io_uring 的 sq 大小 */
+#define URING_NBUFS 1024                            /* 注册的缓冲区数量, 更多的连接使用自己分配的缓冲区 */
+#define URING_IDLE 60                               /* io_uring 模式下连接的空闲超时时间(秒) */
+#define URING_ACCEPT 1                              /* accept 完成事件的 user_data */
+#define URING_TIMEOUT 0                             /* 链接超时完成事件的 user_data, 直接忽略 */
 
 typedef int (event_func)(int fd, int event, void *arg);
+
+/* 输出队列中的一个缓冲区, 从缓冲区池借用, 开头是链表结点, 后面是数据 */
+typedef struct outbuf_t {
+        struct outbuf_t     *o_next;                /* 下一个缓冲区 */
+        uint32_t             o_start;               /* 还没有发送的数据的起始位置 */
+        uint32_t             o_end;                 /* 数据的结束位置 */
+        int                  o_cls;                 /* 缓冲区的大小等级 */
+        char                 o_data[];              /* 数据 */
+} outbuf_t;
+
 /* 自定义事件结构 */
 typedef struct myevent_t {
         int                  e_fd;                  /* 文件描述符 */
         int                  e_event;               /* 监听的事件 */
         void                *e_arg;                 /* 事件函数参数 */
         event_func          *e_callback;            /* 事件对应的函数 */
-        char                 e_buf[BUFLEN];         /* 缓冲区 */
-        size_t               e_buflen;              /* 缓冲区字节数 */
-        time_t               e_last_active;         /* 最后一次通信时间 */
-        struct myevent_t    *e_next;                /* 指向下一结点 */
-        struct myevent_t    *e_prev;                /* 指向上一结点 */
+        outbuf_t            *e_out;                 /* 输出队列, 只在有没发送完的数据时持有缓冲区, 空闲时为 NULL */
+        outbuf_t            *e_out_tail;            /* 输出队列的最后一个缓冲区 */
+        size_t               e_outlen;              /* 输出队列中的字节数 */
+        int                  e_eof;                 /* 对端已经关闭写端, 发送完输出队列后关闭连接 */
+        timer_node_t         e_timer;               /* 空闲超时定时器, 每次通信后重新计时 */
+        admit_key_t          e_client;              /* 客户端地址, 用于准入控制 */
+        uint32_t             e_gen;                 /* 加入连接表时槽位的代数, 和描述符一起作为 epoll 事件的数据 */
+        struct eloop_t      *e_loop;                /* 所属的事件循环 */
 } myevent_t;
 
 
-/* 哈希表 */
-typedef struct hashtable_t {
-    myevent_t    *h_buf[HASH_MAX];                  /* 哈希数组 */
-    myevent_t    *h_listen;                         /* 监听描述符 事件Node */
-    size_t        h_size;                           /* 哈希表中的对象数量 */
-} hashtable_t;
-
-
-static int g_epfd;                                  /* epoll 红黑树根结点 */
-static hashtable_t g_event_table;                   /* 哈希表 */
-
-int initlistensock(int epfd, hashtable_t *table, char const *port);
-int clean_timeout_connection(int epfd, hashtable_t *table);
-int execute(int epfd, hashtable_t *table);
-int destroy(int epfd, hashtable_t *table);
+/* io_uring 模式下的连接, 同一时刻只有一个正在进行的接收或者发送 */
+typedef struct uevent_t {
+        int                  u_fd;                  /* 文件描述符 */
+        int                  u_slot;                /* 注册缓冲区的槽位, -1 表示 u_buf 是自己分配的 */
+        char                *u_buf;                 /* 缓冲区, BUFLEN 字节 */
+        size_t               u_buflen;              /* 缓冲区字节数 */
+        size_t               u_sent;                /* 已经发送的字节数, 接收时为 0 */
+        admit_key_t          u_client;              /* 客户端地址, 用于准入控制 */
+} uevent_t;
+
+/* io_uring 模式的全局状态 */
+typedef struct uring_server_t {
+    uring_t       s_ring;                           /* io_uring */
+    int           s_listenfd;                       /* 监听套接字, 注册为 0 号固定文件 */
+    char         *s_bufs;                           /* 注册的缓冲区, 注册失败为 NULL */
+    int           s_free[URING_NBUFS];              /* 空闲槽位栈 */
+    int           s_nfree;                          /* 空闲槽位数量 */
+    int           s_multishot;                      /* 内核是否支持多次完成的 accept */
+} uring_server_t;
+
+
+/* 连接表的槽位, 下标就是文件描述符 */
+typedef struct conn_slot_t {
+    myevent_t    *s_node;                           /* 描述符对应的结点, 空槽位为 NULL */
+    uint32_t      s_gen;                            /* 代数, 每次加入结点时加一, 用于识别已经关闭的连接的过期事件 */
+} conn_slot_t;
+
+/* 以文件描述符为下标的连接表, 按需扩大, 查找, 加入和删除都是 O(1) */
+typedef struct conntable_t {
+    conn_slot_t  *t_slots;                          /* 槽位数组 */
+    int           t_cap;                            /* 槽位数量 */
+    size_t        t_size;                           /* 表中的结点数量 (包括监听描述符) */
+    myevent_t    *t_listen;                         /* 监听描述符 事件Node */
+} conntable_t;
+
+
+/* 定长对象池: 每次申请一大块切分成对象放入空闲链表, 释放的对象放回空闲链表 (用对象的开头保存链接), 只在销毁时还给 malloc */
+typedef struct pool_t {
+    void         *p_free;                           /* 空闲对象链表 */
+    void         *p_slabs;                          /* 已经申请的块的链表, 每块开头 16 字节保存链接 */
+    size_t        p_objsize;                        /* 对象大小, 16 字节对齐 */
+    int           p_perslab;                        /* 每块的对象数量 */
+} pool_t;
+
+/* 事件循环, 每个线程一个, 拥有自己的 epoll 实例, SO_REUSEPORT 监听套接字, 连接表和定时器, 线程之间不共享连接 */
+typedef struct eloop_t {
+    int           l_epfd;                           /* epoll 红黑树根结点 */
+    conntable_t   l_table;                          /* 连接表 */
+    timer_wheel_t l_timers;                         /* 本循环所有连接的空闲超时定时器 */
+    pool_t        l_conns;                          /* 连接对象池 */
+    pool_t        l_bufs[BUF_CLASSES];              /* 各个大小等级的缓冲区池 */
+    char         *l_rbuf;                           /* 读取用的临时缓冲区, BUF_MAX 字节, 读到数据后复制到合适等级的缓冲区 */
+    int           l_cpu;                            /* 绑定的 cpu, -1 表示不绑定 */
+    pthread_t     l_tid;                            /* 线程 ID */
+} eloop_t;
+
+
+static admit_t g_admit;                             /* 连接准入和接收限速, 所有循环共享 */
+static size_t const g_buf_sizes[BUF_CLASSES] = { 512, 4096, 16384, BUF_MAX };   /* 缓冲区的大小等级 */
+
+int initlistensock(eloop_t *loop, char const *port, int reuseport);
+void *eloop_run(void *arg);
+int clean_timeout_connection(eloop_t *loop);
+int execute(eloop_t *loop);
+int destroy(eloop_t *loop);
 int event_add(int epfd, myevent_t *eventnode);
 int event_del(int epfd, myevent_t *eventnode);
 int event_mod(int epfd, myevent_t *eventnode);
-int hashtable_add(hashtable_t *table, myevent_t *eventnode);
-int hashtable_del(hashtable_t *table, myevent_t *eventnode);
+void event_close(myevent_t *eventnode);
+int conntable_add(conntable_t *table, myevent_t *eventnode);
+int conntable_del(conntable_t *table, myevent_t *eventnode);
+myevent_t *conntable_lookup(conntable_t *table, uint64_t data);
 int accept_connect(int fd, int event, void *arg);
+int conn_event(int fd, int event, void *arg);
 int recvdata(int fd, int event, void *arg);
 int sendtodata(int fd, int event, void *arg);
 int process_data(char *buf, size_t len);
+void pool_init(pool_t *pool, size_t objsize, int perslab);
+void *pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *obj);
+void pool_destroy(pool_t *pool);
+int out_send(myevent_t *eventnode, char const *data, size_t len);
+int out_queue(myevent_t *eventnode, char const *data, size_t len);
+int out_flush(myevent_t *eventnode);
+void out_release(myevent_t *eventnode);
+int uring_execute(char const *port);
+int uring_accept(uring_server_t *srv);
+int uring_recv(uring_server_t *srv, uevent_t *uev);
+int uring_send(uring_server_t *srv, uevent_t *uev);
+int uring_complete(uring_server_t *srv, uevent_t *uev, int res);
+void uring_close(uring_server_t *srv, uevent_t *uev);
 
 int main(int argc, char *argv[])
 {
     char const *port = SERVER_PORT;
+    int use_uring = 0;
+    int nloops = 1;
+    int pin = 0;
+    admit_conf_t admit_conf = { 0, 0, 0, 0 };
+    char *end;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ur:aC:I:L:")) != -1) {
+        switch (opt) {
+        case 'u':                                   /* 使用 io_uring, 内核不支持时退回 epoll */
+            use_uring = 1;
+            break;
+        case 'r':                                   /* 事件循环线程数量, 0 表示使用 cpu 核心数量 */
+            if ((nloops = atoi(optarg)) <= 0)
+                nloops = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+        case 'a':                                   /* 把每个事件循环线程绑定到一个 cpu */
+            pin = 1;
+            break;
+        case 'C':                                   /* 全局并发连接上限 */
+            admit_conf.ac_max_conns = atoi(optarg);
+            break;
+        case 'I':                                   /* 每个客户端地址的并发连接上限 */
+            admit_conf.ac_max_per_ip = atoi(optarg);
+            break;
+        case 'L':                                   /* 每个客户端地址每秒的接收次数和突发次数, 超过时关闭连接 */
+            admit_conf.ac_rate = strtod(optarg, &end);
+            if (*end == ':')
+                admit_conf.ac_burst = strtod(end + 1, NULL);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-u] [-r nloops [-a]] [-C maxconns] [-I maxperip] [-L rate[:burst]] [port]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if (argc == 2)
-        port = argv[1];
+    if (optind < argc)
+        port = argv[optind];
 
-    if ((g_epfd = epoll_create(EPOLL_MAX)) < 0) {
-        fprintf(stderr, "%s: epoll_create error: %s\n", __func__, strerror(errno));
+    if (admit_init(&g_admit, &admit_conf) < 0) {
+        fprintf(stderr, "%s: admit_init error: %s\n", __func__, strerror(errno));
         exit(EXIT_FAILURE);
     }
-    
-    if (initlistensock(g_epfd, &g_event_table, port) < 0) {
-        fprintf(stderr, "initlistensock(%s) error\n", port);
+
+    signal(SIGPIPE, SIG_IGN);                       /* 对端关闭后的发送返回 EPIPE */
+    if (use_uring && uring_execute(port) < 0)
+        fprintf(stderr, "io_uring 不可用, 使用 epoll\n");
+
+    eloop_t *loops;
+    if ((loops = (eloop_t *)calloc(nloops, sizeof(eloop_t))) == NULL) {
+        fprintf(stderr, "%s: calloc error: %s\n", __func__, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    printf("等待客户端连接\n");
-    bzero(&g_event_table.h_buf, sizeof(g_event_table.h_buf));
+    /* 绑定时第 i 个循环使用允许的 cpu 中的第 i % n 个 */
+    cpu_set_t cpus;
+    if (!pin || sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+        CPU_ZERO(&cpus);
+    for (int i = 0, cpu = -1; i < nloops; ++i) {
+        loops[i].l_cpu = -1;
+        for (int n = 0; CPU_COUNT(&cpus) > 0 && n < CPU_SETSIZE; ++n) {
+            cpu = (cpu + 1) % CPU_SETSIZE;
+            if (CPU_ISSET(cpu, &cpus)) {
+                loops[i].l_cpu = cpu;
+                break;
+            }
+        }
+    }
 
-    int ret;
-    while (1) {
-        clean_timeout_connection(g_epfd, &g_event_table);
-        ret = execute(g_epfd, &g_event_table);
+    /* 多个循环时每个循环绑定自己的 SO_REUSEPORT 监听套接字, 由内核按四元组哈希分配新连接 */
+    for (int i = 0; i < nloops; ++i) {
+        if ((loops[i].l_epfd = epoll_create(EPOLL_MAX)) < 0) {
+            fprintf(stderr, "%s: epoll_create error: %s\n", __func__, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
 
-        if (ret < 0) {
-            fprintf(stderr, "%s: execute error\n", __func__);
-            break;
+        if (initlistensock(&loops[i], port, nloops > 1) < 0) {
+            fprintf(stderr, "initlistensock(%s) error\n", port);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("等待客户端连接 (%d 个事件循环)\n", nloops);
+    for (int i = 1; i < nloops; ++i) {
+        if (pthread_create(&loops[i].l_tid, NULL, eloop_run, &loops[i]) != 0) {
+            fprintf(stderr, "%s: pthread_create error\n", __func__);
+            exit(EXIT_FAILURE);
         }
     }
 
-    destroy(g_epfd, &g_event_table);
+    /* 0 号循环在主线程中运行, 它出错退出时整个进程退出 */
+    eloop_run(&loops[0]);
+    destroy(&loops[0]);
     return 0;
 }
 
 /*
- * 函数说明:  初始化监听套接字, 将监听套接字加入到 epoll 红黑树中, 加入 hashtable 中
- * @epfd:     红黑树句柄
- * @table:    哈希表指针
+ * 函数说明:  初始化事件循环的定时器, 对象池和监听套接字, 将监听套接字加入到连接表和 epoll 红黑树中
+ * @loop:     事件循环, l_epfd 已经创建
  * @port:     绑定端口字符串
+ * @reuseport: 是否设置 SO_REUSEPORT
  */
-int initlistensock(int epfd, hashtable_t *table, char const *port)
+int initlistensock(eloop_t *loop, char const *port, int reuseport)
 {
-    if (port == NULL || epfd < 0 || table == NULL)
+    if (port == NULL || loop == NULL || loop->l_epfd < 0)
+        return -1;
+
+    timer_wheel_init(&loop->l_timers);
+    pool_init(&loop->l_conns, sizeof(myevent_t), CONN_SLAB);
+    for (int i = 0; i < BUF_CLASSES; ++i)
+        pool_init(&loop->l_bufs[i], g_buf_sizes[i], (g_buf_sizes[i] < SLAB_BYTES ? SLAB_BYTES / g_buf_sizes[i] : 1));
+    if ((loop->l_rbuf = (char *)malloc(BUF_MAX)) == NULL)
         return -1;
 
     int listenfd;
-    if ((listenfd = tcp_server(NULL, port)) < 0)
+    if ((listenfd = tcp_server_opt(NULL, port, reuseport)) < 0)
         return -1;
 
-    int flags = fcntl(listenfd, F_GETFD);
+    int flags = fcntl(listenfd, F_GETFL);
     flags |= O_NONBLOCK;
-    fcntl(listenfd, F_SETFD, flags);
+    fcntl(listenfd, F_SETFL, flags);
 
     myevent_t *eventnode;
     if ((eventnode = (myevent_t *)malloc(sizeof(myevent_t))) == NULL)
@@ -117,65 +288,91 @@ int initlistensock(int epfd, hashtable_t *table, char const *port)
     bzero(eventnode, sizeof(myevent_t));
     eventnode->e_fd = listenfd;
     eventnode->e_event = EPOLLIN | EPOLLET;
+    eventnode->e_arg = (void *)eventnode;
     eventnode->e_callback = accept_connect;
+    eventnode->e_loop = loop;
 
-    event_add(epfd, eventnode);
-    table->h_listen = eventnode;
+    if (conntable_add(&loop->l_table, eventnode) < 0 || event_add(loop->l_epfd, eventnode) < 0) {
+        close(listenfd);
+        free(eventnode);
+        return -1;
+    }
+    loop->l_table.t_listen = eventnode;
 
     return 0;
 }
 
 
-
 /*
- * 函数说明:    清除哈希表中已连接的套接字中, 超过 60s 没有通信的 套接字
- * @epfd:       红黑树句柄
- * @table:      指向哈希表
+ * 函数说明:    事件循环线程例程函数, 绑定 cpu 后循环执行 epoll_wait 和超时处理, 出错时返回
+ * @arg:        eloop_t 指针
  */
-int clean_timeout_connection(int epfd, hashtable_t *table)
+void *eloop_run(void *arg)
 {
-    if (epfd < 0 || table == NULL)
-        return -1;
+    eloop_t *loop = (eloop_t *)arg;
+
+    if (loop->l_cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(loop->l_cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            fprintf(stderr, "%s: sched_setaffinity(%d) error: %s\n", __func__, loop->l_cpu, strerror(errno));
+    }
 
-    static int index = 0;
-    time_t now = time(NULL);
-    
-    myevent_t *pnode = table->h_buf[index];
-    myevent_t *delnode;
-    while (pnode != NULL) {
-        delnode = pnode;
-        pnode = pnode->e_next;
-        if ((delnode->e_last_active - now) > 60) {
-            hashtable_del(table, delnode);
-            event_del(epfd, delnode);
-            close(delnode->e_fd);
-            free(delnode);
+    int ret;
+    while (1) {
+        ret = execute(loop);
+        clean_timeout_connection(loop);
+
+        if (ret < 0) {
+            fprintf(stderr, "%s: execute error\n", __func__);
+            break;
         }
     }
 
-    index = (index + 1) % HASH_MAX;
+    return NULL;
+}
+
+
+/*
+ * 函数说明:    关闭时间轮中所有到期 (超过 IDLE_TIMEOUT 秒没有通信) 的连接
+ * @loop:       事件循环
+ */
+int clean_timeout_connection(eloop_t *loop)
+{
+    if (loop == NULL)
+        return -1;
+
+    uint64_t now = timer_now();
+    timer_node_t *t;
+    while ((t = timer_expired(&loop->l_timers, now)) != NULL)
+        event_close((myevent_t *)((char *)t - offsetof(myevent_t, e_timer)));
+
     return 0;
 }
 
 /*
- * 函数说明:    执行 epoll_wait, 并执行满足的套接字对应的 callback 回调函数
- * @epfd:       红黑树句柄
- * @table:      哈希表地址(暂时不用)
+ * 函数说明:    执行 epoll_wait, 并执行满足的套接字对应的 callback 回调函数. 一直等到下一个空闲超时到期为止.
+ *              用事件数据中的描述符和代数在连接表中找到结点
+ * @loop:       事件循环
  */
-int execute(int epfd, hashtable_t *table)
+int execute(eloop_t *loop)
 {
-    if (epfd < 0 || table == NULL)
+    if (loop == NULL)
         return -1;
 
     struct epoll_event events[EPOLL_MAX];
     int readyn;
     
-    if ((readyn = epoll_wait(epfd, events, EPOLL_MAX, -1)) < 0)
+    if ((readyn = epoll_wait(loop->l_epfd, events, EPOLL_MAX, timer_timeout(&loop->l_timers, -1))) < 0)
         return -1;
     
     for (int i = 0; i < readyn; ++i) {
-        myevent_t *eventnode = (myevent_t *)events[i].data.ptr;
-        eventnode->e_callback(eventnode->e_fd, eventnode->e_event, eventnode->e_arg);
+        /* 同一批事件中前面的回调可能已经关闭了这个连接, 描述符也可能已经被新连接复用 */
+        myevent_t *eventnode = conntable_lookup(&loop->l_table, events[i].data.u64);
+        if (eventnode == NULL)
+            continue;
+        eventnode->e_callback(eventnode->e_fd, events[i].events, eventnode->e_arg);
     }
 
     return 0;
@@ -183,30 +380,32 @@ int execute(int epfd, hashtable_t *table)
 
 
 /*
- * 函数说明:    销毁函数, 释放 g_event_table 中的资源, 释放 g_epfd 
- * @epfd:       红黑树句柄
- * @table:      指向 g_event_table 的指针
+ * 函数说明:    销毁函数, 释放事件循环连接表中的资源, 关闭 epoll 句柄
+ * @loop:       事件循环
  */
-int destroy(int epfd, hashtable_t *table)
+int destroy(eloop_t *loop)
 {
-    if (epfd < 0 || table == NULL)
+    if (loop == NULL || loop->l_epfd < 0)
         return -1;
 
-    myevent_t *pnode;
+    conntable_t *table = &loop->l_table;
     myevent_t *delnode;
-    for (int i = 0; i < HASH_MAX; ++i) {
-        pnode = table->h_buf[i];
-        while (pnode != NULL) {
-            delnode = pnode;
-            pnode = pnode->e_next;
-            hashtable_del(table, delnode);
-            close(delnode->e_fd);
-            free(delnode);
-        }
+    for (int i = 0; i < table->t_cap; ++i) {
+        if ((delnode = table->t_slots[i].s_node) != NULL && delnode != table->t_listen)
+            event_close(delnode);
     }
 
-    close(table->h_listen->e_fd);
-    free(table->h_listen);
+    close(table->t_listen->e_fd);
+    free(table->t_listen);
+
+    free(table->t_slots);
+    bzero(table, sizeof(conntable_t));
+    pool_destroy(&loop->l_conns);
+    for (int i = 0; i < BUF_CLASSES; ++i)
+        pool_destroy(&loop->l_bufs[i]);
+    free(loop->l_rbuf);
+    close(loop->l_epfd);
+    loop->l_epfd = -1;
 
     return 0;
 }
@@ -214,7 +413,7 @@ int destroy(int epfd, hashtable_t *table)
 
 /*
  * 函数说明:    添加事件到 epfd 中
- * @epfd:       g_epfd 红黑树句柄
+ * @epfd:       红黑树句柄
  * @eventnode:  事件节点指针
  */
 int event_add(int epfd, myevent_t *eventnode)
@@ -226,14 +425,14 @@ int event_add(int epfd, myevent_t *eventnode)
 
     bzero(&tep, sizeof(tep));
     tep.events = eventnode->e_event;
-    tep.data.ptr = (void *)eventnode;
+    tep.data.u64 = ((uint64_t)eventnode->e_gen << 32) | (uint32_t)eventnode->e_fd;
 
     return epoll_ctl(epfd, EPOLL_CTL_ADD, eventnode->e_fd, &tep);
 }
 
 /*
  * 函数说明:    删除 epfd 中的 eventnode->e_fd 节点
- * @epfd        红黑树句柄 g_epfd
+ * @epfd        红黑树句柄
  * @eventnode:  需要删除的节点
  */
 int event_del(int epfd, myevent_t *eventnode)
@@ -246,8 +445,9 @@ int event_del(int epfd, myevent_t *eventnode)
 
 
 /*
- * 函数说明:    修改 epfd 中的 eventnode->e_fd 的事件
- * @epfd:       红黑树句柄 g_epfd
+ * 函数说明:    按连接的状态更新 epfd 中 eventnode->e_fd 的事件: 没有收到 EOF 并且输出队列没有超过 OUT_MAX 时
+ *              监听可读, 只在输出队列不为空时监听可写. 事件没有变化时不调用 epoll_ctl. 同时重新开始空闲计时
+ * @epfd:       红黑树句柄
  * @eventnode:  结点指针
  */
 int event_mod(int epfd, myevent_t *eventnode)
@@ -255,166 +455,280 @@ int event_mod(int epfd, myevent_t *eventnode)
     if (epfd < 0 || eventnode == NULL)
         return -1;
 
+    int events = EPOLLET;
+    if (!eventnode->e_eof && eventnode->e_outlen < OUT_MAX)
+        events |= EPOLLIN;
+    if (eventnode->e_outlen > 0)
+        events |= EPOLLOUT;
+
+    timer_arm(&eventnode->e_loop->l_timers, &eventnode->e_timer, timer_now(), IDLE_TIMEOUT * 1000);
+    if (events == eventnode->e_event)
+        return 0;
+
+    /* 重新加入 EPOLLIN 时 epoll_ctl 会检查当前状态, 暂停读取期间到达的数据不会因为边沿触发而丢失 */
     struct epoll_event tep;
 
     bzero(&tep, sizeof(tep));
-    tep.data.ptr = (void *)eventnode;
-
-    if (eventnode->e_event & EPOLLIN) {
-        eventnode->e_event = EPOLLOUT | EPOLLET;
-        eventnode->e_callback = sendtodata;
+    tep.data.u64 = ((uint64_t)eventnode->e_gen << 32) | (uint32_t)eventnode->e_fd;
+    tep.events = eventnode->e_event = events;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, eventnode->e_fd, &tep);
+}
 
-    } else if (eventnode->e_event & EPOLLOUT) {
-        eventnode->e_event = EPOLLIN | EPOLLET;
-        eventnode->e_callback = recvdata;
-    }
 
-    eventnode->e_last_active = time(NULL);
-    tep.events = eventnode->e_event;
-    return epoll_ctl(epfd, EPOLL_CTL_MOD, eventnode->e_fd, &tep);
+/*
+ * 函数说明:    关闭连接: 从所属循环的连接表和 epfd 中删除, 取消空闲超时定时器, 关闭套接字, 归还缓冲区和结点
+ * @eventnode:  连接的结点
+ */
+void event_close(myevent_t *eventnode)
+{
+    eloop_t *loop = eventnode->e_loop;
+
+    conntable_del(&loop->l_table, eventnode);
+    event_del(loop->l_epfd, eventnode);
+    timer_cancel(&loop->l_timers, &eventnode->e_timer);
+    close(eventnode->e_fd);
+    admit_disconnect(&g_admit, &eventnode->e_client);
+    out_release(eventnode);
+    pool_free(&loop->l_conns, eventnode);
 }
 
 
 /*
- * 函数说明:    讲 myevent_t 节点加入到 hashtable_t 中
- * @table:      指向 g_event_table 的指针
- * @eventnode:  需要添加到 g_event_table 中的节点
+ * 函数说明:    将 myevent_t 节点加入到连接表中, 槽位不够时扩大到能容纳 e_fd, 并记录槽位的新代数.
+ *              必须在 event_add 之前调用. 成功返回 0, 失败返回 -1
+ * @table:      连接表指针
+ * @eventnode:  需要添加到连接表中的节点
  */
-int hashtable_add(hashtable_t *table, myevent_t *eventnode)
+int conntable_add(conntable_t *table, myevent_t *eventnode)
 {
-    if (table == NULL || eventnode == NULL)
+    if (table == NULL || eventnode == NULL || eventnode->e_fd < 0)
         return -1;
-    int index;
-    index = HASH(eventnode->e_fd);
 
-    if (table->h_buf[index] != NULL) 
-        table->h_buf[index]->e_prev = eventnode;
+    if (eventnode->e_fd >= table->t_cap) {
+        int cap = (table->t_cap > 0 ? table->t_cap : TABLE_INIT);
+        while (cap <= eventnode->e_fd)
+            cap *= 2;
+
+        conn_slot_t *slots;
+        if ((slots = (conn_slot_t *)realloc(table->t_slots, sizeof(conn_slot_t) * cap)) == NULL)
+            return -1;
+        bzero(slots + table->t_cap, sizeof(conn_slot_t) * (cap - table->t_cap));
+        table->t_slots = slots;
+        table->t_cap = cap;
+    }
 
-    eventnode->e_prev = NULL;
-    eventnode->e_next = table->h_buf[index];
-    table->h_buf[index] = eventnode;
-    table->h_size++;
+    conn_slot_t *slot = &table->t_slots[eventnode->e_fd];
+    slot->s_node = eventnode;
+    eventnode->e_gen = ++slot->s_gen;
+    table->t_size++;
 
     return 0;
 }
 
 /*
- * 函数说明:    删除 g_event_table 中的节点
- * @table:      指向 g_event_table 的指针
+ * 函数说明:    删除连接表中的节点
+ * @table:      连接表指针
  * @eventnode:  节点指针
  */
-int hashtable_del(hashtable_t *table, myevent_t *eventnode)
+int conntable_del(conntable_t *table, myevent_t *eventnode)
 {
-    if (table == NULL || eventnode == NULL)
+    if (table == NULL || eventnode == NULL || eventnode->e_fd < 0 || eventnode->e_fd >= table->t_cap
+        || table->t_slots[eventnode->e_fd].s_node != eventnode)
         return -1;
 
-    if (eventnode->e_next != NULL)
-        eventnode->e_next->e_prev = eventnode->e_prev;
-
-    if (eventnode->e_prev != NULL)
-        eventnode->e_prev->e_next = eventnode->e_next;
-    
-    int index;
-    index = HASH(eventnode->e_fd);
-    if (table->h_buf[index] == eventnode)
-        table->h_buf[index] = eventnode->e_next;
-
-    table->h_size--;
+    table->t_slots[eventnode->e_fd].s_node = NULL;
+    table->t_size--;
     
     return 0;
 }
 
+/*
+ * 函数说明:    按 epoll 事件数据 (高 32 位是代数, 低 32 位是描述符) 查找节点, 描述符已经关闭或者已经被
+ *              新连接复用 (代数不同) 时返回 NULL
+ * @table:      连接表指针
+ * @data:       epoll 事件数据
+ */
+myevent_t *conntable_lookup(conntable_t *table, uint64_t data)
+{
+    int fd = (int)(uint32_t)data;
+    if (fd < 0 || fd >= table->t_cap || table->t_slots[fd].s_gen != (uint32_t)(data >> 32))
+        return NULL;
+
+    return table->t_slots[fd].s_node;
+}
+
 
 /*
- * 函数说明:    listenfd 回调函数, 当有客户发起连接时, 接受连接, 并创建 myevent_t 节点, 加入 g_event_table 和 g_epfd 中
+ * 函数说明:    listenfd 回调函数, 当有客户发起连接时, 接受所有等待的连接 (边沿触发, 直到 EAGAIN),
+ *              为每个连接创建 myevent_t 节点, 加入监听套接字所属循环的连接表和 epfd 中
  * @listenfd:   监听套接字
  * @event:      listenfd 的事件
- * @arg:        废弃不用(为了统一接口)
+ * @arg:        监听套接字的 myevent_t * 结点指针
  */
 int accept_connect(int listenfd, int event, void *arg)
 {
-    if (listenfd < 0 || !(event & EPOLLIN))
+    if (listenfd < 0 || !(event & EPOLLIN) || arg == NULL)
         return -1;
 
-    myevent_t *eventnode;
-    if ((eventnode = (myevent_t *)malloc(sizeof(myevent_t))) == NULL) {
-        fprintf(stderr, "%s: malloc(sizeof(myevent_t )) error: %s\n", __func__, strerror(errno));
-        return -1;
-    }
+    eloop_t *loop = ((myevent_t *)arg)->e_loop;
 
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t addrlen;
+    int connfd;
 
-    if ((eventnode->e_fd = accept(listenfd, (struct sockaddr *)&addr, &addrlen)) < 0) {
-        free(eventnode);
-        fprintf(stderr, "%s : accept error: %s\n", __func__, strerror(errno));
-        return -1;
-    }
+    while (1) {
+        addrlen = sizeof(addr);
+        if ((connfd = accept4(listenfd, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /* 描述符耗尽时用预留的描述符接受并关闭一个等待的连接, 否则它会一直留在监听队列中 */
+            if ((errno == EMFILE || errno == ENFILE) && admit_shed(&g_admit, listenfd, NULL, 0) == 0)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            fprintf(stderr, "%s : accept error: %s\n", __func__, strerror(errno));
+            return -1;
+        }
 
-    int flags = fcntl(eventnode->e_fd, F_GETFD);
-    flags |= O_NONBLOCK;
-    fcntl(eventnode->e_fd, F_SETFD, flags);
+        admit_key_t client;
+        admit_key(&client, (struct sockaddr *)&addr);
+        if (admit_connect(&g_admit, &client) < 0) {
+            admit_reject(connfd, NULL, 0);
+            continue;
+        }
 
-    char host[128];
-    uint16_t port;
+        myevent_t *eventnode;
+        if ((eventnode = (myevent_t *)pool_alloc(&loop->l_conns)) == NULL) {
+            fprintf(stderr, "%s: pool_alloc error: %s\n", __func__, strerror(errno));
+            close(connfd);
+            admit_disconnect(&g_admit, &client);
+            continue;
+        }
+        eventnode->e_fd = connfd;
+        eventnode->e_out = eventnode->e_out_tail = NULL;
+        eventnode->e_outlen = 0;
+        eventnode->e_eof = 0;
+        eventnode->e_client = client;
+        eventnode->e_loop = loop;
 
-    inet_ntop(AF_INET, &addr.sin_addr.s_addr, host, sizeof(host));
-    port = ntohs(addr.sin_port);
-    printf("connection from %s:%d\n", host, port);
+        char host[128];
+        uint16_t port;
+
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr.s_addr, host, sizeof(host));
+        port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+        printf("connection from %s:%d\n", host, port);
+
+        eventnode->e_arg = (void *)eventnode;
+        eventnode->e_event = EPOLLIN | EPOLLET;
+        eventnode->e_callback = conn_event;
+        timer_init(&eventnode->e_timer);
+
+        if (conntable_add(&loop->l_table, eventnode) < 0 || event_add(loop->l_epfd, eventnode) < 0) {
+            event_close(eventnode);
+            continue;
+        }
+        timer_arm(&loop->l_timers, &eventnode->e_timer, timer_now(), IDLE_TIMEOUT * 1000);
+    }
+}
 
-    eventnode->e_arg = (void *)eventnode;
-    eventnode->e_next = NULL;
-    eventnode->e_prev = NULL;
-    eventnode->e_last_active = time(NULL);
-    eventnode->e_event = EPOLLIN | EPOLLET;
-    eventnode->e_callback = recvdata;
 
-    event_add(g_epfd, eventnode);
-    hashtable_add(&g_event_table, eventnode);
+/*
+ * 函数说明:    连接的事件回调函数: 可写时先发送输出队列, 可读时读取, 最后按输出队列的状态更新监听的事件.
+ *              连接已经关闭时返回 -1
+ * @fd:         与客户端连接的套接字
+ * @event:      epoll_wait 返回的事件
+ * @arg:        指向当前套接字 myevent_t * 的结点指针
+ */
+int conn_event(int fd, int event, void *arg)
+{
+    if (fd < 0 || arg == NULL)
+        return -1;
 
+    myevent_t *eventnode = (myevent_t *)arg;
+    if ((event & EPOLLOUT) && sendtodata(fd, event, arg) < 0)
+        return -1;
+    /* EPOLLHUP 和 EPOLLERR 总会报告, 由 read 取出剩余的数据或者错误 */
+    if ((event & (EPOLLIN | EPOLLHUP | EPOLLERR)) && recvdata(fd, event, arg) < 0)
+        return -1;
+
+    event_mod(eventnode->e_loop->l_epfd, eventnode);
     return 0;
 }
 
 
 /*
- * 函数说明:    读事件回调函数
+ * 函数说明:    读事件处理函数: 循环读取直到 EAGAIN (边沿触发), 每次读到的数据处理后立即发送, 发送不完的部分
+ *              放入输出队列. 输出队列超过 OUT_MAX 时暂停读取. 连接被关闭时返回 -1
  * @fd:         与客户端连接的套接字
  * @event:      事件
  * @arg:        指向当前套接字 myevent_t * 的结点指针
  */
 int recvdata(int fd, int event, void *arg)
 {
-    if (fd < 0 || arg == NULL || !(event & EPOLLIN))
+    if (fd < 0 || arg == NULL)
         return -1;
 
     myevent_t *eventnode = (myevent_t *)arg;
-    if ((eventnode->e_buflen = read(eventnode->e_fd, eventnode->e_buf, BUFLEN)) < 0)
+    if (eventnode->e_eof || eventnode->e_outlen >= OUT_MAX)
+        return 0;
+
+    /* 超过客户端的接收速率时关闭连接, 每次可读事件计为一次请求 */
+    if (admit_request(&g_admit, &eventnode->e_client) < 0) {
+        event_close(eventnode);
         return -1;
+    }
 
-    event_mod(g_epfd, eventnode);
+    char *rbuf = eventnode->e_loop->l_rbuf;
+    ssize_t readn;
+    while (eventnode->e_outlen < OUT_MAX) {
+        if ((readn = read(fd, rbuf, BUF_MAX)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            event_close(eventnode);
+            return -1;
+        }
+
+        if (readn == 0) {
+            eventnode->e_eof = 1;
+            break;
+        }
+
+        process_data(rbuf, readn);
+        if (out_send(eventnode, rbuf, readn) < 0) {
+            event_close(eventnode);
+            return -1;
+        }
+    }
+
+    if (eventnode->e_eof && eventnode->e_outlen == 0) {
+        event_close(eventnode);
+        return -1;
+    }
 
     return 0;
 }
 
 /*
- * 函数说明:    写事件回调函数
+ * 函数说明:    写事件处理函数: 发送输出队列直到队列为空或者 EAGAIN. 出错, 或者对端已经关闭写端并且
+ *              全部发送完成时关闭连接, 返回 -1
  * @fd:         与客户端连接的套接字
  * @event:      事件
  * @arg:        指向 myevent_t * 结点的指针
  */
 int sendtodata(int fd, int event, void *arg)
 {
-    if (fd < 0 || !(event & EPOLLOUT) || arg == NULL)
+    if (fd < 0 || arg == NULL)
         return -1;
 
     myevent_t *eventnode = (myevent_t *)arg;
-    process_data(eventnode->e_buf, eventnode->e_buflen);
-    
-    int writen;
-    writen = write(fd, eventnode->e_buf, eventnode->e_buflen);
+    if (out_flush(eventnode) < 0 || (eventnode->e_eof && eventnode->e_outlen == 0)) {
+        event_close(eventnode);
+        return -1;
+    }
 
-    event_mod(g_epfd, eventnode);
-    return (writen < 0 ? -1 : 0);
+    return 0;
 }
 
 
@@ -433,3 +747,437 @@ int process_data(char *buf, size_t len)
 
     return 0;
 }
+
+
+/*
+ * 函数说明:    初始化对象池, 这时不申请内存
+ * @pool:       对象池
+ * @objsize:    对象大小, 向上对齐到 16 字节
+ * @perslab:    每块的对象数量
+ */
+void pool_init(pool_t *pool, size_t objsize, int perslab)
+{
+    pool->p_free = NULL;
+    pool->p_slabs = NULL;
+    pool->p_objsize = (objsize + 15) & ~(size_t)15;
+    pool->p_perslab = (perslab > 0 ? perslab : 1);
+}
+
+
+/*
+ * 函数说明:    从对象池中取出一个对象, 空闲链表为空时申请新的一块. 失败返回 NULL
+ * @pool:       对象池
+ */
+void *pool_alloc(pool_t *pool)
+{
+    if (pool->p_free == NULL) {
+        char *slab;
+        if ((slab = (char *)malloc(16 + pool->p_objsize * pool->p_perslab)) == NULL)
+            return NULL;
+
+        *(void **)slab = pool->p_slabs;
+        pool->p_slabs = slab;
+        for (int i = pool->p_perslab - 1; i >= 0; --i)
+            pool_free(pool, slab + 16 + pool->p_objsize * i);
+    }
+
+    void *obj = pool->p_free;
+    pool->p_free = *(void **)obj;
+    return obj;
+}
+
+
+/*
+ * 函数说明:    把对象放回对象池的空闲链表
+ * @pool:       对象池
+ * @obj:        pool_alloc 返回的对象
+ */
+void pool_free(pool_t *pool, void *obj)
+{
+    *(void **)obj = pool->p_free;
+    pool->p_free = obj;
+}
+
+
+/*
+ * 函数说明:    释放对象池申请的所有块, 之后不能再使用池中的对象
+ * @pool:       对象池
+ */
+void pool_destroy(pool_t *pool)
+{
+    while (pool->p_slabs != NULL) {
+        void *next = *(void **)pool->p_slabs;
+        free(pool->p_slabs);
+        pool->p_slabs = next;
+    }
+    pool->p_free = NULL;
+}
+
+
+/*
+ * 函数说明:    发送数据: 输出队列为空时直接发送直到 EAGAIN, 剩余的数据 (或者队列不为空时的全部数据) 放入输出队列,
+ *              保证数据按顺序发送. 成功返回 0, 出错返回 -1
+ * @eventnode:  连接的结点
+ * @data:       数据
+ * @len:        数据长度
+ */
+int out_send(myevent_t *eventnode, char const *data, size_t len)
+{
+    ssize_t writen;
+
+    while (eventnode->e_out == NULL && len > 0) {
+        if ((writen = write(eventnode->e_fd, data, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        data += writen;
+        len -= writen;
+    }
+
+    return (len > 0 ? out_queue(eventnode, data, len) : 0);
+}
+
+
+/*
+ * 函数说明:    把数据追加到输出队列: 先填满最后一个缓冲区的剩余空间, 再从缓冲区池借用能容纳剩余数据的
+ *              最小等级的缓冲区 (最大为 BUF_MAX), 组成缓冲区链. 成功返回 0, 失败返回 -1
+ * @eventnode:  连接的结点
+ * @data:       数据
+ * @len:        数据长度
+ */
+int out_queue(myevent_t *eventnode, char const *data, size_t len)
+{
+    outbuf_t *tail = eventnode->e_out_tail;
+    size_t n;
+
+    while (len > 0) {
+        if (tail == NULL || tail->o_end == g_buf_sizes[tail->o_cls] - offsetof(outbuf_t, o_data)) {
+            int cls = 0;
+            while (cls < BUF_CLASSES - 1 && g_buf_sizes[cls] - offsetof(outbuf_t, o_data) < len)
+                ++cls;
+
+            outbuf_t *ob;
+            if ((ob = (outbuf_t *)pool_alloc(&eventnode->e_loop->l_bufs[cls])) == NULL)
+                return -1;
+            ob->o_next = NULL;
+            ob->o_start = ob->o_end = 0;
+            ob->o_cls = cls;
+            if (tail == NULL)
+                eventnode->e_out = ob;
+            else
+                tail->o_next = ob;
+            eventnode->e_out_tail = tail = ob;
+        }
+
+        n = g_buf_sizes[tail->o_cls] - offsetof(outbuf_t, o_data) - tail->o_end;
+        if (n > len)
+            n = len;
+        memcpy(tail->o_data + tail->o_end, data, n);
+        tail->o_end += n;
+        eventnode->e_outlen += n;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    用 writev 一次发送输出队列中最多 OUT_IOV 个缓冲区, 直到队列为空或者 EAGAIN,
+ *              发送完的缓冲区立即还给缓冲区池. 成功 (包括 EAGAIN) 返回 0, 出错返回 -1
+ * @eventnode:  连接的结点
+ */
+int out_flush(myevent_t *eventnode)
+{
+    struct iovec iov[OUT_IOV];
+    ssize_t writen;
+    int iovcnt;
+
+    while (eventnode->e_out != NULL) {
+        iovcnt = 0;
+        for (outbuf_t *ob = eventnode->e_out; ob != NULL && iovcnt < OUT_IOV; ob = ob->o_next) {
+            iov[iovcnt].iov_base = ob->o_data + ob->o_start;
+            iov[iovcnt].iov_len = ob->o_end - ob->o_start;
+            ++iovcnt;
+        }
+
+        if ((writen = writev(eventnode->e_fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+        }
+
+        eventnode->e_outlen -= writen;
+        while (writen > 0) {
+            outbuf_t *ob = eventnode->e_out;
+            size_t left = ob->o_end - ob->o_start;
+            if ((size_t)writen < left) {
+                ob->o_start += writen;
+                break;
+            }
+            writen -= left;
+            eventnode->e_out = ob->o_next;
+            pool_free(&eventnode->e_loop->l_bufs[ob->o_cls], ob);
+        }
+        if (eventnode->e_out == NULL)
+            eventnode->e_out_tail = NULL;
+    }
+
+    return 0;
+}
+
+
+/*
+ * 函数说明:    把输出队列中的所有缓冲区还给缓冲区池, 丢弃没有发送的数据
+ * @eventnode:  连接的结点
+ */
+void out_release(myevent_t *eventnode)
+{
+    outbuf_t *ob;
+    while ((ob = eventnode->e_out) != NULL) {
+        eventnode->e_out = ob->o_next;
+        pool_free(&eventnode->e_loop->l_bufs[ob->o_cls], ob);
+    }
+    eventnode->e_out_tail = NULL;
+    eventnode->e_outlen = 0;
+}
+
+
+/*
+ * 函数说明:    io_uring 模式的主循环: 监听套接字注册为固定文件, 使用多次完成的 accept; 连接在注册的缓冲区上
+ *              READ_FIXED / WRITE_FIXED, 每次接收都链接一个空闲超时. 每轮产生的请求在下一次等待时一起提交.
+ *              内核不支持 (或者初始化失败) 时返回 -1, 由调用者退回 epoll
+ * @port:       绑定端口字符串
+ */
+int uring_execute(char const *port)
+{
+    static int const ops[] = { IORING_OP_ACCEPT, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+                               IORING_OP_RECV, IORING_OP_SEND, IORING_OP_LINK_TIMEOUT };
+    uring_server_t srv;
+
+    bzero(&srv, sizeof(srv));
+    srv.s_multishot = 1;
+    if (uring_init(&srv.s_ring, URING_ENTRIES, 0) < 0)
+        return -1;
+
+    if (!uring_probe(&srv.s_ring, ops, sizeof(ops) / sizeof(ops[0])) ||
+        (srv.s_listenfd = tcp_server(NULL, port)) < 0 ||
+        uring_register(&srv.s_ring, IORING_REGISTER_FILES, &srv.s_listenfd, 1) < 0) {
+        uring_exit(&srv.s_ring);
+        return -1;
+    }
+
+    /* 缓冲区注册为一整块, 超过 RLIMIT_MEMLOCK 时不注册, 所有连接使用自己分配的缓冲区 */
+    struct iovec iov;
+    iov.iov_len = (size_t)URING_NBUFS * BUFLEN;
+    iov.iov_base = mmap(NULL, iov.iov_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (iov.iov_base != MAP_FAILED) {
+        if (uring_register(&srv.s_ring, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+            srv.s_bufs = (char *)iov.iov_base;
+            for (int i = 0; i < URING_NBUFS; ++i)
+                srv.s_free[i] = URING_NBUFS - 1 - i;
+            srv.s_nfree = URING_NBUFS;
+        } else
+            munmap(iov.iov_base, iov.iov_len);
+    }
+
+    printf("等待客户端连接 (io_uring)\n");
+    uring_accept(&srv);
+
+    struct io_uring_cqe *cqe;
+    while (1) {
+        if (uring_submit(&srv.s_ring, 1, -1) < 0 && errno != EBUSY && errno != EAGAIN) {
+            fprintf(stderr, "%s: io_uring_enter error: %s\n", __func__, strerror(errno));
+            break;
+        }
+
+        while ((cqe = uring_peek_cqe(&srv.s_ring)) != NULL) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&srv.s_ring);
+
+            if (data == URING_TIMEOUT)
+                continue;
+
+            if (data != URING_ACCEPT) {
+                uring_complete(&srv, (uevent_t *)(uintptr_t)data, res);
+                continue;
+            }
+
+            /* 多次完成的 accept 被内核终止时重新提交, 5.19 之前的内核不支持时返回 -EINVAL */
+            if (!(flags & IORING_CQE_F_MORE)) {
+                if (res == -EINVAL && srv.s_multishot) {
+                    srv.s_multishot = 0;
+                    uring_accept(&srv);
+                    continue;
+                }
+                uring_accept(&srv);
+            }
+            if (res == -EMFILE || res == -ENFILE) {
+                while (admit_shed(&g_admit, srv.s_listenfd, NULL, 0) == 0)
+                    ;
+                continue;
+            }
+            if (res < 0) {
+                fprintf(stderr, "%s: accept error: %s\n", __func__, strerror(-res));
+                continue;
+            }
+
+            /* 多次完成的 accept 不返回客户端地址, 只在按地址准入时查询 */
+            struct sockaddr_storage addr;
+            socklen_t addrlen = sizeof(addr);
+            admit_key_t client;
+            addr.ss_family = AF_UNSPEC;
+            if (admit_tracking(&g_admit))
+                getpeername(res, (struct sockaddr *)&addr, &addrlen);
+            admit_key(&client, (struct sockaddr *)&addr);
+            if (admit_connect(&g_admit, &client) < 0) {
+                admit_reject(res, NULL, 0);
+                continue;
+            }
+
+            uevent_t *uev;
+            if ((uev = (uevent_t *)malloc(sizeof(uevent_t))) == NULL) {
+                close(res);
+                admit_disconnect(&g_admit, &client);
+                continue;
+            }
+
+            uev->u_fd = res;
+            uev->u_client = client;
+            uev->u_slot = -1;
+            if (srv.s_nfree > 0) {
+                uev->u_slot = srv.s_free[--srv.s_nfree];
+                uev->u_buf = srv.s_bufs + (size_t)uev->u_slot * BUFLEN;
+            } else if ((uev->u_buf = (char *)malloc(BUFLEN)) == NULL) {
+                close(res);
+                admit_disconnect(&g_admit, &client);
+                free(uev);
+                continue;
+            }
+
+            if (uring_recv(&srv, uev) < 0)
+                uring_close(&srv, uev);
+        }
+    }
+
+    close(srv.s_listenfd);
+    uring_exit(&srv.s_ring);
+    return 0;
+}
+
+
+/*
+ * 函数说明:    提交 accept, 支持时使用多次完成的 accept, 否则每个连接之后重新提交
+ * @srv:        io_uring 模式的全局状态
+ */
+int uring_accept(uring_server_t *srv)
+{
+    struct io_uring_sqe *sqe;
+    if ((sqe = uring_get_sqe(&srv->s_ring)) == NULL)
+        return -1;
+
+    uring_prep(sqe, IORING_OP_ACCEPT, 0, NULL, 0, 0, URING_ACCEPT);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (srv->s_multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    return 0;
+}
+
+
+/*
+ * 函数说明:    提交接收请求, 并链接一个 URING_IDLE 秒的超时, 超时后接收以 -ECANCELED 完成
+ * @srv:        io_uring 模式的全局状态
+ * @uev:        连接
+ */
+int uring_recv(uring_server_t *srv, uevent_t *uev)
+{
+    static struct __kernel_timespec idle = { URING_IDLE, 0 };
+    struct io_uring_sqe *sqe;
+
+    /* 接收和它的超时必须在同一次 io_uring_enter 中提交 */
+    if (uring_reserve(&srv->s_ring, 2) < 0)
+        return -1;
+
+    uev->u_buflen = 0;
+    uev->u_sent = 0;
+    sqe = uring_get_sqe(&srv->s_ring);
+    uring_prep(sqe, (uev->u_slot >= 0 ? IORING_OP_READ_FIXED : IORING_OP_RECV), uev->u_fd, uev->u_buf, BUFLEN,
+               0, (uint64_t)(uintptr_t)uev);
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = uring_get_sqe(&srv->s_ring);
+    uring_prep(sqe, IORING_OP_LINK_TIMEOUT, -1, &idle, 1, 0, URING_TIMEOUT);
+    return 0;
+}
+
+
+/*
+ * 函数说明:    提交发送缓冲区中剩余数据的请求
+ * @srv:        io_uring 模式的全局状态
+ * @uev:        连接
+ */
+int uring_send(uring_server_t *srv, uevent_t *uev)
+{
+    struct io_uring_sqe *sqe;
+    if ((sqe = uring_get_sqe(&srv->s_ring)) == NULL)
+        return -1;
+
+    uring_prep(sqe, (uev->u_slot >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_SEND), uev->u_fd,
+               uev->u_buf + uev->u_sent, uev->u_buflen - uev->u_sent, 0, (uint64_t)(uintptr_t)uev);
+    sqe->msg_flags = (uev->u_slot >= 0 ? 0 : MSG_NOSIGNAL);
+    return 0;
+}
+
+
+/*
+ * 函数说明:    连接上的接收或者发送完成: 接收完成后转换为大写并发送, 全部发送完成后继续接收.
+ *              对端关闭, 出错或者空闲超时时关闭连接
+ * @srv:        io_uring 模式的全局状态
+ * @uev:        连接
+ * @res:        操作的结果, 负数为错误码
+ */
+int uring_complete(uring_server_t *srv, uevent_t *uev, int res)
+{
+    if (res <= 0) {
+        uring_close(srv, uev);
+        return -1;
+    }
+
+    if (uev->u_buflen == 0) {
+        if (admit_request(&g_admit, &uev->u_client) < 0) {
+            uring_close(srv, uev);          /* 超过客户端的接收速率 */
+            return -1;
+        }
+        uev->u_buflen = res;
+        process_data(uev->u_buf, uev->u_buflen);
+    } else
+        uev->u_sent += res;
+
+    int ret = (uev->u_sent < uev->u_buflen ? uring_send(srv, uev) : uring_recv(srv, uev));
+    if (ret < 0)
+        uring_close(srv, uev);
+    return ret;
+}
+
+
+/*
+ * 函数说明:    关闭连接, 归还缓冲区. 调用时连接上没有正在进行的操作
+ * @srv:        io_uring 模式的全局状态
+ * @uev:        连接
+ */
+void uring_close(uring_server_t *srv, uevent_t *uev)
+{
+    close(uev->u_fd);
+    admit_disconnect(&g_admit, &uev->u_client);
+    if (uev->u_slot >= 0)
+        srv->s_free[srv->s_nfree++] = uev->u_slot;
+    else
+        free(uev->u_buf);
+    free(uev);
+}
@@ -47,11 +47,13 @@ int tcp_client(char const *host, char const *port)
 
 
 /*
- * 函数说明: 建立服务器 listen 监听套接字, 成功返回 套接字文件描述符, 失败返回 -1
+ * 函数说明: 建立服务器 listen 监听套接字, 成功返回 套接字文件描述符, 失败返回 -1.
+ *           reuseport 不为 0 时设置 SO_REUSEPORT, 多个线程各自绑定同一端口, 由内核分配新连接
  * @host:    绑定的 域名(可选)
  * @port:    绑定的端口号
+ * @reuseport: 是否设置 SO_REUSEPORT
  */
-int tcp_server(char const *host, char const *port)
+int tcp_server_opt(char const *host, char const *port, int reuseport)
 {
     if (port == NULL) 
         return -1;
@@ -75,6 +77,10 @@ int tcp_server(char const *host, char const *port)
             continue;
 
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            close(listenfd);
+            continue;
+        }
 
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break;
@@ -95,6 +101,17 @@ int tcp_server(char const *host, char const *port)
 }
 
 
+/*
+ * 函数说明: 建立服务器 listen 监听套接字 (不设置 SO_REUSEPORT), 成功返回 套接字文件描述符, 失败返回 -1
+ * @host:    绑定的 域名(可选)
+ * @port:    绑定的端口号
+ */
+int tcp_server(char const *host, char const *port)
+{
+    return tcp_server_opt(host, port, 0);
+}
+
+
 /*
  * 函数说明:  传递 域名 和 端口 返回 udp 的客户端的 套接字地址结构, 成功返回 sockfd 文件描述符, 失败返回 -1
  * @host:     域名